@@ -1,9 +1,14 @@
 #include "cache.hpp"
 #include <string.h>
 #include <algorithm>
+#include <cerrno>
 #include <cassert>
 #include <iostream>
 
+// commits a sync makes before giving up, should the server keep losing
+// writes
+static const int MAX_COMMITS = 3;
+
 /* determine if the file cache is stale.
  */
 bool Cache::isStale(const std::string& filename) const
@@ -20,7 +25,7 @@ bool Cache::isStale(const std::string& filename) const
     return false;
 }
 
-const FileTime* Cache::getFileTime(const std::string& filename) const
+const uint64_t* Cache::getChange(const std::string& filename) const
 {
     auto fc_itor = _file_map.find(filename);
     if (fc_itor == _file_map.end())
@@ -28,7 +33,7 @@ const FileTime* Cache::getFileTime(const std::string& filename) const
         return nullptr;
     }
 
-    return &fc_itor->second.attr.time;
+    return &fc_itor->second.attr.change;
 }
 
 /* write to cache, possibly increase file size. The file must exist.  Affected
@@ -251,19 +256,81 @@ void Cache::readBlock(const std::string& filename, size_t block_num,
     moveToHead(entry.useRecord());
 }
 
+/* blocks of the file that are complete in cache, in ascending order. */
+std::vector<size_t> Cache::fullBlocks(const std::string& filename) const
+{
+    std::vector<size_t> blocks;
+    auto fc_itor = _file_map.find(filename);
+    if (fc_itor == _file_map.end())
+    {
+        return blocks;
+    }
+    for (const auto& pair : fc_itor->second.entries)
+    {
+        if (isFullBlock(fc_itor->second, pair.first))
+        {
+            blocks.push_back(pair.first);
+        }
+    }
+    std::sort(blocks.begin(), blocks.end());
+    return blocks;
+}
+
+/* record the attributes of a file, unless it is cached already. */
+void Cache::insertFile(const std::string& filename, const FileAttr& attr)
+{
+    _file_map.insert({filename, FileCache{attr}});
+}
+
+/* store `size` bytes of content read from `offset` of a cached file. Only
+ * blocks that the data covers entirely, or up to the end of the file, are
+ * stored; blocks that are full in cache already are left alone.
+ */
+void Cache::fillBlocks(const std::string& filename, size_t offset,
+                       const char* data, size_t size)
+{
+    FileCache& fc = _file_map.at(filename);
+    size_t data_end = offset + size;
+    size_t block_end = endBlock(std::min(fc.attr.size, data_end));
+    for (size_t b = (offset + _block_size - 1) / _block_size; b < block_end;
+         b++)
+    {
+        size_t start = b * _block_size;
+        size_t end = std::min(start + _block_size, data_end);
+        if ((end < start + _block_size && end < fc.attr.size) ||
+            isFullBlock(fc, b))
+        {
+            continue;
+        }
+        std::vector<char> block_data(_block_size, 0);
+        std::copy(data + (start - offset), data + (end - offset),
+                  block_data.begin());
+        auto block_itor = fc.entries.find(b);
+        if (block_itor == fc.entries.end())
+        {
+            newEntry(filename, b, _recent_list.end())
+                .fetch(std::move(block_data));
+        }
+        else
+        {
+            block_itor->second.fetch(std::move(block_data));
+        }
+    }
+}
+
 void Cache::moveToHead(std::list<CacheEntryID>::const_iterator rec_pos)
 {
     _recent_list.splice(_recent_list.begin(), _recent_list, rec_pos);
 }
 
-size_t Cache::countDirtyBlocks() const
+size_t Cache::countBlocks(CacheEntry::State state) const
 {
     size_t count = 0;
     for (const auto& fpair : _file_map)
     {
         for (const auto& bpair : fpair.second.entries)
         {
-            if (bpair.second.state() == CacheEntry::Dirty)
+            if (bpair.second.state() == state)
             {
                 count += 1;
             }
@@ -271,6 +338,17 @@ size_t Cache::countDirtyBlocks() const
     }
     return count;
 }
+
+size_t Cache::countDirtyBlocks() const
+{
+    return countBlocks(CacheEntry::Dirty);
+}
+
+size_t Cache::countUnstableBlocks() const
+{
+    return countBlocks(CacheEntry::Unstable);
+}
+
 int Cache::flushDirtyBlocks()
 {
     std::unordered_map<std::string, std::vector<size_t>> fblocks;
@@ -298,7 +376,8 @@ int Cache::flushDirtyBlocks()
 }
 
 /* evict blocks from the tail of usage record. dirty blocks are written back.
- * clean blocks are dropped.
+ * unstable blocks are committed, as they cannot be written again once
+ * dropped. clean blocks are dropped.
  */
 int Cache::evictBlocks(size_t count)
 {
@@ -308,6 +387,28 @@ int Cache::evictBlocks(size_t count)
     {
         return err;
     }
+    // the files are committed together, at the cost of a single commit
+    std::vector<std::string> unstable;
+    auto itor = _recent_list.rbegin();
+    for (size_t i = 0; i < count; i++, itor++)
+    {
+        if (_file_map.at(itor->filename)
+                    .entries.at(itor->block_num)
+                    .state() != CacheEntry::Clean &&
+            std::find(unstable.begin(), unstable.end(), itor->filename) ==
+                unstable.end())
+        {
+            unstable.push_back(itor->filename);
+        }
+    }
+    if (!unstable.empty())
+    {
+        err = sync(unstable);
+        if (err)
+        {
+            return err;
+        }
+    }
     for (size_t i = 0; i < count; i++)
     {
         const auto& rec = _recent_list.back();
@@ -337,15 +438,97 @@ int Cache::flush(const std::string& filename)
     if (dblocks.size() > 0)
     {
         std::sort(dblocks.begin(), dblocks.end());
-        flushBlocks(filename, dblocks);
+        return flushBlocks(filename, dblocks);
     }
     return 0;
 }
 
+int Cache::sync(const std::string& filename)
+{
+    return sync(std::vector<std::string>{filename});
+}
+
+/* the server tells whether it lost unstable writes at the commit, in which
+ * case they are written back again, for all files; these are committed
+ * once more.
+ */
+int Cache::sync(const std::vector<std::string>& filenames)
+{
+    for (int commits = 0; commits < MAX_COMMITS; commits++)
+    {
+        for (const auto& filename : filenames)
+        {
+            int err = flush(filename);
+            if (err)
+            {
+                return err;
+            }
+        }
+        bool lost = false;
+        int err = _commit(filenames, lost);
+        if (lost)
+        {
+            loseUnstable();
+        }
+        if (err)
+        {
+            return err;
+        }
+        if (!lost)
+        {
+            for (const auto& filename : filenames)
+            {
+                commitUnstable(filename);
+            }
+            return 0;
+        }
+    }
+    return EIO;
+}
+
+void Cache::commitUnstable(const std::string& filename)
+{
+    auto fc_itor = _file_map.find(filename);
+    if (fc_itor == _file_map.end())
+    {
+        return;
+    }
+    for (auto& pair : fc_itor->second.entries)
+    {
+        if (pair.second.state() == CacheEntry::Unstable)
+        {
+            pair.second.clean();
+        }
+    }
+}
+
+void Cache::loseUnstable()
+{
+    for (auto& fpair : _file_map)
+    {
+        for (auto& bpair : fpair.second.entries)
+        {
+            if (bpair.second.state() == CacheEntry::Unstable)
+            {
+                bpair.second.lost();
+            }
+        }
+    }
+}
+
 int Cache::flushBlocks(const std::string& filename,
                        const std::vector<size_t>& sorted_dblocks)
 {
     FileCache& fc = _file_map.at(filename);
+    for (size_t b : sorted_dblocks)
+    {
+        if (!fc.entries.at(b).intact())
+        {
+            std::cerr << "corrupted dirty block " << b << " of " << filename
+                      << std::endl;
+            return EIO;
+        }
+    }
     std::vector<char> data;
     RangeList flush_range;
     for (size_t b : sorted_dblocks)
@@ -370,7 +553,7 @@ int Cache::flushBlocks(const std::string& filename,
                            data.size());
                     int err = _content_wb(
                         filename, flush_range.begin()->start, &data[0],
-                        data.size(), fc.attr.time, fc.stale);
+                        data.size(), fc.attr.change, fc.stale);
                     if (err)
                     {
                         return err;
@@ -395,7 +578,7 @@ int Cache::flushBlocks(const std::string& filename,
         assert(flush_range.begin()->end - flush_range.begin()->start ==
                data.size());
         int err = _content_wb(filename, flush_range.begin()->start, &data[0],
-                              data.size(), fc.attr.time, fc.stale);
+                              data.size(), fc.attr.change, fc.stale);
         if (err)
         {
             return err;
@@ -404,7 +587,7 @@ int Cache::flushBlocks(const std::string& filename,
     for (size_t b : sorted_dblocks)
     {
         CacheEntry& entry = fc.entries.at(b);
-        entry.clean();
+        entry.written();
     }
 
     int err = _attr_wb(filename, fc.attr, fc.stale);
@@ -472,7 +655,9 @@ bool Cache::isFullBlock(const FileCache& fc, size_t block_num) const
  *
  * full block will not be touched.
  *
- * if _content_ft fails, then no side-effects will happen.
+ * fetched blocks are installed as soon as their content arrives, so only
+ * one block is buffered. If _content_ft fails, the blocks installed before
+ * the failure are kept.
  */
 int Cache::cacheBlocks(const std::string& filename, size_t block_start,
                        size_t block_end)
@@ -488,10 +673,22 @@ int Cache::cacheBlocks(const std::string& filename, size_t block_start,
         return 0;
     }
     RangeList block_range;
-    /* find continuous blocks and try to fetch them in one message
+    /* find continuous blocks and try to fetch them in one message. A clean
+     * block that got corrupted in memory is dropped and fetched again.
      */
     for (size_t b = block_start; b < block_end; b++)
     {
+        auto block_itor = fc.entries.find(b);
+        if (block_itor != fc.entries.end() && !block_itor->second.intact())
+        {
+            std::cerr << "corrupted block " << b << " of " << filename
+                      << std::endl;
+            if (block_itor->second.state() != CacheEntry::Clean)
+            {
+                return EIO;
+            }
+            deleteEntry(filename, b);
+        }
         if (!isFullBlock(fc, b))
         {
             block_range.insertRange(b, b + 1);
@@ -519,24 +716,10 @@ int Cache::cacheBlocks(const std::string& filename, size_t block_start,
     }
     for (auto rg : block_range)
     {
-        size_t block_count = rg.end - rg.start;
-        std::vector<char> buf(block_count * _block_size);
-        size_t read_size;
-        int err = _content_ft(filename, rg.start * _block_size, &buf[0],
-                              buf.size(), read_size);
-        if (err)
-        {
-            return err;
-        }
-
-        size_t curr_block;
-        for (curr_block = rg.start; curr_block < rg.end; curr_block++)
-        {
-            std::vector<char> block_data(_block_size, 0);
-            size_t copy_start = (curr_block - rg.start) * _block_size;
-            std::copy(buf.begin() + copy_start,
-                      buf.begin() + copy_start + _block_size,
-                      block_data.begin());
+        size_t curr_block = rg.start;
+        std::vector<char> block_data(_block_size, 0);
+        size_t filled = 0;
+        auto install = [&] {
             auto block_itor = fc.entries.find(curr_block);
             if (block_itor == fc.entries.end())
             {
@@ -546,9 +729,36 @@ int Cache::cacheBlocks(const std::string& filename, size_t block_start,
             }
             else
             {
-                CacheEntry& entry = block_itor->second;
-                entry.fetch(std::move(block_data));
+                block_itor->second.fetch(std::move(block_data));
+            }
+            curr_block += 1;
+            block_data.assign(_block_size, 0);
+            filled = 0;
+        };
+        auto sink = [&](const char* data, size_t size) {
+            while (size > 0 && curr_block < rg.end)
+            {
+                size_t n = std::min(size, _block_size - filled);
+                std::copy(data, data + n, block_data.begin() + filled);
+                filled += n;
+                data += n;
+                size -= n;
+                if (filled == _block_size)
+                {
+                    install();
+                }
             }
+        };
+        int err = _content_ft(filename, rg.start * _block_size,
+                              (rg.end - rg.start) * _block_size, sink);
+        if (err)
+        {
+            return err;
+        }
+        // beyond the end of the file
+        while (curr_block < rg.end)
+        {
+            install();
         }
     }
     return 0;
@@ -4,6 +4,7 @@
 #include <list>
 #include <unordered_map>
 #include <vector>
+#include "crc32c.hpp"
 #include "msg.hpp"
 #include "range.hpp"
 
@@ -19,12 +20,15 @@ public:
     enum State
     {
         Clean,
-        Dirty
+        Dirty,
+        Unstable  // written back, but not committed yet
     };
 
 private:
     State _state;
     std::vector<char> _data;
+    uint32_t _crc;    // of `_data`, to catch corruption while cached
+    bool _crc_stale;  // written since, to be taken at the next check
     RangeList _valid_ranges;
     std::list<CacheEntryID>::iterator _use_record;
 
@@ -33,6 +37,8 @@ public:
                std::list<CacheEntryID>::iterator use_record)
         : _state(Clean),
           _data(block_size, 0),
+          _crc(crc32c(_data.data(), _data.size())),
+          _crc_stale(false),
           _valid_ranges(),
           _use_record(use_record)
     {
@@ -40,6 +46,9 @@ public:
     size_t blockSize() const { return _data.size(); }
     State state() const { return _state; }
     void clean() { _state = Clean; }
+    void written() { _state = Unstable; }
+    // written back, and lost by the server
+    void lost() { _state = Dirty; }
     const std::vector<char>& data() const { return _data; }
     std::list<CacheEntryID>::iterator useRecord() const
     {
@@ -47,12 +56,27 @@ public:
     }
 
     const RangeList& validRanges() const { return _valid_ranges; }
+    /* the crc of a block written since the last check is taken now, once
+     * for all the writes; it holds from then on
+     */
+    bool intact()
+    {
+        uint32_t crc = crc32c(_data.data(), _data.size());
+        if (_crc_stale)
+        {
+            _crc = crc;
+            _crc_stale = false;
+        }
+        return crc == _crc;
+    }
 
     void fetch(std::vector<char> fetch_data)
     {
         assert(fetch_data.size() == blockSize());
         overlay(&_data[0], validRanges(), &fetch_data[0]);
         std::swap(_data, fetch_data);
+        _crc = crc32c(_data.data(), _data.size());
+        _crc_stale = false;
         _valid_ranges.insertRange(0, blockSize());
     }
 
@@ -60,6 +84,7 @@ public:
     {
         assert(offset + size <= blockSize());
         std::copy(buf, buf + size, &_data[offset]);
+        _crc_stale = true;
         _valid_ranges.insertRange(offset, offset + size);
         _state = Dirty;
     }
@@ -70,6 +95,7 @@ struct FileAttr
     size_t size;
     mode_t mode;
     FileTime time;
+    uint64_t change;  // the version of the file on the server
 };
 
 struct FileCache
@@ -86,14 +112,22 @@ class Cache
 public:
     using WriteBackContentFunc = std::function<int(
         const std::string& fname, size_t offset, const char* data,
-        size_t size, FileTime& time, bool& stale)>;
+        size_t size, uint64_t& change, bool& stale)>;
     using WriteBackFileAttrFunc = std::function<int(
         const std::string& fname, FileAttr& attr, bool& stale)>;
+    // takes fetched content in order, piece by piece as it arrives
+    using ContentSink = std::function<void(const char* data, size_t size)>;
+    // fetches `size` bytes at `offset`, fewer at the end of the file
     using FetchContentFunc =
         std::function<int(const std::string& filename, size_t offset,
-                          char* data, size_t size, size_t& read_size)>;
+                          size_t size, const ContentSink& sink)>;
     using FetchFileAttrFunc =
         std::function<int(const std::string& filename, FileAttr& attr)>;
+    /* makes what was written back to the files durable, together. `lost`
+     * is set if the server may have lost unstable writes of any file.
+     */
+    using CommitFunc = std::function<int(
+        const std::vector<std::string>& filenames, bool& lost)>;
 
 private:
     // cache look up map
@@ -107,21 +141,24 @@ private:
     WriteBackFileAttrFunc _attr_wb;
     FetchContentFunc _content_ft;
     FetchFileAttrFunc _attr_ft;
+    CommitFunc _commit;
 
 public:
     Cache(size_t block_size, WriteBackContentFunc content_wb,
           WriteBackFileAttrFunc attr_wb, FetchContentFunc content_ft,
-          FetchFileAttrFunc attr_ft)
+          FetchFileAttrFunc attr_ft, CommitFunc commit)
         : _block_size(block_size),
           _content_wb(content_wb),
           _attr_wb(attr_wb),
           _content_ft(content_ft),
-          _attr_ft(attr_ft)
+          _attr_ft(attr_ft),
+          _commit(commit)
     {
     }
 
     bool isStale(const std::string& filename) const;
-    const FileTime* getFileTime(const std::string& filename) const;
+    // the version of the cached file, none if it is not cached
+    const uint64_t* getChange(const std::string& filename) const;
 
     int write(const std::string& filename, size_t offset, const char* buf,
               size_t size);
@@ -132,11 +169,22 @@ public:
     int truncate(const std::string& filename, size_t fsize);
 
     int flush(const std::string& filename);
+    // flush, and make the file durable on the server
+    int sync(const std::string& filename);
+    int sync(const std::vector<std::string>& filenames);
 
     void invalidate(const std::string& filename);
 
+    std::vector<size_t> fullBlocks(const std::string& filename) const;
+
+    // for content fetched along with other requests
+    void insertFile(const std::string& filename, const FileAttr& attr);
+    void fillBlocks(const std::string& filename, size_t offset,
+                    const char* data, size_t size);
+
     size_t countCachedBlocks() const { return _recent_list.size(); }
     size_t countDirtyBlocks() const;
+    size_t countUnstableBlocks() const;
     int evictBlocks(size_t count);
     int flushDirtyBlocks();
 
@@ -171,4 +219,7 @@ private:
 
     int flushBlocks(const std::string& filename,
                     const std::vector<size_t>& sorted_dblocks);
+    size_t countBlocks(CacheEntry::State state) const;
+    void commitUnstable(const std::string& filename);
+    void loseUnstable();
 };
@@ -0,0 +1,242 @@
+#include "kstore.hpp"
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+
+static size_t totalLength(const RangeList& ranges)
+{
+    size_t len = 0;
+    for (auto rg : ranges)
+    {
+        len += rg.end - rg.start;
+    }
+    return len;
+}
+
+KernelStore::KernelStore(size_t budget, InodeFunc inode_ft, StoreFunc store,
+                         InvalFunc inval)
+    : _budget(budget),
+      _used(0),
+      _next_generation(0),
+      _stored_bytes(0),
+      _inode_ft(std::move(inode_ft)),
+      _store(std::move(store)),
+      _inval(std::move(inval)),
+      _busy(false),
+      _storing_forgotten(false),
+      _stopping(false)
+{
+    _worker = std::thread(&KernelStore::run, this);
+}
+
+/* pending pushes are dropped, only the one in progress is waited for. */
+KernelStore::~KernelStore()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+        _jobs.clear();
+    }
+    _cv.notify_all();
+    _worker.join();
+}
+
+bool KernelStore::pushed(const std::string& filename, off_t offset,
+                         size_t size)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return covered(filename, offset, size);
+}
+
+bool KernelStore::covered(const std::string& filename, off_t offset,
+                          size_t size)
+{
+    auto fr_itor = _file_map.find(filename);
+    if (fr_itor == _file_map.end())
+    {
+        return false;
+    }
+    for (auto rg : fr_itor->second.ranges)
+    {
+        if (rg.start <= (size_t)offset && offset + size <= rg.end)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool KernelStore::push(const std::string& filename, off_t offset,
+                       const char* data, size_t size)
+{
+    assert(offset >= 0);
+    if (size == 0 || size > _budget)
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (covered(filename, offset, size))
+    {
+        return false;
+    }
+
+    // make room by retiring cold files, but never the one being pushed
+    while (_used + size > _budget)
+    {
+        auto victim = std::find_if(
+            _recent_list.rbegin(), _recent_list.rend(),
+            [&](const std::string& fname) { return fname != filename; });
+        if (victim == _recent_list.rend())
+        {
+            break;
+        }
+        retire(std::string(*victim));
+    }
+    if (_used + size > _budget)
+    {
+        return false;
+    }
+
+    auto fr_itor = _file_map.find(filename);
+    if (fr_itor == _file_map.end())
+    {
+        _recent_list.push_front(filename);
+        fr_itor = _file_map
+                      .insert({filename,
+                               FileRecord{_next_generation++, RangeList(), 0,
+                                          _recent_list.begin()}})
+                      .first;
+    }
+    else
+    {
+        _recent_list.splice(_recent_list.begin(), _recent_list,
+                            fr_itor->second.use_record);
+    }
+    FileRecord& fr = fr_itor->second;
+    fr.ranges.insertRange(offset, offset + size);
+    size_t bytes = totalLength(fr.ranges);
+    _used = _used - fr.bytes + bytes;
+    fr.bytes = bytes;
+
+    _jobs.push_back(Job{filename, fr.generation, offset,
+                        std::vector<char>(data, data + size)});
+    _cv.notify_all();
+    return true;
+}
+
+void KernelStore::forget(const std::string& filename)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    retire(filename);
+}
+
+/* must be called with _mutex held */
+void KernelStore::retire(const std::string& filename)
+{
+    auto fr_itor = _file_map.find(filename);
+    if (fr_itor == _file_map.end())
+    {
+        return;
+    }
+    _used -= fr_itor->second.bytes;
+    _recent_list.erase(fr_itor->second.use_record);
+    _file_map.erase(fr_itor);
+    if (filename == _storing)
+    {
+        _storing_forgotten = true;
+    }
+    for (auto it = _jobs.begin(); it != _jobs.end();)
+    {
+        if (it->filename == filename)
+        {
+            it = _jobs.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void KernelStore::drain()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this] { return _jobs.empty() && !_busy; });
+}
+
+size_t KernelStore::usedBytes()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _used;
+}
+
+size_t KernelStore::storedBytes()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stored_bytes;
+}
+
+/* must be called with _mutex held */
+bool KernelStore::current(const std::string& filename, uint64_t generation)
+{
+    auto fr_itor = _file_map.find(filename);
+    return fr_itor != _file_map.end() &&
+           fr_itor->second.generation == generation;
+}
+
+/* the inode is resolved without holding the lock, since it may call back
+ * into the file system, and so is the store (see above). A file forgotten
+ * before the store is skipped; one forgotten during it is invalidated
+ * after, so that stale data does not outlive the invalidation.
+ */
+void KernelStore::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        _cv.wait(lock, [this] { return _stopping || !_jobs.empty(); });
+        if (_stopping)
+        {
+            return;
+        }
+        Job job = std::move(_jobs.front());
+        _jobs.pop_front();
+        _busy = true;
+        lock.unlock();
+
+        uint64_t ino = 0;
+        int err = _inode_ft(job.filename, ino);
+
+        lock.lock();
+        if (err == 0 && current(job.filename, job.generation))
+        {
+            _storing = job.filename;
+            _storing_forgotten = false;
+            lock.unlock();
+            err = _store(ino, job.offset, &job.data[0], job.data.size());
+            lock.lock();
+            bool stale = _storing_forgotten ||
+                         !current(job.filename, job.generation);
+            _storing.clear();
+            if (err == 0)
+            {
+                _stored_bytes += job.data.size();
+            }
+            if (err == 0 && stale)
+            {
+                lock.unlock();
+                err = _inval(ino);
+                lock.lock();
+            }
+        }
+#ifndef NDEBUG
+        if (err)
+        {
+            std::cout << "kernel store failed: " << job.filename
+                      << ", err: " << err << std::endl;
+        }
+#endif
+        _busy = false;
+        _cv.notify_all();
+    }
+}
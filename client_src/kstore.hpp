@@ -0,0 +1,110 @@
+#pragma once
+#include <sys/types.h>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "range.hpp"
+
+/* Pushes file content into the kernel page cache ahead of reads (FUSE
+ * notify_store), so that the first read of pushed data is served by the
+ * kernel without a round trip to user space.
+ *
+ * Pushes are queued and performed by a background thread. Finding the inode
+ * of a path goes through the mount point, which must never be done by the
+ * thread serving FUSE requests.
+ *
+ * A store is done without holding the lock: the kernel locks the pages
+ * stored to, which readahead may hold while waiting on a read that the
+ * thread serving FUSE requests, which takes the lock, has to answer. A file
+ * forgotten meanwhile has what was stored invalidated again.
+ *
+ * Bytes pushed for a file are accounted against a budget until the file is
+ * forgotten (e.g. invalidated). Ranges that were already pushed are not
+ * pushed again. If a push does not fit in the budget, the least recently
+ * pushed files are retired to make room.
+ */
+class KernelStore
+{
+public:
+    using InodeFunc =
+        std::function<int(const std::string& filename, uint64_t& ino)>;
+    using StoreFunc = std::function<int(uint64_t ino, off_t offset,
+                                        const char* data, size_t size)>;
+    // drop the kernel cache of the inode
+    using InvalFunc = std::function<int(uint64_t ino)>;
+
+private:
+    struct FileRecord
+    {
+        uint64_t generation;
+        RangeList ranges;
+        size_t bytes;
+        std::list<std::string>::iterator use_record;
+    };
+
+    struct Job
+    {
+        std::string filename;
+        uint64_t generation;
+        off_t offset;
+        std::vector<char> data;
+    };
+
+    size_t _budget;
+    size_t _used;
+    uint64_t _next_generation;
+    size_t _stored_bytes;
+    InodeFunc _inode_ft;
+    StoreFunc _store;
+    InvalFunc _inval;
+
+    std::unordered_map<std::string, FileRecord> _file_map;
+    // sorted by recent push, hot file is near head and cold is near tail.
+    std::list<std::string> _recent_list;
+    std::deque<Job> _jobs;
+    bool _busy;
+    std::string _storing;     // the file of the store in progress
+    bool _storing_forgotten;  // forgotten during that store
+    bool _stopping;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _worker;
+
+public:
+    KernelStore(size_t budget, InodeFunc inode_ft, StoreFunc store,
+                InvalFunc inval);
+    ~KernelStore();
+    KernelStore(const KernelStore&) = delete;
+    KernelStore& operator=(const KernelStore&) = delete;
+
+    // queue `data` to be stored at `offset` of `filename`. Returns false if
+    // the range was already pushed or does not fit in the budget.
+    bool push(const std::string& filename, off_t offset, const char* data,
+              size_t size);
+    /* whether the range was pushed already, so that the caller need not
+     * gather its data
+     */
+    bool pushed(const std::string& filename, off_t offset, size_t size);
+    // the file changed or went away: drop its pending pushes and release
+    // its budget.
+    void forget(const std::string& filename);
+    // block until all queued pushes are performed.
+    void drain();
+
+    size_t budget() const { return _budget; }
+    size_t usedBytes();
+    size_t storedBytes();
+
+private:
+    bool covered(const std::string& filename, off_t offset, size_t size);
+    bool current(const std::string& filename, uint64_t generation);
+    void retire(const std::string& filename);
+    void run();
+};
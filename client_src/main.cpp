@@ -26,12 +26,16 @@
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
 #include "execinfo.h"
 #include "fuse.h"
+#include "fuse_lowlevel.h"
 #include "netfs.hpp"
 
 /*
@@ -49,9 +53,17 @@ static struct options
     const char *cache_size;      // in MB
     const char *evict_count;     // number of blocks to evict when cache full
     const char *flush_interval;  // num of writes before flushing
+    const char *kernel_store;    // in MB, pushed into kernel page cache
+    const char *io_size;         // in kb, max payload of one request
+    const char *compress;        // codec of payloads: zlib or none
+    const char *zero_copy;       // yes or no
     int show_help;
 } options;
 
+// absolute path of the mount point, used to find inode numbers
+static std::string mountpoint;
+static struct fuse_session *session;
+
 #define OPTION(t, p)                      \
     {                                     \
         t, offsetof(struct options, p), 1 \
@@ -63,10 +75,64 @@ static const struct fuse_opt option_spec[] = {
     OPTION("--cache_size=%s", cache_size),
     OPTION("--evict_count=%s", evict_count),
     OPTION("--flush_interval=%s", flush_interval),
+    OPTION("--kernel_store=%s", kernel_store),
+    OPTION("--io_size=%s", io_size),
+    OPTION("--compress=%s", compress),
+    OPTION("--zero_copy=%s", zero_copy),
     OPTION("-h", show_help),
     OPTION("--help", show_help),
     FUSE_OPT_END};
 
+/* the high level API does not expose node ids. Unless use_ino is set, the
+ * inode number reported to the kernel is the node id, so it can be found by
+ * a stat through the mount point.
+ */
+static int nfs_inode(const std::string &filename, uint64_t &ino)
+{
+    struct stat stbuf;
+    if (::stat((mountpoint + filename).c_str(), &stbuf) < 0)
+    {
+        return errno;
+    }
+    ino = stbuf.st_ino;
+    return 0;
+}
+
+static int nfs_store(uint64_t ino, off_t offset, const char *data,
+                     size_t size)
+{
+    struct fuse_bufvec bufv;
+    memset(&bufv, 0, sizeof(bufv));
+    bufv.count = 1;
+    bufv.buf[0].size = size;
+    bufv.buf[0].mem = (void *)data;
+    bufv.buf[0].fd = -1;
+    return -fuse_lowlevel_notify_store(session, ino, offset, &bufv,
+                                       (enum fuse_buf_copy_flags)0);
+}
+
+static int nfs_inval(uint64_t ino)
+{
+    return -fuse_lowlevel_notify_inval_inode(session, ino, 0, 0);
+}
+
+/* NetFS throws once the connection to the server is broken. The request
+ * fails with EIO; the next one connects again.
+ */
+template <typename F>
+static auto guard(const char *name, F body) -> decltype(body())
+{
+    try
+    {
+        return body();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << name << ": " << e.what() << std::endl;
+        return -EIO;
+    }
+}
+
 static void *nfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
 #ifndef NDEBUG
@@ -75,21 +141,13 @@ static void *nfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
     (void)conn;
     cfg->kernel_cache = 0;
     size_t k = 1 << 10;
+    // 0 takes the size advised by the server
     size_t block_size = atoi(options.block_size);
-    if (block_size == 0)
-    {
-        block_size = 4;
-    }
     size_t cache_size = atoi(options.cache_size);
     if (cache_size == 0)
     {
         cache_size = 256;
     }
-    size_t max_entry = cache_size * k / block_size;
-    if (max_entry == 0)
-    {
-        max_entry = 1024;
-    }
     size_t evict_count = atoi(options.evict_count);
     if (evict_count == 0)
     {
@@ -102,16 +160,47 @@ static void *nfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
     }
     std::cout << "server: " << options.hostname << std::endl;
     std::cout << "port: " << options.port << std::endl;
-    std::cout << "cache block size: " << block_size << " KB" << std::endl;
-    std::cout << "cache size: " << max_entry * block_size / k << " MB"
+    size_t kernel_store = atoi(options.kernel_store);
+    // 0 takes the size advised by the server
+    size_t io_size = atoi(options.io_size);
+    uint32_t codecs = 0;
+    if (strcmp(options.compress, "zlib") == 0)
+    {
+        codecs = codecBit(CODEC_ZLIB);
+    }
+    auto netfs = new NetFS(options.hostname, options.port, block_size * k,
+                           cache_size * k * k, evict_count, flush_interval,
+                           io_size * k, codecs,
+                           strcmp(options.zero_copy, "no") != 0);
+    std::cout << "cache block size: " << netfs->blockSize() / k << " KB"
               << std::endl;
+    std::cout << "cache size: "
+              << netfs->maxCacheEntry() * netfs->blockSize() / k / k
+              << " MB" << std::endl;
     std::cout << "cache evict count: " << evict_count << std::endl;
     std::cout << "flush interval: " << flush_interval << std::endl;
-    auto netfs = new NetFS(options.hostname, options.port, block_size * k,
-                           max_entry, evict_count, flush_interval);
+    std::cout << "kernel store: " << kernel_store << " MB" << std::endl;
+    std::cout << "io size: " << netfs->ioSize() / k << " KB" << std::endl;
+    std::cout << "compress: " << options.compress << std::endl;
+    if (kernel_store > 0 && !mountpoint.empty())
+    {
+        session = fuse_get_session(fuse_get_context()->fuse);
+        netfs->enableKernelStore(kernel_store * k * k, nfs_inode, nfs_store,
+                                 nfs_inval);
+    }
     return netfs;
 }
 
+static void nfs_destroy(void *private_data)
+{
+#ifndef NDEBUG
+    std::cout << "nfs_destroy" << std::endl;
+#endif
+    NetFS *fs = (NetFS *)private_data;
+    delete fs;
+    std::cout << compressStats() << std::endl;
+}
+
 static int nfs_getattr(const char *path, struct stat *stbuf,
                        struct fuse_file_info *fi)
 {
@@ -120,7 +209,7 @@ static int nfs_getattr(const char *path, struct stat *stbuf,
 #endif
     (void)fi;
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    return -fs->stat(path, *stbuf);
+    return guard("getattr", [&] { return -fs->stat(path, *stbuf); });
 }
 
 static int nfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
@@ -136,10 +225,10 @@ static int nfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
 
     std::vector<std::string> dirs;
-    int err = fs->readdir(path, dirs);
+    int err = guard("readdir", [&] { return -fs->readdir(path, dirs); });
     if (err != 0)
     {
-        return -err;
+        return err;
     }
 
     for (const auto &d : dirs)
@@ -158,13 +247,15 @@ static int nfs_read(const char *path, char *buf, size_t size, off_t offset,
 #endif
     (void)fi;
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    size_t read_size;
-    int err = fs->read(path, offset, size, buf, read_size);
-    if (err != 0)
-    {
-        return -err;
-    }
-    return read_size;
+    return guard("read", [&] {
+        size_t read_size;
+        int err = fs->read(path, offset, size, buf, read_size);
+        if (err != 0)
+        {
+            return -err;
+        }
+        return (int)read_size;
+    });
 }
 
 static int nfs_write(const char *path, const char *buf, size_t size,
@@ -176,15 +267,17 @@ static int nfs_write(const char *path, const char *buf, size_t size,
 #endif
     (void)fi;
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    int err = fs->write(path, offset, buf, size);
-    if (err != 0)
-    {
-        return -err;
-    }
-    else
-    {
-        return size;
-    }
+    return guard("write", [&] {
+        int err = fs->write(path, offset, buf, size);
+        if (err != 0)
+        {
+            return -err;
+        }
+        else
+        {
+            return (int)size;
+        }
+    });
 }
 
 int nfs_open(const char *path, struct fuse_file_info *fi)
@@ -194,12 +287,24 @@ int nfs_open(const char *path, struct fuse_file_info *fi)
 #endif
     (void)fi;
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    int err = fs->access(path);
-    if (err == 0 && (fi->flags & O_TRUNC))
+    // content fetched by the open itself may be older than the kernel's
+    bool was_valid = fs->isCacheValid(path);
+    bool reading =
+        (fi->flags & O_ACCMODE) != O_WRONLY && !(fi->flags & O_TRUNC);
+    int err = guard("open", [&] {
+        int open_err = fs->open(path, reading);
+        if (open_err == 0 && (fi->flags & O_TRUNC))
+        {
+            open_err = fs->truncate(path, 0);
+        }
+        return -open_err;
+    });
+    // pushed content must survive the open
+    if (err == 0 && session != nullptr && was_valid && fs->isCacheValid(path))
     {
-        err = fs->truncate(path, 0);
+        fi->keep_cache = 1;
     }
-    return -err;
+    return err;
 }
 int nfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
@@ -209,8 +314,7 @@ int nfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     (void)fi;
     (void)mode;
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    int err = fs->create(path);
-    return -err;
+    return guard("create", [&] { return -fs->create(path); });
 }
 
 int nfs_truncate(const char *path, off_t offset, struct fuse_file_info *fi)
@@ -220,8 +324,7 @@ int nfs_truncate(const char *path, off_t offset, struct fuse_file_info *fi)
 #endif
     (void)fi;
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    int err = fs->truncate(path, offset);
-    return -err;
+    return guard("truncate", [&] { return -fs->truncate(path, offset); });
 }
 
 int nfs_unlink(const char *path)
@@ -230,8 +333,7 @@ int nfs_unlink(const char *path)
     std::cout << "nfs_unlink" << std::endl;
 #endif
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    int err = fs->unlink(path);
-    return -err;
+    return guard("unlink", [&] { return -fs->unlink(path); });
 }
 
 int nfs_rmdir(const char *path)
@@ -240,8 +342,7 @@ int nfs_rmdir(const char *path)
     std::cout << "nfs_rmdir" << std::endl;
 #endif
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    int err = fs->rmdir(path);
-    return -err;
+    return guard("rmdir", [&] { return -fs->rmdir(path); });
 }
 
 int nfs_mkdir(const char *path, mode_t mode)
@@ -251,8 +352,9 @@ int nfs_mkdir(const char *path, mode_t mode)
 #endif
     (void)mode;
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    int err = fs->mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO);
-    return -err;
+    return guard("mkdir", [&] {
+        return -fs->mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO);
+    });
 }
 
 int nfs_flush(const char *path, struct fuse_file_info *)
@@ -261,8 +363,17 @@ int nfs_flush(const char *path, struct fuse_file_info *)
     std::cout << "nfs_flush" << std::endl;
 #endif
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    int err = fs->flush(path);
-    return -err;
+    return guard("flush", [&] { return -fs->flush(path); });
+}
+
+// data and metadata are synced alike, as the server syncs the whole file
+int nfs_fsync(const char *path, int, struct fuse_file_info *)
+{
+#ifndef NDEBUG
+    std::cout << "nfs_fsync" << std::endl;
+#endif
+    NetFS *fs = (NetFS *)fuse_get_context()->private_data;
+    return guard("fsync", [&] { return -fs->fsync(path); });
 }
 
 int nfs_statfs(const char *path, struct statvfs *buf)
@@ -272,8 +383,7 @@ int nfs_statfs(const char *path, struct statvfs *buf)
 #endif
     (void)path;
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    int err = fs->statfs(*buf);
-    return -err;
+    return guard("statfs", [&] { return -fs->statfs(*buf); });
 }
 
 int nfs_chmod(const char *, mode_t, struct fuse_file_info *)
@@ -299,25 +409,83 @@ int nfs_rename(const char *from, const char *to, unsigned int flags)
     std::cout << "nfs_rename" << std::endl;
 #endif
     NetFS *fs = (NetFS *)fuse_get_context()->private_data;
-    int err = fs->rename(from, to, flags);
-    return -err;
+    return guard("rename", [&] { return -fs->rename(from, to, flags); });
 }
 
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+static ssize_t nfs_copy_file_range(const char *path_in,
+                                   struct fuse_file_info *fi_in,
+                                   off_t offset_in, const char *path_out,
+                                   struct fuse_file_info *fi_out,
+                                   off_t offset_out, size_t size, int flags)
+{
+#ifndef NDEBUG
+    std::cout << "nfs_copy_file_range: " << path_in << " -> " << path_out
+              << ", size: " << size << std::endl;
+#endif
+    (void)fi_in;
+    (void)fi_out;
+    if (flags != 0)
+    {
+        return -EINVAL;
+    }
+    NetFS *fs = (NetFS *)fuse_get_context()->private_data;
+    return guard("copy_file_range", [&] {
+        size_t copied = 0;
+        int err =
+            fs->copy(path_in, offset_in, path_out, offset_out, size, copied);
+        if (err != 0 && copied == 0)
+        {
+            return (ssize_t)-err;
+        }
+        return (ssize_t)copied;
+    });
+}
+#endif
+
 static struct fuse_operations nfs_oper;
 
+/* remember the mount point, every argument is kept for fuse_main */
+static int nfs_opt_proc(void *data, const char *arg, int key,
+                        struct fuse_args *outargs)
+{
+    (void)data;
+    (void)outargs;
+    if (key == FUSE_OPT_KEY_NONOPT)
+    {
+        char path[PATH_MAX];
+        if (realpath(arg, path) != NULL)
+        {
+            mountpoint = path;
+        }
+    }
+    return 1;
+}
+
 static void show_help(const char *progname)
 {
     printf("usage: %s [options] <mountpoint>\n\n", progname);
     printf(
         "File-system specific options:\n"
-        "    --hostname=<s>              server hostname\n"
+        "    --hostname=<s>              server hostname, or "
+        "unix:<path> or shm:<name> for a server on the same host\n"
         "    --port=<s>                  server port number\n"
-        "    --block_size=<i>            cache block size (in KB)\n"
+        "    --block_size=<i>            cache block size (in KB, default: "
+        "advised by the server)\n"
         "    --cache_size=<i>             cache size (in MB)\n"
         "    --evict_count=<i>           number of blocks to evict when "
         "cache is full\n"
         "    --flush_interval=<i>        flush interval (in number of "
         "writes)\n"
+        "    --kernel_store=<i>          budget for pushing cached data "
+        "into the kernel page cache (in MB, 0 disables)\n"
+        "    --io_size=<i>               max size of one read or write "
+        "request (in KB, default: advised by the server)\n"
+        "    --compress=<s>              compress large read and write "
+        "payloads: zlib or none\n"
+        "    --zero_copy=<s>             let the server send large "
+        "uncompressed reads straight from its files, unchecksummed: yes "
+        "or no (default: no)\n"
         "\n");
 }
 
@@ -328,6 +496,7 @@ int main(int argc, char *argv[])
     nfs_oper.write = nfs_write;
     nfs_oper.readdir = nfs_readdir;
     nfs_oper.init = nfs_init;
+    nfs_oper.destroy = nfs_destroy;
     nfs_oper.create = nfs_create;
     nfs_oper.open = nfs_open;
     nfs_oper.truncate = nfs_truncate;
@@ -335,10 +504,14 @@ int main(int argc, char *argv[])
     nfs_oper.rmdir = nfs_rmdir;
     nfs_oper.mkdir = nfs_mkdir;
     nfs_oper.flush = nfs_flush;
+    nfs_oper.fsync = nfs_fsync;
     nfs_oper.statfs = nfs_statfs;
     nfs_oper.chmod = nfs_chmod;
     nfs_oper.chown = nfs_chown;
     nfs_oper.rename = nfs_rename;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+    nfs_oper.copy_file_range = nfs_copy_file_range;
+#endif
 
     int ret;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -352,9 +525,14 @@ int main(int argc, char *argv[])
     options.evict_count = strdup("");
     options.cache_size = strdup("");
     options.flush_interval = strdup("");
+    options.kernel_store = strdup("");
+    options.io_size = strdup("");
+    options.compress = strdup("none");
+    options.zero_copy = strdup("no");
 
     /* Parse options */
-    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) return 1;
+    if (fuse_opt_parse(&args, &options, option_spec, nfs_opt_proc) == -1)
+        return 1;
 
     /* When --help is specified, first print our own file-system
        specific help text, then signal fuse_main to show
@@ -1,10 +1,12 @@
 #include "netfs.hpp"
+#include "crc32c.hpp"
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/errno.h>
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/statvfs.h>
+#include <unistd.h>
 #include <cassert>
 #include <cstring>
 #include <functional>
@@ -12,7 +14,7 @@
 #include <stdexcept>
 #include <system_error>
 
-int connect(const std::string& hostname, const std::string& port)
+static int connectTcp(const std::string& hostname, const std::string& port)
 {
     int socket_fd;
     struct addrinfo host_info;
@@ -45,50 +47,117 @@ int connect(const std::string& hostname, const std::string& port)
     freeaddrinfo(host_info_list);
     return socket_fd;
 }
+
+/* `hostname` may name a unix socket or a shm ring instead (see
+ * parseAddress), for a server on the same host.
+ */
+static std::unique_ptr<Channel> connect(const std::string& hostname,
+                                        const std::string& port)
+{
+    struct sockaddr_un addr;
+    socklen_t len;
+    Transport transport = parseAddress(hostname, addr, len);
+    if (transport == TRANSPORT_TCP)
+    {
+        return std::unique_ptr<Channel>(
+            new SocketChannel(connectTcp(hostname, port)));
+    }
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd == -1)
+    {
+        throw std::system_error(errno, std::system_category());
+    }
+    if (connect(socket_fd, (struct sockaddr*)&addr, len) < 0)
+    {
+        int err = errno;
+        close(socket_fd);
+        throw std::system_error(err, std::system_category());
+    }
+    if (transport == TRANSPORT_SHM)
+    {
+        return ShmChannel::connect(socket_fd);
+    }
+    return std::unique_ptr<Channel>(new SocketChannel(socket_fd));
+}
 using namespace std::placeholders;
 NetFS::NetFS(const std::string& hostname, const std::string& port,
-             size_t block_size, size_t max_cache_entry, size_t evict_count,
-             size_t flush_interval)
-    : msg_id(0),
-      writer(),
-      reader(),
-      block_size(block_size),
-      max_cache_entry(max_cache_entry),
+             size_t block_size, size_t cache_size, size_t evict_count,
+             size_t flush_interval, size_t io_size, uint32_t codecs,
+             bool zero_copy)
+    : hostname(hostname),
+      port(port),
+      codecs(codecs),
+      rpc(new RpcClient(connect(hostname, port))),
+      server(negotiate()),
+      verifier(server.verifier),
+      writes_lost(false),
+      block_size(block_size        ? block_size
+                 : server.block_size ? server.block_size
+                                     : 4096),
+      max_cache_entry(std::max<size_t>(cache_size / this->block_size, 1)),
       evict_count(evict_count),
       flush_interval(flush_interval),
       write_op_count(0),
-      cache(block_size,
+      io_size(std::min<size_t>(io_size ? io_size : server.io_size,
+                               server.max_io_size)),
+      features(server.features),
+      zero_copy(zero_copy),
+      codec(CODEC_NONE),
+      deferred_count(0),
+      deferred_bytes(0),
+      deferred_change(nullptr),
+      deferred_stale(nullptr),
+      cache(this->block_size,
             std::bind(&NetFS::do_write, this, _1, _2, _3, _4, _5, _6),
             std::bind(&NetFS::do_write_attr, this, _1, _2, _3),
-            std::bind(&NetFS::do_read, this, _1, _2, _3, _4, _5),
-            std::bind(&NetFS::do_read_attr, this, _1, _2)
+            std::bind(&NetFS::do_read, this, _1, _2, _3, _4),
+            std::bind(&NetFS::do_read_attr, this, _1, _2),
+            std::bind(&NetFS::do_commit, this, _1, _2)
 
       )
 {
-    int wt = connect(hostname, port);
-    writer = FdWriter(wt);
-    int rd = dup(wt);
-    if (rd < 0)
+    // the first codec both sides support
+    uint32_t common = server.codecs & codecs;
+    if (common != 0)
     {
-        throw std::system_error(errno, std::system_category());
+        codec = __builtin_ctz(common);
+    }
+    std::cout << "protocol version: " << server.version
+              << ", features: " << features << ", payload codec: " << codec
+              << std::endl;
+}
+
+/* throws if the server does not speak a version of the protocol we do */
+MsgNegotiateResp NetFS::negotiate()
+{
+    MsgNegotiate msg(0, SUPPORTED_FEATURES, codecs);
+    auto resp = rpc->send(msg);
+    auto ptr = std::get_if<MsgNegotiateResp>(&resp.get());
+    assert(ptr);
+    int err = ptr->error;
+    if (err == 0 && ptr->version < MIN_PROTOCOL_VERSION)
+    {
+        err = EPROTONOSUPPORT;
     }
-    reader = FdReader(rd);
+    if (err)
+    {
+        throw std::system_error(err, std::system_category());
+    }
+    return *ptr;
 }
 
 int NetFS::access(const std::string& filename)
 {
-    MsgAccess msg(msg_id++, filename);
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgAccessResp*>(resp.get());
+    MsgAccess msg(0, filename);
+    auto resp = call(msg);
+    auto ptr = std::get_if<MsgAccessResp>(&resp.get());
     assert(ptr);
-    assert(ptr->id == msg.id);
 
     if (ptr->error != 0)
     {
         std::cout << "invalidate due to file not exist: " << filename
                   << std::endl;
-        cache.invalidate(filename);
+        invalidate(filename);
     }
     else
     {
@@ -96,33 +165,49 @@ int NetFS::access(const std::string& filename)
         {
             std::cout << "invalidate due to past stale: " << filename
                       << std::endl;
-            cache.invalidate(filename);
+            invalidate(filename);
         }
         else
         {
-            const FileTime* cached_time = cache.getFileTime(filename);
-            if (cached_time != nullptr && *cached_time != ptr->time)
+            const uint64_t* cached_change = cache.getChange(filename);
+            if (cached_change != nullptr && *cached_change != ptr->change)
             {
                 std::cout << "invalidate due to stale cache ";
-                std::cout << "(time miss match, cached: "
-                          << cached_time->mtime
-                          << ", remote: " << ptr->time.mtime
+                std::cout << "(version miss match, cached: "
+                          << *cached_change << ", remote: " << ptr->change
                           << "): " << filename << std::endl;
-                cache.invalidate(filename);
+                invalidate(filename);
+            }
+            else
+            {
+                pushHotBlocks(filename);
             }
         }
     }
     return ptr->error;
 }
 
+/* a file that is not cached is checked and has its attributes fetched in
+ * one round trip, together with its first blocks if it is opened for
+ * reading. This takes a compound, without one the file is only checked.
+ */
+int NetFS::open(const std::string& filename, bool read)
+{
+    if (cache.getChange(filename) != nullptr ||
+        !(features & FEATURE_COMPOUND))
+    {
+        return access(filename);
+    }
+    size_t blocks = read ? std::max<size_t>(io_size / block_size, 1) : 0;
+    return fetchFile(filename, true, 0, blocks);
+}
+
 int NetFS::create(const std::string& filename)
 {
-    MsgCreate msg(msg_id++, filename);
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgCreateResp*>(resp.get());
+    MsgCreate msg(0, filename);
+    auto resp = call(msg);
+    auto ptr = std::get_if<MsgCreateResp>(&resp.get());
     assert(ptr);
-    assert(ptr->id == msg.id);
     return ptr->error;
 }
 
@@ -133,7 +218,7 @@ int NetFS::stat(const std::string& filename, struct stat& stbuf)
     int err = do_read_attr(filename, attr);
     if (err)
     {
-        cache.invalidate(filename);
+        invalidate(filename);
         return err;
     }
 
@@ -141,18 +226,18 @@ int NetFS::stat(const std::string& filename, struct stat& stbuf)
     {
         std::cout << "invalidate due to past stale: " << filename
                   << std::endl;
-        cache.invalidate(filename);
+        invalidate(filename);
     }
     else
     {
-        const FileTime* cached_time = cache.getFileTime(filename);
-        if (cached_time != nullptr && *cached_time != attr.time)
+        const uint64_t* cached_change = cache.getChange(filename);
+        if (cached_change != nullptr && *cached_change != attr.change)
         {
             std::cout << "invalidate due to stale cache ";
-            std::cout << "(time miss match, cached: " << cached_time->mtime
-                      << ", remote: " << attr.time.mtime << "): " << filename
+            std::cout << "(version miss match, cached: " << *cached_change
+                      << ", remote: " << attr.change << "): " << filename
                       << std::endl;
-            cache.invalidate(filename);
+            invalidate(filename);
         }
     }
 
@@ -170,12 +255,10 @@ int NetFS::stat(const std::string& filename, struct stat& stbuf)
 
 int NetFS::statfs(struct statvfs& stbuf)
 {
-    MsgStatfs msg(msg_id++);
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgStatfsResp*>(resp.get());
+    MsgStatfs msg(0);
+    auto resp = call(msg);
+    auto ptr = std::get_if<MsgStatfsResp>(&resp.get());
     assert(ptr);
-    assert(ptr->id == msg.id);
     if (ptr->error)
     {
         return ptr->error;
@@ -195,12 +278,10 @@ int NetFS::statfs(struct statvfs& stbuf)
 int NetFS::readdir(const std::string& filename,
                    std::vector<std::string>& dirs)
 {
-    MsgReaddir msg(msg_id++, filename);
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgReaddirResp*>(resp.get());
+    MsgReaddir msg(0, filename);
+    auto resp = call(msg);
+    auto ptr = std::get_if<MsgReaddirResp>(&resp.get());
     assert(ptr);
-    assert(ptr->id == msg.id);
     if (ptr->error != 0)
     {
         return ptr->error;
@@ -228,11 +309,34 @@ int NetFS::read(const std::string& filename, off_t offset, size_t size,
     std::cout << "NetFS::read(in) filename: " << filename
               << ", offset: " << offset << ", size: " << size << std::endl;
 #endif
+    // the first read of a file fetches its attributes along, if possible
+    bool fetched = false;
+    if (cache.getChange(filename) == nullptr && size > 0 &&
+        (features & FEATURE_COMPOUND))
+    {
+        int err = fetchFile(filename, false, offset / block_size,
+                            (offset + size - 1) / block_size + 1);
+        if (err)
+        {
+            return err;
+        }
+        fetched = true;
+    }
     int err = cache.read(filename, offset, buf, size, total_read);
     if (err)
     {
         return err;
     }
+    if (kstore && total_read > 0 && (fetched || !cache.isLastReadHit()))
+    {
+        // the rest of the fetched blocks is likely to be read soon
+        off_t read_end = offset + total_read;
+        off_t block_start = offset / block_size * (off_t)block_size;
+        off_t block_end =
+            ((read_end - 1) / block_size + 1) * (off_t)block_size;
+        pushToKernel(filename, block_start, offset - block_start);
+        pushToKernel(filename, read_end, block_end - read_end);
+    }
     err = evict();
     if (err)
     {
@@ -275,147 +379,532 @@ int NetFS::truncate(const std::string& filename, off_t offset)
 
 int NetFS::unlink(const std::string& filename)
 {
-    MsgUnlink msg(msg_id++, filename);
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgUnlinkResp*>(resp.get());
+    MsgUnlink msg(0, filename);
+    auto resp = call(msg);
+    auto ptr = std::get_if<MsgUnlinkResp>(&resp.get());
     assert(ptr);
-    assert(ptr->id == msg.id);
     if (ptr->error == 0)
     {
         std::cout << "invalidate due to unlink: " << filename << std::endl;
-        cache.invalidate(filename);
+        invalidate(filename);
     }
     return ptr->error;
 }
 
 int NetFS::rmdir(const std::string& filename)
 {
-    MsgRmdir msg(msg_id++, filename);
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgRmdirResp*>(resp.get());
+    MsgRmdir msg(0, filename);
+    auto resp = call(msg);
+    auto ptr = std::get_if<MsgRmdirResp>(&resp.get());
     assert(ptr);
-    assert(ptr->id == msg.id);
     if (ptr->error == 0)
     {
         std::cout << "invalidate due to rmdir: " << filename << std::endl;
-        cache.invalidate(filename);
+        invalidate(filename);
     }
     return ptr->error;
 }
 
 int NetFS::mkdir(const std::string& filename, mode_t mode)
 {
-    MsgMkdir msg(msg_id++, filename, mode);
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgMkdirResp*>(resp.get());
+    MsgMkdir msg(0, filename, mode);
+    auto resp = call(msg);
+    auto ptr = std::get_if<MsgMkdirResp>(&resp.get());
     assert(ptr);
-    assert(ptr->id == msg.id);
     return ptr->error;
 }
 
 int NetFS::flush(const std::string& filename)
 {
     int err = cache.flush(filename);
-    return err;
+    int write_err = drainWrites();
+    return err ? err : write_err;
+}
+
+int NetFS::fsync(const std::string& filename)
+{
+    int err = cache.sync(filename);
+    int write_err = drainWrites();
+    return err ? err : write_err;
 }
 
 int NetFS::rename(const std::string& from, const std::string& to,
                   unsigned int flags)
 {
-    MsgRename msg(msg_id++, from, to, flags);
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgRenameResp*>(resp.get());
+    MsgRename msg(0, from, to, flags);
+    auto resp = call(msg);
+    auto ptr = std::get_if<MsgRenameResp>(&resp.get());
     assert(ptr);
-    assert(ptr->id == msg.id);
     if (ptr->error == 0)
     {
-        cache.invalidate(from);
-        cache.invalidate(to);
+        invalidate(from);
+        invalidate(to);
     }
     return ptr->error;
 }
 
-void NetFS::sendMsg(const Msg& msg)
+/* the content never crosses the network. Dirty cached content of both files
+ * is written back first, and the cache of the destination is dropped
+ * afterwards, even on failure since part of it may have been copied.
+ */
+int NetFS::copy(const std::string& from, off_t from_offset,
+                const std::string& to, off_t to_offset, size_t size,
+                size_t& copied)
+{
+    copied = 0;
+    if (!(features & FEATURE_COPY))
+    {
+        return EOPNOTSUPP;
+    }
+    int err = flush(from);
+    if (err == 0 && to != from)
+    {
+        err = flush(to);
+    }
+    if (err)
+    {
+        return err;
+    }
+    MsgCopy msg(0, from, from_offset, to, to_offset, size);
+    auto resp = call(msg);
+    auto ptr = std::get_if<MsgCopyResp>(&resp.get());
+    assert(ptr);
+    copied = ptr->copied;
+    invalidate(to);
+    return ptr->error;
+}
+
+void NetFS::enableKernelStore(size_t budget, KernelStore::InodeFunc inode_ft,
+                              KernelStore::StoreFunc store,
+                              KernelStore::InvalFunc inval)
+{
+    kstore = std::make_unique<KernelStore>(
+        budget, std::move(inode_ft), std::move(store), std::move(inval));
+}
+
+bool NetFS::isCacheValid(const std::string& filename) const
+{
+    return cache.getChange(filename) != nullptr && !cache.isStale(filename);
+}
+
+void NetFS::invalidate(const std::string& filename)
+{
+    drainWrites();
+    cache.invalidate(filename);
+    if (kstore)
+    {
+        kstore->forget(filename);
+    }
+}
+
+/* push a range of cached content into the kernel. The range must be cached
+ * already, it is never fetched for this purpose. A range pushed before is
+ * not even read from the cache.
+ */
+void NetFS::pushToKernel(const std::string& filename, off_t offset,
+                         size_t size)
+{
+    if (size == 0 || kstore->pushed(filename, offset, size))
+    {
+        return;
+    }
+    std::vector<char> buf(size);
+    size_t read_size = 0;
+    int err = cache.read(filename, offset, &buf[0], size, read_size);
+    if (err == 0 && read_size > 0)
+    {
+        kstore->push(filename, offset, &buf[0], read_size);
+    }
+}
+
+void NetFS::pushHotBlocks(const std::string& filename)
 {
-    serializeMsg(msg, [&](const char* buf, size_t size) mutable {
-        writer.write(buf, size);
-    });
-    writer.flush();
+    if (!kstore)
+    {
+        return;
+    }
+    for (size_t b : cache.fullBlocks(filename))
+    {
+        pushToKernel(filename, b * block_size, block_size);
+    }
 }
 
-std::unique_ptr<Msg> NetFS::recvMsg()
+/* fetch the attributes of a file that is not cached, and its blocks
+ * [block_start, block_end), in one compound. With `check_access`, the file
+ * is checked first, as by access. The blocks are best effort: if reading
+ * fails, the error is left to the read that needs them.
+ */
+int NetFS::fetchFile(const std::string& filename, bool check_access,
+                     size_t block_start, size_t block_end)
 {
-    return unserializeMsg(
-        [&](char* buf, size_t size) mutable { reader.read(buf, size); });
+    compound_msg.ops.clear();
+    if (check_access)
+    {
+        appendMsg(MsgAccess(0, filename), compound_msg.ops);
+    }
+    appendMsg(MsgStat(0, filename), compound_msg.ops);
+    size_t chunk = std::max<size_t>(io_size / block_size, 1) * block_size;
+    read_msg.filename = filename;
+    read_msg.accept = codec;
+    read_msg.part_size = 0;
+    read_msg.zero_copy = 0;
+    for (size_t off = block_start * block_size; off < block_end * block_size;
+         off += chunk)
+    {
+        read_msg.offset = off;
+        read_msg.size = std::min(chunk, block_end * block_size - off);
+        appendMsg(read_msg, compound_msg.ops);
+    }
+    auto resp = call(compound_msg);
+    auto ptr = std::get_if<MsgCompoundResp>(&resp.get());
+    assert(ptr);
+
+    size_t pos = 0;
+    size_t read_offset = block_start * block_size;
+    while (pos < ptr->results.size())
+    {
+        nextMsg(ptr->results, pos, compound_result);
+        int err = msgError(compound_result);
+        if (auto stat_resp = std::get_if<MsgStatResp>(&compound_result))
+        {
+            if (err == 0)
+            {
+                FileAttr attr;
+                attr.size = stat_resp->stat.size;
+                attr.mode = stat_resp->stat.mode;
+                attr.time = stat_resp->stat.time;
+                attr.change = stat_resp->stat.change;
+                cache.insertFile(filename, attr);
+            }
+        }
+        else if (auto read_resp = std::get_if<MsgReadResp>(&compound_result))
+        {
+            payload.resize(chunk);
+            if (err == 0 &&
+                unpackRead(*read_resp, payload.data(), chunk) == 0)
+            {
+                cache.fillBlocks(filename, read_offset, payload.data(),
+                                 read_resp->raw_size);
+            }
+            read_offset += chunk;
+            err = 0;
+        }
+        else if (err)
+        {
+            std::cout << "invalidate due to file not exist: " << filename
+                      << std::endl;
+            invalidate(filename);
+        }
+        if (err)
+        {
+            return err;
+        }
+    }
+    return 0;
+}
+
+/* send the deferred writes, then wait for all writes. */
+int NetFS::drainWrites()
+{
+    int err = sendDeferred();
+    int wait_err = waitWrites();
+    return err ? err : wait_err;
+}
+
+/* wait for all pipelined writes. The server may execute writes of a batch
+ * in any order, so a write only indicates a conflict if the file was changed
+ * before it to a version that is neither the cached version nor the result
+ * of another write in the batch. The cached version advances to the
+ * greatest result.
+ */
+int NetFS::waitWrites()
+{
+    if (inflight_writes.empty())
+    {
+        return 0;
+    }
+    // reuse the vectors, the window is the only one allocating
+    std::swap(write_batch, inflight_writes);
+    auto& batch = write_batch;
+    for (auto& w : batch)
+    {
+        w.reply = std::get_if<MsgWriteResp>(&w.resp.get());
+        assert(w.reply);
+        checkVerifier(w.reply->verifier);
+    }
+    int err = 0;
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        auto ptr = batch[i].reply;
+        if (ptr->error)
+        {
+            std::cout << "error detected during write" << std::endl;
+            *batch[i].stale = true;
+            err = ptr->error;
+            continue;
+        }
+        bool known = ptr->before_change == *batch[i].cached_change;
+        for (size_t j = 0; j < batch.size() && !known; j++)
+        {
+            auto other = batch[j].reply;
+            known = j != i && other->error == 0 &&
+                    batch[j].cached_change == batch[i].cached_change &&
+                    other->after_change == ptr->before_change;
+        }
+        if (!known)
+        {
+            std::cout << "stale detected during write";
+            std::cout << "(cached: " << *batch[i].cached_change;
+            std::cout << " remote: " << ptr->before_change << std::endl;
+            *batch[i].stale = true;
+        }
+    }
+    for (auto& w : batch)
+    {
+        if (w.reply->error == 0 && w.reply->after_change > *w.cached_change)
+        {
+            *w.cached_change = w.reply->after_change;
+        }
+    }
+    batch.clear();
+    return err;
 }
 
 /* write to the file. detect if the file has been modified by other clients,
  * mark it using `stale`.
- * write error, discrepancy between before_change and cached_time, are all
+ * write error, discrepancy between before_change and cached_change, are all
  * treated as stale
+ *
+ * the write is split into requests of at most io_size. If the server takes
+ * compounds, up to io_size bytes of writes to one file are deferred. The
+ * rest is pipelined. Results are collected by drainWrites or do_write_attr,
+ * one of which is called by any other request, so `cached_change` and
+ * `stale` must stay valid until then. This holds for the FileCache fields that Cache
+ * passes in.
  */
 int NetFS::do_write(const std::string& filename, off_t offset,
-                    const char* buf, size_t size, FileTime& cached_time,
+                    const char* buf, size_t size, uint64_t& cached_change,
                     bool& stale)
 {
-    std::vector<char> data;
-    data.resize(size);
-    std::copy(buf, buf + size, data.begin());
-    MsgWrite msg(msg_id++, filename, offset, std::move(data));
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgWriteResp*>(resp.get());
-    assert(ptr);
-    assert(ptr->id == msg.id);
-    if (ptr->error)
+    for (size_t off = 0; off < size; off += io_size)
     {
-        std::cout << "error detected during write" << std::endl;
-        stale = true;
-        return ptr->error;
+        size_t chunk = std::min(io_size, size - off);
+        if ((features & FEATURE_COMPOUND) &&
+            deferred_bytes + chunk <= io_size &&
+            (deferred_count == 0 || deferred_change == &cached_change))
+        {
+            if (deferred_count == deferred_writes.size())
+            {
+                deferred_writes.emplace_back();
+            }
+            MsgWrite& msg = deferred_writes[deferred_count++];
+            msg.filename = filename;
+            msg.offset = offset + off;
+            packWrite(msg, buf + off, chunk);
+            deferred_bytes += chunk;
+            deferred_change = &cached_change;
+            deferred_stale = &stale;
+            continue;
+        }
+        int err = sendDeferred();
+        if (err)
+        {
+            return err;
+        }
+        write_msg.filename = filename;
+        write_msg.offset = offset + off;
+        packWrite(write_msg, buf + off, chunk);
+        err = sendWrite(write_msg, cached_change, stale);
+        if (err)
+        {
+            return err;
+        }
+    }
+    return 0;
+}
+
+/* pipeline a write of at most io_size. */
+int NetFS::sendWrite(MsgWrite& msg, uint64_t& cached_change, bool& stale)
+{
+    off_t offset = msg.offset;
+    size_t size = msg.raw_size;
+    // the server may reorder writes in flight, so they must not overlap.
+    // Writes to the same file share `cached_change`.
+    bool must_wait = inflight_writes.size() >= MAX_INFLIGHT_WRITES;
+    for (auto& w : inflight_writes)
+    {
+        must_wait = must_wait || (w.cached_change == &cached_change &&
+                                  w.offset < offset + (off_t)size &&
+                                  offset < w.offset + (off_t)w.size);
+    }
+    if (must_wait)
+    {
+        int err = waitWrites();
+        if (err)
+        {
+            return err;
+        }
+    }
+    auto resp = connection().send(msg);
+    inflight_writes.push_back(PendingWrite{
+        offset, size, std::move(resp), nullptr, &cached_change, &stale});
+    return 0;
+}
+
+/* pipeline the deferred writes */
+int NetFS::sendDeferred()
+{
+    size_t count = deferred_count;
+    deferred_count = 0;
+    deferred_bytes = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        int err = sendWrite(deferred_writes[i], *deferred_change,
+                            *deferred_stale);
+        if (err)
+        {
+            return err;
+        }
+    }
+    return 0;
+}
+
+/* set the payload of `msg`, compressed if worth it */
+void NetFS::packWrite(MsgWrite& msg, const char* buf, size_t size)
+{
+    msg.raw_size = size;
+    msg.crc = crc32c(buf, size);
+    if (compressPayload(codec, buf, size, msg.data))
+    {
+        msg.codec = codec;
     }
     else
     {
-        if (ptr->before_change != cached_time)
+        msg.codec = CODEC_NONE;
+        msg.data.assign(buf, buf + size);
+    }
+}
+
+/* copy the payload of `resp` into `buf`, which holds at most `max_size`
+ * bytes, and verify it. The size of the payload is `resp.raw_size`. Only a
+ * zero-copy read comes without a checksum.
+ */
+int NetFS::unpackRead(const MsgReadResp& resp, char* buf, size_t max_size)
+{
+    if (resp.raw_size > max_size)
+    {
+        return EPROTO;
+    }
+    if (resp.codec != CODEC_NONE)
+    {
+        int err = decompressPayload(resp.codec, resp.data.data(),
+                                    resp.data.size(), buf, resp.raw_size);
+        if (err)
         {
-            std::cout << "stale detected during write";
-            std::cout << "(cached: " << cached_time.mtime;
-            std::cout << " remote: " << ptr->before_change.mtime << std::endl;
-            stale = true;
+            return err;
+        }
+    }
+    else if (resp.data.size() == resp.raw_size)
+    {
+        std::copy(resp.data.begin(), resp.data.end(), buf);
+    }
+    else
+    {
+        return EPROTO;
+    }
+    if (!resp.checked)
+    {
+        return zero_copy && resp.codec == CODEC_NONE ? 0 : EPROTO;
+    }
+    if (crc32c(buf, resp.raw_size) != resp.crc)
+    {
+        std::cerr << "checksum mismatch in read payload" << std::endl;
+        return EBADMSG;
+    }
+    return 0;
+}
+
+/* the server answers in parts of io_size, which are handed to `sink` as
+ * they arrive. A server that cannot is sent pipelined requests of io_size
+ * instead.
+ */
+int NetFS::do_read(const std::string& filename, off_t offset, size_t size,
+                   const Cache::ContentSink& sink)
+{
+    drainWrites();
+    // not looked up again between the pipelined requests
+    RpcClient& conn = connection();
+    read_msg.filename = filename;
+    read_msg.accept = codec;
+    size_t read_size = 0;
+    if (features & FEATURE_PARTS)
+    {
+        read_msg.offset = offset;
+        read_msg.size = size;
+        read_msg.part_size = io_size;
+        read_msg.zero_copy = zero_copy;
+        auto call = conn.send(read_msg);
+        while (call.next(read_part))
+        {
+            int err = consumeRead(read_part, io_size, sink, read_size);
+            if (err)
+            {
+                return err;
+            }
+        }
+        return consumeRead(call.get(), io_size, sink, read_size);
+    }
+    read_msg.part_size = 0;
+    read_msg.zero_copy = 0;
+    for (size_t off = 0; off < size; off += io_size)
+    {
+        read_msg.offset = offset + off;
+        read_msg.size = std::min(io_size, size - off);
+        read_calls.push_back(conn.send(read_msg));
+    }
+    int err = 0;
+    for (auto& call : read_calls)
+    {
+        size_t expected = std::min(io_size, size - read_size);
+        size_t before = read_size;
+        err = consumeRead(call.get(), expected, sink, read_size);
+        if (err || read_size - before < expected)
+        {
+            break;
         }
-        cached_time = ptr->after_change;
-        return 0;
     }
+    read_calls.clear();
+    return err;
 }
 
-int NetFS::do_read(const std::string& filename, off_t offset, char* buf,
-                   size_t size, size_t& read_size)
+/* unpack the read response `resp` of at most `max_size` bytes and pass it
+ * to `sink`. `read_size` counts the bytes passed.
+ */
+int NetFS::consumeRead(const Message& resp, size_t max_size,
+                       const Cache::ContentSink& sink, size_t& read_size)
 {
-    MsgRead msg(msg_id++, filename, offset, size);
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgReadResp*>(resp.get());
+    auto ptr = std::get_if<MsgReadResp>(&resp);
     assert(ptr);
-    assert(ptr->data.size() <= size);
     if (ptr->error)
     {
         return ptr->error;
     }
-    read_size = ptr->data.size();
-    std::copy(ptr->data.begin(), ptr->data.end(), buf);
+    payload.resize(max_size);
+    int err = unpackRead(*ptr, payload.data(), max_size);
+    if (err)
+    {
+        return err;
+    }
+    sink(payload.data(), ptr->raw_size);
+    read_size += ptr->raw_size;
     return 0;
 }
 int NetFS::do_read_attr(const std::string& filename, FileAttr& attr)
 {
-    MsgStat msg(msg_id++, filename);
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgStatResp*>(resp.get());
+    MsgStat msg(0, filename);
+    auto resp = call(msg);
+    auto ptr = std::get_if<MsgStatResp>(&resp.get());
     assert(ptr);
-    assert(ptr->id == msg.id);
     if (ptr->error)
     {
         return ptr->error;
@@ -423,17 +912,30 @@ int NetFS::do_read_attr(const std::string& filename, FileAttr& attr)
     attr.size = ptr->stat.size;
     attr.mode = ptr->stat.mode;
     attr.time = ptr->stat.time;
+    attr.change = ptr->stat.change;
     return 0;
 }
 int NetFS::do_write_attr(const std::string& filename, FileAttr& attr,
                          bool& stale)
 {
-    MsgTruncate msg(msg_id++, filename, attr.size);
-    sendMsg(msg);
-    auto resp = recvMsg();
-    auto ptr = dynamic_cast<MsgTruncateResp*>(resp.get());
+    if (deferred_count > 0 && deferred_change == &attr.change)
+    {
+        int err = waitWrites();
+        if (err)
+        {
+            return err;
+        }
+        return writeAttrCompound(filename, attr, stale);
+    }
+    int err = drainWrites();
+    if (err)
+    {
+        return err;
+    }
+    MsgTruncate msg(0, filename, attr.size);
+    auto resp = call(msg);
+    auto ptr = std::get_if<MsgTruncateResp>(&resp.get());
     assert(ptr);
-    assert(ptr->id == msg.id);
     if (ptr->error != 0)
     {
         std::cout << "error detected during attr write" << std::endl;
@@ -442,15 +944,148 @@ int NetFS::do_write_attr(const std::string& filename, FileAttr& attr,
     }
     else
     {
-        if (ptr->before_change != attr.time)
+        if (ptr->before_change != attr.change)
         {
             std::cout << "stale detected during attr write: ";
-            std::cout << "(cached: " << attr.time.mtime,
-                std::cout << " remote: " << ptr->before_change.mtime
-                          << std::endl;
+            std::cout << "(cached: " << attr.change,
+                std::cout << " remote: " << ptr->before_change << std::endl;
             stale = true;
         }
-        attr.time = ptr->after_change;
+        attr.change = ptr->after_change;
         return 0;
     }
 }
+
+/* send the deferred writes of the file and the attribute write in one
+ * compound. They are served in order, so each of them must find the file
+ * as the previous one left it.
+ */
+int NetFS::writeAttrCompound(const std::string& filename, FileAttr& attr,
+                             bool& stale)
+{
+    compound_msg.ops.clear();
+    for (size_t i = 0; i < deferred_count; i++)
+    {
+        appendMsg(deferred_writes[i], compound_msg.ops);
+    }
+    deferred_count = 0;
+    deferred_bytes = 0;
+    appendMsg(MsgTruncate(0, filename, attr.size), compound_msg.ops);
+    auto resp = connection().send(compound_msg);
+    auto ptr = std::get_if<MsgCompoundResp>(&resp.get());
+    assert(ptr);
+
+    size_t pos = 0;
+    while (pos < ptr->results.size())
+    {
+        nextMsg(ptr->results, pos, compound_result);
+        const uint64_t* before_change;
+        const uint64_t* after_change;
+        if (auto write = std::get_if<MsgWriteResp>(&compound_result))
+        {
+            checkVerifier(write->verifier);
+            before_change = &write->before_change;
+            after_change = &write->after_change;
+        }
+        else
+        {
+            auto truncate = std::get_if<MsgTruncateResp>(&compound_result);
+            assert(truncate);
+            before_change = &truncate->before_change;
+            after_change = &truncate->after_change;
+        }
+        int err = msgError(compound_result);
+        if (err)
+        {
+            std::cout << "error detected during flush" << std::endl;
+            stale = true;
+            return err;
+        }
+        if (*before_change != attr.change)
+        {
+            std::cout << "stale detected during flush: ";
+            std::cout << "(cached: " << attr.change;
+            std::cout << " remote: " << *before_change << std::endl;
+            stale = true;
+        }
+        attr.change = *after_change;
+    }
+    return 0;
+}
+
+/* the writes of the files are all answered before the commits are sent,
+ * so that they cover them. The commits are pipelined.
+ */
+int NetFS::do_commit(const std::vector<std::string>& filenames, bool& lost)
+{
+    drainWrites();
+    RpcClient& conn = connection();
+    std::vector<RpcClient::Call> calls;
+    for (const auto& filename : filenames)
+    {
+        MsgCommit msg(0, filename);
+        calls.push_back(conn.send(msg));
+    }
+    int err = 0;
+    for (auto& call : calls)
+    {
+        auto ptr = std::get_if<MsgCommitResp>(&call.get());
+        assert(ptr);
+        checkVerifier(ptr->verifier);
+        err = err ? err : ptr->error;
+    }
+    lost = writes_lost;
+    writes_lost = false;
+    return err;
+}
+
+/* a broken connection is made again at the next request; the one that
+ * found it broken has failed. Writes in flight on it are lost, and unstable
+ * writes may be, even if the server has not started again: they are all
+ * sent again at the next commit. Deferred writes are kept.
+ */
+RpcClient& NetFS::connection()
+{
+    if (!rpc || rpc->broken())
+    {
+        reconnect();
+    }
+    return *rpc;
+}
+
+void NetFS::reconnect()
+{
+    // their calls refer to the connection
+    inflight_writes.clear();
+    write_batch.clear();
+    read_calls.clear();
+    rpc.reset();
+    rpc.reset(new RpcClient(connect(hostname, port)));
+    try
+    {
+        server = negotiate();
+    }
+    catch (...)
+    {
+        rpc.reset();
+        throw;
+    }
+    checkVerifier(server.verifier);
+    writes_lost = true;
+    std::cout << "connected to the server again" << std::endl;
+}
+
+/* a server that starts again, or fails to write out its page cache, has
+ * a new verifier.
+ */
+void NetFS::checkVerifier(uint64_t server_verifier)
+{
+    if (server_verifier != verifier)
+    {
+        std::cout << "server verifier changed, unstable writes are sent "
+                     "again"
+                  << std::endl;
+        verifier = server_verifier;
+        writes_lost = true;
+    }
+}
@@ -3,35 +3,93 @@
 #include <sys/types.h>
 #include <cstdint>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include "cache.hpp"
+#include "kstore.hpp"
 #include "msg.hpp"
+#include "rpc.hpp"
 #include "serial.hpp"
-#include "stream.hpp"
 
 /* all file operations return errno
- * all methods have no throw guarantee
+ * requests to the server throw once the connection is broken; the next
+ * request connects again
  */
 class NetFS
 {
-    int msg_id;
-    FdWriter writer;
-    FdReader reader;
+    struct PendingWrite
+    {
+        off_t offset;
+        size_t size;
+        RpcClient::Call resp;
+        const MsgWriteResp* reply;
+        uint64_t* cached_change;
+        bool* stale;
+    };
+    static const size_t MAX_INFLIGHT_WRITES = 64;
+
+    // to connect again, once the connection is broken
+    std::string hostname;
+    std::string port;
+    uint32_t codecs;
+    std::unique_ptr<RpcClient> rpc;
+    MsgNegotiateResp server;  // what was agreed on when connecting
+    // of the server, see MsgCommitResp. Once it changes, or the connection
+    // is made again, unstable writes made before may be lost, which is
+    // told at the next commit.
+    uint64_t verifier;
+    bool writes_lost;
     size_t block_size;
     size_t max_cache_entry;
     size_t evict_count;
     size_t flush_interval;
     size_t write_op_count;
+    size_t io_size;
+    uint32_t features;  // agreed on with the server
+    bool zero_copy;     // let the server skip checksums of large reads
+    uint32_t codec;     // for payloads, agreed on with the server
+    std::vector<PendingWrite> inflight_writes;
+    std::vector<PendingWrite> write_batch;
+    // reused by do_read and do_write
+    MsgRead read_msg;
+    MsgWrite write_msg;
+    std::vector<RpcClient::Call> read_calls;
+    Message read_part;
+    MsgCompound compound_msg;
+    Message compound_result;
+    std::vector<char> payload;
+    /* a small write is held back, to be sent in one compound with the
+     * attribute write that ends a flush. Only the first deferred_count
+     * messages are in use, the others are kept for their storage.
+     */
+    std::vector<MsgWrite> deferred_writes;
+    size_t deferred_count;
+    size_t deferred_bytes;
+    uint64_t* deferred_change;
+    bool* deferred_stale;
     Cache cache;
+    std::unique_ptr<KernelStore> kstore;
 
 public:
+    /* a `block_size` or `io_size` of 0 takes the size advised by the
+     * server. The io_size is capped by the server's limit. With
+     * `zero_copy`, large uncompressed reads may be sent by the server
+     * straight from its files, without a checksum.
+     */
     NetFS(const std::string& hostname, const std::string& port,
-          size_t block_size, size_t max_cache_entry, size_t evict_count,
-          size_t flush_interval);
+          size_t block_size, size_t cache_size, size_t evict_count,
+          size_t flush_interval, size_t io_size, uint32_t codecs,
+          bool zero_copy);
+
+    size_t blockSize() const { return block_size; }
+    size_t maxCacheEntry() const { return max_cache_entry; }
+    size_t ioSize() const { return io_size; }
 
     int access(const std::string& filename);
+    // access, and fetch the first blocks if `read`
+    int open(const std::string& filename, bool read);
     int create(const std::string& filename);
     int stat(const std::string& filename, struct stat& statbuf);
     int statfs(struct statvfs& statbuf);
@@ -52,28 +110,72 @@ public:
     int mkdir(const std::string& filename, mode_t mode);
 
     int flush(const std::string& filename);
+    // flush, and make the file durable on the server
+    int fsync(const std::string& filename);
 
     int rename(const std::string& from, const std::string& to,
                unsigned int flags);
 
+    // copy on the server; `copied` is short if `from` ends first
+    int copy(const std::string& from, off_t from_offset,
+             const std::string& to, off_t to_offset, size_t size,
+             size_t& copied);
+
+    // push fetched and hot cached blocks into the kernel page cache
+    void enableKernelStore(size_t budget, KernelStore::InodeFunc inode_ft,
+                           KernelStore::StoreFunc store,
+                           KernelStore::InvalFunc inval);
+    // true if the cached content of the file is known to be up to date
+    bool isCacheValid(const std::string& filename) const;
+
 private:
+    MsgNegotiateResp negotiate();
+    RpcClient& connection();
+    void reconnect();
     int fetchBlocks(const std::string& filename, uint32_t block_start,
                     uint32_t block_end, uint32_t& block_count);
 
     int cacheBlocks(const std::string& filename, uint32_t block_start,
                     uint32_t block_end);
     int cacheFile(const std::string& filename);
+    int fetchFile(const std::string& filename, bool check_access,
+                  size_t block_start, size_t block_end);
 
     int do_write(const std::string& filename, off_t offset, const char* buf,
-                 size_t size, FileTime& cached_time, bool& stale);
-    int do_read(const std::string& filename, off_t offset, char* buf,
-                size_t size, size_t& read_size);
+                 size_t size, uint64_t& cached_change, bool& stale);
+    int do_read(const std::string& filename, off_t offset, size_t size,
+                const Cache::ContentSink& sink);
+    int consumeRead(const Message& resp, size_t max_size,
+                    const Cache::ContentSink& sink, size_t& read_size);
     int do_read_attr(const std::string& filename, FileAttr& attr);
     int do_write_attr(const std::string& filename, FileAttr& attr,
                       bool& stale);
+    int do_commit(const std::vector<std::string>& filenames, bool& lost);
+    void checkVerifier(uint64_t server_verifier);
+    int sendWrite(MsgWrite& msg, uint64_t& cached_change, bool& stale);
+    void packWrite(MsgWrite& msg, const char* buf, size_t size);
+    int unpackRead(const MsgReadResp& resp, char* buf, size_t max_size);
+    int sendDeferred();
+    int writeAttrCompound(const std::string& filename, FileAttr& attr,
+                          bool& stale);
+
+    void invalidate(const std::string& filename);
+    void pushToKernel(const std::string& filename, off_t offset,
+                      size_t size);
+    void pushHotBlocks(const std::string& filename);
 
-    void sendMsg(const Msg& msg);
-    std::unique_ptr<Msg> recvMsg();
+    /* writes are deferred or pipelined, and complete in drainWrites, so
+     * every other request first waits for them; their errors are recorded
+     * as stale files.
+     */
+    template <typename M>
+    RpcClient::Call call(M& msg)
+    {
+        drainWrites();
+        return connection().send(msg);
+    }
+    int drainWrites();
+    int waitWrites();
     uint32_t blockNum(off_t offset);
     size_t blockOffset(off_t offset);
     int evict();
@@ -0,0 +1,192 @@
+#include "rpc.hpp"
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+
+void RpcClient::Call::reset()
+{
+    if (_rpc)
+    {
+        _rpc->release(_slot);
+        _rpc = nullptr;
+    }
+}
+
+RpcClient::RpcClient(std::unique_ptr<Channel> channel)
+    : _channel(std::move(channel)), _writer(*_channel), _reader(*_channel)
+{
+    _receiver = std::thread(&RpcClient::receive, this);
+}
+
+RpcClient::RpcClient(int fd)
+    : RpcClient(std::unique_ptr<Channel>(new SocketChannel(fd)))
+{
+}
+
+/* shutting down the channel wakes up the receiver */
+RpcClient::~RpcClient()
+{
+    _channel->shutdown();
+    _receiver.join();
+}
+
+uint32_t RpcClient::acquire()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_error)
+    {
+        std::rethrow_exception(_error);
+    }
+    uint32_t slot;
+    if (_free_slots.empty())
+    {
+        slot = _slots.size();
+        _slots.emplace_back();
+    }
+    else
+    {
+        slot = _free_slots.back();
+        _free_slots.pop_back();
+    }
+    _slots[slot].state = Waiting;
+    return slot;
+}
+
+const Message& RpcClient::wait(uint32_t slot)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [&] { return _slots[slot].state == Done || _error; });
+    if (_slots[slot].state != Done)
+    {
+        std::rethrow_exception(_error);
+    }
+    return _slots[slot].resp;
+}
+
+bool RpcClient::next(uint32_t slot, Message& part)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    Slot& s = _slots[slot];
+    _cv.wait(lock,
+             [&] { return !s.parts.empty() || s.state == Done || _error; });
+    if (!s.parts.empty())
+    {
+        part = std::move(s.parts.front());
+        s.parts.pop_front();
+        return true;
+    }
+    if (s.state != Done)
+    {
+        std::rethrow_exception(_error);
+    }
+    return false;
+}
+
+void RpcClient::release(uint32_t slot)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _slots[slot].parts.clear();
+    if (_slots[slot].state == Waiting && !_error)
+    {
+        _slots[slot].state = Abandoned;
+    }
+    else
+    {
+        assert(_slots[slot].state == Done || _error);
+        _slots[slot].state = Free;
+        _free_slots.push_back(slot);
+    }
+}
+
+/* once the connection is broken, no response is awaited any more */
+size_t RpcClient::countPending()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_error)
+    {
+        return 0;
+    }
+    size_t count = 0;
+    for (const auto& slot : _slots)
+    {
+        count += slot.state == Waiting || slot.state == Abandoned;
+    }
+    return count;
+}
+
+bool RpcClient::broken()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return (bool)_error;
+}
+
+/* a frame may be cut short, so nothing more can be sent. The first error
+ * is kept.
+ */
+void RpcClient::fail(std::exception_ptr error)
+{
+    _channel->shutdown();
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_error)
+    {
+        _error = error;
+    }
+    _cv.notify_all();
+}
+
+/* the response is decoded into its slot without holding the lock; the slot
+ * is not touched by anyone else until it is marked as done. Parts are moved
+ * out of the way into the queue, or dropped if the caller is gone.
+ */
+void RpcClient::receive()
+{
+    try
+    {
+        while (true)
+        {
+            MsgHeader header;
+            const char* body = _reader.readFrame(header);
+            Slot* slot = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if ((uint32_t)header.id < _slots.size() &&
+                    (_slots[header.id].state == Waiting ||
+                     _slots[header.id].state == Abandoned))
+                {
+                    slot = &_slots[header.id];
+                }
+            }
+            if (slot == nullptr)
+            {
+                std::cerr << "response to unknown request: " << header.id
+                          << std::endl;
+                continue;
+            }
+            unserializeMsg(header, body, slot->resp);
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (msgMore(slot->resp))
+            {
+                if (slot->state == Waiting)
+                {
+                    slot->parts.push_back(std::move(slot->resp));
+                    _cv.notify_all();
+                }
+                continue;
+            }
+            if (slot->state == Abandoned)
+            {
+                slot->state = Free;
+                _free_slots.push_back(header.id);
+            }
+            else
+            {
+                slot->state = Done;
+                _cv.notify_all();
+            }
+        }
+    }
+    catch (...)
+    {
+        fail(std::current_exception());
+    }
+}
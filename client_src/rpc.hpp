@@ -0,0 +1,126 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "channel.hpp"
+#include "frame.hpp"
+#include "msg.hpp"
+
+/* Multiplexes requests over one connection. A request is sent as soon as it
+ * is issued, without waiting for earlier ones to be answered. A receiver
+ * thread reads responses and hands each of them to the request with the same
+ * id, so the server is free to answer in any order.
+ *
+ * Every request in flight owns a slot, where its response is decoded. Slots
+ * are recycled, together with the storage of the responses in them, so in
+ * steady state a request allocates nothing. The id of a request is the index
+ * of its slot.
+ *
+ * A response in parts (see msgMore) is queued part by part in its slot, for
+ * the caller to take as they arrive; the last part completes the request.
+ *
+ * If the connection breaks, every pending and later request fails with the
+ * exception raised in the receiver.
+ */
+class RpcClient
+{
+    enum SlotState
+    {
+        Free,
+        Waiting,
+        Done,
+        Abandoned  // the caller is gone, free the slot on response
+    };
+    struct Slot
+    {
+        SlotState state;
+        Message resp;
+        std::deque<Message> parts;  // received, not yet taken
+    };
+
+public:
+    // handle of a request in flight; releases its slot when destroyed
+    class Call
+    {
+        RpcClient* _rpc;
+        uint32_t _slot;
+
+    public:
+        Call() : _rpc(nullptr), _slot(0) {}
+        Call(RpcClient* rpc, uint32_t slot) : _rpc(rpc), _slot(slot) {}
+        ~Call() { reset(); }
+        Call(Call&& rhs) : _rpc(rhs._rpc), _slot(rhs._slot)
+        {
+            rhs._rpc = nullptr;
+        }
+        Call& operator=(Call&& rhs)
+        {
+            std::swap(_rpc, rhs._rpc);
+            std::swap(_slot, rhs._slot);
+            return *this;
+        }
+        Call(const Call&) = delete;
+        Call& operator=(const Call&) = delete;
+
+        // wait for the response. It stays valid until the call is released.
+        const Message& get() { return _rpc->wait(_slot); }
+        // move the next part into `part`; false once only the last is left
+        bool next(Message& part) { return _rpc->next(_slot, part); }
+        void reset();
+    };
+
+private:
+    std::unique_ptr<Channel> _channel;
+    FrameWriter _writer;
+    FrameReader _reader;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    // a deque, so that slots do not move when more are added
+    std::deque<Slot> _slots;
+    std::vector<uint32_t> _free_slots;
+    std::exception_ptr _error;
+    std::thread _receiver;
+
+public:
+    RpcClient(std::unique_ptr<Channel> channel);
+    // takes ownership of the connected socket `fd`
+    RpcClient(int fd);
+    ~RpcClient();
+    RpcClient(const RpcClient&) = delete;
+    RpcClient& operator=(const RpcClient&) = delete;
+
+    // assign a fresh id to `msg` and send it. `M` is a message class.
+    template <typename M>
+    Call send(M& msg)
+    {
+        uint32_t slot = acquire();
+        Call call(this, slot);
+        msg.id = (int32_t)slot;
+        try
+        {
+            _writer.writeMsg(msg);
+        }
+        catch (...)
+        {
+            fail(std::current_exception());
+            throw;
+        }
+        return call;
+    }
+
+    size_t countPending();
+    // true once a request or the receiver failed on the connection
+    bool broken();
+
+private:
+    uint32_t acquire();
+    const Message& wait(uint32_t slot);
+    bool next(uint32_t slot, Message& part);
+    void release(uint32_t slot);
+    void receive();
+    void fail(std::exception_ptr error);
+};
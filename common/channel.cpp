@@ -0,0 +1,587 @@
+#include "channel.hpp"
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <system_error>
+#include <thread>
+
+static void throwErrno(int err)
+{
+    throw std::system_error(err, std::system_category());
+}
+
+SocketChannel::~SocketChannel()
+{
+    if (_owned)
+    {
+        ::close(_fd);
+    }
+}
+
+size_t SocketChannel::recv(char* buf, size_t size)
+{
+    while (true)
+    {
+        ssize_t res = ::read(_fd, buf, size);
+        if (res >= 0)
+        {
+            return res;
+        }
+        if (errno != EINTR)
+        {
+            throwErrno(errno);
+        }
+    }
+}
+
+/* sendmsg is the socket flavor of writev; MSG_NOSIGNAL turns a broken
+ * connection into EPIPE instead of killing the process.
+ */
+void SocketChannel::send(struct iovec* iov, int iovcnt, bool more)
+{
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovcnt;
+    int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    while (mh.msg_iovlen > 0)
+    {
+        ssize_t res = sendmsg(_fd, &mh, flags);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throwErrno(errno);
+        }
+        // skip what was sent, in case of a partial write
+        size_t sent = res;
+        while (mh.msg_iovlen > 0 && sent >= mh.msg_iov[0].iov_len)
+        {
+            sent -= mh.msg_iov[0].iov_len;
+            mh.msg_iov += 1;
+            mh.msg_iovlen -= 1;
+        }
+        if (mh.msg_iovlen > 0)
+        {
+            mh.msg_iov[0].iov_base = (char*)mh.msg_iov[0].iov_base + sent;
+            mh.msg_iov[0].iov_len -= sent;
+        }
+    }
+}
+
+void SocketChannel::sendFile(int file, off_t& offset, size_t& size)
+{
+    while (size > 0)
+    {
+        ssize_t res = ::sendfile(_fd, file, &offset, size);
+        if (res > 0)
+        {
+            size -= res;
+            continue;
+        }
+        if (res == 0)
+        {
+            return;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        // the file does not support sendfile
+        if (errno == EINVAL || errno == ENOSYS)
+        {
+            return;
+        }
+        throwErrno(errno);
+    }
+}
+
+void SocketChannel::shutdown()
+{
+    ::shutdown(_fd, SHUT_RDWR);
+}
+
+/* the positions only grow; they are taken modulo the ring size. Each one is
+ * written by one side only, and kept apart from the other to not share a
+ * cache line.
+ */
+struct ShmChannel::Ring
+{
+    alignas(64) std::atomic<uint64_t> head;  // consumed by the receiver
+    std::atomic<uint32_t> receiver_waiting;
+    alignas(64) std::atomic<uint64_t> tail;  // produced by the sender
+    std::atomic<uint32_t> sender_waiting;
+};
+
+namespace
+{
+const uint64_t SHM_MAGIC = 0x6e657466732d7368;  // "netfs-sh"
+// the rings' control is in the first page, their data follows
+const size_t SHM_DATA_OFFSET = 4096;
+// checks of the ring before going to sleep, if the peer can run meanwhile
+const int SPIN_COUNT = std::thread::hardware_concurrency() > 1 ? 200 : 0;
+
+struct ShmHeader
+{
+    uint64_t magic;
+    uint64_t ring_size;
+};
+}  // namespace
+
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void closeAll(const int* fds, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            ::close(fds[i]);
+        }
+    }
+}
+
+static void signal(int fd)
+{
+    uint64_t one = 1;
+    ssize_t res = ::write(fd, &one, sizeof(one));
+    (void)res;  // fails only if the counter is full, which is as good
+}
+
+/* sleep until `fd` is signaled or the socket hangs up. Returns false on
+ * hang up.
+ */
+static bool sleepOn(int fd, int sock)
+{
+    struct pollfd pfd[2] = {{fd, POLLIN, 0}, {sock, POLLIN, 0}};
+    while (::poll(pfd, 2, -1) < 0)
+    {
+        if (errno != EINTR)
+        {
+            throwErrno(errno);
+        }
+    }
+    if (pfd[0].revents & POLLIN)
+    {
+        uint64_t count;
+        ssize_t res = ::read(fd, &count, sizeof(count));
+        (void)res;
+    }
+    return pfd[1].revents == 0;
+}
+
+/* fds are the eventfds: data then space of the client's ring, then data
+ * then space of the server's ring.
+ */
+ShmChannel::ShmChannel(int sock, void* mem, size_t mem_size,
+                       size_t ring_size, const int* fds, bool client)
+    : _sock(sock),
+      _mem(mem),
+      _mem_size(mem_size),
+      _ring_size(ring_size),
+      _closed(false)
+{
+    static_assert(sizeof(ShmHeader) + 2 * sizeof(Ring) <= SHM_DATA_OFFSET,
+                  "shm control does not fit in a page");
+    std::copy(fds, fds + 4, _fds);
+    Ring* rings = (Ring*)((char*)mem + sizeof(ShmHeader));
+    char* data = (char*)mem + SHM_DATA_OFFSET;
+    int tx = client ? 0 : 1;
+    int rx = 1 - tx;
+    _tx = {&rings[tx], data + tx * ring_size, fds[2 * tx + 1], fds[2 * tx]};
+    _rx = {&rings[rx], data + rx * ring_size, fds[2 * rx], fds[2 * rx + 1]};
+}
+
+ShmChannel::~ShmChannel()
+{
+    ::munmap(_mem, _mem_size);
+    closeAll(_fds, 4);
+    ::close(_sock);
+}
+
+std::unique_ptr<Channel> ShmChannel::connect(int sock, size_t ring_size)
+{
+    assert(ring_size >= 4096 && (ring_size & (ring_size - 1)) == 0);
+    size_t mem_size = SHM_DATA_OFFSET + 2 * ring_size;
+    int fds[5] = {-1, -1, -1, -1, -1};
+    void* mem = MAP_FAILED;
+    int err = 0;
+    fds[4] = ::memfd_create("netfs", MFD_CLOEXEC);
+    if (fds[4] < 0 || ::ftruncate(fds[4], mem_size) < 0)
+    {
+        err = errno;
+    }
+    for (int i = 0; i < 4 && err == 0; i++)
+    {
+        fds[i] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fds[i] < 0)
+        {
+            err = errno;
+        }
+    }
+    if (err == 0)
+    {
+        mem = ::mmap(nullptr, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fds[4], 0);
+        if (mem == MAP_FAILED)
+        {
+            err = errno;
+        }
+    }
+    if (err == 0)
+    {
+        // the memory is zeroed already, which the rings start from
+        ShmHeader* header = (ShmHeader*)mem;
+        header->magic = SHM_MAGIC;
+        header->ring_size = ring_size;
+
+        uint64_t size = ring_size;
+        struct iovec iov = {&size, sizeof(size)};
+        union
+        {
+            char buf[CMSG_SPACE(sizeof(fds))];
+            struct cmsghdr align;
+        } control;
+        memset(&control, 0, sizeof(control));
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        while (::sendmsg(sock, &mh, MSG_NOSIGNAL) < 0)
+        {
+            if (errno != EINTR)
+            {
+                err = errno;
+                break;
+            }
+        }
+    }
+    if (err)
+    {
+        if (mem != MAP_FAILED)
+        {
+            ::munmap(mem, mem_size);
+        }
+        closeAll(fds, 5);
+        ::close(sock);
+        throwErrno(err);
+    }
+    ::close(fds[4]);
+    return std::unique_ptr<Channel>(
+        new ShmChannel(sock, mem, mem_size, ring_size, fds, true));
+}
+
+/* the memory comes from the client, so its layout is checked before use */
+std::unique_ptr<Channel> ShmChannel::accept(int sock)
+{
+    int fds[5] = {-1, -1, -1, -1, -1};
+    uint64_t ring_size = 0;
+    struct iovec iov = {&ring_size, sizeof(ring_size)};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    ssize_t res;
+    while ((res = ::recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0 &&
+           errno == EINTR)
+    {
+    }
+    int err = res < 0 ? errno : 0;
+    struct cmsghdr* cmsg = res < 0 ? nullptr : CMSG_FIRSTHDR(&mh);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        count = std::min<size_t>(count, 5);
+        memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+    }
+    if (err == 0 &&
+        (res != sizeof(ring_size) || (mh.msg_flags & MSG_CTRUNC) ||
+         std::count(fds, fds + 5, -1) != 0 || ring_size < 4096 ||
+         (ring_size & (ring_size - 1)) != 0))
+    {
+        err = EPROTO;
+    }
+    size_t mem_size = SHM_DATA_OFFSET + 2 * ring_size;
+    struct stat st;
+    if (err == 0 &&
+        (::fstat(fds[4], &st) < 0 || (size_t)st.st_size != mem_size))
+    {
+        err = EPROTO;
+    }
+    void* mem = MAP_FAILED;
+    if (err == 0)
+    {
+        mem = ::mmap(nullptr, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fds[4], 0);
+        if (mem == MAP_FAILED)
+        {
+            err = errno;
+        }
+    }
+    if (err == 0)
+    {
+        ShmHeader* header = (ShmHeader*)mem;
+        if (header->magic != SHM_MAGIC || header->ring_size != ring_size)
+        {
+            ::munmap(mem, mem_size);
+            err = EPROTO;
+        }
+    }
+    if (err)
+    {
+        closeAll(fds, 5);
+        ::close(sock);
+        throwErrno(err);
+    }
+    ::close(fds[4]);
+    return std::unique_ptr<Channel>(
+        new ShmChannel(sock, mem, mem_size, ring_size, fds, false));
+}
+
+/* spin for a while, then sleep until the sender signals. The flag is set
+ * before checking the ring for the last time, and the sender checks the
+ * flag after publishing; with the fences, at least one of them sees the
+ * other. Returns the size of the data available, 0 once the peer is gone
+ * and the ring is drained.
+ */
+size_t ShmChannel::waitData()
+{
+    Ring& ring = *_rx.ring;
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    for (int spins = 0;; spins++)
+    {
+        uint64_t avail = ring.tail.load(std::memory_order_acquire) - head;
+        if (avail > _ring_size)
+        {
+            throwErrno(EPROTO);
+        }
+        if (avail > 0)
+        {
+            return avail;
+        }
+        if (spins < SPIN_COUNT)
+        {
+            cpuRelax();
+            continue;
+        }
+        if (_closed)
+        {
+            return 0;
+        }
+        ring.receiver_waiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool alive = true;
+        if (ring.tail.load(std::memory_order_relaxed) == head)
+        {
+            alive = sleepOn(_rx.wait_fd, _sock);
+        }
+        ring.receiver_waiting.store(0, std::memory_order_relaxed);
+        if (!alive && ring.tail.load(std::memory_order_acquire) == head)
+        {
+            return 0;
+        }
+    }
+}
+
+/* like waitData, for space in the sending ring. Returns 0 once the peer is
+ * gone.
+ */
+size_t ShmChannel::waitSpace()
+{
+    Ring& ring = *_tx.ring;
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    for (int spins = 0;; spins++)
+    {
+        if (_closed)
+        {
+            return 0;
+        }
+        uint64_t used = tail - ring.head.load(std::memory_order_acquire);
+        if (used > _ring_size)
+        {
+            throwErrno(EPROTO);
+        }
+        if (used < _ring_size)
+        {
+            return _ring_size - used;
+        }
+        if (spins < SPIN_COUNT)
+        {
+            cpuRelax();
+            continue;
+        }
+        ring.sender_waiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool alive = true;
+        if (tail - ring.head.load(std::memory_order_relaxed) == _ring_size)
+        {
+            alive = sleepOn(_tx.wait_fd, _sock);
+        }
+        ring.sender_waiting.store(0, std::memory_order_relaxed);
+        if (!alive)
+        {
+            return 0;
+        }
+    }
+}
+
+/* publish `size` more bytes written at the tail */
+void ShmChannel::produced(size_t size)
+{
+    Ring& ring = *_tx.ring;
+    ring.tail.store(ring.tail.load(std::memory_order_relaxed) + size,
+                    std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring.receiver_waiting.load(std::memory_order_relaxed))
+    {
+        signal(_tx.signal_fd);
+    }
+}
+
+size_t ShmChannel::recv(char* buf, size_t size)
+{
+    size_t avail = waitData();
+    if (avail == 0)
+    {
+        return 0;
+    }
+    Ring& ring = *_rx.ring;
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    size_t count = std::min(avail, size);
+    size_t pos = head & (_ring_size - 1);
+    size_t first = std::min(count, _ring_size - pos);
+    memcpy(buf, _rx.data + pos, first);
+    memcpy(buf + first, _rx.data, count - first);
+    ring.head.store(head + count, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring.sender_waiting.load(std::memory_order_relaxed))
+    {
+        signal(_rx.signal_fd);
+    }
+    return count;
+}
+
+/* each piece is published as soon as it is copied, so that the receiver
+ * can start on a frame larger than the ring.
+ */
+void ShmChannel::send(struct iovec* iov, int iovcnt, bool)
+{
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char* src = (const char*)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0)
+        {
+            size_t space = waitSpace();
+            if (space == 0)
+            {
+                throwErrno(EPIPE);
+            }
+            size_t pos = _tx.ring->tail.load(std::memory_order_relaxed) &
+                         (_ring_size - 1);
+            size_t count = std::min(left, space);
+            size_t first = std::min(count, _ring_size - pos);
+            memcpy(_tx.data + pos, src, first);
+            memcpy(_tx.data, src + first, count - first);
+            produced(count);
+            src += count;
+            left -= count;
+        }
+    }
+}
+
+/* the file is read straight into the ring */
+void ShmChannel::sendFile(int file, off_t& offset, size_t& size)
+{
+    while (size > 0)
+    {
+        size_t space = waitSpace();
+        if (space == 0)
+        {
+            throwErrno(EPIPE);
+        }
+        size_t pos =
+            _tx.ring->tail.load(std::memory_order_relaxed) & (_ring_size - 1);
+        size_t count = std::min({size, space, _ring_size - pos});
+        ssize_t res = ::pread(file, _tx.data + pos, count, offset);
+        if (res < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (res <= 0)
+        {
+            return;
+        }
+        produced(res);
+        offset += res;
+        size -= res;
+    }
+}
+
+/* hanging up the socket wakes up both sides */
+void ShmChannel::shutdown()
+{
+    _closed = true;
+    ::shutdown(_sock, SHUT_RDWR);
+}
+
+Transport parseAddress(const std::string& address, struct sockaddr_un& addr,
+                       socklen_t& len)
+{
+    std::string path;
+    Transport transport;
+    if (address.compare(0, 5, "unix:") == 0)
+    {
+        transport = TRANSPORT_UNIX;
+        path = address.substr(5);
+    }
+    else if (address.compare(0, 4, "shm:") == 0)
+    {
+        transport = TRANSPORT_SHM;
+        path = std::string(1, '\0') + "netfs.shm." + address.substr(4);
+    }
+    else
+    {
+        return TRANSPORT_TCP;
+    }
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+    {
+        throwErrno(ENAMETOOLONG);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    len = offsetof(struct sockaddr_un, sun_path) + path.size();
+    return transport;
+}
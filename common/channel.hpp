@@ -0,0 +1,122 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/* A byte stream between the two ends of a connection, which frames are read
+ * from and written to (see FrameReader, FrameWriter). At most one thread
+ * sends and one thread receives at a time.
+ *
+ * Errors are thrown as system_error.
+ */
+class Channel
+{
+public:
+    virtual ~Channel() {}
+    // receive at least 1 and at most `size` bytes; 0 once the peer is gone
+    virtual size_t recv(char* buf, size_t size) = 0;
+    // send all of `iov`. `more` tells that more data follows right away.
+    virtual void send(struct iovec* iov, int iovcnt, bool more) = 0;
+    /* send up to `size` bytes at `offset` of `file`, advancing both. Stops
+     * early at the end of the file, or if the channel cannot send from
+     * files; the caller sends the rest.
+     */
+    virtual void sendFile(int file, off_t& offset, size_t& size) = 0;
+    // fail what is blocked in recv or send, and what comes later
+    virtual void shutdown() = 0;
+};
+
+/* a stream socket, TCP or unix. Closes the socket if `owned`. */
+class SocketChannel : public Channel
+{
+    int _fd;
+    bool _owned;
+
+public:
+    SocketChannel(int fd, bool owned = true) : _fd(fd), _owned(owned) {}
+    ~SocketChannel();
+    SocketChannel(const SocketChannel&) = delete;
+    SocketChannel& operator=(const SocketChannel&) = delete;
+
+    size_t recv(char* buf, size_t size) override;
+    void send(struct iovec* iov, int iovcnt, bool more) override;
+    void sendFile(int file, off_t& offset, size_t& size) override;
+    void shutdown() override;
+};
+
+/* Two rings in memory shared by a client and a server on the same host, one
+ * for each direction. Data is copied into the ring by the sender and out of
+ * it by the receiver, without a system call as long as neither of them has
+ * to wait. A side that waits sleeps on an eventfd, which the other side
+ * signals only if it is asked to.
+ *
+ * The memory (a memfd) and the eventfds are created by the client and passed
+ * to the server over a unix socket, which is kept open afterwards: it hangs
+ * up when either side goes away.
+ */
+class ShmChannel : public Channel
+{
+    struct Ring;
+    struct Side
+    {
+        Ring* ring;
+        char* data;
+        int wait_fd;    // signaled by the peer
+        int signal_fd;  // waited on by the peer
+    };
+
+    int _sock;
+    void* _mem;
+    size_t _mem_size;
+    size_t _ring_size;
+    Side _tx;  // sent data, the peer signals space
+    Side _rx;  // received data, the peer signals data
+    int _fds[4];
+    std::atomic<bool> _closed;
+
+public:
+    static const size_t DEFAULT_RING_SIZE = 4 << 20;
+
+    /* set up the rings over the connected unix socket `sock`, on either
+     * side. The socket is owned by the channel, or closed on failure.
+     */
+    static std::unique_ptr<Channel> connect(
+        int sock, size_t ring_size = DEFAULT_RING_SIZE);
+    static std::unique_ptr<Channel> accept(int sock);
+
+    ~ShmChannel();
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+
+    size_t recv(char* buf, size_t size) override;
+    void send(struct iovec* iov, int iovcnt, bool more) override;
+    void sendFile(int file, off_t& offset, size_t& size) override;
+    void shutdown() override;
+
+private:
+    ShmChannel(int sock, void* mem, size_t mem_size, size_t ring_size,
+               const int* fds, bool client);
+    size_t waitData();
+    size_t waitSpace();
+    void produced(size_t size);
+};
+
+enum Transport
+{
+    TRANSPORT_TCP,
+    TRANSPORT_UNIX,  // "unix:<path>"
+    TRANSPORT_SHM    // "shm:<name>"
+};
+
+/* the transport named by `address`, as given by --hostname. For unix and
+ * shm, `addr` and `len` are filled with the address of the unix socket
+ * to connect to; a shm name is in the abstract namespace.
+ */
+Transport parseAddress(const std::string& address, struct sockaddr_un& addr,
+                       socklen_t& len);
@@ -0,0 +1,126 @@
+#include "compress.hpp"
+#include <zlib.h>
+#include <cerrno>
+#include <chrono>
+
+// the prefix tried first, and how much it must shrink
+#define PROBE_SIZE 4096
+#define MIN_RATIO 0.875
+
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+/* a stream per thread, since setting one up allocates its tables. */
+static z_stream* deflater()
+{
+    struct Deflater
+    {
+        z_stream zs{};
+        Deflater() { deflateInit(&zs, Z_BEST_SPEED); }
+        ~Deflater() { deflateEnd(&zs); }
+    };
+    thread_local Deflater d;
+    return &d.zs;
+}
+
+static z_stream* inflater()
+{
+    struct Inflater
+    {
+        z_stream zs{};
+        Inflater() { inflateInit(&zs); }
+        ~Inflater() { inflateEnd(&zs); }
+    };
+    thread_local Inflater i;
+    return &i.zs;
+}
+
+// returns the compressed size, or 0 if it does not fit in `out_size`
+static size_t deflateAll(const char* data, size_t size, char* out,
+                         size_t out_size)
+{
+    z_stream* zs = deflater();
+    deflateReset(zs);
+    zs->next_in = (Bytef*)data;
+    zs->avail_in = size;
+    zs->next_out = (Bytef*)out;
+    zs->avail_out = out_size;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+    {
+        return 0;
+    }
+    return out_size - zs->avail_out;
+}
+
+bool compressPayload(uint32_t codec, const char* data, size_t size,
+                     std::vector<char>& out)
+{
+    if (codec != CODEC_ZLIB || size < COMPRESS_MIN_SIZE)
+    {
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    CompressStats& stats = compressStats();
+    // anything larger than this is not worth it
+    size_t limit = size * MIN_RATIO;
+    out.resize(limit);
+    bool ok = true;
+    if (size > 2 * PROBE_SIZE)
+    {
+        ok = deflateAll(data, PROBE_SIZE, out.data(),
+                        PROBE_SIZE * MIN_RATIO) != 0;
+    }
+    size_t packed = ok ? deflateAll(data, size, out.data(), limit) : 0;
+    stats.compress_ns += elapsedNs(start);
+    if (packed == 0)
+    {
+        stats.skipped_bytes += size;
+        return false;
+    }
+    out.resize(packed);
+    stats.raw_bytes += size;
+    stats.packed_bytes += packed;
+    return true;
+}
+
+int decompressPayload(uint32_t codec, const char* data, size_t size,
+                      char* out, size_t raw_size)
+{
+    if (codec != CODEC_ZLIB)
+    {
+        return EINVAL;
+    }
+    auto start = std::chrono::steady_clock::now();
+    z_stream* zs = inflater();
+    inflateReset(zs);
+    zs->next_in = (Bytef*)data;
+    zs->avail_in = size;
+    zs->next_out = (Bytef*)out;
+    zs->avail_out = raw_size;
+    int res = inflate(zs, Z_FINISH);
+    compressStats().decompress_ns += elapsedNs(start);
+    if (res != Z_STREAM_END || zs->avail_out != 0 || zs->avail_in != 0)
+    {
+        return EPROTO;
+    }
+    return 0;
+}
+
+CompressStats& compressStats()
+{
+    static CompressStats stats;
+    return stats;
+}
+
+std::ostream& operator<<(std::ostream& os, const CompressStats& stats)
+{
+    os << "compressed " << stats.raw_bytes << " bytes into "
+       << stats.packed_bytes << ", skipped " << stats.skipped_bytes
+       << " bytes, compress " << stats.compress_ns / 1000000
+       << " ms, decompress " << stats.decompress_ns / 1000000 << " ms";
+    return os;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+/* Compression of bulk payloads, the data of reads and writes. The peers
+ * agree on the codecs they both support when connecting (MsgNegotiate),
+ * then each payload says how it is encoded, so a payload that does not
+ * compress well is simply sent raw.
+ */
+enum Codec
+{
+    CODEC_NONE = 0,
+    CODEC_ZLIB = 1,
+};
+
+// a set of codecs, as a bit per codec
+inline uint32_t codecBit(uint32_t codec) { return 1u << codec; }
+const uint32_t SUPPORTED_CODECS = 1u << CODEC_ZLIB;
+
+// payloads smaller than this are always sent raw
+const size_t COMPRESS_MIN_SIZE = 4096;
+
+/* compress `size` bytes at `data` into `out`. Returns false if the payload
+ * is too small or does not shrink enough to be worth it, in which case it
+ * should be sent raw. A prefix is tried first, so incompressible data is
+ * given up on cheaply.
+ */
+bool compressPayload(uint32_t codec, const char* data, size_t size,
+                     std::vector<char>& out);
+
+/* decompress `size` bytes at `data` into the `raw_size` bytes at `out`.
+ * Returns errno: EINVAL for an unknown codec, EPROTO for corrupted data.
+ */
+int decompressPayload(uint32_t codec, const char* data, size_t size,
+                      char* out, size_t raw_size);
+
+// process wide counters, to weigh the bandwidth saved against the CPU cost
+struct CompressStats
+{
+    std::atomic<uint64_t> raw_bytes{0};     // compressed payloads, before
+    std::atomic<uint64_t> packed_bytes{0};  // and after
+    std::atomic<uint64_t> skipped_bytes{0};  // not worth compressing
+    std::atomic<uint64_t> compress_ns{0};
+    std::atomic<uint64_t> decompress_ns{0};
+};
+CompressStats& compressStats();
+std::ostream& operator<<(std::ostream& os, const CompressStats& stats);
@@ -0,0 +1,183 @@
+#include "crc32c.hpp"
+#include <cstring>
+
+// reversed Castagnoli polynomial
+#define POLY 0x82f63b78u
+// below this, a single stream is faster than combining three
+#define MIN_INTERLEAVED 1024
+
+/* the functions below work on the CRC register, without the initial and
+ * final inversion.
+ */
+
+/* a * b mod POLY, both in the reflected representation */
+static uint32_t multModP(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    while (true)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+            {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^(8 * size) mod POLY, by squaring */
+static uint32_t shiftFactor(size_t size)
+{
+    uint32_t x2n = 1u << 30;  // x^1
+    uint32_t factor = 1u << 31;  // x^0
+    size *= 8;
+    while (size != 0)
+    {
+        if (size & 1)
+        {
+            factor = multModP(x2n, factor);
+        }
+        size >>= 1;
+        x2n = multModP(x2n, x2n);
+    }
+    return factor;
+}
+
+struct Tables
+{
+    uint32_t t[8][256];
+    Tables()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; k++)
+            {
+                crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+            }
+            t[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            for (int k = 1; k < 8; k++)
+            {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+/* slicing by 8 */
+static uint32_t updateTable(uint32_t crc, const char* data, size_t size)
+{
+    static const Tables tables;
+    const auto& t = tables.t;
+    const unsigned char* p = (const unsigned char*)data;
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+              t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+              t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+              t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+    {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t updateHw(
+    uint32_t crc, const char* data, size_t size)
+{
+    uint64_t c = crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = __builtin_ia32_crc32di(c, word);
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+    {
+        c = __builtin_ia32_crc32qi((uint32_t)c, *data++);
+    }
+    return (uint32_t)c;
+}
+
+/* the instruction has a latency of 3 cycles but issues every cycle, so
+ * three independent streams keep it busy. The data is split in three
+ * parts, whose checksums are combined at the end.
+ */
+__attribute__((target("sse4.2"))) static uint32_t updateHwInterleaved(
+    uint32_t crc, const char* data, size_t size)
+{
+    size_t part = size / 24 * 8;
+    const char* p0 = data;
+    const char* p1 = data + part;
+    const char* p2 = data + 2 * part;
+    uint64_t c0 = crc;
+    uint64_t c1 = 0;
+    uint64_t c2 = 0;
+    for (size_t i = 0; i < part; i += 8)
+    {
+        uint64_t w0, w1, w2;
+        memcpy(&w0, p0 + i, 8);
+        memcpy(&w1, p1 + i, 8);
+        memcpy(&w2, p2 + i, 8);
+        c0 = __builtin_ia32_crc32di(c0, w0);
+        c1 = __builtin_ia32_crc32di(c1, w1);
+        c2 = __builtin_ia32_crc32di(c2, w2);
+    }
+    uint32_t factor = shiftFactor(part);
+    crc = multModP(factor, (uint32_t)c0) ^ (uint32_t)c1;
+    crc = multModP(factor, crc) ^ (uint32_t)c2;
+    return updateHw(crc, data + 3 * part, size - 3 * part);
+}
+#endif
+
+static uint32_t update(uint32_t crc, const char* data, size_t size)
+{
+#if defined(__x86_64__)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42)
+    {
+        return size < MIN_INTERLEAVED ? updateHw(crc, data, size)
+                                      : updateHwInterleaved(crc, data, size);
+    }
+#endif
+    return updateTable(crc, data, size);
+}
+
+uint32_t crc32c(const char* data, size_t size)
+{
+    return crc32cExtend(0, data, size);
+}
+
+uint32_t crc32cSoftware(const char* data, size_t size)
+{
+    return ~updateTable(~0u, data, size);
+}
+
+uint32_t crc32cExtend(uint32_t crc, const char* data, size_t size)
+{
+    return ~update(~crc, data, size);
+}
+
+uint32_t crc32cCombine(uint32_t crc_a, uint32_t crc_b, size_t size_b)
+{
+    return multModP(shiftFactor(size_b), crc_a) ^ crc_b;
+}
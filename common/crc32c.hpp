@@ -0,0 +1,18 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C (Castagnoli) of payloads and cached blocks. Uses the SSE4.2 crc32
+ * instruction when the CPU has it, on three interleaved streams to hide its
+ * latency, and a table otherwise.
+ */
+uint32_t crc32c(const char* data, size_t size);
+
+// the same, always from the table
+uint32_t crc32cSoftware(const char* data, size_t size);
+
+// extend the checksum `crc` of some data with the following `size` bytes
+uint32_t crc32cExtend(uint32_t crc, const char* data, size_t size);
+
+// the checksum of A followed by B, from those of A and B, B being `size_b`
+uint32_t crc32cCombine(uint32_t crc_a, uint32_t crc_b, size_t size_b);
@@ -0,0 +1,224 @@
+#include "frame.hpp"
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+FrameReader::FrameReader(Channel& channel, size_t capacity)
+    : _channel(channel),
+      _buf(capacity),
+      _capacity(capacity),
+      _begin(0),
+      _end(0)
+{
+    assert(capacity >= sizeof(MsgHeader));
+}
+
+FrameReader::FrameReader(int fd, size_t capacity)
+    : _socket(new SocketChannel(fd, false)),
+      _channel(*_socket),
+      _buf(capacity),
+      _capacity(capacity),
+      _begin(0),
+      _end(0)
+{
+    assert(capacity >= sizeof(MsgHeader));
+}
+
+const char* FrameReader::readFrame(MsgHeader& header)
+{
+    fill(sizeof(MsgHeader));
+    memcpy(&header, &_buf[_begin], sizeof(header));
+    if (header.length > MAX_MSG_LENGTH)
+    {
+        throw UnserializeFormatError("MsgHeader");
+    }
+    fill(sizeof(header) + header.length);
+    const char* body = &_buf[_begin + sizeof(header)];
+    // the data stays in place until the next read
+    _begin += sizeof(header) + header.length;
+    if (_begin == _end)
+    {
+        _begin = _end = 0;
+    }
+    return body;
+}
+
+void FrameReader::readMsg(Message& msg)
+{
+    MsgHeader header;
+    const char* body = readFrame(header);
+    unserializeMsg(header, body, msg);
+}
+
+bool FrameReader::hasFrame() const
+{
+    if (_end - _begin < sizeof(MsgHeader))
+    {
+        return false;
+    }
+    MsgHeader header;
+    memcpy(&header, &_buf[_begin], sizeof(header));
+    return header.length > MAX_MSG_LENGTH ||
+           _end - _begin >= sizeof(header) + header.length;
+}
+
+/* room is made for the rest of the frame being received. A buffer grown
+ * for a large frame is given back once it is read.
+ */
+bool FrameReader::receive()
+{
+    if (hasFrame())
+    {
+        return true;
+    }
+    if (_begin == _end && _buf.size() > _capacity)
+    {
+        _buf.resize(_capacity);
+        _buf.shrink_to_fit();
+        _begin = _end = 0;
+    }
+    size_t size = sizeof(MsgHeader);
+    if (_end - _begin >= size)
+    {
+        MsgHeader header;
+        memcpy(&header, &_buf[_begin], sizeof(header));
+        size += header.length;
+    }
+    reserve(size);
+    size_t res = _channel.recv(&_buf[_end], _buf.size() - _end);
+    _end += res;
+    return res > 0;
+}
+
+/* make room for `size` bytes from _begin */
+void FrameReader::reserve(size_t size)
+{
+    if (_begin + size > _buf.size())
+    {
+        memmove(&_buf[0], &_buf[_begin], _end - _begin);
+        _end -= _begin;
+        _begin = 0;
+        if (size > _buf.size())
+        {
+            _buf.resize(size);
+        }
+    }
+}
+
+/* make at least `size` bytes available from _begin */
+void FrameReader::fill(size_t size)
+{
+    if (_end - _begin >= size)
+    {
+        return;
+    }
+    reserve(size);
+    while (_end - _begin < size)
+    {
+        size_t res = _channel.recv(&_buf[_end], _buf.size() - _end);
+        if (res == 0)
+        {
+            throw std::runtime_error("connection closed by peer");
+        }
+        _end += res;
+    }
+}
+
+static thread_local uint64_t thread_sent = 0;
+
+uint64_t FrameWriter::sentByThread()
+{
+    return thread_sent;
+}
+
+std::vector<char>& FrameWriter::encodeBuffer()
+{
+    static thread_local std::vector<char> body;
+    return body;
+}
+
+void FrameWriter::writeFrame(const MsgHeader& header,
+                             const std::vector<char>& body)
+{
+    struct iovec iov[2];
+    iov[0].iov_base = (void*)&header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)body.data();
+    iov[1].iov_len = body.size();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _channel.send(iov, 2, false);
+    thread_sent += sizeof(header) + body.size();
+}
+
+/* the length of the vector ends the body, the payload follows it. If the
+ * file shrinks meanwhile, the rest of the payload is sent as zeros: the
+ * frame is announced already. If it cannot be read, the frame is cut
+ * short, so the channel is shut down before the error is thrown, for no
+ * other frame to follow it and the peer to see the failure.
+ */
+void FrameWriter::writeFileFrame(MsgHeader header, std::vector<char>& body,
+                                 int file, off_t offset, size_t size)
+{
+    uint64_t length = size;
+    assert(body.size() >= sizeof(length));
+    memcpy(&body[body.size() - sizeof(length)], &length, sizeof(length));
+    header.length += size;
+    struct iovec iov[2];
+    iov[0].iov_base = (void*)&header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)body.data();
+    iov[1].iov_len = body.size();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _channel.send(iov, 2, true);
+    try
+    {
+        // what the channel does not send from the file is copied, or padded
+        _channel.sendFile(file, offset, size);
+        sendPayload(file, offset, size);
+    }
+    catch (...)
+    {
+        _channel.shutdown();
+        throw;
+    }
+    thread_sent += sizeof(header) + header.length;
+}
+
+void FrameWriter::sendPayload(int file, off_t offset, size_t size)
+{
+    thread_local std::vector<char> buf(1 << 16);
+    bool padding = false;
+    while (size > 0)
+    {
+        size_t chunk = std::min(size, buf.size());
+        ssize_t res = padding ? 0 : ::pread(file, buf.data(), chunk, offset);
+        if (res < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (res < 0)
+        {
+            throw std::system_error(errno, std::system_category());
+        }
+        if (res == 0 && !padding)
+        {
+            padding = true;
+            std::fill(buf.begin(), buf.end(), 0);
+        }
+        if (padding)
+        {
+            res = chunk;
+        }
+        struct iovec iov = {buf.data(), (size_t)res};
+        _channel.send(&iov, 1, false);
+        offset += res;
+        size -= res;
+    }
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "channel.hpp"
+#include "msg.hpp"
+
+/* Reads framed messages from a channel, or a socket. Data is received into
+ * a reusable buffer, as much as is available, so a frame usually takes one
+ * read, and several small frames may arrive with a single read. A frame
+ * larger than the buffer grows it.
+ *
+ * An event loop can call receive when the channel is readable, and decode
+ * frames as long as hasFrame, so that it never blocks.
+ *
+ * Neither the channel nor the fd is owned. Errors are thrown as
+ * system_error, a closed connection as runtime_error and a corrupted frame
+ * as UnserializeFormatError. The reader is unusable after an error.
+ */
+class FrameReader
+{
+    std::unique_ptr<Channel> _socket;  // when reading from a socket
+    Channel& _channel;
+    std::vector<char> _buf;
+    size_t _capacity;  // the size of _buf when not holding a large frame
+    size_t _begin;
+    size_t _end;
+
+public:
+    FrameReader(Channel& channel, size_t capacity = 1 << 16);
+    FrameReader(int fd, size_t capacity = 1 << 16);
+
+    // decode the next message into `msg`, reusing its storage if possible
+    void readMsg(Message& msg);
+    // the body of the next frame, valid until the next read
+    const char* readFrame(MsgHeader& header);
+
+    // whether the next frame is received whole, so that reading it does
+    // not block
+    bool hasFrame() const;
+    // receive what is available with a single recv. Returns false at the
+    // end of the stream.
+    bool receive();
+
+private:
+    void reserve(size_t size);
+    void fill(size_t size);
+};
+
+/* Writes framed messages to a channel, or a socket, with one writev of the
+ * header and the body. Can be shared by threads: messages are encoded
+ * concurrently, only the write itself is serialized.
+ *
+ * The payload of a message can also be sent straight from a file with
+ * sendfile, so that it is never copied through user space.
+ *
+ * Neither the channel nor the fd is owned. Errors are thrown as
+ * system_error.
+ */
+class FrameWriter
+{
+    std::unique_ptr<Channel> _socket;  // when writing to a socket
+    Channel& _channel;
+    std::mutex _mutex;
+
+public:
+    FrameWriter(Channel& channel) : _channel(channel) {}
+    FrameWriter(int fd)
+        : _socket(new SocketChannel(fd, false)), _channel(*_socket)
+    {
+    }
+
+    // `M` is a message class or Message
+    template <typename M>
+    void writeMsg(const M& msg)
+    {
+        std::vector<char>& body = encodeBuffer();
+        MsgHeader header;
+        serializeMsg(msg, header, body);
+        writeFrame(header, body);
+    }
+
+    /* like writeMsg, with `size` bytes at `offset` of the file `file` as
+     * the payload. The last field of `msg` must be an empty vector<char>,
+     * which the payload stands in for.
+     */
+    template <typename M>
+    void writeMsg(const M& msg, int file, off_t offset, size_t size)
+    {
+        std::vector<char>& body = encodeBuffer();
+        MsgHeader header;
+        serializeMsg(msg, header, body);
+        writeFileFrame(header, body, file, offset, size);
+    }
+
+    void writeFrame(const MsgHeader& header, const std::vector<char>& body);
+    void writeFileFrame(MsgHeader header, std::vector<char>& body, int file,
+                        off_t offset, size_t size);
+
+    /* bytes of frames written by the calling thread so far, by any writer.
+     * The difference across a call tells what it sent.
+     */
+    static uint64_t sentByThread();
+
+private:
+    // per thread, so that encoding needs no lock and no allocation
+    static std::vector<char>& encodeBuffer();
+    // copy the payload of a file frame that sendfile did not send
+    void sendPayload(int file, off_t offset, size_t size);
+};
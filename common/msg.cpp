@@ -1,38 +1,133 @@
 #include "msg.hpp"
 
-std::unordered_map<Msg::Type, std::unique_ptr<Msg> (*)(const SReader& rs)>
-    unserializorLookup = {
-        {Msg::Access, MsgAccess::unserialize},
-        {Msg::AccessResp, MsgAccessResp::unserialize},
-        {Msg::Statfs, MsgStatfs::unserialize},
-        {Msg::StatfsResp, MsgStatfsResp::unserialize},
-        {Msg::Create, MsgCreate::unserialize},
-        {Msg::CreateResp, MsgCreateResp::unserialize},
-        {Msg::Stat, MsgStat::unserialize},
-        {Msg::StatResp, MsgStatResp::unserialize},
-        {Msg::Readdir, MsgReaddir::unserialize},
-        {Msg::ReaddirResp, MsgReaddirResp::unserialize},
-        {Msg::Read, MsgRead::unserialize},
-        {Msg::ReadResp, MsgReadResp::unserialize},
-        {Msg::Write, MsgWrite::unserialize},
-        {Msg::WriteResp, MsgWriteResp::unserialize},
-        {Msg::Truncate, MsgTruncate::unserialize},
-        {Msg::TruncateResp, MsgTruncateResp::unserialize},
-        {Msg::Unlink, MsgUnlink::unserialize},
-        {Msg::UnlinkResp, MsgUnlinkResp::unserialize},
-        {Msg::Rmdir, MsgRmdir::unserialize},
-        {Msg::RmdirResp, MsgRmdirResp::unserialize},
-        {Msg::Mkdir, MsgMkdir::unserialize},
-        {Msg::MkdirResp, MsgMkdirResp::unserialize},
-        {Msg::Rename, MsgRename::unserialize},
-        {Msg::RenameResp, MsgRenameResp::unserialize},
+template <size_t I>
+struct BaseOf
+{
+    static Msg& get(Message& msg) { return std::get<I>(msg); }
+    static constexpr auto value = &get;
+};
+
+template <size_t I>
+struct SerializerOf
+{
+    static void serialize(const Message& msg, MsgHeader& header,
+                          std::vector<char>& body)
+    {
+        serializeMsg(std::get<I>(msg), header, body);
+    }
+    static constexpr auto value = &serialize;
+};
+
+template <size_t I>
+struct AppenderOf
+{
+    static void append(const Message& msg, std::vector<char>& frames)
+    {
+        appendMsg(std::get<I>(msg), frames);
+    }
+    static constexpr auto value = &append;
+};
+
+template <size_t I>
+struct ErrorOf
+{
+    static int32_t error(const Message& msg)
+    {
+        if constexpr (I % 2 == 1)
+        {
+            return std::get<I>(msg).error;
+        }
+        else
+        {
+            (void)msg;
+            return 0;
+        }
+    }
+    static constexpr auto value = &error;
+};
+
+/* the body must be consumed exactly, anything else means the frame is
+ * corrupted.
+ */
+template <size_t I>
+struct UnserializerOf
+{
+    static void unserialize(const MsgHeader& header, const char* body,
+                            Message& msg)
+    {
+        if (msg.index() != I)
+        {
+            msg.emplace<I>();
+        }
+        auto& res = std::get<I>(msg);
+        BufferReader rs(body, header.length);
+        res.unserializeBody(rs);
+        if (rs.remaining() != 0)
+        {
+            throw UnserializeFormatError("Msg");
+        }
+        res.id = header.id;
+    }
+    static constexpr auto value = &unserialize;
 };
 
-void serializeMsg(const Msg& msg, const SWriter& sr) { msg.serialize(sr); }
+static constexpr auto base_getters = makeDispatchArray<BaseOf>();
+static constexpr auto serializers = makeDispatchArray<SerializerOf>();
+static constexpr auto unserializers = makeDispatchArray<UnserializerOf>();
+static constexpr auto appenders = makeDispatchArray<AppenderOf>();
+static constexpr auto error_getters = makeDispatchArray<ErrorOf>();
+
+Msg& msgBase(Message& msg) { return base_getters[msg.index()](msg); }
+
+const Msg& msgBase(const Message& msg)
+{
+    return base_getters[msg.index()](const_cast<Message&>(msg));
+}
+
+void serializeMsg(const Message& msg, MsgHeader& header,
+                  std::vector<char>& body)
+{
+    serializers[msg.index()](msg, header, body);
+}
+
+void unserializeMsg(const MsgHeader& header, const char* body, Message& msg)
+{
+    if (header.type >= MSG_TYPE_COUNT)
+    {
+        throw UnserializeFormatError("Msg::Type");
+    }
+    unserializers[header.type](header, body, msg);
+}
+
+int32_t msgError(const Message& msg)
+{
+    return error_getters[msg.index()](msg);
+}
+
+bool msgMore(const Message& msg)
+{
+    auto read = std::get_if<MsgReadResp>(&msg);
+    return read && read->more;
+}
+
+void appendMsg(const Message& msg, std::vector<char>& frames)
+{
+    appenders[msg.index()](msg, frames);
+}
 
-std::unique_ptr<Msg> unserializeMsg(const SReader& rs)
+void nextMsg(const std::vector<char>& frames, size_t& pos, Message& msg)
 {
-    Msg::Type type = (Msg::Type)unserializePod<uint32_t>(rs);
-    auto creator = unserializorLookup.at(type);
-    return creator(rs);
+    MsgHeader header;
+    if (frames.size() - pos < sizeof(header))
+    {
+        throw UnserializeFormatError("MsgHeader");
+    }
+    memcpy(&header, &frames[pos], sizeof(header));
+    pos += sizeof(header);
+    if (frames.size() - pos < header.length)
+    {
+        throw UnserializeFormatError("Msg");
+    }
+    unserializeMsg(header, &frames[pos], msg);
+    pos += header.length;
 }
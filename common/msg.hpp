@@ -1,8 +1,17 @@
 #pragma once
+#include <array>
+#include <cstring>
+#include <utility>
+#include <variant>
 #include "msg_access.hpp"
 #include "msg_base.hpp"
+#include "msg_commit.hpp"
+#include "msg_compound.hpp"
+#include "msg_copy.hpp"
 #include "msg_create.hpp"
+#include "msg_metrics.hpp"
 #include "msg_mkdir.hpp"
+#include "msg_negotiate.hpp"
 #include "msg_read.hpp"
 #include "msg_readdir.hpp"
 #include "msg_rename.hpp"
@@ -13,5 +22,121 @@
 #include "msg_unlink.hpp"
 #include "msg_write.hpp"
 
-void serializeMsg(const Msg& msg, const SWriter& sr);
-std::unique_ptr<Msg> unserializeMsg(const SReader& rs);
+// any message. The index of an alternative is its Msg::Type.
+using Message =
+    std::variant<MsgAccess, MsgAccessResp, MsgStatfs, MsgStatfsResp,
+                 MsgCreate, MsgCreateResp, MsgStat, MsgStatResp, MsgReaddir,
+                 MsgReaddirResp, MsgRead, MsgReadResp, MsgWrite,
+                 MsgWriteResp, MsgTruncate, MsgTruncateResp, MsgUnlink,
+                 MsgUnlinkResp, MsgRmdir, MsgRmdirResp, MsgMkdir,
+                 MsgMkdirResp, MsgRename, MsgRenameResp, MsgCompound,
+                 MsgCompoundResp, MsgNegotiate, MsgNegotiateResp, MsgCopy,
+                 MsgCopyResp, MsgCommit, MsgCommitResp, MsgMetrics,
+                 MsgMetricsResp>;
+
+constexpr size_t MSG_TYPE_COUNT = std::variant_size_v<Message>;
+
+template <size_t... I>
+constexpr bool isInTypeOrder(std::index_sequence<I...>)
+{
+    return ((std::variant_alternative_t<I, Message>::type_id == I) && ...);
+}
+static_assert(isInTypeOrder(std::make_index_sequence<MSG_TYPE_COUNT>()),
+              "alternatives of Message must be in the order of Msg::Type");
+
+/* builds an array with an entry per message type, entry I being
+ * Entry<I>::value. Used to dispatch on the type of a message without
+ * hashing or virtual calls.
+ */
+template <template <size_t> class Entry, size_t... I>
+constexpr auto makeDispatchArray(std::index_sequence<I...>)
+{
+    return std::array<decltype(Entry<0>::value), sizeof...(I)>{
+        Entry<I>::value...};
+}
+
+template <template <size_t> class Entry>
+constexpr auto makeDispatchArray()
+{
+    return makeDispatchArray<Entry>(
+        std::make_index_sequence<MSG_TYPE_COUNT>());
+}
+
+// the type and id, shared by all messages
+Msg& msgBase(Message& msg);
+const Msg& msgBase(const Message& msg);
+
+/* the error of a response, 0 for requests. Msg::Type lists each request
+ * followed by its response.
+ */
+int32_t msgError(const Message& msg);
+
+// true for a response that is followed by more parts, see MsgReadResp
+bool msgMore(const Message& msg);
+
+// a body longer than this is treated as a format error
+const uint32_t MAX_MSG_LENGTH = 1u << 30;
+
+// the body is written to `body`, which is resized to fit
+template <typename M,
+          std::enable_if_t<std::is_base_of<Msg, M>::value, int> = 0>
+void serializeMsg(const M& msg, MsgHeader& header, std::vector<char>& body)
+{
+    body.resize(msg.bodySize());
+    BufferWriter ws(body.data());
+    msg.serializeBody(ws);
+    header.type = (uint32_t)msg.type;
+    header.id = msg.id;
+    header.length = (uint32_t)body.size();
+}
+void serializeMsg(const Message& msg, MsgHeader& header,
+                  std::vector<char>& body);
+
+// append the frame of `msg` to `frames`, e.g. the ops of a MsgCompound
+template <typename M,
+          std::enable_if_t<std::is_base_of<Msg, M>::value, int> = 0>
+void appendMsg(const M& msg, std::vector<char>& frames)
+{
+    MsgHeader header{(uint32_t)msg.type, msg.id, (uint32_t)msg.bodySize()};
+    size_t pos = frames.size();
+    frames.resize(pos + sizeof(header) + header.length);
+    memcpy(&frames[pos], &header, sizeof(header));
+    BufferWriter ws(&frames[pos + sizeof(header)]);
+    msg.serializeBody(ws);
+}
+void appendMsg(const Message& msg, std::vector<char>& frames);
+
+/* decode the frame at `pos` of `frames` into `msg`, and advance `pos` past
+ * it. Throws UnserializeFormatError if the frame is cut short.
+ */
+void nextMsg(const std::vector<char>& frames, size_t& pos, Message& msg);
+
+/* decode a message from the `header.length` bytes at `body` into `msg`. If
+ * `msg` already holds a message of the same type, its storage is reused.
+ */
+void unserializeMsg(const MsgHeader& header, const char* body, Message& msg);
+
+// write a frame to the stream `ws`
+template <typename W>
+void serializeMsg(const Message& msg, W& ws)
+{
+    MsgHeader header;
+    std::vector<char> body;
+    serializeMsg(msg, header, body);
+    serializePod<MsgHeader>(header, ws);
+    ws.write(body.data(), body.size());
+}
+
+// read a frame from the stream `rs`
+template <typename R>
+void unserializeMsg(R& rs, Message& msg)
+{
+    MsgHeader header = unserializePod<MsgHeader>(rs);
+    if (header.length > MAX_MSG_LENGTH)
+    {
+        throw UnserializeFormatError("MsgHeader");
+    }
+    std::vector<char> body(header.length);
+    rs.read(body.data(), body.size());
+    unserializeMsg(header, body.data(), msg);
+}
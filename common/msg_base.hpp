@@ -1,7 +1,6 @@
 #pragma once
 #include <stdint.h>
 #include <sys/stat.h>
-#include <functional>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -11,55 +10,62 @@
 #include "serial.hpp"
 #include "time.hpp"
 
-/* All message classes should derive from the *Msg* class, which contains one
- * field: message type. The derived message can (and should) have its own
- * fields. To implement (un)serialization, a derived Msg class must:
+/* On the wire, a message is a frame: a fixed size MsgHeader followed by the
+ * body. The length in the header allows the receiver to read a whole frame
+ * at once and decode it from memory.
+ */
+#pragma pack(push, 1)
+struct MsgHeader
+{
+    uint32_t type;
+    int32_t id;
+    uint32_t length;  // of the body
+};
+#pragma pack(pop)
+
+/* All message classes should derive from the *Msg* class, which contains two
+ * fields: message type and message id. A response carries the id of its
+ * request, so that responses can be matched with requests even if they come
+ * out of order. The derived message can (and should) have its own fields.
  *
- * 1) add an new entry in enum Msg::Type.
+ * Messages are passed around as the variant *Message* (see msg.hpp), whose
+ * alternatives are in the order of Msg::Type, so the type of a message is
+ * also its index in the variant. There are no virtual functions; code that
+ * handles any message dispatches through arrays indexed by type. To add a
+ * message:
  *
- * 2) the constructor must call Msg(Type type) with the newly added entry
+ * 1) add an new entry in enum Msg::Type.
  *
- * 3) implement a member function serializeBody that writes its fields into
- * the stream.
+ * 2) derive from MsgBase<itself, the new entry>, and the constructor must
+ * call MsgBase(int32_t id).
  *
- * 4) implement a static function unserialize that reads its body from the
- * stream and construct an instance of its own.
+ * 3) implement a static function template *fields* that passes its fields,
+ * in wire order, to `f`. This is the only place listing the fields; the
+ * body is serialized and unserialized from it by MsgBase. The type of each
+ * field picks its encoding (see serializeField in serial.hpp).
  *
- * 5) add a pair (msg type, the unserialize function) to the hash map
- * *unserializorLookup*. By doing this, the unserializeMsg function is able to
- * look up the unserialize function from the type read from the stream.
+ * 4) add the class to *Message* at the position of its type.
  */
 
 /* template
 
-   class Msg#NAME : public Msg
+   class Msg#NAME : public MsgBase<Msg#NAME, Msg::#NAME>
    {
    public:
-   int32_t id;
    //more fields here
    public:
-   Msg#NAME() : Msg(Msg::#NAME), id(0) //more fields
+   Msg#NAME() : MsgBase() //more fields
 
    {}
    Msg#NAME(int32_t id)
-   : Msg(Msg::#NAME), id(id) //more fields
+   : MsgBase(id) //more fields
    {
    }
 
-   protected:
-   virtual void serializeBody(const SWriter& ws) const
+   template <typename Self, typename F>
+   static void fields(Self& self, F&& f)
    {
-   serializePod<int32_t>(id, ws);
-   //your code here
-   }
-
-   public:
-   static std::unique_ptr<Msg> unserialize(const SReader& rs)
-   {
-   auto res = std::make_unique<Msg#NAME>();
-   res->id = unserializePod<int32_t>(rs);
-   //your code here
-   return res;
+   f(self.field1, self.field2);
    }
    };
 */
@@ -92,18 +98,60 @@ public:
         Mkdir,
         MkdirResp,
         Rename,
-        RenameResp
+        RenameResp,
+        Compound,
+        CompoundResp,
+        Negotiate,
+        NegotiateResp,
+        Copy,
+        CopyResp,
+        Commit,
+        CommitResp,
+        Metrics,
+        MetricsResp
     } type;
+    int32_t id;
 
 protected:
-    Msg(Type type) : type(type) {}
-    virtual void serializeBody(const SWriter& ws) const = 0;
+    Msg(Type type, int32_t id) : type(type), id(id) {}
+};
+
+/* implements (un)serialization of the body of `Derived` from its field
+ * list. Encoding first sizes the body, then writes the fields straight into
+ * the buffer. Decoding assigns the fields in place, so decoding into a
+ * message that is reused keeps the capacity of its strings and vectors.
+ */
+template <typename Derived, Msg::Type TYPE>
+class MsgBase : public Msg
+{
+public:
+    static constexpr Type type_id = TYPE;
+
+protected:
+    MsgBase(int32_t id = 0) : Msg(TYPE, id) {}
 
 public:
-    void serialize(const SWriter& sw) const
+    size_t bodySize() const
+    {
+        SizeCounter counter;
+        serializeBody(counter);
+        return counter.size();
+    }
+
+    template <typename W>
+    void serializeBody(W& ws) const
+    {
+        Derived::fields(static_cast<const Derived&>(*this),
+                        [&ws](const auto&... fields) {
+                            serializeFields(ws, fields...);
+                        });
+    }
+
+    template <typename R>
+    void unserializeBody(R& rs)
     {
-        serializePod<uint32_t>((uint32_t)type, sw);
-        serializeBody(sw);
+        Derived::fields(static_cast<Derived&>(*this), [&rs](auto&... fields) {
+            unserializeFields(rs, fields...);
+        });
     }
-    virtual ~Msg() = default;
 };
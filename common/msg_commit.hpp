@@ -0,0 +1,48 @@
+#pragma once
+#include "msg_base.hpp"
+
+/* make what was written to the file durable on the server. Writes are
+ * unstable until then: the server may lose them if it goes down.
+ */
+class MsgCommit : public MsgBase<MsgCommit, Msg::Commit>
+{
+public:
+    std::string filename;
+
+public:
+    MsgCommit() : MsgBase(), filename() {}
+    MsgCommit(int32_t id, const std::string& filename)
+        : MsgBase(id), filename(filename)
+    {
+    }
+
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
+    {
+        f(self.filename);
+    }
+};
+
+/* the writes committed are those answered with the same verifier. One that
+ * differs means the server may have lost unstable writes, which must be
+ * sent again.
+ */
+class MsgCommitResp : public MsgBase<MsgCommitResp, Msg::CommitResp>
+{
+public:
+    int32_t error;
+    uint64_t verifier;
+
+public:
+    MsgCommitResp() : MsgBase(), error(0), verifier(0) {}
+    MsgCommitResp(int32_t id, int32_t error, uint64_t verifier)
+        : MsgBase(id), error(error), verifier(verifier)
+    {
+    }
+
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
+    {
+        f(self.error, self.verifier);
+    }
+};
@@ -0,0 +1,58 @@
+#pragma once
+#include "msg_base.hpp"
+
+/* a list of sub-requests, served in order within one round trip. Serving
+ * stops at the first sub-request that fails.
+ *
+ * `ops` holds the sub-requests as frames, back to back (see appendMsg and
+ * nextMsg in msg.hpp). The response holds, in the same form, the responses
+ * to the sub-requests that were served, the last of which carries the
+ * error if serving stopped early. Compounds do not nest.
+ */
+class MsgCompound : public MsgBase<MsgCompound, Msg::Compound>
+{
+public:
+    std::vector<char> ops;
+    // more fields here
+public:
+    MsgCompound() : MsgBase(), ops()  // more fields
+
+    {
+    }
+    MsgCompound(int32_t id)
+        : MsgBase(id), ops()  // more fields
+    {
+    }
+
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
+    {
+        f(self.ops);
+    }
+};
+
+class MsgCompoundResp : public MsgBase<MsgCompoundResp, Msg::CompoundResp>
+{
+public:
+    int32_t error;  // of the sub-request that failed, if any
+    std::vector<char> results;
+    // more fields here
+public:
+    MsgCompoundResp()
+        : MsgBase(), error(0), results()  // more fields
+
+    {
+    }
+    MsgCompoundResp(int32_t id, int32_t error, std::vector<char> results)
+        : MsgBase(id),
+          error(error),
+          results(std::move(results))  // more fields
+    {
+    }
+
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
+    {
+        f(self.error, self.results);
+    }
+};
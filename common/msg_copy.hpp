@@ -0,0 +1,68 @@
+#pragma once
+#include "msg_base.hpp"
+
+/* copy `size` bytes between two files on the server, without the content
+ * crossing the network.
+ */
+class MsgCopy : public MsgBase<MsgCopy, Msg::Copy>
+{
+public:
+    std::string from;
+    int64_t from_offset;
+    std::string to;
+    int64_t to_offset;
+    uint64_t size;
+
+public:
+    MsgCopy()
+        : MsgBase(), from(), from_offset(0), to(), to_offset(0), size(0)
+    {
+    }
+    MsgCopy(int32_t id, const std::string& from, int64_t from_offset,
+            const std::string& to, int64_t to_offset, uint64_t size)
+        : MsgBase(id),
+          from(from),
+          from_offset(from_offset),
+          to(to),
+          to_offset(to_offset),
+          size(size)
+    {
+    }
+
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
+    {
+        f(self.from, self.from_offset, self.to, self.to_offset, self.size);
+    }
+};
+
+class MsgCopyResp : public MsgBase<MsgCopyResp, Msg::CopyResp>
+{
+public:
+    int32_t error;
+    uint64_t copied;  // may be short at the end of `from`
+    // versions of `to`
+    uint64_t before_change;
+    uint64_t after_change;
+
+public:
+    MsgCopyResp()
+        : MsgBase(), error(0), copied(0), before_change(0), after_change(0)
+    {
+    }
+    MsgCopyResp(int32_t id, int32_t error, uint64_t copied, uint64_t before,
+                uint64_t after)
+        : MsgBase(id),
+          error(error),
+          copied(copied),
+          before_change(before),
+          after_change(after)
+    {
+    }
+
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
+    {
+        f(self.error, self.copied, self.before_change, self.after_change);
+    }
+};
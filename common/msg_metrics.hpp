@@ -0,0 +1,37 @@
+#pragma once
+#include "msg_base.hpp"
+
+// the latencies and traffic of the requests the server has served
+class MsgMetrics : public MsgBase<MsgMetrics, Msg::Metrics>
+{
+public:
+    MsgMetrics() : MsgBase() {}
+    MsgMetrics(int32_t id) : MsgBase(id) {}
+
+    template <typename Self, typename F>
+    static void fields(Self&, F&& f)
+    {
+        f();
+    }
+};
+
+// as text, a line per type of request, for people to read
+class MsgMetricsResp : public MsgBase<MsgMetricsResp, Msg::MetricsResp>
+{
+public:
+    int32_t error;
+    std::string report;
+
+public:
+    MsgMetricsResp() : MsgBase(), error(0), report() {}
+    MsgMetricsResp(int32_t id, int32_t error, const std::string& report)
+        : MsgBase(id), error(error), report(report)
+    {
+    }
+
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
+    {
+        f(self.error, self.report);
+    }
+};
@@ -0,0 +1,81 @@
+#pragma once
+#include "msg_base.hpp"
+
+// bumped whenever the format of a message changes
+const uint32_t PROTOCOL_VERSION = 5;
+// the oldest version still spoken
+const uint32_t MIN_PROTOCOL_VERSION = 5;
+
+// optional requests, used only if both sides support them
+enum Feature : uint32_t
+{
+    FEATURE_COMPOUND = 1,  // MsgCompound
+    FEATURE_COPY = 2,      // MsgCopy
+    FEATURE_PARTS = 4,     // MsgRead::part_size
+    FEATURE_METRICS = 8    // MsgMetrics
+};
+const uint32_t SUPPORTED_FEATURES =
+    FEATURE_COMPOUND | FEATURE_COPY | FEATURE_PARTS | FEATURE_METRICS;
+
+/* sent first on a connection, to agree on the protocol version and optional
+ * features
+ */
+class MsgNegotiate : public MsgBase<MsgNegotiate, Msg::Negotiate>
+{
+public:
+    uint32_t version;   // the newest spoken by the client
+    uint32_t features;  // supported by the client
+    uint32_t codecs;    // supported by the client, see compress.hpp
+    // more fields here
+public:
+    MsgNegotiate() : MsgBase(), version(0), features(0), codecs(0) {}
+    MsgNegotiate(int32_t id, uint32_t features, uint32_t codecs)
+        : MsgBase(id),
+          version(PROTOCOL_VERSION),
+          features(features),
+          codecs(codecs)  // more fields
+    {
+    }
+
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
+    {
+        f(self.version, self.features, self.codecs);
+    }
+};
+
+/* besides the agreed features, the server advises on the sizes of requests
+ */
+class MsgNegotiateResp : public MsgBase<MsgNegotiateResp, Msg::NegotiateResp>
+{
+public:
+    int32_t error;         // EPROTONOSUPPORT if no version is common
+    uint32_t version;      // to be spoken on the connection
+    uint32_t features;     // supported by both
+    uint32_t codecs;       // supported by both
+    uint32_t block_size;   // of the file system on the server
+    uint32_t io_size;      // preferred size of a read or write
+    uint32_t max_io_size;  // larger reads and writes fail with EINVAL
+    uint64_t verifier;     // see MsgCommitResp
+    // more fields here
+public:
+    MsgNegotiateResp()
+        : MsgBase(),
+          error(0),
+          version(0),
+          features(0),
+          codecs(0),
+          block_size(0),
+          io_size(0),
+          max_io_size(0),
+          verifier(0)  // more fields
+    {
+    }
+
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
+    {
+        f(self.error, self.version, self.features, self.codecs,
+          self.block_size, self.io_size, self.max_io_size, self.verifier);
+    }
+};
@@ -1,85 +1,96 @@
 #pragma once
+#include "compress.hpp"
+#include "crc32c.hpp"
 #include "msg_base.hpp"
 
-class MsgRead : public Msg
+class MsgRead : public MsgBase<MsgRead, Msg::Read>
 {
 public:
-    int32_t id;
     std::string filename;
     int64_t offset;
     int64_t size;
+    uint8_t accept;      // codec the response may use
+    uint32_t part_size;  // answer in parts of this size, 0 for one part
+    uint8_t zero_copy;   // the payload may be sent unchecked, see below
     // more fields here
 public:
-    MsgRead() : Msg(Msg::Read), id(0), offset(0), size(0)  // more fields
+    MsgRead()
+        : MsgBase(),
+          offset(0),
+          size(0),
+          accept(CODEC_NONE),
+          part_size(0),
+          zero_copy(0)  // more fields
 
     {
     }
     MsgRead(int32_t id, std::string filename, int64_t offset, int64_t size)
-        : Msg(Msg::Read),
-          id(id),
+        : MsgBase(id),
           filename(std::move(filename)),
           offset(offset),
-          size(size)  // more fields
+          size(size),
+          accept(CODEC_NONE),
+          part_size(0),
+          zero_copy(0)  // more fields
     {
     }
 
-protected:
-    virtual void serializeBody(const SWriter& ws) const
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
     {
-        serializePod<int32_t>(id, ws);
-        serializeString(filename, ws);
-        serializePod<int64_t>(offset, ws);
-        serializePod<int64_t>(size, ws);
-    }
-
-public:
-    static std::unique_ptr<Msg> unserialize(const SReader& rs)
-    {
-        auto res = std::make_unique<MsgRead>();
-        res->id = unserializePod<int32_t>(rs);
-        res->filename = unserializeString(rs);
-        res->offset = unserializePod<int64_t>(rs);
-        res->size = unserializePod<int64_t>(rs);
-        return res;
+        f(self.filename, self.offset, self.size, self.accept,
+          self.part_size, self.zero_copy);
     }
 };
 
-class MsgReadResp : public Msg
+/* a read in parts is answered with one response per part, all but the last
+ * having `more` set. Each part continues where the previous one ended; a
+ * failed or short part is the last.
+ *
+ * With MsgRead::zero_copy, the server may send an uncompressed payload
+ * straight from the file. It is not checksummed then, since the server
+ * never sees it.
+ */
+class MsgReadResp : public MsgBase<MsgReadResp, Msg::ReadResp>
 {
 public:
-    int32_t id;
     int32_t error;
-    std::vector<char> data;
+    uint8_t more;       // another part follows
+    uint8_t codec;      // of `data`
+    uint32_t raw_size;  // of `data` once decompressed
+    uint32_t crc;       // CRC32C of `data` once decompressed
+    uint8_t checked;    // `crc` is set
+    std::vector<char> data;  // must be the last field, see FrameWriter
     // more fields here
 public:
     MsgReadResp()
-        : Msg(Msg::ReadResp), id(0), error(0), data()  // more fields
+        : MsgBase(),
+          error(0),
+          more(0),
+          codec(CODEC_NONE),
+          raw_size(0),
+          crc(0),
+          checked(0),
+          data()  // more fields
 
     {
     }
     MsgReadResp(int32_t id, int32_t error, std::vector<char> data)
-        : Msg(Msg::ReadResp),
-          id(id),
+        : MsgBase(id),
           error(error),
+          more(0),
+          codec(CODEC_NONE),
+          raw_size(data.size()),
+          crc(crc32c(data.data(), data.size())),
+          checked(1),
           data(std::move(data))  // more fields
     {
     }
 
-protected:
-    virtual void serializeBody(const SWriter& ws) const
-    {
-        serializePod<int32_t>(id, ws);
-        serializePod<int32_t>(error, ws);
-        serializeVectorChar(data, ws);
-    }
-
-public:
-    static std::unique_ptr<Msg> unserialize(const SReader& rs)
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
     {
-        auto res = std::make_unique<MsgReadResp>();
-        res->id = unserializePod<int32_t>(rs);
-        res->error = unserializePod<int32_t>(rs);
-        res->data = unserializeVectorChar(rs);
-        return res;
+        f(self.error, self.more, self.codec, self.raw_size, self.crc,
+          self.checked, self.data);
     }
 };
@@ -1,40 +1,28 @@
 #pragma once
 #include "msg_base.hpp"
 
-class MsgStat : public Msg
+class MsgStat : public MsgBase<MsgStat, Msg::Stat>
 {
 public:
-    int32_t id;
     std::string filename;
 
 public:
-    MsgStat() : Msg(Msg::Stat), id(0), filename() {}
+    MsgStat() : MsgBase(), filename() {}
     MsgStat(int32_t id, std::string filename)
-        : Msg(Msg::Stat), id(id), filename(std::move(filename))
+        : MsgBase(id), filename(std::move(filename))
     {
     }
 
-protected:
-    virtual void serializeBody(const SWriter& ws) const
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
     {
-        serializePod<int32_t>(id, ws);
-        serializeString(filename, ws);
-    }
-
-public:
-    static std::unique_ptr<Msg> unserialize(const SReader& rs)
-    {
-        auto res = std::make_unique<MsgStat>();
-        res->id = unserializePod<int32_t>(rs);
-        res->filename = unserializeString(rs);
-        return res;
+        f(self.filename);
     }
 };
 
-class MsgStatResp : public Msg
+class MsgStatResp : public MsgBase<MsgStatResp, Msg::StatResp>
 {
 public:
-    int32_t id;
     int32_t error;
 // make sure no padding is inserted. The layout should be identical in any
 // machine.
@@ -44,34 +32,27 @@ public:
         int64_t size;
         uint64_t mode;
         FileTime time;
+        /* the version of the file, which the server makes greater with
+         * each change it makes to the file. Comparing versions tells
+         * whether a file changed, which its times may not.
+         */
+        uint64_t change;
     } stat;
 #pragma pack(pop)
 public:
     MsgStatResp()
-        : Msg(Msg::StatResp), id(0), error(0), stat()  // more fields
+        : MsgBase(), error(0), stat()  // more fields
 
     {
     }
     MsgStatResp(int32_t id, int32_t error, Stat stat)
-        : Msg(Msg::StatResp), id(id), error(error), stat(stat)  // more fields
+        : MsgBase(id), error(error), stat(stat)  // more fields
     {
     }
 
-protected:
-    virtual void serializeBody(const SWriter& ws) const
-    {
-        serializePod<int32_t>(id, ws);
-        serializePod<int32_t>(error, ws);
-        serializePod<Stat>(stat, ws);
-    }
-
-public:
-    static std::unique_ptr<Msg> unserialize(const SReader& rs)
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
     {
-        auto res = std::make_unique<MsgStatResp>();
-        res->id = unserializePod<int32_t>(rs);
-        res->error = unserializePod<int32_t>(rs);
-        res->stat = unserializePod<Stat>(rs);
-        return res;
+        f(self.error, self.stat);
     }
 };
@@ -1,27 +1,16 @@
 #pragma once
 #include <sys/statvfs.h>
 #include "msg_base.hpp"
-class MsgStatfs : public Msg
+class MsgStatfs : public MsgBase<MsgStatfs, Msg::Statfs>
 {
 public:
-    int32_t id;
+    MsgStatfs() : MsgBase() {}
+    MsgStatfs(int32_t id) : MsgBase(id) {}
 
-public:
-    MsgStatfs() : Msg(Msg::Statfs), id(0) {}
-    MsgStatfs(int32_t id) : Msg(Msg::Statfs), id(id) {}
-
-protected:
-    virtual void serializeBody(const SWriter& ws) const
-    {
-        serializePod<int32_t>(id, ws);
-    }
-
-public:
-    static std::unique_ptr<Msg> unserialize(const SReader& rs)
+    template <typename Self, typename F>
+    static void fields(Self&, F&& f)
     {
-        auto res = std::make_unique<MsgStatfs>();
-        res->id = unserializePod<int32_t>(rs);
-        return res;
+        f();
     }
 };
 
@@ -41,10 +30,9 @@ struct FsStat
 
 FsStat makeFsStat(const struct statvfs& st);
 
-class MsgStatfsResp : public Msg
+class MsgStatfsResp : public MsgBase<MsgStatfsResp, Msg::StatfsResp>
 {
 public:
-    int32_t id;
     int32_t error;
     FsStat stat;
 
@@ -52,27 +40,15 @@ public:
     // machine.
 
 public:
-    MsgStatfsResp() : Msg(Msg::StatfsResp), id(0), stat() {}
+    MsgStatfsResp() : MsgBase(), stat() {}
     MsgStatfsResp(int32_t id, int32_t error, const FsStat& st)
-        : Msg(Msg::StatfsResp), id(id), error(error), stat(st)
+        : MsgBase(id), error(error), stat(st)
     {
     }
 
-protected:
-    virtual void serializeBody(const SWriter& ws) const
-    {
-        serializePod<int32_t>(id, ws);
-        serializePod<int32_t>(error, ws);
-        serializePod<FsStat>(stat, ws);
-    }
-
-public:
-    static std::unique_ptr<Msg> unserialize(const SReader& rs)
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
     {
-        auto res = std::make_unique<MsgStatfsResp>();
-        res->id = unserializePod<int32_t>(rs);
-        res->error = unserializePod<int32_t>(rs);
-        res->stat = unserializePod<FsStat>(rs);
-        return res;
+        f(self.error, self.stat);
     }
 };
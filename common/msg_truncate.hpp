@@ -1,66 +1,49 @@
 #pragma once
 #include "msg_base.hpp"
 
-class MsgTruncate : public Msg
+class MsgTruncate : public MsgBase<MsgTruncate, Msg::Truncate>
 {
 public:
-    int32_t id;
     std::string filename;
     int64_t offset;
     // more fields here
 public:
     MsgTruncate()
-        : Msg(Msg::Truncate), id(0), filename(), offset(0)  // more fields
+        : MsgBase(), filename(), offset(0)  // more fields
 
     {
     }
     MsgTruncate(int32_t id, std::string filename, int64_t off)
-        : Msg(Msg::Truncate),
-          id(id),
+        : MsgBase(id),
           filename(filename),
           offset(off)  // more fields
     {
     }
 
-protected:
-    virtual void serializeBody(const SWriter& ws) const
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
     {
-        serializePod<int32_t>(id, ws);
-        serializeString(filename, ws);
-        serializePod<int64_t>(offset, ws);
-        // your code here
-    }
-
-public:
-    static std::unique_ptr<Msg> unserialize(const SReader& rs)
-    {
-        auto res = std::make_unique<MsgTruncate>();
-        res->id = unserializePod<int32_t>(rs);
-        res->filename = unserializeString(rs);
-        res->offset = unserializePod<int64_t>(rs);
-        // your code here
-        return res;
+        f(self.filename, self.offset);
     }
 };
 
-class MsgTruncateResp : public Msg
+class MsgTruncateResp : public MsgBase<MsgTruncateResp, Msg::TruncateResp>
 {
 public:
-    int32_t id;
     int32_t error;
-    FileTime before_change;
-    FileTime after_change;
+    // versions of the file, see MsgStatResp
+    uint64_t before_change;
+    uint64_t after_change;
     // more fields here
 public:
     MsgTruncateResp()
-        : Msg(Msg::TruncateResp), id(0), error(0)  // more
-                                                   // fields
+        : MsgBase(), error(0), before_change(0), after_change(0)  // more
+                                                                  // fields
 
     {
     }
-    MsgTruncateResp(int32_t id, int32_t err, FileTime before, FileTime after)
-        : Msg(Msg::TruncateResp),
-          id(id),
+    MsgTruncateResp(int32_t id, int32_t err, uint64_t before, uint64_t after)
+        : MsgBase(id),
           error(err),
           before_change(before),
           after_change(after)
@@ -68,25 +51,9 @@ public:
     {
     }
 
-protected:
-    virtual void serializeBody(const SWriter& ws) const
-    {
-        serializePod<int32_t>(id, ws);
-        serializePod<int32_t>(error, ws);
-        serializePod<FileTime>(before_change, ws);
-        serializePod<FileTime>(after_change, ws);
-        // your code here
-    }
-
-public:
-    static std::unique_ptr<Msg> unserialize(const SReader& rs)
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
     {
-        auto res = std::make_unique<MsgTruncateResp>();
-        res->id = unserializePod<int32_t>(rs);
-        res->error = unserializePod<int32_t>(rs);
-        res->before_change = unserializePod<FileTime>(rs);
-        res->after_change = unserializePod<FileTime>(rs);
-        // your code here
-        return res;
+        f(self.error, self.before_change, self.after_change);
     }
 };
@@ -1,98 +1,84 @@
 #pragma once
 
+#include "compress.hpp"
+#include "crc32c.hpp"
 #include "msg_base.hpp"
 
-class MsgWrite : public Msg
+class MsgWrite : public MsgBase<MsgWrite, Msg::Write>
 {
 public:
-    int32_t id;
     std::string filename;
     int64_t offset;
+    uint8_t codec;      // of `data`
+    uint32_t raw_size;  // of `data` once decompressed
+    uint32_t crc;       // CRC32C of `data` once decompressed
     std::vector<char> data;
     // more fields here
 public:
     MsgWrite()
-        : Msg(Msg::Write),
-          id(0),
+        : MsgBase(),
           filename(),
           offset(0),
+          codec(CODEC_NONE),
+          raw_size(0),
+          crc(0),
           data()  // more fields
 
     {
     }
     MsgWrite(int32_t id, std::string filename, int64_t offset,
              std::vector<char> data)
-        : Msg(Msg::Write),
-          id(id),
+        : MsgBase(id),
           filename(std::move(filename)),
           offset(offset),
+          codec(CODEC_NONE),
+          raw_size(data.size()),
+          crc(crc32c(data.data(), data.size())),
           data(std::move(data))
     {
     }
 
-protected:
-    virtual void serializeBody(const SWriter& ws) const
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
     {
-        serializePod<int32_t>(id, ws);
-        serializeString(filename, ws);
-        serializePod<int64_t>(offset, ws);
-        serializeVectorChar(data, ws);
-    }
-
-public:
-    static std::unique_ptr<Msg> unserialize(const SReader& rs)
-    {
-        auto res = std::make_unique<MsgWrite>();
-        res->id = unserializePod<int32_t>(rs);
-        res->filename = unserializeString(rs);
-        res->offset = unserializePod<int64_t>(rs);
-        res->data = unserializeVectorChar(rs);
-        return res;
+        f(self.filename, self.offset, self.codec, self.raw_size, self.crc,
+          self.data);
     }
 };
 
-class MsgWriteResp : public Msg
+class MsgWriteResp : public MsgBase<MsgWriteResp, Msg::WriteResp>
 {
 public:
-    int32_t id;
     int32_t error;
-    FileTime before_change;
-    FileTime after_change;
+    // versions of the file, see MsgStatResp
+    uint64_t before_change;
+    uint64_t after_change;
+    // the write is unstable until committed under it, see MsgCommitResp
+    uint64_t verifier;
     // more fields here
 public:
-    MsgWriteResp() : Msg(Msg::WriteResp), id(0), error(0)  // more fields
-
+    MsgWriteResp()
+        : MsgBase(),
+          error(0),
+          before_change(0),
+          after_change(0),
+          verifier(0)  // more fields
     {
     }
-    MsgWriteResp(int32_t id, int32_t error, FileTime before, FileTime after)
-        : Msg(Msg::WriteResp),
-          id(id),
+    MsgWriteResp(int32_t id, int32_t error, uint64_t before, uint64_t after,
+                 uint64_t verifier)
+        : MsgBase(id),
           error(error),
           before_change(before),
-          after_change(after)
+          after_change(after),
+          verifier(verifier)
     // more fields
     {
     }
 
-protected:
-    virtual void serializeBody(const SWriter& ws) const
-    {
-        serializePod<int32_t>(id, ws);
-        serializePod<int32_t>(error, ws);
-        serializePod<FileTime>(before_change, ws);
-        serializePod<FileTime>(after_change, ws);
-        // your code here
-    }
-
-public:
-    static std::unique_ptr<Msg> unserialize(const SReader& rs)
+    template <typename Self, typename F>
+    static void fields(Self& self, F&& f)
     {
-        auto res = std::make_unique<MsgWriteResp>();
-        res->id = unserializePod<int32_t>(rs);
-        res->error = unserializePod<int32_t>(rs);
-        res->before_change = unserializePod<FileTime>(rs);
-        res->after_change = unserializePod<FileTime>(rs);
-        // your code here
-        return res;
+        f(self.error, self.before_change, self.after_change, self.verifier);
     }
 };
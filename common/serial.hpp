@@ -1,30 +1,101 @@
 #pragma once
 #include <stdint.h>
-#include <functional>
+#include <cstring>
 #include <stdexcept>
 #include <string>
 #include <type_traits>
+#include <vector>
 
 /* For serialize:
- * the object *val* is serialized into the
- * stream. The stream is represented by *SWriter*, which is just a function
- * wrapper, that should write every bytes in buf to the underlying stream.
- * This design is chosen because the server and client will have different
- * stream implementation (client will use FdWriter and server will use POCO).
- * errors are propagated by throwing exceptions from *SWriter*, likely due to
+ * the object *val* is serialized into the stream *ws*. A writer stream is
+ * any type with a member function `write(const char* buf, size_t size)`,
+ * that should write every bytes in buf to the underlying stream. The
+ * functions are templated on the stream type, so that encoding a field
+ * compiles down to a copy into the stream (e.g. BufferWriter below).
+ * errors are propagated by throwing exceptions from the stream, likely due to
  * network problems.
  *
  * For unserialize:
- * an object T is reconstructed from the stream. *SReader* uses a simliar
- * design. Errors are propagated by throwing exceptions. Exceptions are likely
- * due to 1) system_errors, because of network problem. 2)
- * UnserializeFormatError, due to invalid format in the stream.
+ * an object T is reconstructed from the stream *rs*, any type with a member
+ * function `read(char* buf, size_t size)`. Errors are propagated by throwing
+ * exceptions. Exceptions are likely due to 1) system_errors, because of
+ * network problem. 2) UnserializeFormatError, due to invalid format in the
+ * stream.
  *
  * Example usage can be seen in the unit tests.
  */
 
-using SWriter = std::function<void(const char*, size_t)>;
-using SReader = std::function<void(char*, size_t)>;
+class UnserializeFormatError : public std::runtime_error
+{
+public:
+    UnserializeFormatError(const std::string& tname)
+        : std::runtime_error(
+              "invalid format in unserializing an object of type: " + tname)
+    {
+    }
+};
+
+// counts the bytes written, to size a buffer for BufferWriter
+class SizeCounter
+{
+    size_t _size;
+
+public:
+    SizeCounter() : _size(0) {}
+    void write(const char*, size_t size) { _size += size; }
+    size_t size() const { return _size; }
+};
+
+// writes into memory, which must be large enough
+class BufferWriter
+{
+    char* _pos;
+
+public:
+    BufferWriter(char* buf) : _pos(buf) {}
+    void write(const char* buf, size_t size)
+    {
+        memcpy(_pos, buf, size);
+        _pos += size;
+    }
+};
+
+// reads from memory, reading past the end is a format error
+class BufferReader
+{
+    const char* _pos;
+    size_t _left;
+
+public:
+    BufferReader(const char* buf, size_t size) : _pos(buf), _left(size) {}
+    void read(char* buf, size_t size)
+    {
+        if (size > _left)
+        {
+            throw UnserializeFormatError("buffer");
+        }
+        memcpy(buf, _pos, size);
+        _pos += size;
+        _left -= size;
+    }
+    size_t remaining() const { return _left; }
+};
+
+/* guards against allocating for a corrupted length. Only readers that know
+ * how much is left can check it.
+ */
+template <typename R>
+void checkAvailable(const R&, uint64_t)
+{
+}
+
+inline void checkAvailable(const BufferReader& rs, uint64_t size)
+{
+    if (size > rs.remaining())
+    {
+        throw UnserializeFormatError("buffer");
+    }
+}
 
 /* The following two templates are able to serialize and unserialize any POD
  * types.
@@ -32,64 +103,146 @@ using SReader = std::function<void(char*, size_t)>;
  * enable_if_t part is only a trick to check if T is POD, nothing interesting
  * here.
  */
-template <typename T, std::enable_if_t<std::is_pod<T>::value, int> = 0>
-void serializePod(T val, const SWriter& sw)
+template <typename T, typename W,
+          std::enable_if_t<std::is_pod<T>::value, int> = 0>
+void serializePod(const T& val, W& ws)
 {
-    sw((const char*)&val, sizeof(val));
+    ws.write((const char*)&val, sizeof(val));
 }
 
-template <typename T, std::enable_if_t<std::is_pod<T>::value, int> = 0>
-T unserializePod(const SReader& sr)
+template <typename T, typename R,
+          std::enable_if_t<std::is_pod<T>::value, int> = 0>
+T unserializePod(R& rs)
 {
     T val;
-    sr((char*)&val, sizeof(val));
+    rs.read((char*)&val, sizeof(val));
     return val;
 }
 
 /* For non-POD type, it must be done case by case.
  */
 
-void serializeString(const std::string& str, const SWriter& sw);
-std::string unserializeString(const SReader& sr);
+template <typename W>
+void serializeString(const std::string& str, W& ws)
+{
+    serializePod<uint32_t>((uint32_t)str.size(), ws);
+    ws.write(str.data(), str.size());
+}
+
+template <typename R>
+std::string unserializeString(R& rs);
+
+/* the elements of a vector are (un)serialized as fields, see below. A
+ * vector of POD (e.g. std::vector<char>) is copied as one block.
+ */
+template <typename T, typename W>
+void serializeVector(const std::vector<T>& vec, W& ws);
+template <typename T, typename R>
+std::vector<T> unserializeVector(R& rs);
 
-template <typename T>
-void serializeVector(
-    const std::vector<T>& vec,
-    const std::function<void(const T&, const SWriter&)>& serialElement,
-    const SWriter& sw)
+/* Fields of messages are (un)serialized by overloads of serializeField and
+ * unserializeField, picked by the type of the field. serializeFields and
+ * unserializeFields handle a list of fields in order.
+ */
+template <typename W, typename T,
+          std::enable_if_t<std::is_pod<T>::value, int> = 0>
+void serializeField(W& ws, const T& val)
 {
-    serializePod<uint64_t>((uint64_t)vec.size(), sw);
-    for (const auto& ele : vec)
-    {
-        serialElement(ele, sw);
-    }
+    serializePod<T>(val, ws);
 }
 
-template <typename T>
-std::vector<T> unserializeVector(
-    const std::function<T(const SReader&)>& unserialElement,
-    const SReader& sr)
+template <typename W>
+void serializeField(W& ws, const std::string& str)
 {
-    size_t size = unserializePod<uint64_t>(sr);
-    std::vector<T> vec;
-    vec.reserve(size);
-    for (size_t i = 0; i < size; i++)
+    serializeString(str, ws);
+}
+
+template <typename W, typename T>
+void serializeField(W& ws, const std::vector<T>& vec)
+{
+    serializeVector(vec, ws);
+}
+
+template <typename R, typename T,
+          std::enable_if_t<std::is_pod<T>::value, int> = 0>
+void unserializeField(R& rs, T& val)
+{
+    val = unserializePod<T>(rs);
+}
+
+// strings and vectors are read in place, reusing their capacity
+template <typename R>
+void unserializeField(R& rs, std::string& str)
+{
+    uint32_t str_size = unserializePod<uint32_t>(rs);
+    checkAvailable(rs, str_size);
+    str.resize(str_size);
+    rs.read(&str[0], str_size);
+}
+
+template <typename R, typename T>
+void unserializeField(R& rs, std::vector<T>& vec)
+{
+    uint64_t size = unserializePod<uint64_t>(rs);
+    // every element takes at least one byte
+    checkAvailable(rs, size);
+    if constexpr (std::is_pod<T>::value)
     {
-        vec.push_back(unserialElement(sr));
+        checkAvailable(rs, size * sizeof(T));
+        vec.resize(size);
+        rs.read((char*)vec.data(), size * sizeof(T));
+    }
+    else
+    {
+        vec.resize(size);
+        for (auto& ele : vec)
+        {
+            unserializeField(rs, ele);
+        }
     }
-    return vec;
 }
 
-// fast specialization for std::vector<char>
-void serializeVectorChar(const std::vector<char>& vec, const SWriter& sw);
-std::vector<char> unserializeVectorChar(const SReader& sr);
+template <typename W, typename... Ts>
+void serializeFields(W& ws, const Ts&... fields)
+{
+    (serializeField(ws, fields), ...);
+}
 
-class UnserializeFormatError : public std::runtime_error
+template <typename R, typename... Ts>
+void unserializeFields(R& rs, Ts&... fields)
 {
-public:
-    UnserializeFormatError(const std::string& tname)
-        : std::runtime_error(
-              "invalid format in unserializing an object of type: " + tname)
+    (unserializeField(rs, fields), ...);
+}
+
+template <typename T, typename W>
+void serializeVector(const std::vector<T>& vec, W& ws)
+{
+    serializePod<uint64_t>((uint64_t)vec.size(), ws);
+    if constexpr (std::is_pod<T>::value)
     {
+        ws.write((const char*)vec.data(), vec.size() * sizeof(T));
     }
-};
+    else
+    {
+        for (const auto& ele : vec)
+        {
+            serializeField(ws, ele);
+        }
+    }
+}
+
+template <typename R>
+std::string unserializeString(R& rs)
+{
+    std::string res;
+    unserializeField(rs, res);
+    return res;
+}
+
+template <typename T, typename R>
+std::vector<T> unserializeVector(R& rs)
+{
+    std::vector<T> vec;
+    unserializeField(rs, vec);
+    return vec;
+}
@@ -1,9 +1,26 @@
 #include "StorageServer.h"
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include "listener.hpp"
+#include "metrics.hpp"
+#include "reactor.hpp"
+#include "uring.hpp"
+#include "writelog.hpp"
 
 #define MAX_QUEUE 128
 #define MAX_THREADS 4096
 #define MIN_THREADS 8
 #define PORT_NUM 55555
+#define WORKER_THREADS 16
+// leaves some workers to other clients while one keeps the rest busy
+#define CLIENT_THREADS 12
+#define WRITE_LOG "./nfs_wal"
 
 StorageServer::StorageServer(StorageServerConnectionFactory::Ptr cFactory,
 			       Poco::ThreadPool& serverThreadPool,
@@ -24,37 +41,220 @@ StorageServer::~StorageServer(){
 
 
 
-int StorageServerApp::main(const std::vector<std::string> &){
+StorageServerApp::StorageServerApp():
+  clientThreads(CLIENT_THREADS),
+  maxQueued(MAX_QUEUED_TASKS){
+}
+
+void StorageServerApp::defineOptions(Poco::Util::OptionSet& options){
+  Poco::Util::ServerApplication::defineOptions(options);
+  options.addOption(
+    Poco::Util::Option("io_uring", "", "access files through io_uring")
+      .required(false)
+      .repeatable(false)
+      .callback(Poco::Util::OptionCallback<StorageServerApp>(
+        this, &StorageServerApp::handleIoUring)));
+  options.addOption(
+    Poco::Util::Option("reactor", "", "serve TCP clients with a few event loop threads, 0 for one per cpu")
+      .required(false)
+      .repeatable(false)
+      .argument("threads")
+      .callback(Poco::Util::OptionCallback<StorageServerApp>(
+        this, &StorageServerApp::handleReactor)));
+  options.addOption(
+    Poco::Util::Option("pin_cpus", "", "pin each event loop thread to a cpu of its own")
+      .required(false)
+      .repeatable(false)
+      .callback(Poco::Util::OptionCallback<StorageServerApp>(
+        this, &StorageServerApp::handlePinCpus)));
+  options.addOption(
+    Poco::Util::Option("block_cache", "", "keep up to this many MB of file blocks in memory")
+      .required(false)
+      .repeatable(false)
+      .argument("MB")
+      .callback(Poco::Util::OptionCallback<StorageServerApp>(
+        this, &StorageServerApp::handleBlockCache)));
+  options.addOption(
+    Poco::Util::Option("durable", "", "log writes to " WRITE_LOG " before they are acknowledged; removing or renaming a file just written syncs the file system")
+      .required(false)
+      .repeatable(false)
+      .callback(Poco::Util::OptionCallback<StorageServerApp>(
+        this, &StorageServerApp::handleDurable)));
+  options.addOption(
+    Poco::Util::Option("client_threads", "", "serve a client with at most this many workers at once, 0 for all")
+      .required(false)
+      .repeatable(false)
+      .argument("threads")
+      .callback(Poco::Util::OptionCallback<StorageServerApp>(
+        this, &StorageServerApp::handleClientThreads)));
+  options.addOption(
+    Poco::Util::Option("max_queued", "", "hold back clients flooding the server once this many requests wait")
+      .required(false)
+      .repeatable(false)
+      .argument("requests")
+      .callback(Poco::Util::OptionCallback<StorageServerApp>(
+        this, &StorageServerApp::handleMaxQueued)));
+}
+
+void StorageServerApp::handleIoUring(const std::string&, const std::string&){
+  useIoRing = true;
+}
+
+void StorageServerApp::handleReactor(const std::string&, const std::string& value){
+  int threads = std::stoi(value);
+  if (threads <= 0){
+    threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+  reactorThreads = threads;
+}
+
+void StorageServerApp::handlePinCpus(const std::string&, const std::string&){
+  pinCpus = true;
+}
+
+void StorageServerApp::handleBlockCache(const std::string&, const std::string& value){
+  blockCacheSize = (size_t)std::max(std::stol(value), 0L) << 20;
+}
+
+void StorageServerApp::handleDurable(const std::string&, const std::string&){
+  durable = true;
+}
+
+void StorageServerApp::handleClientThreads(const std::string&, const std::string& value){
+  clientThreads = std::max(std::stoi(value), 0);
+}
+
+void StorageServerApp::handleMaxQueued(const std::string&, const std::string& value){
+  maxQueued = std::max(std::stoi(value), 1);
+}
+
+/* each argument is a local address to accept clients at as well, as
+ * unix:<path> or shm:<name>
+ */
+int StorageServerApp::main(const std::vector<std::string> &args){
+
+  // SIGUSR1 prints the metrics. Blocked before any thread is started, for
+  // all to inherit, so that only the dumper takes it, by sigwait
+  sigset_t dumpSignal;
+  sigemptyset(&dumpSignal);
+  sigaddset(&dumpSignal, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &dumpSignal, nullptr);
 
   // args: min capacity, max capacity, idle timeout, initial stack size
   Poco::ThreadPool storageThreadPool(MIN_THREADS, MAX_THREADS, 60, 0);
 
+  // the kernel may not support it, in which case files are accessed as usual
+  std::unique_ptr<IoRing> ioRing;
+  if (useIoRing){
+    try{
+      ioRing.reset(new IoRing());
+      std::cout << "@@@ Accessing files through io_uring @@@" << std::endl;
+    }
+    catch (std::system_error& e){
+      std::cout << "@@@ io_uring unavailable: " << e.what() << " @@@" << std::endl;
+    }
+  }
+
   // The storage server will handle all incoming connections and assigns a new
   // or existing thread to each connection (threads are managed by the thread pool)
 
-  StorageServerParams * serverParams = new StorageServerParams();
-  serverParams->setMaxQueued(MAX_QUEUE);
-  
-  Poco::Net::ServerSocket storageSocket(PORT_NUM);
-  storageSocket.setKeepAlive(true);
+  // shared by all connections, so that a block read by one is there for all
+  std::unique_ptr<BlockCache> blockCache;
+  if (blockCacheSize > 0){
+    blockCache.reset(new BlockCache(blockCacheSize));
+    std::cout << "@@@ Block cache: " << (blockCacheSize >> 20) << " MB @@@" << std::endl;
+  }
+
+  // what was logged before a crash is applied before any client is served
+  std::unique_ptr<WriteLog> writeLog;
+  if (durable){
+    size_t records = 0;
+    int err = 0;
+    try{
+      writeLog.reset(new WriteLog(WRITE_LOG, "./nfs_root"));
+      err = writeLog->replay(records);
+    }
+    catch (std::system_error& e){
+      err = e.code().value();
+    }
+    if (err){
+      std::cout << "@@@ Cannot replay " << WRITE_LOG << ": " << strerror(err) << " @@@" << std::endl;
+      return Poco::Util::Application::EXIT_IOERR;
+    }
+    std::cout << "@@@ Durable writes, replayed " << records << " from " << WRITE_LOG << " @@@" << std::endl;
+  }
+
+  // serves the requests of all connections, sharing the workers fairly
+  Executor executor(WORKER_THREADS, clientThreads, maxQueued);
+  std::cout << "@@@ Worker threads: " << WORKER_THREADS << ", per client: "
+            << (clientThreads ? clientThreads : WORKER_THREADS)
+            << ", queued before holding back: " << maxQueued << " @@@" << std::endl;
+  FileOp fileOp("./nfs_root", ioRing.get(), MAX_OPEN_FILES, blockCache.get(),
+                writeLog.get());
+
+  // either the Poco TCP server, with a thread per client, or the reactor
+  std::unique_ptr<StorageServer> tcpServer;
+  std::unique_ptr<Reactor> reactor;
+  Poco::Timestamp startTime;
 
-  StorageServer StorageServer(new StorageServerConnectionFactory(),
-				storageThreadPool,
-				storageSocket,
-				serverParams);
+  if (reactorThreads > 0){
+    reactor.reset(new Reactor(PORT_NUM, reactorThreads, executor, fileOp,
+                              pinCpus));
+  }
+  else{
+    StorageServerParams * serverParams = new StorageServerParams();
+    serverParams->setMaxQueued(MAX_QUEUE);
 
-  StorageServer.start();
+    Poco::Net::ServerSocket storageSocket(PORT_NUM);
+    storageSocket.setKeepAlive(true);
+
+    tcpServer.reset(new StorageServer(new StorageServerConnectionFactory(executor, fileOp),
+                                      storageThreadPool,
+                                      storageSocket,
+                                      serverParams));
+
+    tcpServer->start();
+  }
+
+  std::vector<std::unique_ptr<LocalListener>> localListeners;
+  for (const auto& address : args){
+    localListeners.emplace_back(new LocalListener(address, executor, fileOp));
+    std::cout << "@@@ Listening on " << address << " @@@" << std::endl;
+  }
+
+  std::atomic<bool> stopDumper(false);
+  std::thread dumper([&dumpSignal, &stopDumper]{
+    int sig;
+    while (sigwait(&dumpSignal, &sig) == 0 && !stopDumper){
+      std::cout << "@@@ Metrics @@@\n" << metricsReport() << std::flush;
+    }
+  });
 
   std::cout << "@@@ Storage Server Started @@@" << std::endl;
   std::cout << "@@@ Listening on port " << PORT_NUM << " @@@" <<std::endl;
-  std::cout << "@@@ Current thread count: " << StorageServer.currentThreads() << " @@@" << std::endl;
-  std::cout << "@@@ Max thread count set at: " << StorageServer.maxThreads() << " @@@" << std::endl;
+  if (reactor){
+    std::cout << "@@@ Event loop threads: " << reactorThreads << " @@@" << std::endl;
+  }
+  else{
+    std::cout << "@@@ Current thread count: " << tcpServer->currentThreads() << " @@@" << std::endl;
+    std::cout << "@@@ Max thread count set at: " << tcpServer->maxThreads() << " @@@" << std::endl;
+  }
 
   Poco::Util::ServerApplication::waitForTerminationRequest();
   
-  Poco::Timestamp::TimeDiff runtime = StorageServer.StorageServerStartTime.elapsed();
+  Poco::Timestamp::TimeDiff runtime = startTime.elapsed();
+
+  stopDumper = true;
+  pthread_kill(dumper.native_handle(), SIGUSR1);
+  dumper.join();
+
+  localListeners.clear();
+
+  reactor.reset();
 
-  StorageServer.stop();
+  if (tcpServer){
+    tcpServer->stop();
+  }
 
   storageThreadPool.joinAll();
   
@@ -62,6 +262,7 @@ int StorageServerApp::main(const std::vector<std::string> &){
   std::cout << "@@@ Total up time (us) = " << runtime << " @@@" << std::endl;
   std::cout << "@@@ Total up time (seconds) = "
 	    << ((double)runtime/(double)1000000) << " @@@" << std::endl;
+  std::cout << "@@@ Metrics @@@\n" << metricsReport() << std::flush;
   
   return Poco::Util::Application::EXIT_OK;
 }
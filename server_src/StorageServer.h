@@ -3,6 +3,9 @@
 
 // Poco-specific libraries
 #include <Poco/Util/ServerApplication.h>
+#include <Poco/Util/Option.h>
+#include <Poco/Util/OptionSet.h>
+#include <Poco/Util/OptionCallback.h>
 #include <Poco/Net/StreamSocket.h>
 #include <Poco/Net/TCPServer.h>
 #include <Poco/Timestamp.h>
@@ -30,8 +33,48 @@ public:
 
 
 class StorageServerApp : public Poco::Util::ServerApplication{
+private:
+
+  bool useIoRing = false;
+
+  // serve TCP clients with this many event loops instead of a thread each
+  int reactorThreads = 0;
+
+  // each event loop on a cpu of its own
+  bool pinCpus = false;
+
+  // bytes of file blocks kept in memory, none if 0
+  size_t blockCacheSize = 0;
+
+  // writes are logged and synced before they are acknowledged
+  bool durable = false;
+
+  // most workers serving one client at once, 0 for all of them
+  size_t clientThreads;
+
+  // requests waiting for a worker before clients are held back
+  size_t maxQueued;
+
+public:
+  StorageServerApp();
 
 protected:
+  void defineOptions(Poco::Util::OptionSet& options);
+
+  void handleIoUring(const std::string& name, const std::string& value);
+
+  void handleReactor(const std::string& name, const std::string& value);
+
+  void handlePinCpus(const std::string& name, const std::string& value);
+
+  void handleBlockCache(const std::string& name, const std::string& value);
+
+  void handleDurable(const std::string& name, const std::string& value);
+
+  void handleClientThreads(const std::string& name, const std::string& value);
+
+  void handleMaxQueued(const std::string& name, const std::string& value);
+
   int main(const std::vector<std::string> &);
 
 };
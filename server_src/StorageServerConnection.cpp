@@ -6,23 +6,29 @@
 #include <Poco/Process.h>
 #include <Poco/StreamCopier.h>
 #include <cassert>
+#include <condition_variable>
 #include <cstring>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <vector>
+#include "compress.hpp"
+#include "executor.hpp"
 #include "fileop.hpp"
+#include "frame.hpp"
+#include "metrics.hpp"
 #include "msg.hpp"
 #include "msg_response.hpp"
 
-#define BUFF_SIZE 4096
+// max number of requests of one connection being served at the same time
+#define MAX_INFLIGHT 64
 //#define NUM_REQ 16000 // for terminating server for scalability testing
 
 StorageServerConnection::StorageServerConnection(
-    const Poco::Net::StreamSocket& socket)
-    : Poco::Net::TCPServerConnection(socket)
+    const Poco::Net::StreamSocket& socket, Executor& executor, FileOp& op)
+    : Poco::Net::TCPServerConnection(socket), executor(executor), op(op)
 {
-    this->count = this->next_count;
-    this->next_count++;
 }
 
 StorageServerConnection::~StorageServerConnection() {}
@@ -32,53 +38,103 @@ StorageServerConnection::~StorageServerConnection() {}
  */
 void StorageServerConnection::run()
 {
-    try
+    SocketChannel channel(this->socket().impl()->sockfd(), false);
+    serve(channel, executor, op);
+}
+
+/* requests are read by this thread and served by the shared executor, so a
+ * slow request does not hold up the ones behind it. Responses are sent as
+ * soon as they are ready, possibly out of order; the client matches them by
+ * id. Before returning, all requests in flight are waited for, since they
+ * refer to the channel.
+ *
+ * each request in flight occupies a job, which holds the decoded request and
+ * its response. Jobs are recycled along with the storage of their messages.
+ *
+ * requests go to a flow of the executor of their own. One the executor
+ * refuses is held until another request of the client is done, and the
+ * client is not read from meanwhile.
+ */
+void StorageServerConnection::serve(Channel& channel, Executor& executor,
+                                    FileOp& op)
+{
+    struct Job
     {
-        FileOp op("./nfs_root");
-        auto unserial_reader = [&](char* buf, size_t size) {
-            int off = 0;
-            int left = (int)size;
-            while (left > 0)
-            {
-                int read_size = this->socket().receiveBytes(buf + off, left);
-                if (read_size == 0)
-                {
-                    // client closed (for unknown reason)
-                    throw std::runtime_error(
-                        "client closed with out say bye-bye. rude");
-                }
-                assert(read_size <= left);
-                left -= read_size;
-                off += read_size;
-            }
-        };
+        Message req;
+        Message resp;
+        MetricsClock::time_point queued;  // when read
+    };
+
+    unsigned long count = next_count++;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Job> jobs(MAX_INFLIGHT);
+    std::vector<size_t> free_jobs;
+    for (size_t i = 0; i < MAX_INFLIGHT; i++)
+    {
+        free_jobs.push_back(i);
+    }
+    unsigned long done = 0;
+
+    FrameReader reader(channel);
+    FrameWriter writer(channel);
 
-        auto serial_writer = [&](const char* buf, size_t size) {
-            int off = 0;
-            int left = (int)size;
-            while (left > 0)
+    auto serve = [&](size_t idx) {
+        Job& job = jobs[idx];
+        MetricsClock::time_point started = MetricsClock::now();
+        uint64_t sent = FrameWriter::sentByThread();
+        try
+        {
+            if (!respondMsg(job.req, job.resp, op, &writer))
             {
-                int sent_size = this->socket().sendBytes(buf + off, left);
-                if (sent_size <= 0)
-                {
-                    throw std::runtime_error(
-                        "error happened while sending Msg to client");
-                }
-                assert(sent_size <= left);
-                left -= sent_size;
-                off += sent_size;
+                writer.writeMsg(job.resp);
             }
-        };
+        }
+        catch (std::exception& e)
+        {
+            std::cout << e.what() << std::endl;
+            channel.shutdown();
+        }
+        recordRequest(job.req, job.queued, started,
+                      FrameWriter::sentByThread() - sent);
+        std::lock_guard<std::mutex> lock(mutex);
+        free_jobs.push_back(idx);
+        done++;
+        cv.notify_all();
+    };
 
-        std::cout << "client " << this->count << " connected." << std::endl;
+    // destroyed first, once the last request has left the executor
+    Executor::Flow flow(executor);
+    try
+    {
+        std::cout << "client " << count << " connected." << std::endl;
         while (true)
         {
-            auto msg = unserializeMsg(unserial_reader);
-            auto responder = responder_map.at(msg->type);
-            auto resp_msg = responder(*msg, op);
-            if (resp_msg)
+            size_t idx;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return !free_jobs.empty(); });
+                idx = free_jobs.back();
+                free_jobs.pop_back();
+            }
+            try
+            {
+                reader.readMsg(jobs[idx].req);
+                jobs[idx].queued = MetricsClock::now();
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                free_jobs.push_back(idx);
+                throw;
+            }
+            size_t cost = requestCost(jobs[idx].req);
+            auto task = [&serve, idx] { serve(idx); };
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!executor.submit(flow, cost, task))
             {
-                serializeMsg(*resp_msg, serial_writer);
+                unsigned long seen = done;
+                cv.wait(lock, [&] { return done != seen; });
             }
         }
     }
@@ -86,8 +142,12 @@ void StorageServerConnection::run()
     {
         std::cout << e.what() << std::endl;
     }
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return free_jobs.size() == MAX_INFLIGHT; });
+    std::cout << "client " << count << " disconnected, "
+              << compressStats() << std::endl;
 }
 
-unsigned long StorageServerConnection::next_count = 1;
+std::atomic<unsigned long> StorageServerConnection::next_count(1);
 
 Poco::Timestamp StorageServerConnection::firstRequestTime = Poco::Timestamp();
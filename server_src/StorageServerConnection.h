@@ -1,23 +1,34 @@
 #include <Poco/Net/TCPServerConnection.h>
 #include <Poco/Net/StreamSocket.h>
 #include <Poco/Timestamp.h>
+#include <atomic>
+#include "channel.hpp"
+#include "executor.hpp"
+#include "fileop.hpp"
 
 class StorageServerConnection : public Poco::Net::TCPServerConnection{
 private:
 
-  static unsigned long next_count;
-  
-  unsigned long count;
+  static std::atomic<unsigned long> next_count;
 
   static Poco::Timestamp firstRequestTime;
 
+  Executor& executor;
+
+  FileOp& op;
+
  public:
 
-  StorageServerConnection(const Poco::Net::StreamSocket& socket);
+  StorageServerConnection(const Poco::Net::StreamSocket& socket,
+                          Executor& executor, FileOp& op);
   
   ~StorageServerConnection();
 
   virtual void run();
 
+  // serve the client at the other end of `channel` until it goes away.
+  // Files are accessed through `op`, shared by all connections.
+  static void serve(Channel& channel, Executor& executor, FileOp& op);
+
   
 };
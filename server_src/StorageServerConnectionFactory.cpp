@@ -2,7 +2,9 @@
 #include <iostream>
 
 
-StorageServerConnectionFactory::StorageServerConnectionFactory(){
+StorageServerConnectionFactory::StorageServerConnectionFactory(Executor& executor,
+                                                               FileOp& op):
+  executor(executor), op(op){
   //std::cout << "---- StorageServerConnectionFactory created ----" << std::endl;
 
 }
@@ -13,7 +15,7 @@ StorageServerConnectionFactory::~StorageServerConnectionFactory(){
 
 Poco::Net::TCPServerConnection* StorageServerConnectionFactory::createConnection(const Poco::Net::StreamSocket& socket){
 
-  return new StorageServerConnection(socket);
+  return new StorageServerConnection(socket, executor, op);
 
 }
 
@@ -6,10 +6,13 @@
 class StorageServerConnectionFactory : public Poco::Net::TCPServerConnectionFactory{
 private:
 
+  Executor& executor;
+
+  FileOp& op;
   
 public:
 
-  StorageServerConnectionFactory();
+  StorageServerConnectionFactory(Executor& executor, FileOp& op);
 
   ~StorageServerConnectionFactory();
 
@@ -0,0 +1,222 @@
+#include "blockcache.hpp"
+#include <algorithm>
+#include <cstring>
+
+// more shards than busy worker threads, so that they seldom meet
+static const size_t CACHE_SHARDS = 16;
+
+BlockCache::BlockCache(size_t budget, size_t block_size)
+    : _block_size(block_size), _budget(budget), _used(0), _next_victim(0)
+{
+    for (size_t i = 0; i < CACHE_SHARDS; i++)
+    {
+        _shards.emplace_back(new Shard);
+    }
+}
+
+BlockCache::Shard& BlockCache::shardOf(const std::string& path)
+{
+    return *_shards[std::hash<std::string>()(path) % _shards.size()];
+}
+
+/* blocks missing are fetched without holding the lock. If the file was
+ * invalidated meanwhile, a block may hold what it had before, so it is used
+ * but not cached.
+ */
+int BlockCache::read(const std::string& path, off_t offset, size_t size,
+                     char* buf, size_t& read_size, const FetchFunc& fetch)
+{
+    Shard& shard = shardOf(path);
+    read_size = 0;
+    while (read_size < size)
+    {
+        off_t pos = offset + read_size;
+        size_t index = pos / _block_size;
+        size_t skip = pos % _block_size;
+        uint64_t epoch;
+        Block block = find(shard, path, index, epoch);
+        if (!block)
+        {
+            std::vector<char> data(_block_size);
+            size_t fetched = 0;
+            int err = fetch(index * _block_size, _block_size, data.data(),
+                            fetched);
+            if (err)
+            {
+                return err;
+            }
+            data.resize(fetched);
+            block = std::make_shared<const std::vector<char>>(
+                std::move(data));
+            insert(shard, path, index, block, epoch);
+        }
+        if (block->size() <= skip)
+        {
+            break;
+        }
+        size_t n = std::min(block->size() - skip, size - read_size);
+        memcpy(buf + read_size, block->data() + skip, n);
+        read_size += n;
+        if (block->size() < _block_size)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+BlockCache::Block BlockCache::find(Shard& shard, const std::string& path,
+                                   size_t index, uint64_t& epoch)
+{
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    epoch = shard.epoch;
+    auto file = shard.files.find(path);
+    if (file == shard.files.end())
+    {
+        return nullptr;
+    }
+    auto it = file->second.find(index);
+    if (it == file->second.end())
+    {
+        return nullptr;
+    }
+    shard.recent_list.splice(shard.recent_list.begin(), shard.recent_list,
+                             it->second.use_record);
+    return it->second.block;
+}
+
+/* the end of a file is cached as a partial block, an empty one is not */
+void BlockCache::insert(Shard& shard, const std::string& path, size_t index,
+                        const Block& block, uint64_t epoch)
+{
+    if (block->empty() || _budget < _block_size)
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (epoch != shard.epoch)
+        {
+            return;
+        }
+        auto file = shard.files.find(path);
+        if (file != shard.files.end())
+        {
+            auto it = file->second.find(index);
+            if (it != file->second.end())
+            {
+                // fetched by someone else too
+                it->second.block = block;
+                shard.recent_list.splice(shard.recent_list.begin(),
+                                         shard.recent_list,
+                                         it->second.use_record);
+                return;
+            }
+        }
+        shard.recent_list.push_front({path, index});
+        shard.files[path].insert(
+            {index, Entry{block, shard.recent_list.begin()}});
+        _used += _block_size;
+    }
+    evict();
+}
+
+/* one block at a time, so that no two shard locks are held at once */
+void BlockCache::evict()
+{
+    while (_used > _budget)
+    {
+        Shard& shard = *_shards[_next_victim++ % _shards.size()];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.recent_list.empty())
+        {
+            continue;
+        }
+        const BlockID& cold = shard.recent_list.back();
+        auto file = shard.files.find(cold.first);
+        erase(shard, file->second, file->second.find(cold.second));
+        if (file->second.empty())
+        {
+            shard.files.erase(file);
+        }
+    }
+}
+
+void BlockCache::erase(Shard& shard, std::map<size_t, Entry>& blocks,
+                       std::map<size_t, Entry>::iterator it)
+{
+    shard.recent_list.erase(it->second.use_record);
+    blocks.erase(it);
+    _used -= _block_size;
+}
+
+void BlockCache::invalidate(const std::string& path, off_t offset,
+                            size_t size)
+{
+    Shard& shard = shardOf(path);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.epoch++;
+    auto file = shard.files.find(path);
+    if (file == shard.files.end())
+    {
+        return;
+    }
+    auto& blocks = file->second;
+    size_t begin = offset / _block_size;
+    size_t end = (offset + size + _block_size - 1) / _block_size;
+    for (auto it = blocks.lower_bound(begin);
+         it != blocks.end() && it->first < end;)
+    {
+        auto next = std::next(it);
+        erase(shard, blocks, it);
+        it = next;
+    }
+    if (!blocks.empty() &&
+        blocks.rbegin()->second.block->size() < _block_size)
+    {
+        erase(shard, blocks, std::prev(blocks.end()));
+    }
+    if (blocks.empty())
+    {
+        shard.files.erase(file);
+    }
+}
+
+/* the files under a directory are in any shard */
+void BlockCache::invalidate(const std::string& path)
+{
+    std::string dir = path + "/";
+    for (auto& shard : _shards)
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->epoch++;
+        for (auto file = shard->files.begin(); file != shard->files.end();)
+        {
+            if (file->first == path ||
+                file->first.compare(0, dir.size(), dir) == 0)
+            {
+                for (auto& block : file->second)
+                {
+                    shard->recent_list.erase(block.second.use_record);
+                    _used -= _block_size;
+                }
+                file = shard->files.erase(file);
+            }
+            else
+            {
+                ++file;
+            }
+        }
+    }
+}
+
+size_t BlockCache::countBlocks()
+{
+    size_t count = 0;
+    for (auto& shard : _shards)
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        count += shard->recent_list.size();
+    }
+    return count;
+}
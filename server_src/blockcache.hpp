@@ -0,0 +1,97 @@
+#pragma once
+#include <sys/types.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// the size of a cached block, the size clients are told to read in
+const size_t CACHE_BLOCK_SIZE = 64 << 10;
+
+/* Keeps recently read blocks of files in memory, so that data read by many
+ * clients at once, or again and again, is copied from memory instead of
+ * read from the file. Shared by all connections.
+ *
+ * Files are spread over shards, each with a lock and a least recently used
+ * list, so that readers of different files seldom wait for each other. The
+ * memory budget is shared, so that a single hot file may take all of it;
+ * once it is spent, the coldest block of each shard in turn is evicted. A
+ * block in use stays in memory even if it is evicted or invalidated
+ * meanwhile.
+ *
+ * Only changes made through the server are seen: blocks must be
+ * invalidated once they are written to, and a path once it names another
+ * file, or none.
+ */
+class BlockCache
+{
+public:
+    // read `size` bytes at `offset` of the file, fewer at its end. Returns
+    // errno or 0.
+    using FetchFunc = std::function<int(off_t offset, size_t size, char* buf,
+                                        size_t& read_size)>;
+
+private:
+    using Block = std::shared_ptr<const std::vector<char>>;
+    using BlockID = std::pair<std::string, size_t>;
+
+    struct Entry
+    {
+        Block block;
+        std::list<BlockID>::iterator use_record;
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        // the blocks of each file by index
+        std::unordered_map<std::string, std::map<size_t, Entry>> files;
+        // sorted by recent use, hot block is near head and cold is near tail
+        std::list<BlockID> recent_list;
+        // bumped by each invalidation
+        uint64_t epoch = 0;
+    };
+
+    size_t _block_size;
+    size_t _budget;
+    std::atomic<size_t> _used;  // by blocks cached, a full block each
+    std::atomic<size_t> _next_victim;  // the shard to evict from next
+    std::vector<std::unique_ptr<Shard>> _shards;
+
+public:
+    // keep up to `budget` bytes of blocks of `block_size`
+    BlockCache(size_t budget, size_t block_size = CACHE_BLOCK_SIZE);
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    /* read `size` bytes at `offset` of `path`, fewer at its end, fetching
+     * whole blocks that are not cached. Returns errno or 0.
+     */
+    int read(const std::string& path, off_t offset, size_t size, char* buf,
+             size_t& read_size, const FetchFunc& fetch);
+    // forget the blocks of `path` with bytes in [offset, offset + size),
+    // and a partial last block, which a write may extend
+    void invalidate(const std::string& path, off_t offset, size_t size);
+    // forget `path` and every path under it
+    void invalidate(const std::string& path);
+
+    size_t blockSize() const { return _block_size; }
+    size_t countBlocks();
+
+private:
+    Shard& shardOf(const std::string& path);
+    Block find(Shard& shard, const std::string& path, size_t index,
+               uint64_t& epoch);
+    void insert(Shard& shard, const std::string& path, size_t index,
+                const Block& block, uint64_t epoch);
+    void erase(Shard& shard, std::map<size_t, Entry>& blocks,
+               std::map<size_t, Entry>::iterator it);
+    void evict();
+};
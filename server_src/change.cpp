@@ -0,0 +1,77 @@
+#include "change.hpp"
+#include <time.h>
+#include <algorithm>
+
+static const size_t CHANGE_SHARDS = 16;
+
+static uint64_t nowNsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+ChangeTable::ChangeTable(size_t capacity)
+    : _shard_capacity(std::max<size_t>(capacity / CHANGE_SHARDS, 1)),
+      _last(nowNsec())
+{
+    for (size_t i = 0; i < CHANGE_SHARDS; i++)
+    {
+        _shards.emplace_back(new Shard);
+    }
+}
+
+ChangeTable::Shard& ChangeTable::shardOf(const FileID& id)
+{
+    return *_shards[Hash()(id) % _shards.size()];
+}
+
+uint64_t ChangeTable::unchangedVersion(const struct stat& st)
+{
+    return (uint64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+}
+
+uint64_t ChangeTable::version(const struct stat& st)
+{
+    return version(makeFileID(st), unchangedVersion(st));
+}
+
+uint64_t ChangeTable::version(const FileID& id, uint64_t unchanged)
+{
+    Shard& shard = shardOf(id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.versions.find(id);
+    return it != shard.versions.end() ? it->second
+                                      : std::max(unchanged, shard.forgotten);
+}
+
+/* the first file remembered is forgotten once the shard is full, which is
+ * as good as any other without keeping track of use. A file changed by
+ * others after the counter started is still given a greater version.
+ */
+void ChangeTable::bump(const FileID& id, uint64_t unchanged, uint64_t& before,
+                       uint64_t& after)
+{
+    Shard& shard = shardOf(id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.versions.find(id);
+    if (it == shard.versions.end())
+    {
+        if (shard.versions.size() >= _shard_capacity)
+        {
+            auto victim = shard.versions.begin();
+            shard.forgotten = std::max(shard.forgotten, victim->second);
+            shard.versions.erase(victim);
+        }
+        it = shard.versions
+                 .insert({id, std::max(unchanged, shard.forgotten)})
+                 .first;
+    }
+    before = it->second;
+    uint64_t last = _last;
+    do
+    {
+        after = std::max(last, before) + 1;
+    } while (!_last.compare_exchange_weak(last, after));
+    it->second = after;
+}
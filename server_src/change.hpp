@@ -0,0 +1,85 @@
+#pragma once
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// files whose versions are remembered by default
+const size_t MAX_CHANGED_FILES = 1 << 18;
+
+struct FileID
+{
+    dev_t dev;
+    ino_t ino;
+};
+
+inline FileID makeFileID(const struct stat& st)
+{
+    return FileID{st.st_dev, st.st_ino};
+}
+
+/* Versions of files, which clients compare to tell whether a file changed.
+ *
+ * Each change the server makes to a file gives it the next version from a
+ * counter, which starts at the time the table is made, in nanoseconds. A
+ * file not changed since has its change time as its version, so versions
+ * only grow, also across restarts of the server.
+ *
+ * Files are spread over shards, each with a lock. Up to `capacity` files
+ * are remembered. A file not remembered has at least the greatest version
+ * forgotten in its shard, so that a forgotten file does not go back to an
+ * older version; files never changed may move up with it, which clients
+ * take for a change.
+ */
+class ChangeTable
+{
+    struct Hash
+    {
+        size_t operator()(const FileID& id) const
+        {
+            return std::hash<uint64_t>()(id.ino) ^ id.dev;
+        }
+    };
+    struct Equal
+    {
+        bool operator()(const FileID& a, const FileID& b) const
+        {
+            return a.dev == b.dev && a.ino == b.ino;
+        }
+    };
+    struct Shard
+    {
+        std::mutex mutex;
+        std::unordered_map<FileID, uint64_t, Hash, Equal> versions;
+        uint64_t forgotten = 0;  // the greatest version forgotten
+    };
+
+    size_t _shard_capacity;
+    std::atomic<uint64_t> _last;  // the version last given out
+    std::vector<std::unique_ptr<Shard>> _shards;
+
+public:
+    ChangeTable(size_t capacity = MAX_CHANGED_FILES);
+    ChangeTable(const ChangeTable&) = delete;
+    ChangeTable& operator=(const ChangeTable&) = delete;
+
+    // the version of the file with the status `st`
+    uint64_t version(const struct stat& st);
+    uint64_t version(const FileID& id, uint64_t unchanged);
+    /* give the file `id` a new version, once it is changed. `unchanged` is
+     * its version if the server has not changed it before, as from
+     * unchangedVersion.
+     */
+    void bump(const FileID& id, uint64_t unchanged, uint64_t& before,
+              uint64_t& after);
+
+    static uint64_t unchangedVersion(const struct stat& st);
+
+private:
+    Shard& shardOf(const FileID& id);
+};
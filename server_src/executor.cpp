@@ -0,0 +1,165 @@
+#include "executor.hpp"
+#include <algorithm>
+#include <cassert>
+
+Executor::Flow::Flow(Executor& executor)
+    : _executor(executor), _running(0), _deficit(0)
+{
+}
+
+Executor::Flow::~Flow()
+{
+    _executor.leave(*this);
+}
+
+Executor::Executor(size_t nthreads, size_t flow_threads, size_t max_queued)
+    : _flow_threads(flow_threads ? flow_threads : nthreads),
+      _max_queued(std::max<size_t>(max_queued, 1)),
+      _queued(0),
+      _stopping(false),
+      _default(*this)
+{
+    assert(nthreads > 0);
+    for (size_t i = 0; i < nthreads; i++)
+    {
+        _workers.emplace_back(&Executor::run, this);
+    }
+}
+
+Executor::~Executor()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _cv.notify_all();
+    for (auto& worker : _workers)
+    {
+        worker.join();
+    }
+}
+
+void Executor::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_default._tasks.empty())
+        {
+            _active.push_back(&_default);
+        }
+        // a turn each
+        _default._tasks.push_back(Task{std::move(task), EXECUTOR_QUANTUM});
+        _queued++;
+    }
+    _cv.notify_one();
+}
+
+/* the share of a flow is taken among the flows with tasks queued, which
+ * it is one of
+ */
+bool Executor::submit(Flow& flow, size_t cost, std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_queued >= _max_queued && !flow._tasks.empty() &&
+            flow._tasks.size() >=
+                std::max<size_t>(_max_queued / _active.size(), 1))
+        {
+            return false;
+        }
+        if (flow._tasks.empty())
+        {
+            _active.push_back(&flow);
+        }
+        flow._tasks.push_back(Task{std::move(task), cost});
+        _queued++;
+    }
+    _cv.notify_one();
+    return true;
+}
+
+/* the flow at the front takes tasks as long as its deficit covers them;
+ * once it does not, the flow is given another quantum and goes to the
+ * back. Flows running on all the threads they may use are passed over.
+ * Called with the lock held.
+ */
+Executor::Flow* Executor::pick()
+{
+    size_t passed = 0;
+    while (passed < _active.size())
+    {
+        Flow* flow = _active.front();
+        if (flow->_running >= _flow_threads)
+        {
+            passed++;
+        }
+        else if (flow->_deficit >= flow->_tasks.front().cost)
+        {
+            return flow;
+        }
+        else
+        {
+            passed = 0;
+            flow->_deficit += EXECUTOR_QUANTUM;
+        }
+        _active.pop_front();
+        _active.push_back(flow);
+    }
+    return nullptr;
+}
+
+/* the task is destroyed without the lock, as it may own the flow */
+void Executor::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        Flow* flow = nullptr;
+        _cv.wait(lock, [this, &flow] {
+            flow = pick();
+            return flow || (_stopping && _queued == 0);
+        });
+        if (!flow)
+        {
+            return;
+        }
+        Task task = std::move(flow->_tasks.front());
+        flow->_tasks.pop_front();
+        flow->_deficit -= task.cost;
+        flow->_running++;
+        _queued--;
+        if (flow->_tasks.empty())
+        {
+            // a flow keeps no credit while it has nothing to spend it on
+            flow->_deficit = 0;
+            _active.pop_front();
+        }
+        lock.unlock();
+        task.run();
+        lock.lock();
+        bool was_full = flow->_running-- == _flow_threads;
+        if (_stopping && _queued == 0)
+        {
+            _cv.notify_all();
+        }
+        else if (was_full && !flow->_tasks.empty())
+        {
+            _cv.notify_one();
+        }
+        if (flow->_running == 0)
+        {
+            _idle_cv.notify_all();
+        }
+        lock.unlock();
+        task.run = nullptr;
+        lock.lock();
+    }
+}
+
+void Executor::leave(Flow& flow)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle_cv.wait(lock, [&flow] {
+        return flow._running == 0 && flow._tasks.empty();
+    });
+}
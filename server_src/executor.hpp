@@ -0,0 +1,89 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// tasks waiting in an executor before clients have to wait their turn
+const size_t MAX_QUEUED_TASKS = 256;
+// cost a client may spend at each of its turns, see Executor
+const size_t EXECUTOR_QUANTUM = 64 << 10;
+
+/* A fixed pool of worker threads running submitted tasks. Shared by all
+ * connections, so the number of threads touching the file system does not
+ * grow with the number of clients.
+ *
+ * Each client submits to a flow of its own, whose tasks run in FIFO order.
+ * Workers take turns between flows by deficit round robin: at its turn, a
+ * flow is given EXECUTOR_QUANTUM to spend on the costs of its tasks, so
+ * that clients get the same share of the workers however large their
+ * requests are. A flow runs on at most `flow_threads` workers at once,
+ * leaving the others for other clients. A client doing a large transfer
+ * cannot keep the rest waiting behind it.
+ *
+ * Once more than `max_queued` tasks wait, a flow may only queue its share
+ * of them, and is refused beyond it; a flow with nothing queued is always
+ * taken. A refused client is to wait until one of its tasks is done, which
+ * holds back the clients that flood the server rather than the others.
+ *
+ * Tasks must not throw. Tasks still queued at destruction are run before
+ * the workers exit.
+ */
+class Executor
+{
+    struct Task
+    {
+        std::function<void()> run;
+        size_t cost;
+    };
+
+public:
+    // the tasks of a client. Destruction waits for the tasks running.
+    class Flow
+    {
+        friend class Executor;
+        Executor& _executor;
+        std::deque<Task> _tasks;
+        size_t _running;
+        size_t _deficit;
+
+    public:
+        explicit Flow(Executor& executor);
+        ~Flow();
+        Flow(const Flow&) = delete;
+        Flow& operator=(const Flow&) = delete;
+    };
+
+private:
+    size_t _flow_threads;
+    size_t _max_queued;
+    // flows with tasks queued, the one whose turn it is at the front
+    std::deque<Flow*> _active;
+    size_t _queued;
+    bool _stopping;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::condition_variable _idle_cv;  // for a flow being destroyed
+    Flow _default;
+    std::vector<std::thread> _workers;
+
+public:
+    // a `flow_threads` of 0 lets one flow use all threads
+    Executor(size_t nthreads, size_t flow_threads = 0,
+             size_t max_queued = MAX_QUEUED_TASKS);
+    ~Executor();
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    // to a flow shared by tasks of no client, which is never refused
+    void submit(std::function<void()> task);
+    // false if refused, in which case the task is not run
+    bool submit(Flow& flow, size_t cost, std::function<void()> task);
+
+private:
+    Flow* pick();
+    void run();
+    void leave(Flow& flow);
+};
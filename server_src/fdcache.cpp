@@ -0,0 +1,109 @@
+#include "fdcache.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+FdCache::File::~File()
+{
+    ::close(fd);
+}
+
+FdCache::FdCache(size_t capacity) : _capacity(capacity), _epoch(0) {}
+
+int FdCache::open(const std::string& path, bool write, FilePtr& file)
+{
+    return openAt(path, AT_FDCWD, path.c_str(), write ? Write : Read, file);
+}
+
+/* the file is opened without holding the lock. If a path was invalidated
+ * meanwhile, the file may be the one it named before, so it is used but not
+ * cached.
+ */
+int FdCache::openAt(const std::string& path, int dirfd, const char* name,
+                    Mode mode, FilePtr& file)
+{
+    bool write = mode == Write;
+    uint64_t epoch;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _entries.find(path);
+        if (it != _entries.end() && (it->second.file->writable || !write))
+        {
+            _recent_list.splice(_recent_list.begin(), _recent_list,
+                                it->second.use_record);
+            file = it->second.file;
+            return 0;
+        }
+        epoch = _epoch;
+    }
+    bool writable = mode != Directory;
+    int fd = writable ? ::openat(dirfd, name, O_RDWR | O_CLOEXEC)
+                      : ::openat(dirfd, name,
+                                 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && mode == Read &&
+        (errno == EACCES || errno == EROFS || errno == EISDIR))
+    {
+        writable = false;
+        fd = ::openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    }
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) < 0)
+    {
+        int err = errno;
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        return err;
+    }
+    file = std::make_shared<const File>(fd, writable, st);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_capacity == 0 || epoch != _epoch)
+    {
+        return 0;
+    }
+    auto it = _entries.find(path);
+    if (it != _entries.end())
+    {
+        // opened by someone else too, or again for writing
+        it->second.file = file;
+        _recent_list.splice(_recent_list.begin(), _recent_list,
+                            it->second.use_record);
+        return 0;
+    }
+    if (_entries.size() >= _capacity)
+    {
+        _entries.erase(_recent_list.back());
+        _recent_list.pop_back();
+    }
+    _recent_list.push_front(path);
+    _entries.insert({path, Entry{file, _recent_list.begin()}});
+    return 0;
+}
+
+void FdCache::invalidate(const std::string& path)
+{
+    std::string dir = path + "/";
+    std::lock_guard<std::mutex> lock(_mutex);
+    _epoch++;
+    for (auto it = _entries.begin(); it != _entries.end();)
+    {
+        if (it->first == path || it->first.compare(0, dir.size(), dir) == 0)
+        {
+            _recent_list.erase(it->second.use_record);
+            it = _entries.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+size_t FdCache::size()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _entries.size();
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "change.hpp"
+#include "readahead.hpp"
+
+/* Keeps recently used files open, so that a request on a file costs a
+ * pread or pwrite instead of a path lookup, an open and a close. Shared by
+ * all connections; the least recently used file is closed when the cache
+ * is full.
+ *
+ * A file stays open as long as it is in use, even if it is evicted or
+ * invalidated meanwhile. How it is read is followed while it is open, see
+ * ReadAhead. Files are opened for reading and writing where
+ * allowed, and for reading only otherwise.
+ *
+ * Only changes made through the server are seen: a path must be
+ * invalidated once it names another file, or none.
+ */
+class FdCache
+{
+public:
+    struct File
+    {
+        int fd;
+        bool writable;
+        FileID id;
+        uint64_t unchanged;  // its version when opened, see ChangeTable
+        mutable ReadAhead readahead;
+        File(int fd, bool writable, const struct stat& st)
+            : fd(fd),
+              writable(writable),
+              id(makeFileID(st)),
+              unchanged(ChangeTable::unchangedVersion(st))
+        {
+        }
+        ~File();
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+    };
+    using FilePtr = std::shared_ptr<const File>;
+
+private:
+    struct Entry
+    {
+        FilePtr file;
+        std::list<std::string>::iterator use_record;
+    };
+
+    size_t _capacity;
+    std::mutex _mutex;
+    std::unordered_map<std::string, Entry> _entries;
+    // sorted by recent use, hot file is near head and cold is near tail.
+    std::list<std::string> _recent_list;
+    // bumped by each invalidation
+    uint64_t _epoch;
+
+public:
+    FdCache(size_t capacity);
+    FdCache(const FdCache&) = delete;
+    FdCache& operator=(const FdCache&) = delete;
+
+    enum Mode
+    {
+        Read,
+        Write,
+        Directory  // to look up names in
+    };
+
+    // open `path`, for writing if `write`. Returns errno or 0.
+    int open(const std::string& path, bool write, FilePtr& file);
+    // open `name` in the directory `dirfd`, which is cached as `path`
+    int openAt(const std::string& path, int dirfd, const char* name,
+               Mode mode, FilePtr& file);
+    // forget `path` and every path under it
+    void invalidate(const std::string& path);
+    size_t size();
+};
@@ -1,69 +1,163 @@
 #include "fileop.hpp"
+#include <stdio.h>
+#include <time.h>
 
-int loadTime(const std::string& fname, FileTime& time)
+// differs at each start of the server
+static uint64_t bootVerifier()
 {
-    struct stat stbuf;
-    int err = stat(fname.c_str(), &stbuf);
-    if (err == 0)
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+FileOp::FileOp(std::string root, IoRing* ring, size_t max_open,
+               BlockCache* blocks, WriteLog* log)
+    : _root(std::move(root)),
+      _root_fd(::open(_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)),
+      _ring(ring),
+      _files(max_open),
+      _blocks(blocks),
+      _log(log),
+      _verifier(bootVerifier())
+{
+}
+
+FileOp::~FileOp()
+{
+    if (_root_fd >= 0)
     {
-        time = makeFileTime(stbuf);
-        return 0;
+        ::close(_root_fd);
     }
-    else
+}
+
+/* the parent directory is opened relative to the root, and kept open in the
+ * cache along with files. The root and paths ending in '/' are looked up as
+ * ".".
+ */
+int FileOp::locate(const std::string& fpath, Location& loc)
+{
+    size_t slash = fpath.find_last_of('/');
+    size_t parent_begin = fpath.find_first_not_of('/');
+    loc.name = slash == std::string::npos ? fpath : fpath.substr(slash + 1);
+    if (loc.name.empty())
+    {
+        loc.name = ".";
+    }
+    loc.dir.reset();
+    loc.dirfd = _root_fd;
+    if (slash == std::string::npos || parent_begin >= slash)
+    {
+        return _root_fd < 0 ? EBADF : 0;
+    }
+    std::string parent = fpath.substr(parent_begin, slash - parent_begin);
+    int err = _files.openAt(_root + "/" + parent, _root_fd, parent.c_str(),
+                            FdCache::Directory, loc.dir);
+    if (err)
     {
         return err;
     }
+    loc.dirfd = loc.dir->fd;
+    return 0;
 }
 
-int FileOp::access(const std::string& fpath, FileTime& time)
+int FileOp::openAt(const std::string& fpath, FdCache::Mode mode,
+                   FdCache::FilePtr& file)
 {
-    auto filename = _root + fpath;
+    Location loc;
+    int err = locate(fpath, loc);
+    if (err)
+    {
+        return err;
+    }
+    return _files.openAt(_root + fpath, loc.dirfd, loc.name.c_str(), mode,
+                         file);
+}
 
-    int err = ::access(filename.c_str(), R_OK | W_OK);
-    if (err < 0)
+int FileOp::access(const std::string& fpath, uint64_t& change)
+{
+    Location loc;
+    int err = locate(fpath, loc);
+    if (err)
+    {
+        return err;
+    }
+    if (::faccessat(loc.dirfd, loc.name.c_str(), R_OK | W_OK, 0) < 0)
     {
         return errno;
     }
-    err = loadTime(filename, time);
-    if (err < 0)
+    struct stat stbuf;
+    if (::fstatat(loc.dirfd, loc.name.c_str(), &stbuf, 0) < 0)
     {
         return errno;
     }
-
+    change = _changes.version(stbuf);
     return 0;
 }
 
+/* a file that existed is emptied, which is a change to it */
 int FileOp::creat(const std::string& fpath)
 {
-    auto filename = _root + fpath;
-
-    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 00777);
+    Location loc;
+    int err = locate(fpath, loc);
+    if (err)
+    {
+        return err;
+    }
+    if (_log && (err = _log->logCreate(fpath)))
+    {
+        return err;
+    }
+    int fd = ::openat(loc.dirfd, loc.name.c_str(),
+                      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00777);
+    err = fd < 0 ? errno : 0;
+    applied(err);
     if (fd < 0)
     {
-        return errno;
+        return err;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == 0)
+    {
+        uint64_t before, after;
+        _changes.bump(makeFileID(st), ChangeTable::unchangedVersion(st),
+                      before, after);
     }
     ::close(fd);
+    if (_blocks)
+    {
+        _blocks->invalidate(_root + fpath);
+    }
     return 0;
 }
 
+int FileOp::open(const std::string& fpath, FdCache::FilePtr& file)
+{
+    return openAt(fpath, FdCache::Read, file);
+}
+
 int FileOp::stat(const std::string& fpath, struct stat& stbuf)
 {
-    auto filename = _root + fpath;
-    int res = ::stat(filename.c_str(), &stbuf);
-    if (res < 0)
+    Location loc;
+    int err = locate(fpath, loc);
+    if (err)
     {
-        return errno;
+        return err;
     }
-    else
+    if (_ring)
     {
-        return 0;
+        return _ring->stat(loc.dirfd, loc.name.c_str(), stbuf);
     }
+    if (::fstatat(loc.dirfd, loc.name.c_str(), &stbuf, 0) < 0)
+    {
+        return errno;
+    }
+    return 0;
 }
 
 int FileOp::statfs(FsStat& stat)
 {
     struct statvfs stbuf;
-    int err = ::statvfs(_root.c_str(), &stbuf);
+    int err = ::fstatvfs(_root_fd, &stbuf);
     if (err < 0)
     {
         return errno;
@@ -75,179 +169,409 @@ int FileOp::statfs(FsStat& stat)
 int FileOp::readdir(const std::string& fpath,
                     std::vector<std::string>& dirnames)
 {
-    auto filename = _root + fpath;
-    DIR* dirs = ::opendir(filename.c_str());
-    if (dirs == NULL)
+    Location loc;
+    int err = locate(fpath, loc);
+    if (err)
+    {
+        return err;
+    }
+    int fd = ::openat(loc.dirfd, loc.name.c_str(),
+                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
     {
         return errno;
     }
+    DIR* dirs = ::fdopendir(fd);
+    if (dirs == NULL)
+    {
+        err = errno;
+        ::close(fd);
+        return err;
+    }
     errno = 0;
     while (struct dirent* ent = ::readdir(dirs))
     {
         dirnames.push_back(ent->d_name);
     }
+    err = errno;
     closedir(dirs);
-    return errno;
+    return err;
 }
 
 int FileOp::read(const std::string& fpath, off_t offset, size_t size,
                  char* buf, size_t& total_read)
 {
-    auto filename = _root + fpath;
-    int fd = ::open(filename.c_str(), O_RDONLY);
     total_read = 0;
-    if (fd < 0)
+    FdCache::FilePtr file;
+    int err = openAt(fpath, FdCache::Read, file);
+    if (err)
     {
-        return errno;
+        return err;
     }
-    int err = ::lseek(fd, offset, SEEK_SET);
-    if (err < 0)
+    file->readahead.onRead(file->fd, offset, size);
+    if (_blocks)
     {
-        ::close(fd);
-        return errno;
+        return _blocks->read(
+            _root + fpath, offset, size, buf, total_read,
+            [&](off_t at, size_t len, char* into, size_t& read_size) {
+                return readFile(file->fd, at, len, into, read_size);
+            });
     }
-    ssize_t read_size = 0;
+    return readFile(file->fd, offset, size, buf, total_read);
+}
+
+int FileOp::readFile(int fd, off_t offset, size_t size, char* buf,
+                     size_t& total_read)
+{
     total_read = 0;
+    if (_ring)
+    {
+        return _ring->read(fd, offset, buf, size, total_read);
+    }
     while (total_read < size)
     {
-        read_size = ::read(fd, buf + total_read, size - total_read);
-        if (read_size <= 0)
+        ssize_t read_size =
+            ::pread(fd, buf + total_read, size - total_read,
+                    offset + total_read);
+        if (read_size < 0)
+        {
+            return errno;
+        }
+        if (read_size == 0)
         {
             break;
         }
         total_read += read_size;
     }
-    assert(total_read <= size);
-    ::close(fd);
-    if (read_size >= 0)
+    return 0;
+}
+
+/* the version is bumped once the file is written, so that a client seeing
+ * it sees the data too
+ */
+int FileOp::write(const std::string& fpath, off_t offset, const char* buf,
+                  size_t size, uint64_t& before_change,
+                  uint64_t& after_change)
+{
+    FdCache::FilePtr file;
+    int err = openAt(fpath, FdCache::Write, file);
+    if (err)
     {
-        return 0;
+        return err;
+    }
+    if (_log && (err = _log->logWrite(fpath, offset, buf, size)))
+    {
+        return err;
+    }
+    if (_ring)
+    {
+        err = _ring->write(file->fd, offset, buf, size);
     }
     else
     {
-        return errno;
+        ssize_t written_size = ::pwrite(file->fd, buf, size, offset);
+        if (written_size < 0)
+        {
+            err = errno;
+        }
+        else if (written_size < (ssize_t)size)
+        {
+            err = EDQUOT;
+        }
     }
+    if (_blocks)
+    {
+        _blocks->invalidate(_root + fpath, offset, size);
+    }
+    applied(err);
+    // a failed write may have written part of the data
+    _changes.bump(file->id, file->unchanged, before_change, after_change);
+    return err;
 }
 
-int FileOp::write(const std::string& fpath, off_t offset, const char* buf,
-                  size_t size, FileTime& before_change,
-                  FileTime& after_change)
+/* through the open file, as a write */
+int FileOp::truncate(const std::string& fpath, off_t offset,
+                     uint64_t& before_change, uint64_t& after_change)
 {
-    auto filename = _root + fpath;
-    int err = loadTime(filename, before_change);
-    if (err < 0)
+    FdCache::FilePtr file;
+    int err = openAt(fpath, FdCache::Write, file);
+    if (err)
     {
-        return errno;
+        return err;
     }
-
-    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT, 0766);
-    if (fd < 0)
+    if (_log && (err = _log->logTruncate(fpath, offset)))
     {
-        return errno;
+        return err;
     }
-    err = ::lseek(fd, offset, SEEK_SET);
-    if (err < 0)
+    err = ::ftruncate(file->fd, offset) < 0 ? errno : 0;
+    if (_blocks)
     {
-        ::close(fd);
-        return errno;
+        _blocks->invalidate(_root + fpath);
     }
-    ssize_t written_size = ::write(fd, buf, size);
-    ::close(fd);
-
-    if (written_size < 0)
+    applied(err);
+    if (err)
     {
-        perror("write");
-        std::cerr << "write errno" << std::endl;
-        return errno;
+        return err;
     }
-    else if (written_size < (ssize_t)size)
+    _changes.bump(file->id, file->unchanged, before_change, after_change);
+    return 0;
+}
+
+/* a change logged that then fails is dropped from the log by a checkpoint
+ * before the error is returned, so that replay does not make it after all
+ */
+void FileOp::applied(int err)
+{
+    if (_log)
     {
-        std::cerr << "write too small" << written_size << "v.s. " << size
-                  << std::endl;
-        return EDQUOT;
+        _log->applied();
+        if (err)
+        {
+            _log->checkpoint();
+        }
     }
+}
 
-    err = loadTime(filename, after_change);
-    if (err < 0)
+/* the log is emptied before a change it does not hold to a path it has
+ * records of, or of paths under it, as it names files by their paths
+ */
+int FileOp::checkpoint(const std::string& fpath)
+{
+    return _log && _log->holds(fpath) ? _log->checkpoint() : 0;
+}
+
+// make a change to the entries of a directory durable
+int FileOp::syncDir(int dirfd)
+{
+    if (_log && ::fsync(dirfd) < 0)
     {
         return errno;
     }
-
     return 0;
 }
 
-int FileOp::truncate(const std::string& fpath, off_t offset,
-                     FileTime& before_change, FileTime& after_change)
+/* a path no longer names what it did, nor do the paths under it */
+void FileOp::invalidate(const std::string& fpath)
 {
     auto filename = _root + fpath;
-    int err = loadTime(filename, before_change);
-    if (err < 0)
+    _files.invalidate(filename);
+    if (_blocks)
     {
-        return errno;
+        _blocks->invalidate(filename);
+    }
+}
+
+int FileOp::unlink(const std::string& fpath)
+{
+    Location loc;
+    int err = locate(fpath, loc);
+    if (err == 0)
+    {
+        err = checkpoint(fpath);
+    }
+    if (err)
+    {
+        return err;
     }
-    int res = ::truncate(filename.c_str(), offset);
-    if (res < 0)
+    if (::unlinkat(loc.dirfd, loc.name.c_str(), 0) < 0)
     {
         return errno;
     }
+    invalidate(fpath);
+    return syncDir(loc.dirfd);
+}
 
-    err = loadTime(filename, after_change);
-    if (err < 0)
+int FileOp::rmdir(const std::string& fpath)
+{
+    Location loc;
+    int err = locate(fpath, loc);
+    if (err == 0)
+    {
+        err = checkpoint(fpath);
+    }
+    if (err)
+    {
+        return err;
+    }
+    if (::unlinkat(loc.dirfd, loc.name.c_str(), AT_REMOVEDIR) < 0)
     {
         return errno;
     }
-
-    return 0;
+    invalidate(fpath);
+    return syncDir(loc.dirfd);
 }
 
-int FileOp::unlink(const std::string& fpath)
+int FileOp::mkdir(const std::string& fpath, mode_t mode)
 {
-    auto filename = _root + fpath;
-    int res = ::unlink(filename.c_str());
-    if (res < 0)
+    Location loc;
+    int err = locate(fpath, loc);
+    if (err)
     {
-        return errno;
+        return err;
     }
-    else
+    if (::mkdirat(loc.dirfd, loc.name.c_str(), mode) < 0)
     {
-        return res;
+        return errno;
     }
+    return syncDir(loc.dirfd);
 }
-int FileOp::rmdir(const std::string& fpath)
+
+/* the flags are those of renameat2, as RENAME_NOREPLACE and
+ * RENAME_EXCHANGE
+ */
+int FileOp::rename(const std::string& from, const std::string& to,
+                   unsigned int flags)
 {
-    auto filename = _root + fpath;
-    int res = ::rmdir(filename.c_str());
-    if (res < 0)
+    Location from_loc, to_loc;
+    int err = locate(from, from_loc);
+    if (err == 0)
+    {
+        err = locate(to, to_loc);
+    }
+    if (err == 0)
+    {
+        err = checkpoint(from);
+    }
+    if (err == 0)
+    {
+        err = checkpoint(to);
+    }
+    if (err)
+    {
+        return err;
+    }
+    if (::renameat2(from_loc.dirfd, from_loc.name.c_str(), to_loc.dirfd,
+                    to_loc.name.c_str(), flags) < 0)
     {
         return errno;
     }
-    else
+    invalidate(from);
+    invalidate(to);
+    err = syncDir(from_loc.dirfd);
+    if (err == 0 && to_loc.dirfd != from_loc.dirfd)
     {
-        return res;
+        err = syncDir(to_loc.dirfd);
     }
+    return err;
 }
 
-int FileOp::mkdir(const std::string& fpath, mode_t mode)
+/* copy through a buffer, for when the kernel cannot copy between the files
+ */
+static int copyBuffered(int in_fd, off_t in_off, int out_fd, off_t out_off,
+                        size_t size, size_t& copied)
 {
-    auto filename = _root + fpath;
-    int res = ::mkdir(filename.c_str(), mode);
-    if (res < 0)
+    std::vector<char> buf(std::min(size - copied, (size_t)1 << 20));
+    while (copied < size)
     {
-        return errno;
+        ssize_t n = ::pread(in_fd, buf.data(),
+                            std::min(buf.size(), size - copied), in_off);
+        if (n <= 0)
+        {
+            return n < 0 ? errno : 0;
+        }
+        ssize_t written = ::pwrite(out_fd, buf.data(), n, out_off);
+        if (written < n)
+        {
+            return written < 0 ? errno : EDQUOT;
+        }
+        in_off += n;
+        out_off += n;
+        copied += n;
+    }
+    return 0;
+}
+
+/* copy_file_range shares the extents (reflink) where the file system
+ * supports it, and copies inside the kernel otherwise.
+ */
+int FileOp::copy(const std::string& from, off_t from_offset,
+                 const std::string& to, off_t to_offset, size_t size,
+                 size_t& copied, uint64_t& before_change,
+                 uint64_t& after_change)
+{
+    copied = 0;
+    FdCache::FilePtr in, out;
+    int err = openAt(from, FdCache::Read, in);
+    if (err)
+    {
+        return err;
+    }
+    err = openAt(to, FdCache::Write, out);
+    if (err == 0)
+    {
+        err = checkpoint(to);
+    }
+    if (err)
+    {
+        return err;
+    }
+    int in_fd = in->fd;
+    int out_fd = out->fd;
+    off_t to_start = to_offset;
+    while (copied < size)
+    {
+        ssize_t n = ::copy_file_range(in_fd, &from_offset, out_fd,
+                                      &to_offset, size - copied, 0);
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS ||
+                      errno == EOPNOTSUPP))
+        {
+            err = copyBuffered(in_fd, from_offset, out_fd, to_offset, size,
+                               copied);
+            break;
+        }
+        if (n <= 0)
+        {
+            err = n < 0 ? errno : 0;
+            break;
+        }
+        copied += n;
+    }
+    if (_blocks)
+    {
+        _blocks->invalidate(_root + to, to_start, size);
+    }
+    if (err == 0 && _log && copied > 0 && ::fdatasync(out_fd) < 0)
+    {
+        err = errno;
+    }
+    if (copied > 0)
+    {
+        _changes.bump(out->id, out->unchanged, before_change, after_change);
     }
     else
     {
-        return res;
+        before_change = after_change =
+            _changes.version(out->id, out->unchanged);
     }
+    return err;
 }
 
-int FileOp::rename(const std::string& from, const std::string& to,
-                   unsigned int flags)
+/* pages that fail to be written out are dropped by the kernel, along with
+ * writes to the file that were never committed, so a failed sync changes
+ * the verifier. The error is reported once, to whichever sync of the shared
+ * fd sees it first, so syncs are made one at a time: one that succeeds
+ * after another failed returns the new verifier.
+ */
+int FileOp::commit(const std::string& fpath, uint64_t& verifier)
 {
-    int err = ::rename((_root + from).c_str(), (_root + to).c_str());
-    if (err)
+    FdCache::FilePtr file;
+    int err = openAt(fpath, FdCache::Read, file);
+    if (err || _log)
     {
-        return errno;
+        verifier = _verifier;
+        return err;
     }
-    return 0;
+    std::lock_guard<std::mutex> lock(_commit_mutex);
+    if (::fdatasync(file->fd) < 0)
+    {
+        err = errno;
+        _verifier++;
+    }
+    verifier = _verifier;
+    return err;
+}
+
+uint64_t FileOp::version(const struct stat& stbuf)
+{
+    return _changes.version(stbuf);
 }
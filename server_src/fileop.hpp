@@ -6,37 +6,125 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include "blockcache.hpp"
+#include "fdcache.hpp"
 #include "msg.hpp"
+#include "uring.hpp"
+#include "writelog.hpp"
+
+// files kept open by default, well below the usual limit of 1024 fds
+const size_t MAX_OPEN_FILES = 256;
 
 /* A class to rule them (file operations) all
  * all function resembles the system call except returns errno or 0.
+ *
+ * Paths are looked up from the directory holding them, which is kept open
+ * along with files, so that the kernel walks a path once rather than on
+ * each request. The root must exist when the FileOp is made.
+ *
+ * Files read, written or copied are kept open in a cache of up to
+ * `max_open` files and directories, see FdCache. One FileOp may be shared
+ * by all connections, so that they share the cache too.
+ *
+ * Given an IoRing, reads, writes and stats go through it instead of
+ * blocking system calls.
+ *
+ * Given a BlockCache, reads are served from it, and it is kept in step
+ * with changes made through the FileOp.
+ *
+ * Each change made through the FileOp gives the file a new version, see
+ * ChangeTable, which is returned along with the versions before it.
+ *
+ * Given a WriteLog, writes, truncates and creats are durable once they
+ * return. Other changes are not logged: they sync what they change, and
+ * start with a checkpoint of the log, a sync of the whole file system, if
+ * it holds records of the paths they change.
+ *
+ * Without one, writes are unstable until the file is committed: they may
+ * be lost if the server goes down, or if the page cache fails to write
+ * them out. Either changes the verifier, so that clients know to send
+ * again what they wrote under the one before.
  */
 class FileOp
 {
+    // a directory and a name in it, which stand for a path
+    struct Location
+    {
+        FdCache::FilePtr dir;  // none for the root
+        int dirfd;
+        std::string name;
+    };
+
     std::string _root;
+    int _root_fd;
+    IoRing* _ring;
+    FdCache _files;
+    BlockCache* _blocks;
+    WriteLog* _log;
+    ChangeTable _changes;
+    std::atomic<uint64_t> _verifier;
+    std::mutex _commit_mutex;
 
 public:
-    FileOp(std::string root) : _root(std::move(root)) {}
-    int access(const std::string& fpath, FileTime& time);
+    FileOp(std::string root, IoRing* ring = nullptr,
+           size_t max_open = MAX_OPEN_FILES, BlockCache* blocks = nullptr,
+           WriteLog* log = nullptr);
+    ~FileOp();
+    FileOp(const FileOp&) = delete;
+    FileOp& operator=(const FileOp&) = delete;
+
+    int access(const std::string& fpath, uint64_t& change);
     int creat(const std::string& fpath);
+    // open for reading
+    int open(const std::string& fpath, FdCache::FilePtr& file);
     int stat(const std::string& fpath, struct stat& stbuf);
     int statfs(FsStat& stat);
     int readdir(const std::string& fpath, std::vector<std::string>& dirnames);
     int read(const std::string& fpath, off_t offset, size_t size, char* buf,
              size_t& total_read);
+    /* reads go straight to the files, through neither the block cache nor
+     * io_uring, so that a file may as well be sent with sendfile
+     */
+    bool readsDirect() const { return !_blocks && !_ring; }
     int write(const std::string& fpath, off_t offset, const char* buf,
-              size_t size, FileTime& before_change, FileTime& after_change);
+              size_t size, uint64_t& before_change, uint64_t& after_change);
     int truncate(const std::string& fpath, off_t offset,
-                 FileTime& before_change, FileTime& after_change);
+                 uint64_t& before_change, uint64_t& after_change);
     int unlink(const std::string& filename);
     int rmdir(const std::string& filename);
     int mkdir(const std::string& filename, mode_t mode);
 
     int rename(const std::string& from, const std::string& to,
                unsigned int flags);
+    // `copied` is short if `from` ends first; the versions are those of `to`
+    int copy(const std::string& from, off_t from_offset,
+             const std::string& to, off_t to_offset, size_t size,
+             size_t& copied, uint64_t& before_change,
+             uint64_t& after_change);
+    // the version of the file with the status `stbuf`
+    uint64_t version(const struct stat& stbuf);
+    // make the writes to the file durable; `verifier` is the one after
+    int commit(const std::string& fpath, uint64_t& verifier);
+    // taken before a write, which is unstable under it
+    uint64_t verifier() const { return _verifier; }
+
+private:
+    int locate(const std::string& fpath, Location& loc);
+    int openAt(const std::string& fpath, FdCache::Mode mode,
+               FdCache::FilePtr& file);
+    void invalidate(const std::string& fpath);
+    // a change logged is made, or failed with `err`
+    void applied(int err);
+    int checkpoint(const std::string& fpath);
+    int syncDir(int dirfd);
+    int readFile(int fd, off_t offset, size_t size, char* buf,
+                 size_t& total_read);
 };
@@ -0,0 +1,134 @@
+#include "listener.hpp"
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include "StorageServerConnection.h"
+
+LocalListener::LocalListener(const std::string& address, Executor& executor,
+                             FileOp& op)
+    : _executor(executor), _op(op)
+{
+    struct sockaddr_un addr;
+    socklen_t len;
+    _transport = parseAddress(address, addr, len);
+    if (_transport == TRANSPORT_TCP)
+    {
+        throw std::invalid_argument("not a local address: " + address);
+    }
+    _fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_fd < 0)
+    {
+        throw std::system_error(errno, std::system_category());
+    }
+    if (_transport == TRANSPORT_UNIX)
+    {
+        // left behind by an earlier server
+        _path = addr.sun_path;
+        ::unlink(_path.c_str());
+    }
+    if (::bind(_fd, (struct sockaddr*)&addr, len) < 0 ||
+        ::listen(_fd, SOMAXCONN) < 0)
+    {
+        int err = errno;
+        ::close(_fd);
+        throw std::system_error(err, std::system_category());
+    }
+    _acceptor = std::thread(&LocalListener::run, this);
+}
+
+LocalListener::~LocalListener()
+{
+    ::shutdown(_fd, SHUT_RDWR);
+    _acceptor.join();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto& client : _clients)
+        {
+            ::shutdown(client.fd, SHUT_RDWR);
+        }
+    }
+    for (auto& client : _clients)
+    {
+        client.thread.join();
+        ::close(client.fd);
+    }
+    ::close(_fd);
+    if (!_path.empty())
+    {
+        ::unlink(_path.c_str());
+    }
+}
+
+/* shutting down the listening socket fails accept */
+void LocalListener::run()
+{
+    while (true)
+    {
+        int fd = ::accept4(_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            return;
+        }
+        reap();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _clients.push_back(Client{fd, std::thread(), false});
+        Client& client = _clients.back();
+        client.thread = std::thread(&LocalListener::serve, this,
+                                    std::ref(client));
+    }
+}
+
+/* the socket stays open until the client is reaped, so that it can be
+ * hung up on without racing with its close. The shm rings are set up on a
+ * dup of it.
+ */
+void LocalListener::serve(Client& client)
+{
+    try
+    {
+        std::unique_ptr<Channel> channel;
+        if (_transport == TRANSPORT_SHM)
+        {
+            channel = ShmChannel::accept(::dup(client.fd));
+        }
+        else
+        {
+            channel.reset(new SocketChannel(client.fd, false));
+        }
+        StorageServerConnection::serve(*channel, _executor, _op);
+    }
+    catch (std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    client.done = true;
+}
+
+/* join the threads of clients that are gone */
+void LocalListener::reap()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto it = _clients.begin(); it != _clients.end();)
+    {
+        if (it->done)
+        {
+            it->thread.join();
+            ::close(it->fd);
+            it = _clients.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "channel.hpp"
+#include "executor.hpp"
+#include "fileop.hpp"
+
+/* Accepts clients on the same host, at a unix socket ("unix:<path>") or
+ * over shm rings ("shm:<name>"), see parseAddress. Each client is served by
+ * a thread of its own, as by the TCP server.
+ *
+ * Errors in setting up are thrown as system_error.
+ */
+class LocalListener
+{
+    struct Client
+    {
+        int fd;  // the accepted socket, to hang up
+        std::thread thread;
+        bool done;
+    };
+
+    Transport _transport;
+    std::string _path;  // of a unix socket, removed when done
+    int _fd;
+    Executor& _executor;
+    FileOp& _op;
+    std::mutex _mutex;
+    std::list<Client> _clients;
+    std::thread _acceptor;
+
+public:
+    LocalListener(const std::string& address, Executor& executor,
+                  FileOp& op);
+    // stops accepting, hangs up on all clients and waits for them
+    ~LocalListener();
+    LocalListener(const LocalListener&) = delete;
+    LocalListener& operator=(const LocalListener&) = delete;
+
+private:
+    void run();
+    void serve(Client& client);
+    void reap();
+};
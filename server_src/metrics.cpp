@@ -0,0 +1,207 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+// Msg::Type lists each request followed by its response
+static const size_t REQUEST_TYPES = MSG_TYPE_COUNT / 2;
+
+static const char* const request_names[] = {
+    "access", "statfs", "create",   "stat",      "readdir", "read",
+    "write",  "truncate", "unlink", "rmdir",     "mkdir",   "rename",
+    "compound", "negotiate", "copy", "commit", "metrics"};
+static_assert(sizeof(request_names) / sizeof(request_names[0]) ==
+                  REQUEST_TYPES,
+              "a name is needed for each request");
+
+// an increment by the only thread writing to `counter`
+static void bump(std::atomic<uint64_t>& counter, uint64_t n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+Histogram::Histogram()
+{
+    for (auto& count : _counts)
+    {
+        count.store(0, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::record(uint64_t value)
+{
+    bump(_counts[bucketOf(value)], 1);
+}
+
+void Histogram::add(const Histogram& other)
+{
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+        bump(_counts[i], other._counts[i].load(std::memory_order_relaxed));
+    }
+}
+
+uint64_t Histogram::count() const
+{
+    uint64_t total = 0;
+    for (auto& count : _counts)
+    {
+        total += count.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t Histogram::percentile(double percent) const
+{
+    uint64_t total = count();
+    if (total == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(
+        std::min<uint64_t>((uint64_t)(percent / 100 * total + 0.5), total),
+        1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+        seen += _counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+        {
+            return bucketEnd(i);
+        }
+    }
+    // recorded to meanwhile
+    return bucketEnd(BUCKETS - 1);
+}
+
+/* values below 2^SUB_BITS have a bucket each. Above, the bucket is given by
+ * the highest bit set and the SUB_BITS bits below it.
+ */
+size_t Histogram::bucketOf(uint64_t value)
+{
+    value = std::min<uint64_t>(value, (1ull << MAX_BITS) - 1);
+    if (value < (1u << SUB_BITS))
+    {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return ((size_t)(shift + 1) << SUB_BITS) + (value >> shift) -
+           (1u << SUB_BITS);
+}
+
+uint64_t Histogram::bucketEnd(size_t bucket)
+{
+    if (bucket < (1u << SUB_BITS))
+    {
+        return bucket;
+    }
+    int shift = (bucket >> SUB_BITS) - 1;
+    uint64_t top = (bucket & ((1u << SUB_BITS) - 1)) + (1u << SUB_BITS);
+    return ((top + 1) << shift) - 1;
+}
+
+namespace
+{
+struct RequestMetrics
+{
+    Histogram queued;
+    Histogram served;
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+};
+
+struct ThreadMetrics
+{
+    RequestMetrics requests[REQUEST_TYPES];
+};
+
+// those of all threads that ever recorded
+struct Registry
+{
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadMetrics>> threads;
+};
+}  // namespace
+
+static Registry& registry()
+{
+    static Registry registry;
+    return registry;
+}
+
+static ThreadMetrics& threadMetrics()
+{
+    thread_local ThreadMetrics* metrics = nullptr;
+    if (!metrics)
+    {
+        std::unique_ptr<ThreadMetrics> fresh(new ThreadMetrics);
+        metrics = fresh.get();
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        reg.threads.push_back(std::move(fresh));
+    }
+    return *metrics;
+}
+
+static uint64_t elapsedNs(MetricsClock::time_point from,
+                          MetricsClock::time_point to)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from)
+        .count();
+}
+
+void recordRequest(const Message& req, MetricsClock::time_point queued,
+                   MetricsClock::time_point started, size_t bytes_out)
+{
+    MetricsClock::time_point done = MetricsClock::now();
+    RequestMetrics& metrics = threadMetrics().requests[req.index() / 2];
+    metrics.queued.record(elapsedNs(queued, started));
+    metrics.served.record(elapsedNs(started, done));
+    size_t body = std::visit([](auto& msg) { return msg.bodySize(); }, req);
+    bump(metrics.bytes_in, sizeof(MsgHeader) + body);
+    bump(metrics.bytes_out, bytes_out);
+}
+
+static void printPercentiles(std::ostream& os, const Histogram& hist)
+{
+    os << "p50 " << hist.percentile(50) / 1000.0 << " p99 "
+       << hist.percentile(99) / 1000.0 << " p999 "
+       << hist.percentile(99.9) / 1000.0 << " us";
+}
+
+std::string metricsReport()
+{
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(1);
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    for (size_t type = 0; type < REQUEST_TYPES; type++)
+    {
+        // too large for the stack
+        std::unique_ptr<RequestMetrics> sum(new RequestMetrics);
+        for (auto& thread : reg.threads)
+        {
+            const RequestMetrics& metrics = thread->requests[type];
+            sum->queued.add(metrics.queued);
+            sum->served.add(metrics.served);
+            bump(sum->bytes_in, metrics.bytes_in);
+            bump(sum->bytes_out, metrics.bytes_out);
+        }
+        uint64_t count = sum->served.count();
+        if (count == 0)
+        {
+            continue;
+        }
+        os << request_names[type] << ": " << count << " requests, queued ";
+        printPercentiles(os, sum->queued);
+        os << ", served ";
+        printPercentiles(os, sum->served);
+        os << ", " << sum->bytes_in << " bytes in, " << sum->bytes_out
+           << " bytes out\n";
+    }
+    return os.str();
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include "msg.hpp"
+
+/* Counts of values in buckets whose width grows with the value, as in
+ * HdrHistogram: each power of two is split into 2^SUB_BITS buckets, so that
+ * a value is known to within 1/2^SUB_BITS of it. Values from 2^MAX_BITS on
+ * are counted in the last bucket.
+ *
+ * Meant to be recorded to by a single thread, with no atomic
+ * read-modify-write, while other threads read it.
+ */
+class Histogram
+{
+public:
+    static constexpr int SUB_BITS = 5;
+    static constexpr int MAX_BITS = 36;  // of nanoseconds, over a minute
+    static constexpr size_t BUCKETS = (size_t)(MAX_BITS - SUB_BITS + 1)
+                                      << SUB_BITS;
+
+private:
+    std::atomic<uint64_t> _counts[BUCKETS];
+
+public:
+    Histogram();
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    // by the only thread recording
+    void record(uint64_t value);
+    // add the counts of `other`, for one that is not recorded to
+    void add(const Histogram& other);
+
+    uint64_t count() const;
+    /* the value that `percent` of the values are at or below, as the end
+     * of its bucket; 0 if empty
+     */
+    uint64_t percentile(double percent) const;
+
+    static size_t bucketOf(uint64_t value);
+    // the largest value counted in `bucket`
+    static uint64_t bucketEnd(size_t bucket);
+};
+
+using MetricsClock = std::chrono::steady_clock;
+
+/* record a request served: read at `queued`, taken up by a worker at
+ * `started` and done now, having sent `bytes_out` in response.
+ *
+ * Each thread records to histograms of its own, which live until the
+ * process exits, so that recording takes no lock and shares no cache line
+ * with other threads. They are added up when the metrics are read.
+ */
+void recordRequest(const Message& req, MetricsClock::time_point queued,
+                   MetricsClock::time_point started, size_t bytes_out);
+
+/* a line per type of request served so far: the count, percentiles of the
+ * time queued and the time served, in microseconds, and the bytes received
+ * and sent
+ */
+std::string metricsReport();
@@ -1,195 +1,436 @@
 #include "msg_response.hpp"
+#include "crc32c.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include "metrics.hpp"
 
-std::unique_ptr<Msg> respondAccess(const Msg& msg, FileOp& op)
+// advertised in MsgNegotiateResp
+const uint32_t PREFERRED_IO_SIZE = 64 << 10;
+const uint32_t MAX_IO_SIZE = 16 << 20;
+// smaller parts are read and copied, which costs less than a sendfile
+const uint32_t ZERO_COPY_MIN_SIZE = 16 << 10;
+
+static void respond(const MsgAccess& req, MsgAccessResp& resp, FileOp& op)
 {
-    auto ptr = dynamic_cast<const MsgAccess*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgAccess id: " << ptr->id
-              << ", filename: " << ptr->filename << std::endl;
+    std::cout << "MsgAccess id: " << req.id
+              << ", filename: " << req.filename << std::endl;
 #endif
-    auto resp = std::make_unique<MsgAccessResp>();
-    resp->id = ptr->id;
-    resp->error = op.access(ptr->filename, resp->time);
-    return resp;
+    resp.error = op.access(req.filename, resp.change);
 }
 
-std::unique_ptr<Msg> respondCreate(const Msg& msg, FileOp& op)
+static void respond(const MsgCreate& req, MsgCreateResp& resp, FileOp& op)
 {
-    auto ptr = dynamic_cast<const MsgCreate*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgCreate id: " << ptr->id
-              << ", filename: " << ptr->filename << std::endl;
+    std::cout << "MsgCreate id: " << req.id
+              << ", filename: " << req.filename << std::endl;
 #endif
-    auto resp = std::make_unique<MsgCreateResp>();
-    resp->id = ptr->id;
-    resp->error = op.creat(ptr->filename);
-    return resp;
+    resp.error = op.creat(req.filename);
 }
 
-std::unique_ptr<Msg> respondStat(const Msg& msg, FileOp& op)
+static void respond(const MsgStat& req, MsgStatResp& resp, FileOp& op)
 {
-    auto ptr = dynamic_cast<const MsgStat*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgStat id: " << ptr->id << ", filename: " << ptr->filename
+    std::cout << "MsgStat id: " << req.id << ", filename: " << req.filename
               << std::endl;
 #endif
-    struct stat stbuf;
-    auto resp = std::make_unique<MsgStatResp>();
-    resp->id = ptr->id;
-    resp->error = op.stat(ptr->filename, stbuf);
-    resp->stat.size = stbuf.st_size;
-    resp->stat.mode = stbuf.st_mode;
-    resp->stat.time = makeFileTime(stbuf);
-    return resp;
+    struct stat stbuf = {};
+    resp.error = op.stat(req.filename, stbuf);
+    if (resp.error)
+    {
+        // the response may be reused, nothing of an earlier one is sent
+        resp.stat = MsgStatResp::Stat();
+        return;
+    }
+    resp.stat.size = stbuf.st_size;
+    resp.stat.mode = stbuf.st_mode;
+    resp.stat.time = makeFileTime(stbuf);
+    resp.stat.change = op.version(stbuf);
 }
 
-std::unique_ptr<Msg> respondStatfs(const Msg& msg, FileOp& op)
+static void respond(const MsgStatfs& req, MsgStatfsResp& resp, FileOp& op)
 {
-    auto ptr = dynamic_cast<const MsgStatfs*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgStatfs id: " << ptr->id << std::endl;
+    std::cout << "MsgStatfs id: " << req.id << std::endl;
 #endif
-    auto resp = std::make_unique<MsgStatfsResp>();
-    resp->id = ptr->id;
-    resp->error = op.statfs(resp->stat);
-    return resp;
+    resp.error = op.statfs(resp.stat);
 }
 
-std::unique_ptr<Msg> respondReaddir(const Msg& msg, FileOp& op)
+static void respond(const MsgReaddir& req, MsgReaddirResp& resp, FileOp& op)
 {
-    auto ptr = dynamic_cast<const MsgReaddir*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgReaddir id: " << ptr->id
-              << ", dirname: " << ptr->filename << std::endl;
+    std::cout << "MsgReaddir id: " << req.id
+              << ", dirname: " << req.filename << std::endl;
 #endif
-    auto resp = std::make_unique<MsgReaddirResp>();
-    resp->id = ptr->id;
-    resp->error = op.readdir(ptr->filename, resp->dir_names);
-    return resp;
+    resp.dir_names.clear();
+    resp.error = op.readdir(req.filename, resp.dir_names);
 }
 
-std::unique_ptr<Msg> respondRead(const Msg& msg, FileOp& op)
+/* read `size` bytes at `offset` into `resp`, as the last part */
+static void readPart(const MsgRead& req, off_t offset, size_t size,
+                     MsgReadResp& resp, FileOp& op)
+{
+    resp.data.resize(size);
+    size_t read_size = 0;
+    resp.error =
+        op.read(req.filename, offset, size, resp.data.data(), read_size);
+    resp.data.resize(read_size);
+    resp.more = 0;
+    resp.codec = CODEC_NONE;
+    resp.raw_size = read_size;
+    resp.crc = crc32c(resp.data.data(), read_size);
+    resp.checked = 1;
+    thread_local std::vector<char> packed;
+    if (resp.error == 0 &&
+        compressPayload(req.accept, resp.data.data(), read_size, packed))
+    {
+        std::swap(resp.data, packed);
+        resp.codec = req.accept;
+    }
+}
+
+/* send all parts of the read with the payload straight from the file.
+ * Returns false if the file cannot be opened, for the error to be reported
+ * as usual.
+ */
+static bool sendFromFile(const MsgRead& req, size_t part_size,
+                         MsgReadResp& resp, FileOp& op, FrameWriter& out)
+{
+    FdCache::FilePtr file;
+    struct stat st;
+    if (op.open(req.filename, file) != 0 || ::fstat(file->fd, &st) < 0)
+    {
+        return false;
+    }
+    size_t size = std::min<size_t>(
+        req.size, std::max<off_t>(st.st_size - req.offset, 0));
+    file->readahead.onRead(file->fd, req.offset, size);
+    resp.error = 0;
+    resp.codec = CODEC_NONE;
+    resp.crc = 0;
+    resp.checked = 0;
+    resp.data.clear();
+    size_t done = 0;
+    do
+    {
+        size_t part = std::min(part_size, size - done);
+        resp.raw_size = part;
+        resp.more = done + part < size;
+        out.writeMsg(resp, file->fd, req.offset + done, part);
+        done += part;
+    } while (done < size);
+    return true;
+}
+
+/* a read in parts holds one part in memory at a time, so only the part size
+ * is limited. A large read that allows it is sent from the file without
+ * going through memory at all, unless the server reads through the block
+ * cache or io_uring: the blocks a read would cache are what other clients
+ * reading the file share.
+ */
+static bool respond(const MsgRead& req, MsgReadResp& resp, FileOp& op,
+                    FrameWriter* out)
 {
-    auto ptr = dynamic_cast<const MsgRead*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgRead id: " << ptr->id << ", filename" << ptr->filename
-              << ", offset: " << ptr->offset << ", size: " << ptr->size
-              << std::endl;
+    std::cout << "MsgRead id: " << req.id << ", filename" << req.filename
+              << ", offset: " << req.offset << ", size: " << req.size
+              << ", part size: " << req.part_size << std::endl;
 #endif
-    auto resp = std::make_unique<MsgReadResp>();
-    resp->id = ptr->id;
-    resp->data = std::vector<char>(ptr->size);
-    size_t read_size = 0;
-    resp->error = op.read(ptr->filename, ptr->offset, ptr->size,
-                          &resp->data[0], read_size);
-    resp->data.resize(read_size);
-    return resp;
+    size_t part_size = out && req.part_size ? req.part_size : req.size;
+    if (req.size < 0 || req.offset < 0 || part_size > MAX_IO_SIZE)
+    {
+        readPart(req, 0, 0, resp, op);
+        resp.error = EINVAL;
+        return false;
+    }
+    if (out && req.zero_copy && req.accept == CODEC_NONE &&
+        op.readsDirect() &&
+        std::min<size_t>(part_size, req.size) >= ZERO_COPY_MIN_SIZE &&
+        sendFromFile(req, part_size, resp, op, *out))
+    {
+        return true;
+    }
+    size_t size = req.size;
+    size_t done = 0;
+    while (true)
+    {
+        size_t part = std::min(part_size, size - done);
+        readPart(req, req.offset + done, part, resp, op);
+        done += resp.raw_size;
+        if (resp.error || resp.raw_size < part || done == size)
+        {
+            return false;
+        }
+        resp.more = 1;
+        out->writeMsg(resp);
+    }
 }
 
-std::unique_ptr<Msg> respondWrite(const Msg& msg, FileOp& op)
+static void respond(const MsgWrite& req, MsgWriteResp& resp, FileOp& op)
 {
-    auto ptr = dynamic_cast<const MsgWrite*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgWrite id: " << ptr->id << ", filename" << ptr->filename
-              << ", offset: " << ptr->offset << ", size: " << ptr->data.size()
+    std::cout << "MsgWrite id: " << req.id << ", filename" << req.filename
+              << ", offset: " << req.offset << ", size: " << req.data.size()
               << std::endl;
 #endif
-    auto resp = std::make_unique<MsgWriteResp>();
-    resp->id = ptr->id;
-    assert(ptr->data.size() > 0);
-    resp->error =
-        op.write(ptr->filename, ptr->offset, &ptr->data[0], ptr->data.size(),
-                 resp->before_change, resp->after_change);
-    return resp;
+    assert(req.data.size() > 0);
+    if (req.raw_size > MAX_IO_SIZE)
+    {
+        resp.error = EINVAL;
+        return;
+    }
+    const char* data = req.data.data();
+    thread_local std::vector<char> raw;
+    if (req.codec == CODEC_NONE && req.raw_size != req.data.size())
+    {
+        resp.error = EPROTO;
+        return;
+    }
+    if (req.codec != CODEC_NONE)
+    {
+        raw.resize(req.raw_size);
+        resp.error = decompressPayload(req.codec, req.data.data(),
+                                       req.data.size(), raw.data(),
+                                       raw.size());
+        if (resp.error)
+        {
+            return;
+        }
+        data = raw.data();
+    }
+    if (crc32c(data, req.raw_size) != req.crc)
+    {
+        resp.error = EBADMSG;
+        return;
+    }
+    // a write lost along with the verifier it is answered with must not
+    // be taken as committed under the next one
+    resp.verifier = op.verifier();
+    resp.error = op.write(req.filename, req.offset, data, req.raw_size,
+                          resp.before_change, resp.after_change);
 }
 
-std::unique_ptr<Msg> respondTruncate(const Msg& msg, FileOp& op)
+static void respond(const MsgTruncate& req, MsgTruncateResp& resp, FileOp& op)
 {
-    auto ptr = dynamic_cast<const MsgTruncate*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgTruncate id: " << ptr->id
-              << ", filename: " << ptr->filename
-              << ", offset: " << ptr->offset << std::endl;
+    std::cout << "MsgTruncate id: " << req.id
+              << ", filename: " << req.filename
+              << ", offset: " << req.offset << std::endl;
 #endif
-    auto resp = std::make_unique<MsgTruncateResp>();
-
-    resp->id = ptr->id;
-    resp->error = op.truncate(ptr->filename, ptr->offset, resp->before_change,
-                              resp->after_change);
-    return resp;
+    resp.error = op.truncate(req.filename, req.offset, resp.before_change,
+                             resp.after_change);
 }
 
-std::unique_ptr<Msg> respondUnlink(const Msg& msg, FileOp& op)
+static void respond(const MsgUnlink& req, MsgUnlinkResp& resp, FileOp& op)
 {
-    auto ptr = dynamic_cast<const MsgUnlink*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgUnlink id: " << ptr->id
-              << ", filename: " << ptr->filename << std::endl;
+    std::cout << "MsgUnlink id: " << req.id
+              << ", filename: " << req.filename << std::endl;
 #endif
-    auto resp = std::make_unique<MsgUnlinkResp>();
-    resp->id = ptr->id;
-    resp->error = op.unlink(ptr->filename);
-    return resp;
+    resp.error = op.unlink(req.filename);
 }
 
-std::unique_ptr<Msg> respondRmdir(const Msg& msg, FileOp& op)
+static void respond(const MsgRmdir& req, MsgRmdirResp& resp, FileOp& op)
 {
-    auto ptr = dynamic_cast<const MsgRmdir*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgRmdir id: " << ptr->id << ", filename: " << ptr->filename
+    std::cout << "MsgRmdir id: " << req.id << ", filename: " << req.filename
               << std::endl;
 #endif
-    auto resp = std::make_unique<MsgRmdirResp>();
-    resp->id = ptr->id;
-    resp->error = op.rmdir(ptr->filename);
-    return resp;
+    resp.error = op.rmdir(req.filename);
 }
 
-std::unique_ptr<Msg> respondMkdir(const Msg& msg, FileOp& op)
+static void respond(const MsgMkdir& req, MsgMkdirResp& resp, FileOp& op)
 {
-    auto ptr = dynamic_cast<const MsgMkdir*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgMkdir id: " << ptr->id << ", filename: " << ptr->filename
+    std::cout << "MsgMkdir id: " << req.id << ", filename: " << req.filename
               << std::endl;
 #endif
-    auto resp = std::make_unique<MsgMkdirResp>();
-    resp->id = ptr->id;
-    resp->error = op.mkdir(ptr->filename, ptr->mode);
-    return resp;
+    resp.error = op.mkdir(req.filename, req.mode);
+}
+
+static void respond(const MsgRename& req, MsgRenameResp& resp, FileOp& op)
+{
+#ifndef NDEBUG
+    std::cout << "MsgRename id: " << req.id << ", from: " << req.from
+              << ", to: " << req.to << std::endl;
+#endif
+    resp.error = op.rename(req.from, req.to, req.flags);
+}
+
+static void respond(const MsgCopy& req, MsgCopyResp& resp, FileOp& op)
+{
+#ifndef NDEBUG
+    std::cout << "MsgCopy id: " << req.id << ", from: " << req.from
+              << ", to: " << req.to << ", size: " << req.size << std::endl;
+#endif
+    size_t copied = 0;
+    resp.error = op.copy(req.from, req.from_offset, req.to, req.to_offset,
+                         req.size, copied, resp.before_change,
+                         resp.after_change);
+    resp.copied = copied;
+}
+
+static void respond(const MsgNegotiate& req, MsgNegotiateResp& resp,
+                    FileOp& op)
+{
+#ifndef NDEBUG
+    std::cout << "MsgNegotiate id: " << req.id
+              << ", version: " << req.version
+              << ", features: " << req.features
+              << ", codecs: " << req.codecs << std::endl;
+#endif
+    resp.version = std::min(req.version, PROTOCOL_VERSION);
+    if (resp.version < MIN_PROTOCOL_VERSION)
+    {
+        resp.error = EPROTONOSUPPORT;
+        return;
+    }
+    resp.error = 0;
+    resp.features = req.features & SUPPORTED_FEATURES;
+    resp.codecs = req.codecs & SUPPORTED_CODECS;
+    FsStat stat;
+    resp.block_size = op.statfs(stat) == 0 ? stat.bsize : 0;
+    resp.io_size = PREFERRED_IO_SIZE;
+    resp.max_io_size = MAX_IO_SIZE;
+    resp.verifier = op.verifier();
 }
 
-std::unique_ptr<Msg> respondRename(const Msg& msg, FileOp& op)
+static void respond(const MsgCommit& req, MsgCommitResp& resp, FileOp& op)
 {
-    auto ptr = dynamic_cast<const MsgRename*>(&msg);
-    assert(ptr);
 #ifndef NDEBUG
-    std::cout << "MsgRename id: " << ptr->id << ", from: " << ptr->from
-              << ", to: " << ptr->to << std::endl;
+    std::cout << "MsgCommit id: " << req.id
+              << ", filename: " << req.filename << std::endl;
 #endif
-    auto resp = std::make_unique<MsgRenameResp>();
-    resp->id = ptr->id;
-    resp->error = op.rename(ptr->from, ptr->to, ptr->flags);
-    return resp;
+    resp.error = op.commit(req.filename, resp.verifier);
+}
+
+static void respond(const MsgMetrics& req, MsgMetricsResp& resp, FileOp&)
+{
+#ifndef NDEBUG
+    std::cout << "MsgMetrics id: " << req.id << std::endl;
+#endif
+    resp.error = 0;
+    resp.report = metricsReport();
+}
+
+/* the sub-requests are decoded into per-thread messages, which is why
+ * compounds must not nest.
+ */
+static void respond(const MsgCompound& req, MsgCompoundResp& resp,
+                    FileOp& op)
+{
+#ifndef NDEBUG
+    std::cout << "MsgCompound id: " << req.id
+              << ", size: " << req.ops.size() << std::endl;
+#endif
+    thread_local Message sub_req;
+    thread_local Message sub_resp;
+    resp.error = 0;
+    resp.results.clear();
+    size_t pos = 0;
+    while (pos < req.ops.size() && resp.error == 0)
+    {
+        nextMsg(req.ops, pos, sub_req);
+        if (sub_req.index() == Msg::Compound)
+        {
+            resp.error = EINVAL;
+            break;
+        }
+        respondMsg(sub_req, sub_resp, op);
+        appendMsg(sub_resp, resp.results);
+        resp.error = msgError(sub_resp);
+    }
+}
+
+/* responds to a request of type `Req`, with a response of type `Resp`.
+ * `resp` is reused when it already holds a `Resp`. Only reads may be sent
+ * to `out`.
+ */
+template <typename Req, typename Resp>
+static bool respondTo(const Message& req, Message& resp, FileOp& op,
+                      FrameWriter* out)
+{
+    if (resp.index() != Resp::type_id)
+    {
+        resp.emplace<Resp>();
+    }
+    auto& res = std::get<Resp>(resp);
+    const auto& msg = std::get<Req>(req);
+    res.id = msg.id;
+    if constexpr (std::is_same_v<Req, MsgRead>)
+    {
+        return respond(msg, res, op, out);
+    }
+    else
+    {
+        respond(msg, res, op);
+        return false;
+    }
+}
+
+static bool respondUnexpected(const Message& req, Message&, FileOp&,
+                              FrameWriter*)
+{
+    throw std::runtime_error("unexpected message type: " +
+                             std::to_string(req.index()));
+}
+
+/* in Msg::Type, requests are at even positions, each followed by its
+ * response.
+ */
+template <size_t I>
+struct ResponderOf
+{
+    static constexpr Responder select()
+    {
+        if constexpr (I % 2 == 0)
+        {
+            return respondTo<std::variant_alternative_t<I, Message>,
+                             std::variant_alternative_t<I + 1, Message>>;
+        }
+        else
+        {
+            return respondUnexpected;
+        }
+    }
+    static constexpr Responder value = select();
+};
+
+static constexpr auto responders = makeDispatchArray<ResponderOf>();
+
+/* any request costs at least a small block, for the lookups and system
+ * calls it makes. Large ones are counted up to the most a read or write may
+ * move.
+ */
+size_t requestCost(const Message& req)
+{
+    const size_t base = 4096;
+    size_t bytes = 0;
+    if (auto read = std::get_if<MsgRead>(&req))
+    {
+        bytes = std::max<int64_t>(read->size, 0);
+    }
+    else if (auto write = std::get_if<MsgWrite>(&req))
+    {
+        bytes = write->raw_size;
+    }
+    else if (auto copy = std::get_if<MsgCopy>(&req))
+    {
+        bytes = copy->size;
+    }
+    else if (auto compound = std::get_if<MsgCompound>(&req))
+    {
+        bytes = compound->ops.size();
+    }
+    return base + std::min<size_t>(bytes, MAX_IO_SIZE);
+}
+
+bool respondMsg(const Message& req, Message& resp, FileOp& op,
+                FrameWriter* out)
+{
+    return responders[req.index()](req, resp, op, out);
 }
-std::unordered_map<Msg::Type,
-                   std::unique_ptr<Msg> (*)(const Msg& msg, FileOp& op)>
-    responder_map = {
-        {Msg::Access, respondAccess},   {Msg::Create, respondCreate},
-        {Msg::Statfs, respondStatfs},   {Msg::Stat, respondStat},
-        {Msg::Readdir, respondReaddir}, {Msg::Read, respondRead},
-        {Msg::Write, respondWrite},     {Msg::Truncate, respondTruncate},
-        {Msg::Unlink, respondUnlink},   {Msg::Rmdir, respondRmdir},
-        {Msg::Mkdir, respondMkdir},     {Msg::Rename, respondRename}};
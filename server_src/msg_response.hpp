@@ -1,7 +1,19 @@
 #pragma once
-#include <unordered_map>
 #include "fileop.hpp"
+#include "frame.hpp"
 #include "msg.hpp"
-extern std::unordered_map<Msg::Type, std::unique_ptr<Msg> (*)(const Msg& msg,
-                                                              FileOp& op)>
-    responder_map;
+
+/* fills `resp` with the response to the request `req`. A response in parts
+ * (see MsgReadResp) sends all parts but the last to `out`; without it, the
+ * response is in one part. Returns true if the whole response was sent to
+ * `out` already, as is a read sent straight from the file.
+ */
+using Responder = bool (*)(const Message& req, Message& resp, FileOp& op,
+                           FrameWriter* out);
+bool respondMsg(const Message& req, Message& resp, FileOp& op,
+                FrameWriter* out = nullptr);
+
+/* the work of serving `req`, in bytes moved, for the executor to share
+ * workers fairly among clients
+ */
+size_t requestCost(const Message& req);
@@ -0,0 +1,528 @@
+#include "reactor.hpp"
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+#include "channel.hpp"
+#include "compress.hpp"
+#include "frame.hpp"
+#include "metrics.hpp"
+#include "msg_response.hpp"
+
+// max number of requests of one connection being served at the same time
+#define MAX_INFLIGHT 64
+// jobs a connection keeps for later requests once they are done
+#define SPARE_JOBS 4
+// a worker gives up on sending a response after this long
+#define SEND_TIMEOUT_SEC 30
+#define MAX_EVENTS 64
+#define NO_JOB ((size_t)-1)
+
+struct Reactor::Connection
+{
+    struct Job
+    {
+        Message req;
+        Message resp;
+        MetricsClock::time_point queued;  // when read
+    };
+
+    Reactor& reactor;
+    Loop& loop;
+    unsigned long count;
+    int fd;
+    SocketChannel channel;
+    FrameReader reader;
+    FrameWriter writer;
+    Executor::Flow flow;
+
+    std::mutex mutex;
+    // allocated on demand, and freed again beyond SPARE_JOBS
+    std::vector<std::unique_ptr<Job>> jobs;
+    // allocated ones at the back, to be used first
+    std::deque<size_t> free_jobs;
+    size_t spare;
+    // read, and refused by the executor; only used by the loop
+    size_t held;
+    bool paused;  // not read from for want of a free job, or held
+    bool closed;
+    bool reading;  // EPOLLIN is set; only used by the loop
+
+    Connection(Reactor& reactor, Loop& loop, int fd, unsigned long count)
+        : reactor(reactor),
+          loop(loop),
+          count(count),
+          fd(fd),
+          channel(fd),
+          reader(channel, 4096),
+          writer(channel),
+          flow(reactor._executor),
+          jobs(MAX_INFLIGHT),
+          spare(0),
+          held(NO_JOB),
+          paused(false),
+          closed(false),
+          reading(true)
+    {
+        for (size_t i = 0; i < MAX_INFLIGHT; i++)
+        {
+            free_jobs.push_back(i);
+        }
+    }
+
+    ~Connection()
+    {
+        std::lock_guard<std::mutex> lock(reactor._mutex);
+        reactor._alive -= 1;
+        reactor._cv.notify_all();
+    }
+
+    // called with the lock held
+    void release(size_t idx)
+    {
+        if (spare < SPARE_JOBS)
+        {
+            spare += 1;
+            free_jobs.push_back(idx);
+        }
+        else
+        {
+            jobs[idx].reset();
+            free_jobs.push_front(idx);
+        }
+    }
+};
+
+static void throwErrno()
+{
+    throw std::system_error(errno, std::system_category());
+}
+
+/* a socket of its own for each loop, all at the same port. Pinned to a
+ * cpu, it is preferred for clients whose packets arrive at that cpu.
+ */
+static int listenAt(int port, int cpu)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        throwErrno();
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (cpu >= 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (::bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        ::listen(fd, SOMAXCONN) < 0)
+    {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::system_category());
+    }
+    return fd;
+}
+
+// the cpus this process may run on
+static std::vector<int> allowedCpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+/* the listening socket of a loop is tagged null in its set, the eventfd is
+ * tagged with the loop. Given port 0, the first socket gets one from the
+ * kernel, and the others share it.
+ */
+Reactor::Reactor(int port, size_t threads, Executor& executor, FileOp& op,
+                 bool pin)
+    : _executor(executor),
+      _op(op),
+      _stopping(false),
+      _alive(0),
+      _next_count(1)
+{
+    std::vector<int> cpus = allowedCpus();
+    pin = pin && !cpus.empty();
+    try
+    {
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); i++)
+        {
+            std::unique_ptr<Loop> loop(new Loop);
+            loop->cpu = pin ? cpus[i % cpus.size()] : -1;
+            loop->listen_fd = -1;
+            loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            loop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            _loops.push_back(std::move(loop));
+            Loop& added = *_loops.back();
+            if (added.epoll_fd < 0 || added.wake_fd < 0)
+            {
+                throwErrno();
+            }
+            added.listen_fd = listenAt(i == 0 ? port : this->port(), added.cpu);
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = nullptr;
+            if (epoll_ctl(added.epoll_fd, EPOLL_CTL_ADD, added.listen_fd,
+                          &ev) < 0)
+            {
+                throwErrno();
+            }
+            ev.data.ptr = &added;
+            if (epoll_ctl(added.epoll_fd, EPOLL_CTL_ADD, added.wake_fd,
+                          &ev) < 0)
+            {
+                throwErrno();
+            }
+        }
+    }
+    catch (...)
+    {
+        for (auto& loop : _loops)
+        {
+            ::close(loop->listen_fd);
+            ::close(loop->epoll_fd);
+            ::close(loop->wake_fd);
+        }
+        throw;
+    }
+    for (auto& loop : _loops)
+    {
+        loop->thread = std::thread(&Reactor::run, this, std::ref(*loop));
+        if (loop->cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(loop->cpu, &set);
+            pthread_setaffinity_np(loop->thread.native_handle(), sizeof(set),
+                                   &set);
+        }
+    }
+}
+
+/* a worker still serving a request of a client may resume it, unless
+ * stopping, which is checked under the lock of the loop
+ */
+Reactor::~Reactor()
+{
+    _stopping = true;
+    for (auto& loop : _loops)
+    {
+        eventfd_write(loop->wake_fd, 1);
+        loop->thread.join();
+    }
+    for (auto& loop : _loops)
+    {
+        std::lock_guard<std::mutex> lock(loop->mutex);
+        for (auto& item : loop->connections)
+        {
+            item.second->channel.shutdown();
+        }
+        loop->connections.clear();
+        loop->resumed.clear();
+    }
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this] { return _alive == 0; });
+    for (auto& loop : _loops)
+    {
+        ::close(loop->listen_fd);
+        ::close(loop->epoll_fd);
+        ::close(loop->wake_fd);
+    }
+}
+
+int Reactor::port() const
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(_loops[0]->listen_fd, (struct sockaddr*)&addr, &len) < 0)
+    {
+        throwErrno();
+    }
+    return ntohs(addr.sin_port);
+}
+
+/* new clients and resumed ones are looked at after the events of a batch,
+ * so that no event refers to a connection closed and replaced meanwhile
+ */
+void Reactor::run(Loop& loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    while (!_stopping)
+    {
+        int n = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            abort();
+        }
+        bool accepting = false;
+        bool woken = false;
+        for (int i = 0; i < n; i++)
+        {
+            void* ptr = events[i].data.ptr;
+            if (ptr == nullptr)
+            {
+                accepting = true;
+            }
+            else if (ptr == &loop)
+            {
+                woken = true;
+            }
+            else
+            {
+                ConnectionPtr conn = loop.connections.at((Connection*)ptr);
+                if (events[i].events & (EPOLLHUP | EPOLLERR))
+                {
+                    close(loop, conn);
+                }
+                else
+                {
+                    receive(loop, conn);
+                }
+            }
+        }
+        if (woken)
+        {
+            eventfd_t value;
+            eventfd_read(loop.wake_fd, &value);
+            std::vector<ConnectionPtr> resumed;
+            {
+                std::lock_guard<std::mutex> lock(loop.mutex);
+                resumed.swap(loop.resumed);
+            }
+            for (auto& conn : resumed)
+            {
+                if (!conn->closed)
+                {
+                    dispatch(loop, conn);
+                }
+            }
+        }
+        if (accepting)
+        {
+            accept(loop);
+        }
+    }
+}
+
+void Reactor::accept(Loop& loop)
+{
+    while (true)
+    {
+        int fd = ::accept4(loop.listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN)
+            {
+                // e.g. out of fds; the client waits for another try
+                perror("accept");
+            }
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+        struct timeval timeout = {SEND_TIMEOUT_SEC, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _alive += 1;
+        }
+        ConnectionPtr conn =
+            std::make_shared<Connection>(*this, loop, fd, _next_count++);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn.get();
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            continue;
+        }
+        loop.connections[conn.get()] = conn;
+        std::cout << "client " << conn->count << " connected." << std::endl;
+    }
+}
+
+/* the socket is readable, so the single recv does not block */
+void Reactor::receive(Loop& loop, const ConnectionPtr& conn)
+{
+    try
+    {
+        if (!conn->reader.receive())
+        {
+            close(loop, conn);
+            return;
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+        close(loop, conn);
+        return;
+    }
+    dispatch(loop, conn);
+}
+
+/* pass on the requests received whole. Out of jobs, or with a request
+ * refused by the executor, the connection is paused: it is not read from
+ * until a worker resumes it. The refused request is passed on first then.
+ */
+void Reactor::dispatch(Loop& loop, const ConnectionPtr& conn)
+{
+    bool paused = false;
+    try
+    {
+        while (conn->held != NO_JOB || conn->reader.hasFrame())
+        {
+            size_t idx = conn->held;
+            if (idx == NO_JOB)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(conn->mutex);
+                    if (conn->free_jobs.empty())
+                    {
+                        conn->paused = paused = true;
+                        break;
+                    }
+                    idx = conn->free_jobs.back();
+                    conn->free_jobs.pop_back();
+                    if (conn->jobs[idx])
+                    {
+                        conn->spare -= 1;
+                    }
+                    else
+                    {
+                        conn->jobs[idx].reset(new Connection::Job);
+                    }
+                }
+                try
+                {
+                    conn->reader.readMsg(conn->jobs[idx]->req);
+                    conn->jobs[idx]->queued = MetricsClock::now();
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(conn->mutex);
+                    conn->release(idx);
+                    throw;
+                }
+            }
+            size_t cost = requestCost(conn->jobs[idx]->req);
+            std::lock_guard<std::mutex> lock(conn->mutex);
+            if (!_executor.submit(conn->flow, cost,
+                                  [this, conn, idx] { serve(conn, idx); }))
+            {
+                conn->held = idx;
+                conn->paused = paused = true;
+                break;
+            }
+            conn->held = NO_JOB;
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+        close(loop, conn);
+        return;
+    }
+    if (conn->reading == paused)
+    {
+        conn->reading = !paused;
+        struct epoll_event ev;
+        ev.events = paused ? 0 : EPOLLIN;
+        ev.data.ptr = conn.get();
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    }
+}
+
+/* run by a worker */
+void Reactor::serve(const ConnectionPtr& conn, size_t idx)
+{
+    Connection::Job& job = *conn->jobs[idx];
+    MetricsClock::time_point started = MetricsClock::now();
+    uint64_t sent = FrameWriter::sentByThread();
+    try
+    {
+        if (!respondMsg(job.req, job.resp, _op, &conn->writer))
+        {
+            conn->writer.writeMsg(job.resp);
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+        conn->channel.shutdown();
+    }
+    recordRequest(job.req, job.queued, started,
+                  FrameWriter::sentByThread() - sent);
+    bool resume = false;
+    {
+        std::lock_guard<std::mutex> lock(conn->mutex);
+        conn->release(idx);
+        if (conn->paused && !conn->closed)
+        {
+            conn->paused = false;
+            resume = true;
+        }
+    }
+    if (resume)
+    {
+        Loop& loop = conn->loop;
+        std::lock_guard<std::mutex> lock(loop.mutex);
+        if (!_stopping)
+        {
+            loop.resumed.push_back(conn);
+            eventfd_write(loop.wake_fd, 1);
+        }
+    }
+}
+
+/* requests in flight are still answered; the socket is closed when the
+ * last of them is done
+ */
+void Reactor::close(Loop& loop, const ConnectionPtr& conn)
+{
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    {
+        std::lock_guard<std::mutex> lock(conn->mutex);
+        conn->closed = true;
+    }
+    std::cout << "client " << conn->count << " disconnected, "
+              << compressStats() << std::endl;
+    loop.connections.erase(conn.get());
+}
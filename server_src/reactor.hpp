@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "executor.hpp"
+#include "fileop.hpp"
+
+/* Serves TCP clients with a few event loop threads instead of a thread per
+ * client, for servers with many mostly idle clients.
+ *
+ * Each loop has a listening socket of its own, all bound to the same port
+ * with SO_REUSEPORT, so that the kernel spreads new clients over the loops
+ * and accepting is never serialized. A loop keeps the clients it accepts.
+ * Loops may be pinned to cpus, each to one of its own; a client then tends
+ * to be accepted, received from and kept track of on a single cpu.
+ *
+ * When a client's socket is readable, its loop receives what has arrived
+ * and passes each whole request to the executor. The response is sent by
+ * the worker, as from a connection thread, so sockets stay blocking; a send
+ * timeout keeps a client that does not read from holding up a worker for
+ * long.
+ *
+ * A client with MAX_INFLIGHT requests being served, or with one refused by
+ * the executor, is not read from until one of them is done.
+ *
+ * Errors in setting up are thrown as system_error.
+ */
+class Reactor
+{
+    struct Connection;
+    using ConnectionPtr = std::shared_ptr<Connection>;
+
+    struct Loop
+    {
+        int cpu;  // pinned to, or -1
+        int listen_fd;
+        int epoll_fd;
+        int wake_fd;  // an eventfd, to look at `resumed` or stop
+        std::unordered_map<Connection*, ConnectionPtr> connections;
+        std::mutex mutex;
+        std::vector<ConnectionPtr> resumed;
+        std::thread thread;
+    };
+
+    Executor& _executor;
+    FileOp& _op;
+    std::vector<std::unique_ptr<Loop>> _loops;
+    std::atomic<bool> _stopping;
+    // connections alive, which may be referred to by requests being served
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    size_t _alive;
+    std::atomic<unsigned long> _next_count;
+
+public:
+    Reactor(int port, size_t threads, Executor& executor, FileOp& op,
+            bool pin = false);
+    // stops accepting, hangs up on all clients and waits for their requests
+    ~Reactor();
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    // the port listened at, which is chosen by the kernel if given as 0
+    int port() const;
+
+private:
+    void run(Loop& loop);
+    void accept(Loop& loop);
+    void receive(Loop& loop, const ConnectionPtr& conn);
+    void dispatch(Loop& loop, const ConnectionPtr& conn);
+    void serve(const ConnectionPtr& conn, size_t idx);
+    void close(Loop& loop, const ConnectionPtr& conn);
+};
@@ -0,0 +1,137 @@
+#include "readahead.hpp"
+#include <fcntl.h>
+#include <algorithm>
+
+// how far a read may start from where a stream ended and still continue
+// it, as pipelined reads arrive out of order
+static const off_t STREAM_SLACK = 1 << 20;
+// bytes a stream reads before it is read ahead of
+static const size_t STREAM_MIN = 128 << 10;
+// reads in a row that continue no stream, for a file to be random
+static const unsigned RANDOM_READS = 8;
+// a stream reading this much is a scan, and drops what it has read ...
+static const size_t SCAN_MIN = 64 << 20;
+// ... but for this much behind it, a chunk at a time
+static const off_t DROP_BEHIND = 16 << 20;
+static const off_t DROP_CHUNK = 4 << 20;
+// reads since a stream was last continued, for it to be idle
+static const uint64_t STREAM_IDLE = 64;
+
+ReadAhead::ReadAhead() : _clock(0), _misses(0), _advice(Normal), _dropped(0)
+{
+}
+
+/* the system calls, which may block on the disk, are made without holding
+ * the lock
+ */
+void ReadAhead::onRead(int fd, off_t offset, size_t size)
+{
+    off_t end = offset + size;
+    int advise = -1;
+    off_t ahead_from = 0, ahead_size = 0;
+    off_t drop_from = 0, drop_size = 0;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _clock++;
+        Stream* stream = nullptr;
+        for (auto& s : _streams)
+        {
+            if (s.run > 0 && offset >= s.next - STREAM_SLACK &&
+                offset <= s.next + STREAM_SLACK)
+            {
+                stream = &s;
+                break;
+            }
+        }
+        if (!stream)
+        {
+            stream = std::min_element(std::begin(_streams),
+                                      std::end(_streams),
+                                      [](const Stream& a, const Stream& b) {
+                                          return a.used < b.used;
+                                      });
+            *stream = Stream();
+            stream->next = end;
+            stream->window = READAHEAD_MIN;
+            stream->run = std::max<size_t>(size, 1);
+            stream->used = _clock;
+            if (++_misses >= RANDOM_READS && _advice != Random)
+            {
+                _advice = Random;
+                advise = POSIX_FADV_RANDOM;
+            }
+        }
+        else
+        {
+            _misses = 0;
+            stream->next = std::max(stream->next, end);
+            stream->run += size;
+            stream->used = _clock;
+            if (stream->run >= STREAM_MIN)
+            {
+                if (_advice == Random)
+                {
+                    _advice = Normal;
+                    advise = POSIX_FADV_NORMAL;
+                }
+                if (stream->ahead < end + (off_t)stream->window / 2)
+                {
+                    ahead_from = std::max(stream->ahead, end);
+                    ahead_size = stream->window;
+                    stream->ahead = ahead_from + ahead_size;
+                    stream->window =
+                        std::min(stream->window * 2, READAHEAD_MAX);
+                }
+            }
+            bool alone = std::all_of(
+                std::begin(_streams), std::end(_streams),
+                [&](const Stream& s) {
+                    return &s == stream || s.run == 0 ||
+                           s.used + STREAM_IDLE < _clock;
+                });
+            off_t behind = end - DROP_BEHIND;
+            if (stream->run >= SCAN_MIN && alone &&
+                behind >= _dropped + DROP_CHUNK)
+            {
+                drop_from = _dropped;
+                drop_size = behind - _dropped;
+                _dropped = behind;
+            }
+        }
+    }
+    if (advise >= 0)
+    {
+        posix_fadvise(fd, 0, 0, advise);
+    }
+    if (ahead_size > 0)
+    {
+        ::readahead(fd, ahead_from, ahead_size);
+    }
+    if (drop_size > 0)
+    {
+        posix_fadvise(fd, drop_from, drop_size, POSIX_FADV_DONTNEED);
+    }
+}
+
+ReadAhead::Advice ReadAhead::advice()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _advice;
+}
+
+off_t ReadAhead::readAheadTo()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    off_t ahead = 0;
+    for (auto& s : _streams)
+    {
+        ahead = std::max(ahead, s.ahead);
+    }
+    return ahead;
+}
+
+off_t ReadAhead::droppedTo()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _dropped;
+}
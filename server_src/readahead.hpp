@@ -0,0 +1,63 @@
+#pragma once
+#include <sys/types.h>
+#include <cstdint>
+#include <mutex>
+
+// the first and the largest window read ahead of a stream
+const size_t READAHEAD_MIN = 512 << 10;
+const size_t READAHEAD_MAX = 8 << 20;
+
+/* Follows the reads of an open file, by all clients, to tell the kernel
+ * how the file is read.
+ *
+ * A read that starts near where an earlier one ended continues its stream.
+ * Once a stream is long enough, the file is read ahead of it with a window
+ * that doubles up to READAHEAD_MAX. A few streams are followed at once, so
+ * that clients reading the same file at once do not look random.
+ *
+ * A file read mostly at random is advised as such, so that the kernel
+ * stops reading ahead of it. A long scan that is the only stream of its
+ * file drops what it has read from the page cache, so that it does not
+ * push out data that is read again.
+ */
+class ReadAhead
+{
+public:
+    enum Advice
+    {
+        Normal,
+        Random
+    };
+
+private:
+    struct Stream
+    {
+        off_t next = 0;   // where a read continuing it would start
+        off_t ahead = 0;  // the end of what is read ahead
+        size_t window = 0;
+        size_t run = 0;  // bytes read, none if the slot is unused
+        uint64_t used = 0;
+    };
+    static const int STREAMS = 4;
+
+    std::mutex _mutex;
+    Stream _streams[STREAMS];
+    uint64_t _clock;   // counts reads
+    unsigned _misses;  // reads in a row that continued no stream
+    Advice _advice;
+    off_t _dropped;  // the end of what a scan has dropped
+
+public:
+    ReadAhead();
+    ReadAhead(const ReadAhead&) = delete;
+    ReadAhead& operator=(const ReadAhead&) = delete;
+
+    // about to read `size` bytes at `offset` of the file open at `fd`
+    void onRead(int fd, off_t offset, size_t size);
+
+    Advice advice();
+    // the end of what is read ahead by any stream
+    off_t readAheadTo();
+    // the end of what is dropped behind a scan
+    off_t droppedTo();
+};
@@ -0,0 +1,375 @@
+#include "uring.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+
+struct IoRing::Op
+{
+    struct io_uring_sqe sqe;
+    int result;
+    bool done;
+};
+
+static int ioUringSetup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ioUringEnter(int fd, unsigned to_submit, unsigned min_complete,
+                        unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, nullptr, 0);
+}
+
+static void prepRw(struct io_uring_sqe& sqe, uint8_t opcode, int fd,
+                   const char* buf, size_t size, off_t offset)
+{
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)buf;
+    sqe.len = size;
+    sqe.off = offset;
+}
+
+static void prepStat(struct io_uring_sqe& sqe, int dirfd, const char* path,
+                     struct statx* stx)
+{
+    sqe.opcode = IORING_OP_STATX;
+    sqe.fd = dirfd;
+    sqe.addr = (uint64_t)path;
+    sqe.len = STATX_BASIC_STATS;
+    sqe.off = (uint64_t)stx;
+}
+
+static void statFromStatx(const struct statx& stx, struct stat& st)
+{
+    memset(&st, 0, sizeof(st));
+    st.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    st.st_ino = stx.stx_ino;
+    st.st_mode = stx.stx_mode;
+    st.st_nlink = stx.stx_nlink;
+    st.st_uid = stx.stx_uid;
+    st.st_gid = stx.stx_gid;
+    st.st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    st.st_size = stx.stx_size;
+    st.st_blksize = stx.stx_blksize;
+    st.st_blocks = stx.stx_blocks;
+    st.st_atim = {stx.stx_atime.tv_sec, stx.stx_atime.tv_nsec};
+    st.st_mtim = {stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec};
+    st.st_ctim = {stx.stx_ctime.tv_sec, stx.stx_ctime.tv_nsec};
+}
+
+// user_data of the eventfd read; that of others is their Op
+#define WAKE_TAG 0
+
+/* a request takes one entry; there are no more requests in flight than
+ * slots, and one entry is left for the eventfd read, so the queues never
+ * overflow.
+ */
+IoRing::IoRing(unsigned entries)
+    : _sq_ring(MAP_FAILED),
+      _cq_ring(MAP_FAILED),
+      _sqes((struct io_uring_sqe*)MAP_FAILED),
+      _unsubmitted(0),
+      _wake_fd(-1),
+      _wake_pending(false)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    _fd = ioUringSetup(entries, &p);
+    if (_fd < 0)
+    {
+        throw std::system_error(errno, std::system_category());
+    }
+    int err = 0;
+    _sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+    {
+        _sq_ring_size = _cq_ring_size =
+            std::max(_sq_ring_size, _cq_ring_size);
+    }
+    _sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    _sq_ring = mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    _cq_ring = single ? _sq_ring
+                      : mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, _fd,
+                             IORING_OFF_CQ_RING);
+    _sqes = (struct io_uring_sqe*)mmap(nullptr, _sqes_size,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, _fd,
+                                       IORING_OFF_SQES);
+    if (_sq_ring == MAP_FAILED || _cq_ring == MAP_FAILED ||
+        _sqes == MAP_FAILED)
+    {
+        err = errno;
+    }
+    unsigned slots = std::max(p.sq_entries - 1, 1u);
+    if (err == 0)
+    {
+        _wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (_wake_fd < 0)
+        {
+            err = errno;
+        }
+    }
+    if (err)
+    {
+        if (_wake_fd >= 0)
+        {
+            close(_wake_fd);
+        }
+        if (_sqes != MAP_FAILED)
+        {
+            munmap(_sqes, _sqes_size);
+        }
+        if (_cq_ring != MAP_FAILED && !single)
+        {
+            munmap(_cq_ring, _cq_ring_size);
+        }
+        if (_sq_ring != MAP_FAILED)
+        {
+            munmap(_sq_ring, _sq_ring_size);
+        }
+        close(_fd);
+        throw std::system_error(err, std::system_category());
+    }
+    char* sq = (char*)_sq_ring;
+    _sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    _sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    _sq_array = (unsigned*)(sq + p.sq_off.array);
+    char* cq = (char*)_cq_ring;
+    _cq_head = (unsigned*)(cq + p.cq_off.head);
+    _cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    _cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    _cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    for (unsigned i = 0; i < slots; i++)
+    {
+        _free_slots.push_back(i);
+    }
+    queueWake();
+    _reaper = std::thread(&IoRing::reap, this);
+}
+
+/* a nop, which is not used otherwise, tells the reaper to exit */
+IoRing::~IoRing()
+{
+    Op stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sqe.opcode = IORING_OP_NOP;
+    submit(&stop, 1);
+    _reaper.join();
+    munmap(_sqes, _sqes_size);
+    if (_cq_ring != _sq_ring)
+    {
+        munmap(_cq_ring, _cq_ring_size);
+    }
+    munmap(_sq_ring, _sq_ring_size);
+    close(_fd);
+    close(_wake_fd);
+}
+
+unsigned IoRing::acquireSlot()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this] { return !_free_slots.empty(); });
+    unsigned slot = _free_slots.back();
+    _free_slots.pop_back();
+    return slot;
+}
+
+void IoRing::releaseSlot(unsigned slot)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _free_slots.push_back(slot);
+    _cv.notify_all();
+}
+
+/* called with the lock held */
+void IoRing::queue(const struct io_uring_sqe& sqe, uint64_t user_data)
+{
+    unsigned tail = *_sq_tail;
+    unsigned index = tail & *_sq_mask;
+    _sqes[index] = sqe;
+    _sqes[index].user_data = user_data;
+    _sq_array[index] = index;
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    _unsubmitted++;
+}
+
+void IoRing::queueWake()
+{
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = _wake_fd;
+    sqe.addr = (uint64_t)&_wake_count;
+    sqe.len = sizeof(_wake_count);
+    queue(sqe, WAKE_TAG);
+}
+
+/* the requests are queued in one piece. The ring thread is woken once for
+ * everything queued until it gets to submit.
+ */
+void IoRing::submit(Op* ops, size_t count)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (size_t i = 0; i < count; i++)
+    {
+        ops[i].done = false;
+        queue(ops[i].sqe, (uint64_t)&ops[i]);
+    }
+    if (!_wake_pending)
+    {
+        _wake_pending = true;
+        lock.unlock();
+        eventfd_write(_wake_fd, 1);
+        lock.lock();
+    }
+    _cv.wait(lock, [&] {
+        return std::all_of(ops, ops + count,
+                           [](const Op& op) { return op.done; });
+    });
+}
+
+void IoRing::enter(unsigned count)
+{
+    while (count > 0)
+    {
+        int res = ioUringEnter(_fd, count, 0, 0);
+        if (res < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+                sched_yield();
+                continue;
+            }
+            // what is queued would never complete
+            perror("io_uring_enter");
+            abort();
+        }
+        count -= res;
+    }
+}
+
+/* submit what is queued, then wait for completions. A completed eventfd
+ * read means there is more to submit, and is queued again.
+ */
+void IoRing::reap()
+{
+    while (true)
+    {
+        unsigned count;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            count = _unsubmitted;
+            _unsubmitted = 0;
+            _wake_pending = false;
+        }
+        enter(count);
+        if (ioUringEnter(_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR)
+        {
+            // nothing would ever complete again
+            perror("io_uring_enter");
+            abort();
+        }
+        bool stop = false;
+        std::lock_guard<std::mutex> lock(_mutex);
+        unsigned head = *_cq_head;
+        unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const struct io_uring_cqe& cqe = _cqes[head & *_cq_mask];
+            if (cqe.user_data == WAKE_TAG)
+            {
+                queueWake();
+                continue;
+            }
+            Op* op = (Op*)cqe.user_data;
+            op->result = cqe.res;
+            op->done = true;
+            stop |= op->sqe.opcode == IORING_OP_NOP;
+        }
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        _cv.notify_all();
+        if (stop)
+        {
+            return;
+        }
+    }
+}
+
+int IoRing::read(int fd, off_t offset, char* buf, size_t size,
+                 size_t& done)
+{
+    done = 0;
+    unsigned slot = acquireSlot();
+    int err = 0;
+    // a read may come back short before the end, as pread may
+    while (done < size)
+    {
+        Op op;
+        memset(&op, 0, sizeof(op));
+        prepRw(op.sqe, IORING_OP_READ, fd, buf + done, size - done,
+               offset + done);
+        submit(&op, 1);
+        if (op.result <= 0)
+        {
+            err = -op.result;
+            break;
+        }
+        done += op.result;
+    }
+    releaseSlot(slot);
+    return err;
+}
+
+int IoRing::write(int fd, off_t offset, const char* buf, size_t size)
+{
+    unsigned slot = acquireSlot();
+    Op op;
+    memset(&op, 0, sizeof(op));
+    prepRw(op.sqe, IORING_OP_WRITE, fd, buf, size, offset);
+    submit(&op, 1);
+    releaseSlot(slot);
+    if (op.result < 0)
+    {
+        return -op.result;
+    }
+    if ((size_t)op.result < size)
+    {
+        return EDQUOT;
+    }
+    return 0;
+}
+
+int IoRing::stat(int dirfd, const char* name, struct stat& stbuf)
+{
+    struct statx stx;
+    unsigned slot = acquireSlot();
+    Op op;
+    memset(&op, 0, sizeof(op));
+    prepStat(op.sqe, dirfd, name, &stx);
+    submit(&op, 1);
+    releaseSlot(slot);
+    if (op.result < 0)
+    {
+        return -op.result;
+    }
+    statFromStatx(stx, stbuf);
+    return 0;
+}
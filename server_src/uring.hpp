@@ -0,0 +1,75 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* An io_uring shared by all connections, driven with raw system calls.
+ *
+ * Operations are on files that FileOp keeps open, or on names in
+ * directories it keeps open, so each is a single request.
+ *
+ * Callers block until their request completes. Requests are submitted, in
+ * batches, and reaped by a thread of the ring, which a caller wakes through
+ * an eventfd read kept queued in the ring. The kernel cancels the work a
+ * thread queued once the thread exits, so short-lived callers do not
+ * submit themselves.
+ *
+ * Like FileOp, operations return errno or 0. Setting up throws
+ * system_error, e.g. if the kernel does not support io_uring. The requests
+ * used here need Linux 5.6.
+ */
+class IoRing
+{
+    struct Op;
+
+    int _fd;
+    void* _sq_ring;
+    size_t _sq_ring_size;
+    void* _cq_ring;
+    size_t _cq_ring_size;
+    struct io_uring_sqe* _sqes;
+    size_t _sqes_size;
+    unsigned* _sq_tail;
+    unsigned* _sq_mask;
+    unsigned* _sq_array;
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    unsigned* _cq_mask;
+    struct io_uring_cqe* _cqes;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;  // a slot is free, or an op is done
+    std::vector<unsigned> _free_slots;
+    unsigned _unsubmitted;
+    int _wake_fd;          // an eventfd
+    uint64_t _wake_count;  // read from it by the ring
+    bool _wake_pending;    // the eventfd is written to, or about to be
+    std::thread _reaper;
+
+public:
+    IoRing(unsigned entries = 256);
+    ~IoRing();
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    // read up to `size` bytes at `offset`; a file is read to its end
+    int read(int fd, off_t offset, char* buf, size_t size, size_t& done);
+    // write all of `buf` at `offset`
+    int write(int fd, off_t offset, const char* buf, size_t size);
+    // of `name` in the directory `dirfd`
+    int stat(int dirfd, const char* name, struct stat& stbuf);
+
+private:
+    unsigned acquireSlot();
+    void releaseSlot(unsigned slot);
+    void queue(const struct io_uring_sqe& sqe, uint64_t user_data);
+    void queueWake();
+    void submit(Op* ops, size_t count);
+    void enter(unsigned count);
+    void reap();
+};
@@ -0,0 +1,449 @@
+#include "writelog.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <system_error>
+#include "crc32c.hpp"
+
+enum : uint32_t
+{
+    LOG_WRITE = 1,
+    LOG_TRUNCATE,
+    LOG_CREATE
+};
+
+static const uint32_t LOG_MAGIC = 0x4c534e4e;  // "NNSL"
+// records follow the header, a block of its own
+static const off_t LOG_HEADER_SIZE = 4096;
+
+#pragma pack(push, 1)
+struct LogHeader
+{
+    uint32_t magic;
+    uint32_t unused;
+    uint64_t generation;
+};
+
+struct LogRecord
+{
+    uint32_t crc;  // of the rest of the record, the name and the data
+    uint32_t type;
+    uint64_t generation;  // that of the log when the record was written
+    uint64_t offset;  // the size, for a truncate
+    uint32_t name_size;
+    uint32_t data_size;
+};
+#pragma pack(pop)
+
+WriteLog::WriteLog(const std::string& path, const std::string& root,
+                   size_t checkpoint_size)
+    : _root_fd(-1),
+      _fd(-1),
+      _checkpoint_size(checkpoint_size),
+      _generation(0),
+      _appended(0),
+      _synced(0),
+      _syncing(false),
+      _checkpointing(false),
+      _applying(0),
+      _size(0),
+      _syncs(0),
+      _error(0)
+{
+    _root_fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (_root_fd < 0)
+    {
+        throw std::system_error(errno, std::system_category());
+    }
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    int err = _fd < 0 ? errno : readHeader();
+    if (err)
+    {
+        if (_fd >= 0)
+        {
+            ::close(_fd);
+        }
+        ::close(_root_fd);
+        throw std::system_error(err, std::system_category());
+    }
+}
+
+WriteLog::~WriteLog()
+{
+    ::close(_fd);
+    ::close(_root_fd);
+}
+
+static int readAll(int fd, off_t offset, char* buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = ::pread(fd, buf + done, size - done, offset + done);
+        if (n < 0)
+        {
+            return errno;
+        }
+        if (n == 0)
+        {
+            return EIO;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int writeAll(int fd, off_t offset, const char* buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = ::pwrite(fd, buf + done, size - done, offset + done);
+        if (n < 0)
+        {
+            return errno;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* a new log is given its first generation */
+int WriteLog::readHeader()
+{
+    LogHeader header;
+    struct stat st;
+    if (::fstat(_fd, &st) < 0)
+    {
+        return errno;
+    }
+    if (st.st_size == 0)
+    {
+        return writeHeader(1);
+    }
+    int err = readAll(_fd, 0, (char*)&header, sizeof(header));
+    if (err)
+    {
+        return err;
+    }
+    if (header.magic != LOG_MAGIC)
+    {
+        return EINVAL;
+    }
+    _generation = header.generation;
+    return 0;
+}
+
+int WriteLog::writeHeader(uint64_t generation)
+{
+    std::vector<char> block(LOG_HEADER_SIZE);
+    LogHeader header{LOG_MAGIC, 0, generation};
+    memcpy(block.data(), &header, sizeof(header));
+    int err = writeAll(_fd, 0, block.data(), block.size());
+    if (err == 0 && ::fdatasync(_fd) < 0)
+    {
+        err = errno;
+    }
+    if (err == 0)
+    {
+        _generation = generation;
+    }
+    return err;
+}
+
+/* a record that cannot be read whole, or does not match its checksum, is
+ * the one being written at the crash, and ends the log. So does one of an
+ * earlier generation, left from before the last checkpoint.
+ */
+int WriteLog::replay(size_t& records)
+{
+    records = 0;
+    struct stat st;
+    if (::fstat(_fd, &st) < 0)
+    {
+        return errno;
+    }
+    size_t end = st.st_size;
+    std::vector<char> body;
+    size_t pos = LOG_HEADER_SIZE;
+    LogRecord rec;
+    while (pos + sizeof(rec) <= end &&
+           readAll(_fd, pos, (char*)&rec, sizeof(rec)) == 0 &&
+           rec.generation == _generation)
+    {
+        size_t body_size = (size_t)rec.name_size + rec.data_size;
+        if (pos + sizeof(rec) + body_size > end)
+        {
+            break;
+        }
+        body.resize(body_size);
+        if (readAll(_fd, pos + sizeof(rec), body.data(), body_size) != 0)
+        {
+            break;
+        }
+        uint32_t crc = crc32c((const char*)&rec.type,
+                              sizeof(rec) - sizeof(rec.crc));
+        if (crc32cExtend(crc, body.data(), body_size) != rec.crc)
+        {
+            break;
+        }
+        std::string fpath(body.data(), rec.name_size);
+        int err = apply(rec.type, fpath, rec.offset,
+                        body.data() + rec.name_size, rec.data_size);
+        if (err)
+        {
+            return err;
+        }
+        records++;
+        pos += sizeof(rec) + body_size;
+    }
+    return empty();
+}
+
+/* the file may have been removed since, along with what was logged of it
+ */
+int WriteLog::apply(uint32_t type, const std::string& fpath, off_t offset,
+                    const char* data, size_t size)
+{
+    int flags = O_WRONLY | O_CLOEXEC;
+    if (type == LOG_CREATE)
+    {
+        flags |= O_CREAT | O_TRUNC;
+    }
+    int fd = ::openat(_root_fd, ("." + fpath).c_str(), flags, 00777);
+    if (fd < 0)
+    {
+        return errno == ENOENT || errno == ENOTDIR ? 0 : errno;
+    }
+    int err = 0;
+    if (type == LOG_WRITE)
+    {
+        for (size_t done = 0; done < size && err == 0;)
+        {
+            ssize_t n = ::pwrite(fd, data + done, size - done, offset + done);
+            if (n <= 0)
+            {
+                err = n < 0 ? errno : EIO;
+            }
+            else
+            {
+                done += n;
+            }
+        }
+    }
+    else if (type == LOG_TRUNCATE && ::ftruncate(fd, offset) < 0)
+    {
+        err = errno;
+    }
+    ::close(fd);
+    return err;
+}
+
+int WriteLog::logWrite(const std::string& fpath, off_t offset,
+                       const char* buf, size_t size)
+{
+    return append(LOG_WRITE, fpath, offset, buf, size);
+}
+
+int WriteLog::logTruncate(const std::string& fpath, off_t size)
+{
+    return append(LOG_TRUNCATE, fpath, size, nullptr, 0);
+}
+
+int WriteLog::logCreate(const std::string& fpath)
+{
+    return append(LOG_CREATE, fpath, 0, nullptr, 0);
+}
+
+// write all of `iov`, which is left pointing past what is written
+static int writeAll(int fd, off_t offset, std::vector<struct iovec>& iov)
+{
+    size_t i = 0;
+    while (i < iov.size())
+    {
+        int count = std::min<size_t>(iov.size() - i, IOV_MAX);
+        ssize_t n = ::pwritev(fd, &iov[i], count, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return errno;
+        }
+        offset += n;
+        for (; i < iov.size() && (size_t)n >= iov[i].iov_len; i++)
+        {
+            n -= iov[i].iov_len;
+        }
+        if (n > 0)
+        {
+            iov[i].iov_base = (char*)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* the record stays in the buffers of the caller, which waits until it is
+ * synced, by itself or by another thread
+ */
+int WriteLog::append(uint32_t type, const std::string& fpath, off_t offset,
+                     const char* data, size_t size)
+{
+    LogRecord rec;
+    rec.type = type;
+    rec.offset = offset;
+    rec.name_size = fpath.size();
+    rec.data_size = size;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this]() { return !_checkpointing; });
+    if (_error)
+    {
+        return _error;
+    }
+    rec.generation = _generation;
+    rec.crc = crc32c((const char*)&rec.type, sizeof(rec) - sizeof(rec.crc));
+    rec.crc = crc32cExtend(rec.crc, fpath.data(), fpath.size());
+    rec.crc = crc32cExtend(rec.crc, data, size);
+    _pending.push_back({&rec, sizeof(rec)});
+    _pending.push_back({(void*)fpath.data(), fpath.size()});
+    if (size > 0)
+    {
+        _pending.push_back({(void*)data, size});
+    }
+    _paths.insert(fpath);
+    uint64_t seq = ++_appended;
+    _applying++;
+    while (_synced < seq && !_error)
+    {
+        if (_syncing)
+        {
+            _cv.wait(lock);
+            continue;
+        }
+        _syncing = true;
+        std::swap(_batch, _pending);
+        uint64_t upto = _appended;
+        size_t bytes = 0;
+        for (auto& v : _batch)
+        {
+            bytes += v.iov_len;
+        }
+        off_t at = LOG_HEADER_SIZE + _size;
+        lock.unlock();
+        int err = writeAll(_fd, at, _batch);
+        if (err == 0 && ::fdatasync(_fd) < 0)
+        {
+            err = errno;
+        }
+        lock.lock();
+        _batch.clear();
+        _syncing = false;
+        _syncs++;
+        if (err)
+        {
+            // the waiting records are not written either
+            _error = err;
+            _pending.clear();
+        }
+        else
+        {
+            _synced = upto;
+            _size += bytes;
+        }
+        _cv.notify_all();
+    }
+    if (_synced < seq)
+    {
+        _applying--;
+        _cv.notify_all();
+        return _error;
+    }
+    return 0;
+}
+
+/* the change that fills the log makes the checkpoint */
+void WriteLog::applied()
+{
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _applying--;
+        full = _size >= _checkpoint_size && !_checkpointing;
+        _cv.notify_all();
+    }
+    if (full)
+    {
+        checkpoint();
+    }
+}
+
+/* a checkpoint that fails leaves the log as it is, to be replayed */
+int WriteLog::checkpoint()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this]() { return !_checkpointing; });
+    if (_size == 0 && _appended == _synced)
+    {
+        return 0;
+    }
+    _checkpointing = true;
+    _cv.wait(lock, [this]() { return _applying == 0; });
+    lock.unlock();
+    int err = empty();
+    lock.lock();
+    _checkpointing = false;
+    _cv.notify_all();
+    return err;
+}
+
+/* the log is emptied once the files are synced, by starting a generation,
+ * so that a later crash does not replay what it held. It is written over
+ * rather than truncated, as syncing a file that grows costs more.
+ */
+int WriteLog::empty()
+{
+    if (::syncfs(_root_fd) < 0)
+    {
+        return errno;
+    }
+    int err = writeHeader(_generation + 1);
+    if (err)
+    {
+        return err;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _size = 0;
+    _paths.clear();
+    return 0;
+}
+
+bool WriteLog::holds(const std::string& fpath)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_paths.count(fpath))
+    {
+        return true;
+    }
+    std::string dir = fpath + "/";
+    auto it = _paths.lower_bound(dir);
+    return it != _paths.end() && it->compare(0, dir.size(), dir) == 0;
+}
+
+size_t WriteLog::size()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _size;
+}
+
+uint64_t WriteLog::countSyncs()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _syncs;
+}
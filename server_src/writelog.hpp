@@ -0,0 +1,102 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// bytes the log grows to before the files are flushed and it is emptied
+const size_t LOG_CHECKPOINT_SIZE = 64 << 20;
+
+/* A write-ahead log, which makes changes durable before they are
+ * acknowledged without syncing the files they change.
+ *
+ * A change is appended to the log and synced before it is applied to its
+ * file, which only reaches the page cache. Changes logged at once by
+ * different threads are synced together by one fdatasync: the first of
+ * them to find the log idle writes out all that is pending, while the
+ * others wait for it (group commit).
+ *
+ * Once the log has grown past `checkpoint_size`, the file system holding
+ * `root` is synced and the log emptied, by moving it on to a new
+ * generation; records of older ones are written over. A checkpoint waits
+ * for the changes logged but not yet applied, and holds back new ones.
+ *
+ * After a crash, replay applies what is in the log to the files again. A
+ * record cut short by the crash ends the log. Paths are relative to
+ * `root`, as those of FileOp.
+ *
+ * Once the log fails to be written, all later changes fail, as it can no
+ * longer be appended to.
+ */
+class WriteLog
+{
+    int _root_fd;
+    int _fd;
+    size_t _checkpoint_size;
+    uint64_t _generation;  // of the records, new at each checkpoint
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    // records to be written by the next sync, in the buffers of their
+    // threads, which wait for it
+    std::vector<struct iovec> _pending;
+    std::vector<struct iovec> _batch;
+    uint64_t _appended;  // records appended so far
+    uint64_t _synced;    // ... and synced
+    bool _syncing;
+    bool _checkpointing;
+    size_t _applying;  // changes logged and not applied yet
+    size_t _size;      // bytes of records in the log
+    std::set<std::string> _paths;  // of the records in the log
+    uint64_t _syncs;
+    int _error;
+
+public:
+    // throws std::system_error if the log cannot be opened
+    WriteLog(const std::string& path, const std::string& root,
+             size_t checkpoint_size = LOG_CHECKPOINT_SIZE);
+    ~WriteLog();
+    WriteLog(const WriteLog&) = delete;
+    WriteLog& operator=(const WriteLog&) = delete;
+
+    /* apply the changes left in the log to the files, then empty it. For
+     * when the server starts, before any change is logged.
+     */
+    int replay(size_t& records);
+
+    /* log a change, which is durable once it returns 0. The change must
+     * then be applied and applied() called, whether it succeeds or not.
+     */
+    int logWrite(const std::string& fpath, off_t offset, const char* buf,
+                 size_t size);
+    int logTruncate(const std::string& fpath, off_t size);
+    // creates the file, or empties it
+    int logCreate(const std::string& fpath);
+    void applied();
+
+    /* sync the files and empty the log. Changes that are not logged, as
+     * renames, are made after one if the log holds records of the paths
+     * they change, so that the log never refers to a path by a name it had
+     * before. It costs a sync of the whole file system.
+     */
+    int checkpoint();
+    // whether the log holds records of `fpath`, or of paths under it
+    bool holds(const std::string& fpath);
+
+    size_t size();
+    // the fdatasync calls made on the log
+    uint64_t countSyncs();
+
+private:
+    int append(uint32_t type, const std::string& fpath, off_t offset,
+               const char* data, size_t size);
+    int apply(uint32_t type, const std::string& fpath, off_t offset,
+              const char* data, size_t size);
+    int empty();
+    int readHeader();
+    int writeHeader(uint64_t generation);
+};
@@ -0,0 +1,181 @@
+#include "blockcache.hpp"
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fileop.hpp"
+
+static std::string tmpRoot()
+{
+    char root[] = "/tmp/netfs-blockcache-XXXXXX";
+    EXPECT_TRUE(mkdtemp(root));
+    return root;
+}
+
+// fetches from `content`, counting fetches
+struct FakeFile
+{
+    std::string content;
+    std::atomic<int> fetches{0};
+
+    BlockCache::FetchFunc fetch()
+    {
+        return [this](off_t offset, size_t size, char* buf, size_t& done) {
+            fetches++;
+            done = 0;
+            if ((size_t)offset < content.size())
+            {
+                done = std::min(size, content.size() - offset);
+                content.copy(buf, done, offset);
+            }
+            return 0;
+        };
+    }
+};
+
+static std::string readString(BlockCache& cache, FakeFile& file,
+                              off_t offset, size_t size)
+{
+    std::vector<char> buf(size);
+    size_t done = 0;
+    EXPECT_EQ(cache.read("/f", offset, size, buf.data(), done, file.fetch()),
+              0);
+    return std::string(buf.data(), done);
+}
+
+TEST(blockcache, read)
+{
+    BlockCache cache(4 * 16, 16);
+    FakeFile file;
+    file.content = "0123456789abcdefghijklmnopqrstuvwxyz";
+    ASSERT_EQ(readString(cache, file, 10, 20), file.content.substr(10, 20));
+    ASSERT_EQ(file.fetches, 2);
+    ASSERT_EQ(readString(cache, file, 0, 32), file.content.substr(0, 32));
+    ASSERT_EQ(file.fetches, 2);
+    // the partial last block, and beyond it
+    ASSERT_EQ(readString(cache, file, 30, 100), file.content.substr(30));
+    ASSERT_EQ(file.fetches, 3);
+    ASSERT_EQ(readString(cache, file, 30, 100), file.content.substr(30));
+    ASSERT_EQ(readString(cache, file, 40, 10), "");
+    ASSERT_EQ(file.fetches, 3);
+    ASSERT_EQ(cache.countBlocks(), 3);
+
+    BlockCache::FetchFunc fail = [](off_t, size_t, char*, size_t&) {
+        return EIO;
+    };
+    char buf[16];
+    size_t done;
+    ASSERT_EQ(cache.read("/g", 0, 16, buf, done, fail), EIO);
+}
+
+TEST(blockcache, budget)
+{
+    BlockCache cache(3 * 16, 16);
+    FakeFile file;
+    file.content = std::string(16 * 10, 'x');
+    for (int i = 0; i < 10; i++)
+    {
+        readString(cache, file, i * 16, 16);
+    }
+    ASSERT_LE(cache.countBlocks(), 3);
+    ASSERT_EQ(file.fetches, 10);
+
+    // less than a block caches nothing
+    BlockCache none(10, 16);
+    readString(none, file, 0, 16);
+    readString(none, file, 0, 16);
+    ASSERT_EQ(file.fetches, 12);
+    ASSERT_EQ(none.countBlocks(), 0);
+}
+
+TEST(blockcache, invalidate)
+{
+    BlockCache cache(16 * 16, 16);
+    FakeFile file;
+    file.content = std::string(40, 'a');
+    readString(cache, file, 0, 100);
+    ASSERT_EQ(cache.countBlocks(), 3);
+    // the blocks written to, and the partial last block
+    file.content[17] = 'b';
+    cache.invalidate("/f", 17, 1);
+    ASSERT_EQ(cache.countBlocks(), 1);
+    ASSERT_EQ(readString(cache, file, 0, 100), file.content);
+
+    file.content += "cc";
+    cache.invalidate("/f", 40, 2);
+    ASSERT_EQ(readString(cache, file, 0, 100), file.content);
+    ASSERT_EQ(cache.countBlocks(), 3);
+
+    cache.invalidate("/f");
+    ASSERT_EQ(cache.countBlocks(), 0);
+}
+
+/* many readers of the same file, as many clients loading it at once */
+TEST(blockcache, fan_out)
+{
+    BlockCache cache(64 * 16, 16);
+    FakeFile file;
+    for (int i = 0; i < 64 * 16; i++)
+    {
+        file.content.push_back('a' + i % 26);
+    }
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 8; t++)
+    {
+        readers.emplace_back([&] {
+            for (int round = 0; round < 10; round++)
+            {
+                ASSERT_EQ(readString(cache, file, 0, file.content.size()),
+                          file.content);
+            }
+        });
+    }
+    for (auto& reader : readers)
+    {
+        reader.join();
+    }
+    // each block is fetched once, or a few times by readers meeting
+    ASSERT_LE(file.fetches, 64 * 8);
+    int fetches = file.fetches;
+    ASSERT_EQ(readString(cache, file, 0, file.content.size()), file.content);
+    ASSERT_EQ(file.fetches, fetches);
+}
+
+/* reads through a FileOp see all changes made through it */
+TEST(blockcache, file_op)
+{
+    std::string root = tmpRoot();
+    BlockCache cache(1 << 20);
+    FileOp op(root, nullptr, MAX_OPEN_FILES, &cache);
+    uint64_t before, after;
+    char buf[16];
+    size_t done;
+    ASSERT_EQ(op.creat("/a"), 0);
+    ASSERT_EQ(op.write("/a", 0, "aaaa", 4, before, after), 0);
+    ASSERT_EQ(op.read("/a", 0, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), "aaaa");
+    ASSERT_EQ(op.write("/a", 2, "bbbb", 4, before, after), 0);
+    ASSERT_EQ(op.read("/a", 0, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), "aabbbb");
+    ASSERT_EQ(op.truncate("/a", 3, before, after), 0);
+    ASSERT_EQ(op.read("/a", 0, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), "aab");
+
+    ASSERT_EQ(op.creat("/b"), 0);
+    ASSERT_EQ(op.read("/b", 0, 16, buf, done), 0);
+    ASSERT_EQ(op.copy("/a", 0, "/b", 0, 3, done, before, after), 0);
+    ASSERT_EQ(op.read("/b", 0, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), "aab");
+    ASSERT_EQ(op.rename("/a", "/b", 0), 0);
+    ASSERT_EQ(op.write("/b", 0, "c", 1, before, after), 0);
+    ASSERT_EQ(op.read("/b", 0, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), "cab");
+    ASSERT_EQ(op.creat("/b"), 0);
+    ASSERT_EQ(op.read("/b", 0, 16, buf, done), 0);
+    ASSERT_EQ(done, 0);
+    ASSERT_EQ(op.unlink("/b"), 0);
+    ASSERT_EQ(op.read("/b", 0, 16, buf, done), ENOENT);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
@@ -36,28 +36,35 @@ static std::vector<char> readAll(const std::string& fname)
     return buf;
 }
 
-static void beforeChange(const std::string& fname, FileTime& time,
+// the change time stands in for the version kept by the server
+static uint64_t version(const struct stat& stbuf)
+{
+    return (uint64_t)stbuf.st_ctim.tv_sec * 1000000000 +
+           stbuf.st_ctim.tv_nsec;
+}
+
+static void beforeChange(const std::string& fname, uint64_t& change,
                          bool& stale)
 {
     struct stat stbuf;
     int err = stat(fname.c_str(), &stbuf);
     assert(err == 0);
-    if (time != makeFileTime(stbuf))
+    if (change != version(stbuf))
     {
         stale = true;
     }
 }
 
-static void afterChange(const std::string& fname, FileTime& time)
+static void afterChange(const std::string& fname, uint64_t& change)
 {
     struct stat stbuf;
     int err = stat(fname.c_str(), &stbuf);
     assert(err == 0);
-    time = makeFileTime(stbuf);
+    change = version(stbuf);
 }
 
 static int writeContent(const std::string& fname, size_t offset,
-                        const char* data, size_t size, FileTime& time,
+                        const char* data, size_t size, uint64_t& change,
                         bool& stale)
 {
     std::cout << "write to " << fname << " at " << offset
@@ -65,14 +72,14 @@ static int writeContent(const std::string& fname, size_t offset,
     std::string str(data, size);
     std::cout << ". content: " << str << std::endl;
     auto fpath = tmpFilename(fname);
-    beforeChange(fpath, time, stale);
+    beforeChange(fpath, change, stale);
     FILE* fp = fopen(fpath.c_str(), "r+");
     int err = fseek(fp, offset, SEEK_SET);
     assert(err == 0);
     err = fwrite(data, 1, size, fp);
     assert(err == (int)size);
     fclose(fp);
-    afterChange(fpath, time);
+    afterChange(fpath, change);
     return 0;
 }
 
@@ -81,35 +88,42 @@ static int writeAttr(const std::string& fname, FileAttr& attr, bool& stale)
     std::cout << "truncating file: " << fname << " to size: " << attr.size
               << std::endl;
     auto fpath = tmpFilename(fname);
-    beforeChange(fpath, attr.time, stale);
+    beforeChange(fpath, attr.change, stale);
     int res = truncate(fpath.c_str(), attr.size);
     if (res < 0)
     {
         perror("truncate");
     }
     assert(res == 0);
-    afterChange(fpath, attr.time);
+    afterChange(fpath, attr.change);
     return 0;
 }
 
-static int readContent(const std::string& fname, size_t offset, char* data,
-                       size_t size, size_t& read_size)
+/* the content is passed on in small pieces, which do not line up with the
+ * blocks
+ */
+static int readContent(const std::string& fname, size_t offset, size_t size,
+                       const Cache::ContentSink& sink)
 {
     auto fpath = tmpFilename(fname);
     FILE* fp = fopen(fpath.c_str(), "r");
     int err = fseek(fp, offset, SEEK_SET);
     assert(err == 0);
-    read_size = fread(data, sizeof(*data), size, fp);
-    assert(read_size >= 0);
+    std::vector<char> data(size);
+    size_t read_size = fread(&data[0], sizeof(char), size, fp);
     if (read_size < size)
     {
         assert(feof(fp));
     }
     fclose(fp);
     std::cout << "reading from " + fname + " at " << offset
-              << " of size: " << read_size
-              << ". content: " << std::string(data, data + read_size)
+              << " of size: " << read_size << ". content: "
+              << std::string(data.begin(), data.begin() + read_size)
               << std::endl;
+    for (size_t off = 0; off < read_size; off += 5)
+    {
+        sink(&data[off], std::min<size_t>(5, read_size - off));
+    }
     return 0;
 }
 
@@ -125,6 +139,23 @@ static int readAttr(const std::string& fname, FileAttr& attr)
     attr.mode = stbuf.st_mode;
     attr.size = stbuf.st_size;
     attr.time = makeFileTime(stbuf);
+    attr.change = version(stbuf);
+    return 0;
+}
+
+static int commit_count = 0;
+// commits to come that tell of lost writes
+static int lost_commits = 0;
+
+static int commitFile(const std::vector<std::string>& fnames, bool& lost)
+{
+    for (const auto& fname : fnames)
+    {
+        std::cout << "committing file: " << fname << std::endl;
+    }
+    commit_count++;
+    lost = lost_commits > 0;
+    lost_commits -= lost;
     return 0;
 }
 
@@ -137,7 +168,8 @@ static void createFile(const std::string& fname)
 
 TEST(cache, read_hit_1)
 {
-    Cache cache(1 << 4, writeContent, writeAttr, readContent, readAttr);
+    Cache cache(1 << 4, writeContent, writeAttr, readContent, readAttr,
+                commitFile);
     std::vector<char> data;
     for (int i = 40; i < 120; i++)
     {
@@ -173,7 +205,8 @@ TEST(cache, read_hit_1)
 
 TEST(cache, read_hit_2)
 {
-    Cache cache(1 << 4, writeContent, writeAttr, readContent, readAttr);
+    Cache cache(1 << 4, writeContent, writeAttr, readContent, readAttr,
+                commitFile);
     std::vector<char> data;
     for (int i = 40; i < 120; i++)
     {
@@ -211,7 +244,8 @@ TEST(cache, read_hit_2)
 
 TEST(cache, flush)
 {
-    Cache cache(1 << 4, writeContent, writeAttr, readContent, readAttr);
+    Cache cache(1 << 4, writeContent, writeAttr, readContent, readAttr,
+                commitFile);
     std::vector<char> data;
     for (int i = 0; i < 26; i++)
     {
@@ -235,7 +269,8 @@ TEST(cache, flush)
 
 TEST(cache, evict)
 {
-    Cache cache(1 << 4, writeContent, writeAttr, readContent, readAttr);
+    Cache cache(1 << 4, writeContent, writeAttr, readContent, readAttr,
+                commitFile);
     std::string fname = "cache_evict";
     std::vector<char> data;
     for (int i = 40; i < 120; i++)
@@ -280,7 +315,8 @@ TEST(cache, evict)
 
 TEST(cache, evict2)
 {
-    Cache cache(4, writeContent, writeAttr, readContent, readAttr);
+    Cache cache(4, writeContent, writeAttr, readContent, readAttr,
+                commitFile);
     std::string fname = "cache_evict";
     std::vector<char> data;
     for (int i = 40; i < 40 + 16; i++)
@@ -304,7 +340,8 @@ TEST(cache, evict2)
 
 TEST(cache, evict3)
 {
-    Cache cache(4, writeContent, writeAttr, readContent, readAttr);
+    Cache cache(4, writeContent, writeAttr, readContent, readAttr,
+                commitFile);
     std::string fname = "cache_evict";
     std::vector<char> data;
     for (int i = 40; i < 40 + 36; i++)
@@ -346,3 +383,152 @@ TEST(cache, evict3)
     ASSERT_EQ(rd.size(), 36);
     ASSERT_EQ(rd, data);
 }
+
+TEST(cache, fill_blocks)
+{
+    auto no_fetch = [](const std::string&, size_t, size_t,
+                       const Cache::ContentSink&) { return EIO; };
+    auto no_attr = [](const std::string&, FileAttr&) { return EIO; };
+    Cache cache(1 << 4, writeContent, writeAttr, no_fetch, no_attr,
+                commitFile);
+    std::string fname = "cache_fill_blocks";
+    FileAttr attr{};
+    attr.size = 40;
+    cache.insertFile(fname, attr);
+    std::vector<char> data;
+    for (int i = 0; i < 40; i++)
+    {
+        data.push_back(i);
+    }
+    // the second block is not covered entirely
+    cache.fillBlocks(fname, 0, &data[0], 20);
+    ASSERT_EQ(cache.fullBlocks(fname), std::vector<size_t>({0}));
+    // the last block ends the file
+    cache.fillBlocks(fname, 20, &data[20], 20);
+    ASSERT_EQ(cache.fullBlocks(fname), std::vector<size_t>({0, 2}));
+
+    std::vector<char> read_data(16);
+    size_t read_size;
+    ASSERT_EQ(cache.read(fname, 32, &read_data[0], 16, read_size), 0);
+    ASSERT_EQ(read_size, 8);
+    ASSERT_EQ(std::vector<char>(read_data.begin(), read_data.begin() + 8),
+              std::vector<char>(data.begin() + 32, data.end()));
+    ASSERT_TRUE(cache.isLastReadHit());
+    ASSERT_EQ(cache.read(fname, 0, &read_data[0], 16, read_size), 0);
+    ASSERT_EQ(read_size, 16);
+    ASSERT_EQ(read_data, std::vector<char>(data.begin(), data.begin() + 16));
+    ASSERT_EQ(cache.read(fname, 16, &read_data[0], 16, read_size), EIO);
+}
+
+TEST(cache, sync)
+{
+    Cache cache(1 << 4, writeContent, writeAttr, readContent, readAttr,
+                commitFile);
+    std::string fname = "cache_sync";
+    std::vector<char> data(20, 'a');
+    createFile(fname);
+    ASSERT_EQ(cache.write(fname, 0, &data[0], 20), 0);
+    ASSERT_EQ(cache.flushDirtyBlocks(), 0);
+    ASSERT_EQ(cache.countDirtyBlocks(), 0);
+    ASSERT_EQ(cache.countUnstableBlocks(), 2);
+    int commits = commit_count;
+    ASSERT_EQ(cache.sync(fname), 0);
+    ASSERT_EQ(commit_count, commits + 1);
+    ASSERT_EQ(cache.countUnstableBlocks(), 0);
+    ASSERT_EQ(readAll(fname), data);
+}
+
+/* writes lost by the server are written again, those of other files at
+ * their next flush
+ */
+TEST(cache, sync_lost)
+{
+    Cache cache(1 << 4, writeContent, writeAttr, readContent, readAttr,
+                commitFile);
+    std::string fname = "cache_sync_lost";
+    std::string other = "cache_sync_lost_other";
+    std::vector<char> data(20, 'b');
+    createFile(fname);
+    createFile(other);
+    ASSERT_EQ(cache.write(fname, 0, &data[0], 20), 0);
+    ASSERT_EQ(cache.write(other, 0, &data[0], 4), 0);
+    ASSERT_EQ(cache.flushDirtyBlocks(), 0);
+    createFile(fname);
+    lost_commits = 1;
+    int commits = commit_count;
+    ASSERT_EQ(cache.sync(fname), 0);
+    ASSERT_EQ(commit_count, commits + 2);
+    ASSERT_EQ(readAll(fname), data);
+    ASSERT_EQ(cache.countDirtyBlocks(), 1);
+    ASSERT_EQ(cache.countUnstableBlocks(), 0);
+
+    lost_commits = 10;
+    ASSERT_EQ(cache.sync(fname), EIO);
+    lost_commits = 0;
+}
+
+/* unstable blocks are committed before they are dropped */
+TEST(cache, evict_unstable)
+{
+    Cache cache(4, writeContent, writeAttr, readContent, readAttr,
+                commitFile);
+    std::string fname = "cache_evict_unstable";
+    std::vector<char> data(16, 'c');
+    createFile(fname);
+    ASSERT_EQ(cache.write(fname, 0, &data[0], 16), 0);
+    ASSERT_EQ(cache.flushDirtyBlocks(), 0);
+    ASSERT_EQ(cache.countUnstableBlocks(), 4);
+    int commits = commit_count;
+    ASSERT_EQ(cache.evictBlocks(2), 0);
+    ASSERT_EQ(commit_count, commits + 1);
+    ASSERT_EQ(cache.countCachedBlocks(), 2);
+    ASSERT_EQ(cache.countUnstableBlocks(), 0);
+    // nothing is left to commit
+    ASSERT_EQ(cache.evictBlocks(2), 0);
+    ASSERT_EQ(commit_count, commits + 1);
+    ASSERT_EQ(readAll(fname), data);
+}
+
+/* the crc of a written block is taken at the check after the writes, and
+ * catches corruption from then on
+ */
+TEST(cache, entry_crc)
+{
+    std::list<CacheEntryID> use_list(1);
+    CacheEntry entry(16, use_list.begin());
+    ASSERT_TRUE(entry.intact());
+    for (size_t i = 0; i < 16; i++)
+    {
+        char c = 'a' + i;
+        entry.write(i, &c, 1);
+    }
+    ASSERT_TRUE(entry.intact());
+    const_cast<char&>(entry.data()[3]) ^= 1;
+    ASSERT_FALSE(entry.intact());
+    entry.write(3, "d", 1);
+    ASSERT_TRUE(entry.intact());
+}
+
+/* the files of the blocks evicted are committed at once */
+TEST(cache, evict_batch)
+{
+    Cache cache(4, writeContent, writeAttr, readContent, readAttr,
+                commitFile);
+    std::vector<std::string> fnames = {"cache_evict_batch_a",
+                                       "cache_evict_batch_b",
+                                       "cache_evict_batch_c"};
+    std::vector<char> data(4, 'd');
+    for (const auto& fname : fnames)
+    {
+        createFile(fname);
+        ASSERT_EQ(cache.write(fname, 0, &data[0], 4), 0);
+    }
+    int commits = commit_count;
+    ASSERT_EQ(cache.evictBlocks(3), 0);
+    ASSERT_EQ(commit_count, commits + 1);
+    ASSERT_EQ(cache.countCachedBlocks(), 0);
+    for (const auto& fname : fnames)
+    {
+        ASSERT_EQ(readAll(fname), data);
+    }
+}
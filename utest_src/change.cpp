@@ -0,0 +1,141 @@
+#include "change.hpp"
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fileop.hpp"
+
+static struct stat fileStat(ino_t ino, time_t ctime)
+{
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_dev = 1;
+    st.st_ino = ino;
+    st.st_ctim.tv_sec = ctime;
+    return st;
+}
+
+TEST(change, bump)
+{
+    ChangeTable table;
+    struct stat st = fileStat(1, 1000);
+    uint64_t unchanged = ChangeTable::unchangedVersion(st);
+    ASSERT_EQ(table.version(st), unchanged);
+    uint64_t before, after;
+    table.bump(makeFileID(st), unchanged, before, after);
+    ASSERT_EQ(before, unchanged);
+    ASSERT_GT(after, before);
+    ASSERT_EQ(table.version(st), after);
+    // the change time no longer matters
+    st.st_ctim.tv_sec = 2000;
+    ASSERT_EQ(table.version(st), after);
+    uint64_t last = after;
+    table.bump(makeFileID(st), unchanged, before, after);
+    ASSERT_EQ(before, last);
+    ASSERT_GT(after, last);
+
+    // a file changed in the future, as by a skewed clock
+    struct stat later = fileStat(2, 4000000000);
+    table.bump(makeFileID(later), ChangeTable::unchangedVersion(later),
+               before, after);
+    ASSERT_GT(after, ChangeTable::unchangedVersion(later));
+}
+
+/* versions of files that are forgotten do not go back, even with the
+ * change times they were opened with
+ */
+TEST(change, capacity)
+{
+    ChangeTable table(16);
+    uint64_t before, after;
+    std::vector<uint64_t> last(65);
+    for (ino_t ino = 1; ino <= 64; ino++)
+    {
+        struct stat st = fileStat(ino, 1000);
+        table.bump(makeFileID(st), ChangeTable::unchangedVersion(st), before,
+                   after);
+        last[ino] = after;
+    }
+    for (ino_t ino = 1; ino <= 64; ino++)
+    {
+        struct stat st = fileStat(ino, 1000);
+        ASSERT_GE(table.version(st), last[ino]);
+        table.bump(makeFileID(st), ChangeTable::unchangedVersion(st), before,
+                   after);
+        ASSERT_GE(before, last[ino]);
+        ASSERT_GT(after, before);
+    }
+}
+
+TEST(change, concurrent)
+{
+    ChangeTable table;
+    struct stat st = fileStat(1, 1000);
+    const int threads = 4, bumps = 10000;
+    std::vector<std::vector<uint64_t>> seen(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]() {
+            uint64_t before, after;
+            for (int i = 0; i < bumps; i++)
+            {
+                table.bump(makeFileID(st), 0, before, after);
+                ASSERT_GT(after, before);
+                seen[t].push_back(after);
+            }
+        });
+    }
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+    std::vector<uint64_t> all;
+    for (auto& s : seen)
+    {
+        all.insert(all.end(), s.begin(), s.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(std::unique(all.begin(), all.end()), all.end());
+    ASSERT_EQ(table.version(st), all.back());
+}
+
+/* each change made through a FileOp is seen by stat and access */
+TEST(change, file_op)
+{
+    char root[] = "/tmp/netfs-change-XXXXXX";
+    ASSERT_TRUE(mkdtemp(root));
+    FileOp op(root);
+    ASSERT_EQ(op.creat("/a"), 0);
+    struct stat st;
+    ASSERT_EQ(op.stat("/a", st), 0);
+    uint64_t created = op.version(st);
+    uint64_t before, after, change;
+    ASSERT_EQ(op.write("/a", 0, "abc", 3, before, after), 0);
+    ASSERT_EQ(before, created);
+    ASSERT_GT(after, before);
+    ASSERT_EQ(op.access("/a", change), 0);
+    ASSERT_EQ(change, after);
+    uint64_t written = after;
+    ASSERT_EQ(op.truncate("/a", 1, before, after), 0);
+    ASSERT_EQ(before, written);
+    ASSERT_EQ(op.stat("/a", st), 0);
+    ASSERT_EQ(op.version(st), after);
+    size_t copied;
+    uint64_t truncated = after;
+    ASSERT_EQ(op.creat("/b"), 0);
+    ASSERT_EQ(op.copy("/b", 0, "/a", 0, 4, copied, before, after), 0);
+    ASSERT_EQ(copied, 0);
+    ASSERT_EQ(after, truncated);
+    // emptied by creat
+    ASSERT_EQ(op.creat("/a"), 0);
+    ASSERT_EQ(op.access("/a", change), 0);
+    ASSERT_GT(change, truncated);
+    unlink((std::string(root) + "/a").c_str());
+    unlink((std::string(root) + "/b").c_str());
+    rmdir(root);
+}
@@ -0,0 +1,147 @@
+#include "channel.hpp"
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include "frame.hpp"
+
+/* a pair of shm channels with small rings, so that frames wrap around */
+static void shmPair(std::unique_ptr<Channel>& client,
+                    std::unique_ptr<Channel>& server)
+{
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    client = ShmChannel::connect(fds[0], 4096);
+    server = ShmChannel::accept(fds[1]);
+}
+
+TEST(channel, shm_frames)
+{
+    std::unique_ptr<Channel> client, server;
+    shmPair(client, server);
+    FrameWriter writer(*client);
+    FrameReader reader(*server, 64);
+    for (int i = 0; i < 3; i++)
+    {
+        writer.writeMsg(MsgUnlink(i, "/some/file"));
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        Message msg;
+        reader.readMsg(msg);
+        auto ptr = std::get_if<MsgUnlink>(&msg);
+        ASSERT_TRUE(ptr);
+        ASSERT_EQ(ptr->id, i);
+        ASSERT_EQ(ptr->filename, "/some/file");
+    }
+
+    // many times the size of the ring
+    std::vector<char> data(1 << 20);
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = (char)i;
+    }
+    std::thread sender(
+        [&] { writer.writeMsg(MsgWrite(7, "/big", 100, data)); });
+    Message msg;
+    reader.readMsg(msg);
+    sender.join();
+    auto ptr = std::get_if<MsgWrite>(&msg);
+    ASSERT_TRUE(ptr);
+    ASSERT_EQ(ptr->id, 7);
+    ASSERT_EQ(ptr->data, data);
+
+    // the other way around
+    FrameWriter back_writer(*server);
+    FrameReader back_reader(*client);
+    back_writer.writeMsg(MsgUnlinkResp(8, 0));
+    back_reader.readMsg(msg);
+    ASSERT_EQ(std::get<MsgUnlinkResp>(msg).id, 8);
+}
+
+TEST(channel, shm_send_file)
+{
+    char name[] = "/tmp/netfs_channel_XXXXXX";
+    int file = mkstemp(name);
+    ASSERT_GE(file, 0);
+    unlink(name);
+    std::vector<char> content(10000);
+    for (size_t i = 0; i < content.size(); i++)
+    {
+        content[i] = (char)(i * 3);
+    }
+    ASSERT_EQ(write(file, content.data(), content.size()), content.size());
+
+    std::unique_ptr<Channel> client, server;
+    shmPair(client, server);
+    FrameWriter writer(*server);
+    FrameReader reader(*client);
+    MsgReadResp resp;
+    resp.id = 3;
+    resp.raw_size = 9000;
+    std::thread sender([&] { writer.writeMsg(resp, file, 1000, 9000); });
+    Message msg;
+    reader.readMsg(msg);
+    sender.join();
+    auto ptr = std::get_if<MsgReadResp>(&msg);
+    ASSERT_TRUE(ptr);
+    ASSERT_EQ(ptr->id, 3);
+    ASSERT_EQ(ptr->data,
+              std::vector<char>(content.begin() + 1000, content.end()));
+
+    // past the end of the file, the payload is padded
+    sender = std::thread([&] { writer.writeMsg(resp, file, 5000, 6000); });
+    reader.readMsg(msg);
+    sender.join();
+    ptr = std::get_if<MsgReadResp>(&msg);
+    ASSERT_EQ(ptr->data.size(), 6000);
+    ASSERT_TRUE(std::equal(content.begin() + 5000, content.end(),
+                           ptr->data.begin()));
+    ASSERT_EQ(ptr->data.back(), 0);
+    close(file);
+}
+
+TEST(channel, shm_hang_up)
+{
+    std::unique_ptr<Channel> client, server;
+    shmPair(client, server);
+    FrameWriter writer(*server);
+    FrameReader reader(*client);
+    writer.writeMsg(MsgUnlinkResp(1, 0));
+    std::thread receiver([&] {
+        Message msg;
+        reader.readMsg(msg);
+        ASSERT_EQ(std::get<MsgUnlinkResp>(msg).id, 1);
+        // the peer is gone, after what it sent was received
+        ASSERT_THROW(reader.readMsg(msg), std::runtime_error);
+    });
+    server.reset();
+    receiver.join();
+
+    // shutting down wakes up a receiver on the same side
+    shmPair(client, server);
+    std::thread waiter([&] {
+        char c;
+        ASSERT_EQ(server->recv(&c, 1), 0);
+    });
+    server->shutdown();
+    waiter.join();
+    ASSERT_THROW(FrameWriter(*server).writeMsg(MsgUnlinkResp(1, 0)),
+                 std::system_error);
+}
+
+TEST(channel, parse_address)
+{
+    struct sockaddr_un addr;
+    socklen_t len;
+    ASSERT_EQ(parseAddress("localhost", addr, len), TRANSPORT_TCP);
+    ASSERT_EQ(parseAddress("unix:/tmp/sock", addr, len), TRANSPORT_UNIX);
+    ASSERT_STREQ(addr.sun_path, "/tmp/sock");
+    ASSERT_EQ(parseAddress("shm:ci", addr, len), TRANSPORT_SHM);
+    // in the abstract namespace
+    ASSERT_EQ(addr.sun_path[0], '\0');
+    ASSERT_EQ(std::string(addr.sun_path + 1, 12), "netfs.shm.ci");
+    ASSERT_THROW(parseAddress("unix:", addr, len), std::system_error);
+}
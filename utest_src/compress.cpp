@@ -0,0 +1,65 @@
+#include "compress.hpp"
+#include <gtest/gtest.h>
+#include <cerrno>
+#include <random>
+#include <string>
+
+static std::vector<char> textData(size_t size)
+{
+    std::string text;
+    for (int i = 0; text.size() < size; i++)
+    {
+        text += "line " + std::to_string(i) + " of some repetitive text\n";
+    }
+    return std::vector<char>(text.begin(), text.begin() + size);
+}
+
+TEST(compress, round_trip)
+{
+    auto data = textData(100000);
+    std::vector<char> packed;
+    ASSERT_TRUE(
+        compressPayload(CODEC_ZLIB, data.data(), data.size(), packed));
+    ASSERT_LT(packed.size(), data.size() / 2);
+    std::vector<char> raw(data.size());
+    ASSERT_EQ(decompressPayload(CODEC_ZLIB, packed.data(), packed.size(),
+                                raw.data(), raw.size()),
+              0);
+    ASSERT_EQ(raw, data);
+
+    // the raw size must match
+    raw.resize(data.size() - 1);
+    ASSERT_EQ(decompressPayload(CODEC_ZLIB, packed.data(), packed.size(),
+                                raw.data(), raw.size()),
+              EPROTO);
+    packed[packed.size() / 2] ^= 0x55;
+    raw.resize(data.size());
+    ASSERT_NE(decompressPayload(CODEC_ZLIB, packed.data(), packed.size(),
+                                raw.data(), raw.size()),
+              0);
+}
+
+TEST(compress, skip)
+{
+    std::vector<char> packed;
+    auto text = textData(COMPRESS_MIN_SIZE - 1);
+    ASSERT_FALSE(
+        compressPayload(CODEC_ZLIB, text.data(), text.size(), packed));
+    text = textData(COMPRESS_MIN_SIZE);
+    ASSERT_FALSE(
+        compressPayload(CODEC_NONE, text.data(), text.size(), packed));
+
+    std::mt19937 gen(1);
+    std::vector<char> noise(100000);
+    for (auto& c : noise)
+    {
+        c = (char)gen();
+    }
+    uint64_t skipped = compressStats().skipped_bytes;
+    ASSERT_FALSE(
+        compressPayload(CODEC_ZLIB, noise.data(), noise.size(), packed));
+    ASSERT_EQ(compressStats().skipped_bytes, skipped + noise.size());
+    ASSERT_EQ(decompressPayload(CODEC_NONE, noise.data(), noise.size(),
+                                packed.data(), packed.size()),
+              EINVAL);
+}
@@ -0,0 +1,87 @@
+#include "crc32c.hpp"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+static uint32_t bitwiseCrc(const char* data, size_t size)
+{
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc ^= (unsigned char)data[i];
+        for (int k = 0; k < 8; k++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78u : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+static std::vector<char> randomData(size_t size)
+{
+    std::mt19937 gen(size);
+    std::vector<char> data(size);
+    for (auto& c : data)
+    {
+        c = (char)gen();
+    }
+    return data;
+}
+
+TEST(crc32c, known)
+{
+    ASSERT_EQ(crc32c("123456789", 9), 0xe3069283u);
+    ASSERT_EQ(crc32cSoftware("123456789", 9), 0xe3069283u);
+    ASSERT_EQ(crc32c("", 0), 0u);
+}
+
+TEST(crc32c, sizes)
+{
+    auto data = randomData(5000);
+    for (size_t size = 0; size <= data.size(); size += 1 + size / 16)
+    {
+        uint32_t expect = bitwiseCrc(data.data(), size);
+        ASSERT_EQ(crc32c(data.data(), size), expect) << size;
+        ASSERT_EQ(crc32cSoftware(data.data(), size), expect) << size;
+        // unaligned
+        ASSERT_EQ(crc32c(data.data() + 3, size - std::min<size_t>(size, 3)),
+                  bitwiseCrc(data.data() + 3,
+                             size - std::min<size_t>(size, 3)));
+    }
+}
+
+TEST(crc32c, extend_combine)
+{
+    auto data = randomData(10000);
+    uint32_t whole = crc32c(data.data(), data.size());
+    for (size_t split : {0, 1, 7, 1000, 4097, 10000})
+    {
+        uint32_t a = crc32c(data.data(), split);
+        uint32_t b = crc32c(data.data() + split, data.size() - split);
+        ASSERT_EQ(crc32cExtend(a, data.data() + split, data.size() - split),
+                  whole);
+        ASSERT_EQ(crc32cCombine(a, b, data.size() - split), whole);
+    }
+}
+
+/* throughput, run with --gtest_also_run_disabled_tests */
+TEST(crc32c, DISABLED_bench)
+{
+    auto data = randomData(1 << 20);
+    for (auto f : {crc32c, crc32cSoftware})
+    {
+        uint32_t crc = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 200; i++)
+        {
+            crc += f(data.data(), data.size());
+        }
+        double sec = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+        std::cout << (f == crc32c ? "crc32c" : "software") << ": "
+                  << 200 * data.size() / sec / 1e9 << " GB/s (" << crc
+                  << ")" << std::endl;
+    }
+}
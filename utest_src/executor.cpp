@@ -0,0 +1,152 @@
+#include "executor.hpp"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+TEST(executor, run_all)
+{
+    std::atomic<int> sum(0);
+    {
+        Executor executor(4);
+        for (int i = 1; i <= 100; i++)
+        {
+            executor.submit([&sum, i] { sum += i; });
+        }
+    }
+    ASSERT_EQ(sum, 5050);
+}
+
+TEST(executor, concurrent)
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    int arrived = 0;
+    Executor executor(2);
+    // both tasks can only finish if they run at the same time
+    for (int i = 0; i < 2; i++)
+    {
+        executor.submit([&] {
+            std::unique_lock<std::mutex> lock(mutex);
+            arrived += 1;
+            cv.notify_all();
+            cv.wait(lock, [&] { return arrived == 2; });
+        });
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return arrived == 2; });
+}
+
+// holds the only worker until opened, so that tasks queue up behind it
+struct Gate
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool open = false;
+    bool entered = false;
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        entered = true;
+        cv.notify_all();
+        cv.wait(lock, [this] { return open; });
+    }
+    void waitEntered()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return entered; });
+    }
+    void release()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        open = true;
+        cv.notify_all();
+    }
+};
+
+/* a client with a few small tasks is not kept waiting behind one with many
+ * large ones
+ */
+TEST(executor, fair_share)
+{
+    Gate gate;
+    std::vector<char> order;
+    {
+        Executor executor(1);
+        Executor::Flow batch(executor), interactive(executor);
+        executor.submit([&gate] { gate.wait(); });
+        for (int i = 0; i < 50; i++)
+        {
+            ASSERT_TRUE(executor.submit(batch, 1 << 20,
+                                        [&order] { order.push_back('b'); }));
+        }
+        for (int i = 0; i < 5; i++)
+        {
+            ASSERT_TRUE(executor.submit(interactive, 4096,
+                                        [&order] { order.push_back('i'); }));
+        }
+        gate.release();
+    }
+    ASSERT_EQ(order.size(), 55);
+    auto last = std::find(order.rbegin(), order.rend(), 'i');
+    ASSERT_LT(order.rend() - last, 8);
+}
+
+/* a client runs on at most `flow_threads` workers, the others are left for
+ * the rest
+ */
+TEST(executor, flow_threads)
+{
+    Gate gate;
+    std::atomic<int> running(0), most(0);
+    std::atomic<bool> other_done(false);
+    {
+        Executor executor(3, 2);
+        Executor::Flow busy(executor), other(executor);
+        for (int i = 0; i < 4; i++)
+        {
+            executor.submit(busy, 4096, [&] {
+                int now = ++running;
+                int seen = most;
+                while (now > seen && !most.compare_exchange_weak(seen, now))
+                {
+                }
+                gate.wait();
+                running--;
+            });
+        }
+        executor.submit(other, 4096, [&] { other_done = true; });
+        while (!other_done)
+        {
+            std::this_thread::yield();
+        }
+        gate.release();
+    }
+    ASSERT_EQ(most, 2);
+}
+
+/* once the queue is full, a client may only queue its share of it, while
+ * one with nothing queued is always taken
+ */
+TEST(executor, admission)
+{
+    Gate gate;
+    Executor executor(1, 0, 8);
+    Executor::Flow flood(executor), light(executor);
+    executor.submit([&gate] { gate.wait(); });
+    gate.waitEntered();
+    size_t taken = 0;
+    while (taken < 100 && executor.submit(flood, 4096, [] {}))
+    {
+        taken++;
+    }
+    ASSERT_EQ(taken, 8);
+    ASSERT_TRUE(executor.submit(light, 4096, [] {}));
+    ASSERT_TRUE(executor.submit(light, 4096, [] {}));
+    ASSERT_FALSE(executor.submit(flood, 4096, [] {}));
+    gate.release();
+}
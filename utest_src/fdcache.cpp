@@ -0,0 +1,195 @@
+#include "fdcache.hpp"
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "fileop.hpp"
+
+static std::string tmpRoot()
+{
+    char root[] = "/tmp/netfs-fdcache-XXXXXX";
+    EXPECT_TRUE(mkdtemp(root));
+    return root;
+}
+
+static void putFile(const std::string& path, const std::string& data)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(::write(fd, data.data(), data.size()), (ssize_t)data.size());
+    ::close(fd);
+}
+
+static std::string readAll(const FdCache::FilePtr& file)
+{
+    char buf[64];
+    ssize_t n = ::pread(file->fd, buf, sizeof(buf), 0);
+    return std::string(buf, n > 0 ? n : 0);
+}
+
+TEST(fdcache, lru)
+{
+    std::string root = tmpRoot();
+    for (auto name : {"/a", "/b", "/c"})
+    {
+        putFile(root + name, name);
+    }
+    FdCache cache(2);
+    FdCache::FilePtr a, b, c, again;
+    ASSERT_EQ(cache.open(root + "/a", false, a), 0);
+    ASSERT_EQ(cache.open(root + "/b", true, b), 0);
+    ASSERT_TRUE(a->writable);
+    ASSERT_EQ(cache.open(root + "/a", false, again), 0);
+    ASSERT_EQ(again, a);
+    // b is the least recently used
+    ASSERT_EQ(cache.open(root + "/c", false, c), 0);
+    ASSERT_EQ(cache.size(), 2);
+    ASSERT_EQ(cache.open(root + "/a", false, again), 0);
+    ASSERT_EQ(again, a);
+    ASSERT_EQ(cache.open(root + "/b", false, again), 0);
+    ASSERT_NE(again, b);
+    // an evicted file stays open while in use
+    ASSERT_EQ(readAll(b), "/b");
+    ASSERT_EQ(cache.open(root + "/d", false, again), ENOENT);
+    ASSERT_EQ(cache.size(), 2);
+
+    FdCache none(0);
+    ASSERT_EQ(none.open(root + "/a", false, again), 0);
+    ASSERT_EQ(readAll(again), "/a");
+    ASSERT_EQ(none.size(), 0);
+    for (auto name : {"/a", "/b", "/c"})
+    {
+        ASSERT_EQ(unlink((root + name).c_str()), 0);
+    }
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+TEST(fdcache, invalidate)
+{
+    std::string root = tmpRoot();
+    ASSERT_EQ(mkdir((root + "/d").c_str(), 0755), 0);
+    for (auto name : {"/d/x", "/d/y", "/dx"})
+    {
+        putFile(root + name, name);
+    }
+    FdCache cache(8);
+    FdCache::FilePtr file;
+    for (auto name : {"/d/x", "/d/y", "/dx", "/d"})
+    {
+        ASSERT_EQ(cache.open(root + name, false, file), 0);
+    }
+    ASSERT_FALSE(file->writable);
+    ASSERT_EQ(cache.size(), 4);
+    cache.invalidate(root + "/d");
+    ASSERT_EQ(cache.size(), 1);
+    cache.invalidate(root + "/dx");
+    ASSERT_EQ(cache.size(), 0);
+    // a directory is not opened for writing
+    ASSERT_EQ(cache.open(root + "/d", true, file), EISDIR);
+    for (auto name : {"/d/x", "/d/y", "/dx"})
+    {
+        ASSERT_EQ(unlink((root + name).c_str()), 0);
+    }
+    ASSERT_EQ(rmdir((root + "/d").c_str()), 0);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+/* paths that name other files after a rename or unlink are read afresh */
+TEST(fdcache, file_op)
+{
+    std::string root = tmpRoot();
+    FileOp op(root);
+    uint64_t before, after;
+    char buf[16];
+    size_t done;
+    ASSERT_EQ(op.creat("/a"), 0);
+    ASSERT_EQ(op.creat("/b"), 0);
+    ASSERT_EQ(op.write("/a", 0, "aaa", 3, before, after), 0);
+    ASSERT_EQ(op.write("/b", 0, "bbbb", 4, before, after), 0);
+    ASSERT_EQ(op.read("/b", 0, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), "bbbb");
+    struct stat st;
+    ASSERT_EQ(op.stat("/b", st), 0);
+    ASSERT_EQ(op.version(st), after);
+
+    ASSERT_EQ(op.rename("/a", "/b", 0), 0);
+    ASSERT_EQ(op.read("/b", 0, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), "aaa");
+    ASSERT_EQ(op.read("/a", 0, 16, buf, done), ENOENT);
+
+    ASSERT_EQ(op.mkdir("/d", 0755), 0);
+    ASSERT_EQ(op.rename("/b", "/d/b", 0), 0);
+    ASSERT_EQ(op.write("/d/b", 3, "a", 1, before, after), 0);
+    ASSERT_EQ(op.rename("/d", "/e", 0), 0);
+    ASSERT_EQ(op.write("/d/b", 0, "x", 1, before, after), ENOENT);
+    ASSERT_EQ(op.read("/e/b", 0, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), "aaaa");
+
+    ASSERT_EQ(op.unlink("/e/b"), 0);
+    ASSERT_EQ(op.creat("/e/b"), 0);
+    ASSERT_EQ(op.read("/e/b", 0, 16, buf, done), 0);
+    ASSERT_EQ(done, 0);
+    ASSERT_EQ(op.unlink("/e/b"), 0);
+    ASSERT_EQ(op.rmdir("/e"), 0);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+/* names in a deep tree are looked up from their open directories */
+TEST(fdcache, file_op_at)
+{
+    std::string root = tmpRoot();
+    FileOp op(root);
+    uint64_t before, after;
+    char buf[16];
+    size_t done;
+    ASSERT_EQ(op.mkdir("/d", 0755), 0);
+    ASSERT_EQ(op.mkdir("/d/e", 0755), 0);
+    ASSERT_EQ(op.mkdir("/d/e", 0755), EEXIST);
+    ASSERT_EQ(op.creat("/d/e/f"), 0);
+    ASSERT_EQ(op.creat("/d/e/g"), 0);
+    ASSERT_EQ(op.write("/d/e/f", 0, "ff", 2, before, after), 0);
+    ASSERT_EQ(op.write("/d/e/g", 0, "g", 1, before, after), 0);
+    ASSERT_EQ(op.access("/d/e/f", before), 0);
+    ASSERT_EQ(op.access("/d/x/f", before), ENOENT);
+    struct stat st;
+    ASSERT_EQ(op.stat("/", st), 0);
+    ASSERT_TRUE(S_ISDIR(st.st_mode));
+    ASSERT_EQ(op.stat("/d/e/f", st), 0);
+    ASSERT_EQ(st.st_size, 2);
+    std::vector<std::string> names;
+    ASSERT_EQ(op.readdir("/d/e", names), 0);
+    ASSERT_EQ(names.size(), 4);
+    FsStat fs;
+    ASSERT_EQ(op.statfs(fs), 0);
+
+    ASSERT_EQ(op.rename("/d/e/f", "/d/e/g", RENAME_NOREPLACE), EEXIST);
+    ASSERT_EQ(op.rename("/d/e/f", "/d/e/g", RENAME_EXCHANGE), 0);
+    ASSERT_EQ(op.read("/d/e/g", 0, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), "ff");
+    ASSERT_EQ(op.read("/d/e/f", 0, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), "g");
+    ASSERT_EQ(op.truncate("/d/e/f", 0, before, after), 0);
+    ASSERT_EQ(op.stat("/d/e/f", st), 0);
+    ASSERT_EQ(st.st_size, 0);
+
+    // the open directories are not those of the old paths
+    ASSERT_EQ(op.rename("/d", "/x", 0), 0);
+    ASSERT_EQ(op.stat("/d/e/g", st), ENOENT);
+    ASSERT_EQ(op.mkdir("/d", 0755), 0);
+    ASSERT_EQ(op.creat("/d/e"), 0);
+    ASSERT_EQ(op.stat("/d/e/g", st), ENOTDIR);
+    ASSERT_EQ(op.read("/x/e/g", 0, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), "ff");
+
+    for (auto name : {"/x/e/f", "/x/e/g", "/d/e"})
+    {
+        ASSERT_EQ(op.unlink(name), 0);
+    }
+    ASSERT_EQ(op.rmdir("/x/e"), 0);
+    ASSERT_EQ(op.rmdir("/x"), 0);
+    ASSERT_EQ(op.rmdir("/d"), 0);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
@@ -0,0 +1,105 @@
+#include "frame.hpp"
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <thread>
+
+TEST(frame, read_write)
+{
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    FrameWriter writer(fds[0]);
+    FrameReader reader(fds[1], 64);
+    // several small frames arrive in one read
+    for (int i = 0; i < 3; i++)
+    {
+        writer.writeMsg(MsgUnlink(i, "/some/file"));
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        Message msg;
+        reader.readMsg(msg);
+        auto ptr = std::get_if<MsgUnlink>(&msg);
+        ASSERT_TRUE(ptr);
+        ASSERT_EQ(ptr->id, i);
+        ASSERT_EQ(ptr->filename, "/some/file");
+    }
+
+    // a frame larger than the buffer and the socket buffer
+    std::vector<char> data(1 << 22);
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = (char)i;
+    }
+    std::thread sender(
+        [&] { writer.writeMsg(MsgWrite(7, "/big", 100, data)); });
+    Message msg;
+    reader.readMsg(msg);
+    sender.join();
+    auto ptr = std::get_if<MsgWrite>(&msg);
+    ASSERT_TRUE(ptr);
+    ASSERT_EQ(ptr->id, 7);
+    ASSERT_EQ(ptr->offset, 100);
+    ASSERT_EQ(ptr->data, data);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void expectCorrupted(const MsgHeader& header, size_t body_size)
+{
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    std::vector<char> body(body_size);
+    ASSERT_EQ(write(fds[0], &header, sizeof(header)), sizeof(header));
+    ASSERT_EQ(write(fds[0], body.data(), body.size()), body.size());
+    FrameReader reader(fds[1]);
+    Message msg;
+    ASSERT_THROW(reader.readMsg(msg), UnserializeFormatError);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(frame, corrupted)
+{
+    // body is longer than what the message consumes
+    expectCorrupted(MsgHeader{Msg::Unlink, 0, 100}, 100);
+    // body is shorter
+    expectCorrupted(MsgHeader{Msg::Rename, 0, 2}, 2);
+    // unknown type
+    expectCorrupted(MsgHeader{1000, 0, 0}, 0);
+    // too long
+    expectCorrupted(MsgHeader{Msg::Unlink, 0, MAX_MSG_LENGTH + 1}, 0);
+}
+
+TEST(frame, closed)
+{
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    FrameReader reader(fds[1]);
+    close(fds[0]);
+    Message msg;
+    ASSERT_THROW(reader.readMsg(msg), std::runtime_error);
+    close(fds[1]);
+}
+
+/* a payload that cannot be read from its file is not sent as zeros: the
+ * frame is cut short and the channel shut down
+ */
+TEST(frame, file_error)
+{
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    FrameWriter writer(fds[0]);
+    FrameReader reader(fds[1]);
+    int dir = ::open("/tmp", O_RDONLY | O_DIRECTORY);
+    ASSERT_GE(dir, 0);
+    MsgReadResp resp;
+    resp.raw_size = 100;
+    ASSERT_THROW(writer.writeMsg(resp, dir, 0, 100), std::system_error);
+    Message msg;
+    ASSERT_THROW(reader.readMsg(msg), std::runtime_error);
+    ::close(dir);
+    close(fds[0]);
+    close(fds[1]);
+}
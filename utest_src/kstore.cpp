@@ -0,0 +1,156 @@
+#include "kstore.hpp"
+#include <gtest/gtest.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+
+struct StoreRecord
+{
+    uint64_t ino;
+    off_t offset;
+    std::string data;
+};
+
+static int inodeOf(const std::string& fname, uint64_t& ino)
+{
+    ino = std::hash<std::string>()(fname);
+    return 0;
+}
+
+static int noInval(uint64_t)
+{
+    return 0;
+}
+
+TEST(kstore, push)
+{
+    std::vector<StoreRecord> stored;
+    KernelStore ks(100, inodeOf,
+                   [&](uint64_t ino, off_t off, const char* data,
+                       size_t size) {
+                       stored.push_back({ino, off, std::string(data, size)});
+                       return 0;
+                   },
+                   noInval);
+    ASSERT_TRUE(ks.push("/a", 10, "hello", 5));
+    ASSERT_TRUE(ks.push("/a", 15, "world", 5));
+    ks.drain();
+    ASSERT_EQ(stored.size(), 2);
+    ASSERT_EQ(stored[0].ino, std::hash<std::string>()("/a"));
+    ASSERT_EQ(stored[0].offset, 10);
+    ASSERT_EQ(stored[0].data, "hello");
+    ASSERT_EQ(stored[1].offset, 15);
+    ASSERT_EQ(stored[1].data, "world");
+    ASSERT_EQ(ks.usedBytes(), 10);
+    ASSERT_EQ(ks.storedBytes(), 10);
+
+    // already pushed
+    ASSERT_TRUE(ks.pushed("/a", 12, 3));
+    ASSERT_FALSE(ks.pushed("/a", 12, 10));
+    ASSERT_FALSE(ks.pushed("/b", 0, 1));
+    ASSERT_FALSE(ks.push("/a", 12, "llo", 3));
+    ks.drain();
+    ASSERT_EQ(stored.size(), 2);
+}
+
+TEST(kstore, budget)
+{
+    std::vector<StoreRecord> stored;
+    KernelStore ks(10, inodeOf,
+                   [&](uint64_t ino, off_t off, const char* data,
+                       size_t size) {
+                       stored.push_back({ino, off, std::string(data, size)});
+                       return 0;
+                   },
+                   noInval);
+    ASSERT_FALSE(ks.push("/a", 0, "01234567890", 11));
+    ASSERT_TRUE(ks.push("/a", 0, "0123", 4));
+    ASSERT_TRUE(ks.push("/b", 0, "0123", 4));
+    ASSERT_EQ(ks.usedBytes(), 8);
+    // retires /a, the least recently pushed file
+    ASSERT_TRUE(ks.push("/c", 0, "0123", 4));
+    ASSERT_EQ(ks.usedBytes(), 8);
+    ASSERT_TRUE(ks.push("/c", 4, "45", 2));
+    ASSERT_EQ(ks.usedBytes(), 10);
+    // retires /b, but a file cannot retire itself
+    ASSERT_FALSE(ks.push("/c", 6, "6789012", 7));
+    ASSERT_EQ(ks.usedBytes(), 6);
+    ks.drain();
+    ks.forget("/c");
+    ASSERT_EQ(ks.usedBytes(), 0);
+    ASSERT_TRUE(ks.push("/c", 6, "6789", 4));
+    ks.drain();
+    ASSERT_EQ(stored.back().offset, 6);
+    ASSERT_EQ(stored.back().data, "6789");
+}
+
+TEST(kstore, forget)
+{
+    std::map<std::string, int> inode_calls;
+    size_t store_count = 0;
+    KernelStore ks(100,
+                   [&](const std::string& fname, uint64_t& ino) {
+                       inode_calls[fname] += 1;
+                       ino = 1;
+                       return 0;
+                   },
+                   [&](uint64_t, off_t, const char*, size_t) {
+                       store_count += 1;
+                       return 0;
+                   },
+                   noInval);
+    for (int i = 0; i < 10; i++)
+    {
+        ks.push("/a", i * 2, "xy", 2);
+    }
+    ks.forget("/a");
+    ks.drain();
+    ASSERT_LE(store_count, 10);
+    ASSERT_EQ(ks.usedBytes(), 0);
+    ASSERT_TRUE(ks.push("/a", 0, "xy", 2));
+    ks.drain();
+    ASSERT_EQ(ks.usedBytes(), 2);
+}
+
+/* a store blocks, as on pages the kernel holds; pushes and forgets go on
+ * meanwhile, and what was stored of a forgotten file is invalidated
+ */
+TEST(kstore, blocked_store)
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool storing = false, release = false;
+    std::vector<uint64_t> invalidated;
+    KernelStore ks(100, inodeOf,
+                   [&](uint64_t, off_t, const char*, size_t) {
+                       std::unique_lock<std::mutex> lock(mutex);
+                       storing = true;
+                       cv.notify_all();
+                       cv.wait(lock, [&] { return release; });
+                       return 0;
+                   },
+                   [&](uint64_t ino) {
+                       invalidated.push_back(ino);
+                       return 0;
+                   });
+    ASSERT_TRUE(ks.push("/a", 0, "xy", 2));
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return storing; });
+    }
+    ASSERT_TRUE(ks.push("/b", 0, "xy", 2));
+    ASSERT_TRUE(ks.pushed("/a", 0, 2));
+    ks.forget("/a");
+    ASSERT_FALSE(ks.pushed("/a", 0, 2));
+    ASSERT_EQ(ks.usedBytes(), 2);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        release = true;
+        cv.notify_all();
+    }
+    ks.drain();
+    ASSERT_EQ(invalidated.size(), 1);
+    ASSERT_EQ(invalidated[0], std::hash<std::string>()("/a"));
+    ASSERT_EQ(ks.storedBytes(), 4);
+}
@@ -0,0 +1,55 @@
+#include "listener.hpp"
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include "rpc.hpp"
+
+static std::unique_ptr<Channel> connectLocal(const std::string& address)
+{
+    struct sockaddr_un addr;
+    socklen_t len;
+    Transport transport = parseAddress(address, addr, len);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    EXPECT_EQ(connect(fd, (struct sockaddr*)&addr, len), 0);
+    if (transport == TRANSPORT_SHM)
+    {
+        return ShmChannel::connect(fd);
+    }
+    return std::unique_ptr<Channel>(new SocketChannel(fd));
+}
+
+/* the server answers whether or not its root exists */
+static void expectServed(const std::string& address)
+{
+    RpcClient rpc(connectLocal(address));
+    for (int i = 0; i < 3; i++)
+    {
+        MsgStat msg(0, "/");
+        auto call = rpc.send(msg);
+        ASSERT_TRUE(std::get_if<MsgStatResp>(&call.get()));
+    }
+}
+
+TEST(listener, unix_and_shm)
+{
+    char dir[] = "/tmp/netfs-listen-XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir));
+    std::string sock = std::string(dir) + "/sock";
+    std::string shm = "shm:utest-" + std::to_string(getpid());
+    Executor executor(2);
+    FileOp op(dir);
+    {
+        LocalListener unix_listener("unix:" + sock, executor, op);
+        LocalListener shm_listener(shm, executor, op);
+        expectServed("unix:" + sock);
+        expectServed(shm);
+        // clients still connected are hung up on
+        RpcClient idle(connectLocal(shm));
+    }
+    // the socket is removed
+    ASSERT_NE(access(sock.c_str(), F_OK), 0);
+    ASSERT_EQ(rmdir(dir), 0);
+    ASSERT_THROW(LocalListener("localhost", executor, op),
+                 std::invalid_argument);
+}
@@ -0,0 +1,94 @@
+#include "metrics.hpp"
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* the requests of type `name` counted in a report */
+static uint64_t requestCount(const std::string& report,
+                             const std::string& name)
+{
+    std::istringstream is(report);
+    std::string line;
+    while (std::getline(is, line))
+    {
+        if (line.compare(0, name.size() + 2, name + ": ") == 0)
+        {
+            return std::stoull(line.substr(name.size() + 2));
+        }
+    }
+    return 0;
+}
+
+/* a value is in a bucket that ends at most 1/32 above it, and buckets
+ * follow the order of values
+ */
+TEST(metrics, buckets)
+{
+    size_t last = 0;
+    for (uint64_t value = 0; value < (1ull << Histogram::MAX_BITS);
+         value = value * 9 / 8 + 1)
+    {
+        size_t bucket = Histogram::bucketOf(value);
+        ASSERT_LT(bucket, Histogram::BUCKETS);
+        ASSERT_GE(bucket, last);
+        uint64_t end = Histogram::bucketEnd(bucket);
+        ASSERT_GE(end, value);
+        ASSERT_LE(end - value, value >> Histogram::SUB_BITS);
+        ASSERT_LT(Histogram::bucketEnd(bucket - (bucket > 0)), value + 1);
+        last = bucket;
+    }
+    ASSERT_EQ(Histogram::bucketOf(~0ull), Histogram::BUCKETS - 1);
+    ASSERT_EQ(Histogram::bucketEnd(Histogram::BUCKETS - 1),
+              (1ull << Histogram::MAX_BITS) - 1);
+}
+
+TEST(metrics, percentile)
+{
+    Histogram hist;
+    ASSERT_EQ(hist.percentile(50), 0);
+    for (uint64_t value = 1; value <= 100000; value++)
+    {
+        hist.record(value);
+    }
+    ASSERT_EQ(hist.count(), 100000);
+    ASSERT_NEAR(hist.percentile(50), 50000, 50000 / 32);
+    ASSERT_NEAR(hist.percentile(99), 99000, 99000 / 32);
+    ASSERT_NEAR(hist.percentile(99.9), 99900, 99900 / 32);
+    size_t top = Histogram::bucketOf(100000);
+    ASSERT_EQ(hist.percentile(100), Histogram::bucketEnd(top));
+
+    Histogram sum;
+    sum.add(hist);
+    sum.add(hist);
+    ASSERT_EQ(sum.count(), 200000);
+    ASSERT_EQ(sum.percentile(50), hist.percentile(50));
+}
+
+/* what threads record is added up in the report, and kept after they exit
+ */
+TEST(metrics, report)
+{
+    const int threads = 4, requests = 1000;
+    uint64_t before = requestCount(metricsReport(), "rmdir");
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([] {
+            Message req = MsgRmdir(0, "/dir");
+            for (int i = 0; i < requests; i++)
+            {
+                MetricsClock::time_point now = MetricsClock::now();
+                recordRequest(req, now - std::chrono::microseconds(10), now,
+                              100);
+            }
+        });
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    ASSERT_EQ(requestCount(metricsReport(), "rmdir"),
+              before + threads * requests);
+}
@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/vfs.h>
 #include <unistd.h>
+#include <chrono>
 #include <string>
 #include "stream.hpp"
 
@@ -26,23 +27,17 @@ static std::string tmpFilename(const std::string& name)
     return (std::string("/tmp/") + getUserName() + "." + name).c_str();
 }
 
-static SReader tmpReader(const std::string& fname)
+static FdReader tmpReader(const std::string& fname)
 {
     int fd = open(tmpFilename(fname).c_str(), O_RDONLY);
-    auto fdrd = FdReader(fd);
-    return [fdrd = std::move(fdrd)](char* buf, size_t size) mutable {
-        fdrd.read(buf, size);
-    };
+    return FdReader(fd);
 }
 
-static SWriter tmpWriter(const std::string& fname)
+static FdWriter tmpWriter(const std::string& fname)
 {
     int fd = open(tmpFilename(fname).c_str(), O_WRONLY | O_CREAT | O_TRUNC,
                   S_IRWXU | S_IRWXG | S_IRWXO);
-    auto wt = FdWriter(fd);
-    return [wt = std::move(wt)](const char* buf, size_t size) mutable {
-        wt.write(buf, size);
-    };
+    return FdWriter(fd);
 }
 
 TEST(msg, serial_msg_access)
@@ -55,8 +50,9 @@ TEST(msg, serial_msg_access)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgAccess*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgAccess>(&res);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->filename, msg.filename);
     }
@@ -64,7 +60,7 @@ TEST(msg, serial_msg_access)
 
 TEST(msg, serial_msg_access_resp)
 {
-    MsgAccessResp msg(234, -10, {{-1000, -2000}, {3000, 400}, {5, 6}});
+    MsgAccessResp msg(234, -10, 1234567890123456789ULL);
     const std::string tmpfile = "ece590-msg-serial";
     {
         auto ws = tmpWriter(tmpfile);
@@ -72,11 +68,12 @@ TEST(msg, serial_msg_access_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgAccessResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgAccessResp>(&res);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
-        ASSERT_EQ(ptr->time, msg.time);
+        ASSERT_EQ(ptr->change, msg.change);
     }
 }
 
@@ -90,8 +87,9 @@ TEST(msg, serial_msg_create)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgCreate*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgCreate>(&res);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->filename, msg.filename);
     }
@@ -107,8 +105,9 @@ TEST(msg, serial_msg_create_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgCreateResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgCreateResp>(&res);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
     }
@@ -124,8 +123,9 @@ TEST(msg, serial_msg_stat)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgStat*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgStat>(&res);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->filename, msg.filename);
     }
@@ -135,7 +135,10 @@ TEST(msg, serial_msg_stat_resp)
 {
     MsgStatResp msg(
         234, 1,
-        {1000, 123, {{-1000, -2000}, {-3000, -4000}, {-5000, -6000}}});
+        {1000,
+         123,
+         {{-1000, -2000}, {-3000, -4000}, {-5000, -6000}},
+         1234567890123456789ULL});
     const std::string tmpfile = "ece590-msg-serial";
     {
         auto ws = tmpWriter(tmpfile);
@@ -143,13 +146,15 @@ TEST(msg, serial_msg_stat_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgStatResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgStatResp>(&res);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
         ASSERT_EQ(ptr->stat.size, msg.stat.size);
         ASSERT_EQ(ptr->stat.mode, msg.stat.mode);
         ASSERT_EQ(ptr->stat.time, msg.stat.time);
+        ASSERT_EQ(ptr->stat.change, msg.stat.change);
     }
 }
 
@@ -163,8 +168,9 @@ TEST(msg, serial_msg_readdir)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgReaddir*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgReaddir>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->filename, msg.filename);
@@ -181,8 +187,9 @@ TEST(msg, serial_msg_readdir_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgReaddirResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgReaddirResp>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
@@ -200,8 +207,9 @@ TEST(msg, serial_msg_read)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgRead*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgRead>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->filename, msg.filename);
@@ -220,11 +228,13 @@ TEST(msg, serial_msg_read_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgReadResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgReadResp>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
+        ASSERT_EQ(ptr->crc, crc32c(msg.data.data(), msg.data.size()));
         ASSERT_EQ(ptr->data, msg.data);
     }
 }
@@ -239,20 +249,22 @@ TEST(msg, serial_msg_write)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgWrite*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgWrite>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->filename, msg.filename);
         ASSERT_EQ(ptr->offset, msg.offset);
+        ASSERT_EQ(ptr->crc, crc32c(msg.data.data(), msg.data.size()));
         ASSERT_EQ(ptr->data, msg.data);
     }
 }
 
 TEST(msg, serial_msg_write_resp)
 {
-    MsgWriteResp msg(1, 5, {{1, 2}, {3, 4}, {5, 6}},
-                     {{7, 8}, {9, 10}, {11, 12}});
+    MsgWriteResp msg(1, 5, 1234567890123456789ULL, 1234567890123456790ULL,
+                     1234567890123456791ULL);
     const std::string tmpfile = "ece590-msg-serial";
     {
         auto ws = tmpWriter(tmpfile);
@@ -260,13 +272,15 @@ TEST(msg, serial_msg_write_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgWriteResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgWriteResp>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
         ASSERT_EQ(ptr->before_change, msg.before_change);
         ASSERT_EQ(ptr->after_change, msg.after_change);
+        ASSERT_EQ(ptr->verifier, msg.verifier);
     }
 }
 
@@ -280,8 +294,9 @@ TEST(msg, serial_msg_truncate)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgTruncate*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgTruncate>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->filename, msg.filename);
@@ -291,8 +306,8 @@ TEST(msg, serial_msg_truncate)
 
 TEST(msg, serial_msg_truncate_resp)
 {
-    MsgTruncateResp msg(1, 123, {{1, 2}, {3, 4}, {5, 6}},
-                        {{7, 8}, {9, 10}, {11, 12}});
+    MsgTruncateResp msg(1, 123, 1234567890123456789ULL,
+                        1234567890123456790ULL);
     const std::string tmpfile = "ece590-msg-serial";
     {
         auto ws = tmpWriter(tmpfile);
@@ -300,8 +315,9 @@ TEST(msg, serial_msg_truncate_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgTruncateResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgTruncateResp>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
@@ -320,8 +336,9 @@ TEST(msg, serial_msg_unlink)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgUnlink*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgUnlink>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->filename, msg.filename);
@@ -338,8 +355,9 @@ TEST(msg, serial_msg_unlink_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgUnlinkResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgUnlinkResp>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
@@ -356,8 +374,9 @@ TEST(msg, serial_msg_rmdir)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgRmdir*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgRmdir>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->filename, msg.filename);
@@ -374,8 +393,9 @@ TEST(msg, serial_msg_rmdir_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgRmdirResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgRmdirResp>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
@@ -392,8 +412,9 @@ TEST(msg, serial_msg_mkdir)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgMkdir*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgMkdir>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->filename, msg.filename);
@@ -411,8 +432,9 @@ TEST(msg, serial_msg_mkdir_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgMkdirResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgMkdirResp>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
@@ -429,8 +451,9 @@ TEST(msg, serial_msg_statfs)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgStatfs*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgStatfs>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
     }
@@ -449,8 +472,9 @@ TEST(msg, serial_msg_statfs_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgStatfsResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgStatfsResp>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
@@ -475,8 +499,9 @@ TEST(msg, serial_msg_rename)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgRename*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgRename>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->from, msg.from);
@@ -495,10 +520,146 @@ TEST(msg, serial_msg_rename_resp)
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeMsg(rs);
-        auto ptr = dynamic_cast<MsgRenameResp*>(res.get());
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgRenameResp>(&res);
+        ASSERT_TRUE(ptr);
+        ASSERT_EQ(ptr->id, msg.id);
+        ASSERT_EQ(ptr->error, msg.error);
+    }
+}
+
+TEST(msg, serial_msg_commit)
+{
+    MsgCommit msg(1, "file1");
+    const std::string tmpfile = "ece590-msg-serial";
+    {
+        auto ws = tmpWriter(tmpfile);
+        serializeMsg(msg, ws);
+    }
+    {
+        auto rs = tmpReader(tmpfile);
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgCommit>(&res);
+        ASSERT_TRUE(ptr);
+        ASSERT_EQ(ptr->id, msg.id);
+        ASSERT_EQ(ptr->filename, msg.filename);
+    }
+}
+
+TEST(msg, serial_msg_commit_resp)
+{
+    MsgCommitResp msg(1, EIO, 1234567890123456789ULL);
+    const std::string tmpfile = "ece590-msg-serial";
+    {
+        auto ws = tmpWriter(tmpfile);
+        serializeMsg(msg, ws);
+    }
+    {
+        auto rs = tmpReader(tmpfile);
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgCommitResp>(&res);
         ASSERT_TRUE(ptr);
         ASSERT_EQ(ptr->id, msg.id);
         ASSERT_EQ(ptr->error, msg.error);
+        ASSERT_EQ(ptr->verifier, msg.verifier);
+    }
+}
+
+TEST(msg, serial_msg_metrics_resp)
+{
+    MsgMetricsResp msg(1, 0, "read: 1 requests\n");
+    const std::string tmpfile = "ece590-msg-serial";
+    {
+        auto ws = tmpWriter(tmpfile);
+        serializeMsg(msg, ws);
+    }
+    {
+        auto rs = tmpReader(tmpfile);
+        Message res;
+        unserializeMsg(rs, res);
+        auto ptr = std::get_if<MsgMetricsResp>(&res);
+        ASSERT_TRUE(ptr);
+        ASSERT_EQ(ptr->id, msg.id);
+        ASSERT_EQ(ptr->error, msg.error);
+        ASSERT_EQ(ptr->report, msg.report);
+    }
+}
+
+TEST(msg, unserialize_reuse)
+{
+    MsgHeader header;
+    std::vector<char> body;
+    Message res;
+    serializeMsg(MsgReaddirResp(1, 0, {"a", "bb", "ccc"}), header, body);
+    unserializeMsg(header, body.data(), res);
+    auto ptr = std::get_if<MsgReaddirResp>(&res);
+    ASSERT_TRUE(ptr);
+    ASSERT_EQ(ptr->dir_names, std::vector<std::string>({"a", "bb", "ccc"}));
+
+    // decoded in place, shorter fields shrink
+    serializeMsg(MsgReaddirResp(2, 0, {"dd"}), header, body);
+    unserializeMsg(header, body.data(), res);
+    ASSERT_EQ(ptr, std::get_if<MsgReaddirResp>(&res));
+    ASSERT_EQ(ptr->id, 2);
+    ASSERT_EQ(ptr->dir_names, std::vector<std::string>({"dd"}));
+
+    // switches to another type
+    serializeMsg(MsgUnlink(3, "/a"), header, body);
+    unserializeMsg(header, body.data(), res);
+    auto unlink = std::get_if<MsgUnlink>(&res);
+    ASSERT_TRUE(unlink);
+    ASSERT_EQ(unlink->id, 3);
+    ASSERT_EQ(unlink->filename, "/a");
+
+    header.type = MSG_TYPE_COUNT;
+    ASSERT_THROW(unserializeMsg(header, body.data(), res),
+                 UnserializeFormatError);
+}
+
+/* microbenchmark of encoding and decoding message bodies, run with
+ * --gtest_also_run_disabled_tests
+ */
+template <typename M>
+static void benchMsg(const char* name, const M& msg, size_t rounds)
+{
+    MsgHeader header;
+    std::vector<char> body;
+    Message res;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; i++)
+    {
+        serializeMsg(msg, header, body);
+    }
+    auto mid = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; i++)
+    {
+        unserializeMsg(header, body.data(), res);
+        ASSERT_EQ(res.index(), msg.type);
+    }
+    auto end = std::chrono::steady_clock::now();
+    auto ns = [&](auto d) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(d)
+                   .count() /
+               rounds;
+    };
+    std::cout << name << ": encode " << ns(mid - start) << " ns, decode "
+              << ns(end - mid) << " ns" << std::endl;
+}
+
+TEST(msg, DISABLED_bench)
+{
+    benchMsg("stat_resp",
+             MsgStatResp(1, 0, {100, 0644, {{1, 2}, {3, 4}, {5, 6}}}),
+             1000000);
+    benchMsg("write", MsgWrite(1, "/dir/file", 4096, std::vector<char>(64)),
+             1000000);
+    std::vector<std::string> names;
+    for (int i = 0; i < 100; i++)
+    {
+        names.push_back("file" + std::to_string(i));
     }
+    benchMsg("readdir_resp", MsgReaddirResp(1, 0, names), 100000);
 }
@@ -0,0 +1,350 @@
+#include "msg_response.hpp"
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "blockcache.hpp"
+#include "metrics.hpp"
+
+static std::string tmpRoot()
+{
+    char root[] = "/tmp/netfs-respond-XXXXXX";
+    EXPECT_TRUE(mkdtemp(root));
+    return root;
+}
+
+static std::vector<Message> compoundResults(const Message& resp)
+{
+    auto ptr = std::get_if<MsgCompoundResp>(&resp);
+    EXPECT_TRUE(ptr);
+    std::vector<Message> results;
+    size_t pos = 0;
+    while (pos < ptr->results.size())
+    {
+        results.emplace_back();
+        nextMsg(ptr->results, pos, results.back());
+    }
+    return results;
+}
+
+TEST(msg_response, compound)
+{
+    std::string root = tmpRoot();
+    FileOp op(root);
+    MsgCompound req(5);
+    appendMsg(MsgCreate(0, "/a"), req.ops);
+    appendMsg(MsgWrite(0, "/a", 0, {'h', 'i'}), req.ops);
+    appendMsg(MsgRead(0, "/a", 0, 100), req.ops);
+    Message resp;
+    respondMsg(req, resp, op);
+    ASSERT_EQ(msgBase(resp).id, 5);
+    ASSERT_EQ(msgError(resp), 0);
+    auto results = compoundResults(resp);
+    ASSERT_EQ(results.size(), 3);
+    ASSERT_TRUE(std::get_if<MsgCreateResp>(&results[0]));
+    ASSERT_TRUE(std::get_if<MsgWriteResp>(&results[1]));
+    auto read = std::get_if<MsgReadResp>(&results[2]);
+    ASSERT_TRUE(read);
+    ASSERT_EQ(read->data, std::vector<char>({'h', 'i'}));
+
+    // stops at the first failure
+    req.ops.clear();
+    appendMsg(MsgUnlink(0, "/a"), req.ops);
+    appendMsg(MsgStat(0, "/a"), req.ops);
+    appendMsg(MsgMkdir(0, "/d", 0755), req.ops);
+    respondMsg(req, resp, op);
+    ASSERT_EQ(msgError(resp), ENOENT);
+    results = compoundResults(resp);
+    ASSERT_EQ(results.size(), 2);
+    ASSERT_EQ(msgError(results[0]), 0);
+    ASSERT_EQ(msgError(results[1]), ENOENT);
+
+    // compounds do not nest
+    MsgCompound outer(6);
+    appendMsg(req, outer.ops);
+    respondMsg(outer, resp, op);
+    ASSERT_EQ(msgError(resp), EINVAL);
+    ASSERT_TRUE(compoundResults(resp).empty());
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+TEST(msg_response, checksum)
+{
+    std::string root = tmpRoot();
+    FileOp op(root);
+    Message resp;
+    respondMsg(MsgCreate(0, "/a"), resp, op);
+    ASSERT_EQ(msgError(resp), 0);
+
+    MsgWrite write(1, "/a", 0, {'h', 'i'});
+    write.crc += 1;
+    respondMsg(write, resp, op);
+    ASSERT_EQ(msgError(resp), EBADMSG);
+    write.crc -= 1;
+    respondMsg(write, resp, op);
+    ASSERT_EQ(msgError(resp), 0);
+
+    respondMsg(MsgRead(2, "/a", 0, 100), resp, op);
+    auto read = std::get_if<MsgReadResp>(&resp);
+    ASSERT_TRUE(read);
+    ASSERT_EQ(read->crc, crc32c("hi", 2));
+    respondMsg(MsgUnlink(3, "/a"), resp, op);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+TEST(msg_response, copy)
+{
+    std::string root = tmpRoot();
+    FileOp op(root);
+    Message resp;
+    respondMsg(MsgCreate(0, "/a"), resp, op);
+    respondMsg(MsgCreate(0, "/b"), resp, op);
+    respondMsg(MsgWrite(0, "/a", 0, {'h', 'e', 'l', 'l', 'o'}), resp, op);
+    ASSERT_EQ(msgError(resp), 0);
+
+    respondMsg(MsgCopy(1, "/a", 1, "/b", 2, 100), resp, op);
+    auto copy = std::get_if<MsgCopyResp>(&resp);
+    ASSERT_TRUE(copy);
+    ASSERT_EQ(copy->error, 0);
+    // stops at the end of the source
+    ASSERT_EQ(copy->copied, 4);
+    respondMsg(MsgRead(2, "/b", 0, 100), resp, op);
+    auto read = std::get_if<MsgReadResp>(&resp);
+    ASSERT_TRUE(read);
+    ASSERT_EQ(read->data, std::vector<char>({0, 0, 'e', 'l', 'l', 'o'}));
+
+    respondMsg(MsgCopy(3, "/none", 0, "/b", 0, 1), resp, op);
+    ASSERT_EQ(msgError(resp), ENOENT);
+    respondMsg(MsgUnlink(4, "/a"), resp, op);
+    respondMsg(MsgUnlink(4, "/b"), resp, op);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+TEST(msg_response, negotiate)
+{
+    std::string root = tmpRoot();
+    FileOp op(root);
+    Message resp;
+    MsgNegotiate req(0, SUPPORTED_FEATURES | 0x80000000u, ~0u);
+    respondMsg(req, resp, op);
+    auto ptr = std::get_if<MsgNegotiateResp>(&resp);
+    ASSERT_TRUE(ptr);
+    ASSERT_EQ(ptr->error, 0);
+    ASSERT_EQ(ptr->version, PROTOCOL_VERSION);
+    ASSERT_EQ(ptr->features, SUPPORTED_FEATURES);
+    ASSERT_EQ(ptr->codecs, SUPPORTED_CODECS);
+    ASSERT_GT(ptr->block_size, 0);
+    ASSERT_GT(ptr->io_size, 0);
+    ASSERT_LE(ptr->io_size, ptr->max_io_size);
+
+    // reads and writes are limited
+    respondMsg(MsgRead(1, "/a", 0, ptr->max_io_size + 1), resp, op);
+    ASSERT_EQ(msgError(resp), EINVAL);
+
+    req.version = 0;
+    respondMsg(req, resp, op);
+    ASSERT_EQ(msgError(resp), EPROTONOSUPPORT);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+/* a file that is not there has no attributes, not even those of the file
+ * stated before with the same response
+ */
+TEST(msg_response, stat_missing)
+{
+    std::string root = tmpRoot();
+    FileOp op(root);
+    Message resp;
+    respondMsg(MsgCreate(0, "/a"), resp, op);
+    respondMsg(MsgWrite(1, "/a", 0, {'a'}), resp, op);
+    respondMsg(MsgStat(2, "/a"), resp, op);
+    auto stat = std::get_if<MsgStatResp>(&resp);
+    ASSERT_TRUE(stat);
+    ASSERT_EQ(stat->error, 0);
+    ASSERT_EQ(stat->stat.size, 1);
+    ASSERT_NE(stat->stat.change, 0u);
+
+    respondMsg(MsgStat(3, "/none"), resp, op);
+    stat = std::get_if<MsgStatResp>(&resp);
+    ASSERT_TRUE(stat);
+    ASSERT_EQ(stat->error, ENOENT);
+    ASSERT_EQ(stat->stat.size, 0);
+    ASSERT_EQ(stat->stat.mode, 0u);
+    ASSERT_EQ(stat->stat.change, 0u);
+    respondMsg(MsgUnlink(4, "/a"), resp, op);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+/* writes are unstable under the verifier given when connecting, which
+ * commits return as long as nothing is lost
+ */
+TEST(msg_response, commit)
+{
+    std::string root = tmpRoot();
+    FileOp op(root);
+    Message resp;
+    respondMsg(MsgNegotiate(0, SUPPORTED_FEATURES, 0), resp, op);
+    uint64_t verifier = std::get<MsgNegotiateResp>(resp).verifier;
+    respondMsg(MsgCreate(0, "/a"), resp, op);
+    respondMsg(MsgWrite(1, "/a", 0, {'a'}), resp, op);
+    auto write = std::get_if<MsgWriteResp>(&resp);
+    ASSERT_TRUE(write);
+    ASSERT_EQ(write->error, 0);
+    ASSERT_EQ(write->verifier, verifier);
+
+    respondMsg(MsgCommit(2, "/a"), resp, op);
+    auto commit = std::get_if<MsgCommitResp>(&resp);
+    ASSERT_TRUE(commit);
+    ASSERT_EQ(commit->error, 0);
+    ASSERT_EQ(commit->verifier, verifier);
+    respondMsg(MsgCommit(3, "/none"), resp, op);
+    ASSERT_EQ(msgError(resp), ENOENT);
+    respondMsg(MsgUnlink(4, "/a"), resp, op);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+/* the report covers the requests recorded so far */
+TEST(msg_response, metrics)
+{
+    std::string root = tmpRoot();
+    FileOp op(root);
+    MetricsClock::time_point now = MetricsClock::now();
+    recordRequest(MsgStatfs(0), now, now, 0);
+    Message resp;
+    respondMsg(MsgMetrics(1), resp, op);
+    auto metrics = std::get_if<MsgMetricsResp>(&resp);
+    ASSERT_TRUE(metrics);
+    ASSERT_EQ(metrics->error, 0);
+    ASSERT_NE(metrics->report.find("statfs: "), std::string::npos);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+TEST(msg_response, read_parts)
+{
+    std::string root = tmpRoot();
+    FileOp op(root);
+    Message resp;
+    respondMsg(MsgCreate(0, "/a"), resp, op);
+    respondMsg(MsgWrite(0, "/a", 0, {'0', '1', '2', '3', '4', '5', '6'}),
+               resp, op);
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    FrameWriter writer(fds[0]);
+    FrameReader reader(fds[1]);
+
+    MsgRead req(1, "/a", 1, 100);
+    req.part_size = 2;
+    ASSERT_FALSE(respondMsg(req, resp, op, &writer));
+    std::string data;
+    for (int i = 0; i < 3; i++)
+    {
+        Message part;
+        reader.readMsg(part);
+        auto ptr = std::get_if<MsgReadResp>(&part);
+        ASSERT_TRUE(ptr);
+        ASSERT_EQ(ptr->id, 1);
+        ASSERT_TRUE(ptr->more);
+        data.append(ptr->data.begin(), ptr->data.end());
+    }
+    // a short part, here an empty one, ends the read
+    auto last = std::get_if<MsgReadResp>(&resp);
+    ASSERT_TRUE(last);
+    ASSERT_FALSE(last->more);
+    ASSERT_TRUE(last->data.empty());
+    ASSERT_EQ(data, "123456");
+
+    // without a writer, the response is in one part
+    respondMsg(req, resp, op);
+    last = std::get_if<MsgReadResp>(&resp);
+    ASSERT_FALSE(last->more);
+    ASSERT_EQ(std::string(last->data.begin(), last->data.end()), "123456");
+    close(fds[0]);
+    close(fds[1]);
+    respondMsg(MsgUnlink(2, "/a"), resp, op);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+TEST(msg_response, read_zero_copy)
+{
+    std::string root = tmpRoot();
+    FileOp op(root);
+    Message resp;
+    std::vector<char> content(40000);
+    for (size_t i = 0; i < content.size(); i++)
+    {
+        content[i] = (char)(i * 7);
+    }
+    respondMsg(MsgCreate(0, "/a"), resp, op);
+    respondMsg(MsgWrite(0, "/a", 0, content), resp, op);
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    FrameWriter writer(fds[0]);
+    FrameReader reader(fds[1]);
+
+    // the whole response is sent from the file, without checksums
+    MsgRead req(1, "/a", 0, 100000);
+    req.part_size = 16384;
+    req.zero_copy = 1;
+    ASSERT_TRUE(respondMsg(req, resp, op, &writer));
+    std::vector<char> data;
+    while (true)
+    {
+        Message part;
+        reader.readMsg(part);
+        auto ptr = std::get_if<MsgReadResp>(&part);
+        ASSERT_TRUE(ptr);
+        ASSERT_EQ(ptr->error, 0);
+        ASSERT_FALSE(ptr->checked);
+        ASSERT_EQ(ptr->raw_size, ptr->data.size());
+        data.insert(data.end(), ptr->data.begin(), ptr->data.end());
+        if (!ptr->more)
+        {
+            break;
+        }
+    }
+    ASSERT_EQ(data, content);
+
+    // small reads are copied and checksummed as usual
+    req.size = 1000;
+    ASSERT_FALSE(respondMsg(req, resp, op, &writer));
+    auto last = std::get_if<MsgReadResp>(&resp);
+    ASSERT_TRUE(last->checked);
+    ASSERT_EQ(last->data.size(), 1000);
+    close(fds[0]);
+    close(fds[1]);
+    respondMsg(MsgUnlink(2, "/a"), resp, op);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+/* with a block cache, large reads are cached and checksummed rather than
+ * sent from the file, for other clients to share
+ */
+TEST(msg_response, read_zero_copy_cached)
+{
+    std::string root = tmpRoot();
+    BlockCache blocks(1 << 20);
+    FileOp op(root, nullptr, MAX_OPEN_FILES, &blocks);
+    Message resp;
+    std::vector<char> content(40000, 'x');
+    respondMsg(MsgCreate(0, "/a"), resp, op);
+    respondMsg(MsgWrite(0, "/a", 0, content), resp, op);
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    FrameWriter writer(fds[0]);
+
+    MsgRead req(1, "/a", 0, 40000);
+    req.part_size = 40000;
+    req.zero_copy = 1;
+    ASSERT_FALSE(respondMsg(req, resp, op, &writer));
+    auto ptr = std::get_if<MsgReadResp>(&resp);
+    ASSERT_TRUE(ptr);
+    ASSERT_TRUE(ptr->checked);
+    ASSERT_EQ(ptr->data, content);
+    ASSERT_GT(blocks.countBlocks(), 0);
+    close(fds[0]);
+    close(fds[1]);
+    respondMsg(MsgUnlink(2, "/a"), resp, op);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
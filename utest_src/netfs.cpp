@@ -0,0 +1,81 @@
+#include "netfs.hpp"
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "reactor.hpp"
+
+static std::string tmpRoot()
+{
+    char root[] = "/tmp/netfs-client-XXXXXX";
+    EXPECT_TRUE(mkdtemp(root));
+    return root;
+}
+
+/* the request that finds the connection broken fails; the next one is
+ * sent on a new connection
+ */
+static int retry(const std::function<int()>& op)
+{
+    try
+    {
+        return op();
+    }
+    catch (const std::exception&)
+    {
+        return op();
+    }
+}
+
+static std::vector<char> readFile(const std::string& path)
+{
+    std::vector<char> data(1 << 16);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    EXPECT_GE(fd, 0);
+    ssize_t size = ::read(fd, data.data(), data.size());
+    EXPECT_GE(size, 0);
+    data.resize(size);
+    ::close(fd);
+    return data;
+}
+
+/* the server starts again before the writes are committed and has lost
+ * them; the client connects again and sends them again
+ */
+TEST(netfs, server_restart)
+{
+    std::string root = tmpRoot();
+    Executor executor(2);
+    std::unique_ptr<FileOp> op(new FileOp(root));
+    std::unique_ptr<Reactor> reactor(new Reactor(0, 1, executor, *op));
+    int port = reactor->port();
+    NetFS fs("127.0.0.1", std::to_string(port), 4096, 1 << 20, 16, 1000, 0,
+             0, false);
+    std::vector<char> data(3 * 4096, 'r');
+    ASSERT_EQ(fs.create("/f"), 0);
+    ASSERT_EQ(fs.write("/f", 0, data.data(), data.size()), 0);
+    ASSERT_EQ(fs.flush("/f"), 0);
+    ASSERT_EQ(readFile(root + "/f"), data);
+
+    reactor.reset();
+    op.reset();
+    ASSERT_EQ(::truncate((root + "/f").c_str(), 0), 0);
+    op.reset(new FileOp(root));
+    reactor.reset(new Reactor(port, 1, executor, *op));
+
+    int err = retry([&] { return fs.fsync("/f"); });
+    ASSERT_EQ(err, 0);
+    ASSERT_EQ(readFile(root + "/f"), data);
+    // committed, nothing is sent again
+    ASSERT_EQ(::truncate((root + "/f").c_str(), 0), 0);
+    ASSERT_EQ(fs.fsync("/f"), 0);
+    ASSERT_EQ(readFile(root + "/f").size(), 0u);
+
+    reactor.reset();
+    ASSERT_EQ(unlink((root + "/f").c_str()), 0);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
@@ -0,0 +1,129 @@
+#include "reactor.hpp"
+#include <gtest/gtest.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "rpc.hpp"
+
+static std::unique_ptr<RpcClient> connectTo(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    EXPECT_EQ(connect(fd, (struct sockaddr*)&addr, sizeof(addr)), 0);
+    return std::unique_ptr<RpcClient>(new RpcClient(fd));
+}
+
+static std::string tmpRoot()
+{
+    char root[] = "/tmp/netfs-reactor-XXXXXX";
+    EXPECT_TRUE(mkdtemp(root));
+    return root;
+}
+
+TEST(reactor, many_clients)
+{
+    std::string root = tmpRoot();
+    Executor executor(4);
+    FileOp op(root);
+    Reactor reactor(0, 2, executor, op);
+    std::vector<std::unique_ptr<RpcClient>> clients;
+    for (int i = 0; i < 100; i++)
+    {
+        clients.push_back(connectTo(reactor.port()));
+    }
+    for (int round = 0; round < 3; round++)
+    {
+        std::vector<RpcClient::Call> calls;
+        for (auto& client : clients)
+        {
+            MsgStat msg(0, "/");
+            calls.push_back(client->send(msg));
+        }
+        for (auto& call : calls)
+        {
+            auto resp = std::get_if<MsgStatResp>(&call.get());
+            ASSERT_TRUE(resp);
+            ASSERT_EQ(resp->error, 0);
+        }
+    }
+    // some go away, the others are still served
+    clients.resize(50);
+    MsgStat msg(0, "/");
+    auto call = clients.back()->send(msg);
+    ASSERT_TRUE(std::get_if<MsgStatResp>(&call.get()));
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+/* more requests in flight than a connection may have being served, so that
+ * it is paused and resumed
+ */
+TEST(reactor, pipelined)
+{
+    std::string root = tmpRoot();
+    Executor executor(2);
+    FileOp op(root);
+    Reactor reactor(0, 1, executor, op);
+    auto client = connectTo(reactor.port());
+    MsgCreate create(0, "/f");
+    client->send(create).get();
+    std::vector<RpcClient::Call> calls;
+    for (int i = 0; i < 500; i++)
+    {
+        MsgWrite write(0, "/f", i * 1000, std::vector<char>(1000, (char)i));
+        calls.push_back(client->send(write));
+    }
+    for (auto& call : calls)
+    {
+        auto resp = std::get_if<MsgWriteResp>(&call.get());
+        ASSERT_TRUE(resp);
+        ASSERT_EQ(resp->error, 0);
+    }
+    MsgRead read(0, "/f", 499 * 1000, 1000);
+    auto call = client->send(read);
+    auto resp = std::get_if<MsgReadResp>(&call.get());
+    ASSERT_TRUE(resp);
+    ASSERT_EQ(resp->data, std::vector<char>(1000, (char)499));
+    calls.clear();
+    call.reset();
+    // hung up on with requests in flight
+    MsgStat stat(0, "/f");
+    for (int i = 0; i < 100; i++)
+    {
+        client->send(stat);
+    }
+    client.reset();
+    ASSERT_EQ(unlink((root + "/f").c_str()), 0);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+// two servers at the same port, as with a loop each, one of them pinned
+TEST(reactor, shared_port)
+{
+    std::string root = tmpRoot();
+    Executor executor(2);
+    FileOp op(root);
+    Reactor a(0, 2, executor, op, true);
+    Reactor b(a.port(), 1, executor, op);
+    ASSERT_EQ(b.port(), a.port());
+    std::vector<std::unique_ptr<RpcClient>> clients;
+    for (int i = 0; i < 20; i++)
+    {
+        clients.push_back(connectTo(a.port()));
+    }
+    for (auto& client : clients)
+    {
+        MsgStat msg(0, "/");
+        auto call = client->send(msg);
+        auto resp = std::get_if<MsgStatResp>(&call.get());
+        ASSERT_TRUE(resp);
+        ASSERT_EQ(resp->error, 0);
+    }
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
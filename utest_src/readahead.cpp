@@ -0,0 +1,101 @@
+#include "readahead.hpp"
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+
+// a large sparse file, which costs nothing to read ahead of
+static int sparseFile()
+{
+    char path[] = "/tmp/netfs-readahead-XXXXXX";
+    int fd = mkstemp(path);
+    EXPECT_GE(fd, 0);
+    unlink(path);
+    EXPECT_EQ(ftruncate(fd, 1L << 30), 0);
+    return fd;
+}
+
+const size_t READ_SIZE = 64 << 10;
+
+TEST(readahead, sequential)
+{
+    int fd = sparseFile();
+    ReadAhead ra;
+    ra.onRead(fd, 0, READ_SIZE);
+    ASSERT_EQ(ra.readAheadTo(), 0);
+    off_t offset = READ_SIZE;
+    for (; offset < (off_t)READAHEAD_MAX * 4; offset += READ_SIZE)
+    {
+        ra.onRead(fd, offset, READ_SIZE);
+        ASSERT_GT(ra.readAheadTo(), offset + (off_t)READ_SIZE);
+    }
+    // the window has grown to its largest
+    ASSERT_GE(ra.readAheadTo(), offset + (off_t)READAHEAD_MAX / 2);
+    ASSERT_EQ(ra.advice(), ReadAhead::Normal);
+    // out of order, as pipelined
+    ra.onRead(fd, offset + READ_SIZE, READ_SIZE);
+    ra.onRead(fd, offset, READ_SIZE);
+    ASSERT_EQ(ra.advice(), ReadAhead::Normal);
+    ASSERT_EQ(ra.droppedTo(), 0);
+    close(fd);
+}
+
+TEST(readahead, random)
+{
+    int fd = sparseFile();
+    ReadAhead ra;
+    for (int i = 0; i < 16; i++)
+    {
+        ra.onRead(fd, (off_t)((i * 7919) % 997) << 20, 4096);
+    }
+    ASSERT_EQ(ra.advice(), ReadAhead::Random);
+    ASSERT_EQ(ra.readAheadTo(), 0);
+    // then read through
+    for (off_t offset = 0; offset < 1 << 20; offset += READ_SIZE)
+    {
+        ra.onRead(fd, offset, READ_SIZE);
+    }
+    ASSERT_EQ(ra.advice(), ReadAhead::Normal);
+    ASSERT_GT(ra.readAheadTo(), 1 << 20);
+    close(fd);
+}
+
+/* clients reading the same file each at their own place */
+TEST(readahead, interleaved)
+{
+    int fd = sparseFile();
+    ReadAhead ra;
+    for (off_t offset = 0; offset < 4 << 20; offset += READ_SIZE)
+    {
+        for (off_t base : {0L, 100L << 20, 200L << 20, 300L << 20})
+        {
+            ra.onRead(fd, base + offset, READ_SIZE);
+        }
+    }
+    ASSERT_EQ(ra.advice(), ReadAhead::Normal);
+    ASSERT_GT(ra.readAheadTo(), (300L << 20) + (4 << 20));
+    close(fd);
+}
+
+/* a long scan drops what it has read, unless others read the file too */
+TEST(readahead, scan)
+{
+    int fd = sparseFile();
+    ReadAhead ra;
+    off_t offset = 0;
+    for (; offset < 128 << 20; offset += READ_SIZE)
+    {
+        ra.onRead(fd, offset, READ_SIZE);
+    }
+    ASSERT_GT(ra.droppedTo(), 32 << 20);
+    ASSERT_LT(ra.droppedTo(), offset);
+
+    ReadAhead shared;
+    for (offset = 0; offset < 128 << 20; offset += READ_SIZE)
+    {
+        shared.onRead(fd, offset, READ_SIZE);
+        shared.onRead(fd, (512 << 20) + offset, READ_SIZE);
+    }
+    ASSERT_EQ(shared.droppedTo(), 0);
+    close(fd);
+}
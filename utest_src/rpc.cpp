@@ -0,0 +1,120 @@
+#include "rpc.hpp"
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include "stream.hpp"
+
+/* a fake server that reads `count` requests, then answers them in reverse
+ * order.
+ */
+static void reverseServer(int fd, int count)
+{
+    FdReader rd(dup(fd));
+    FdWriter wt(fd);
+    std::vector<Message> reqs(count);
+    for (int i = 0; i < count; i++)
+    {
+        unserializeMsg(rd, reqs[i]);
+    }
+    for (int i = count - 1; i >= 0; i--)
+    {
+        auto req = std::get_if<MsgMkdir>(&reqs[i]);
+        MsgMkdirResp resp(req->id, (int)req->mode);
+        serializeMsg(resp, wt);
+    }
+    wt.flush();
+}
+
+TEST(rpc, out_of_order)
+{
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    std::thread server(reverseServer, fds[1], 10);
+    {
+        RpcClient rpc(fds[0]);
+        std::vector<RpcClient::Call> calls;
+        for (int i = 0; i < 10; i++)
+        {
+            MsgMkdir msg(0, "/dir", i);
+            calls.push_back(rpc.send(msg));
+        }
+        for (int i = 0; i < 10; i++)
+        {
+            auto ptr = std::get_if<MsgMkdirResp>(&calls[i].get());
+            ASSERT_TRUE(ptr);
+            ASSERT_EQ(ptr->error, i);
+        }
+        calls.clear();
+        ASSERT_EQ(rpc.countPending(), 0);
+    }
+    server.join();
+}
+
+TEST(rpc, broken_connection)
+{
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    RpcClient rpc(fds[0]);
+    MsgMkdir msg(0, "/dir", 0);
+    auto call = rpc.send(msg);
+    ASSERT_FALSE(rpc.broken());
+    close(fds[1]);
+    ASSERT_THROW(call.get(), std::runtime_error);
+    ASSERT_EQ(rpc.countPending(), 0);
+    ASSERT_TRUE(rpc.broken());
+}
+
+/* answers each read with `parts` parts of one byte, the byte being the
+ * index of the part.
+ */
+static void partServer(int fd, int count, int parts)
+{
+    FdReader rd(dup(fd));
+    FdWriter wt(fd);
+    for (int i = 0; i < count; i++)
+    {
+        Message req;
+        unserializeMsg(rd, req);
+        for (int p = 0; p < parts; p++)
+        {
+            MsgReadResp resp(msgBase(req).id, 0, {(char)p});
+            resp.more = p + 1 < parts;
+            serializeMsg(resp, wt);
+        }
+    }
+    wt.flush();
+}
+
+TEST(rpc, parts)
+{
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    std::thread server(partServer, fds[1], 2, 5);
+    {
+        RpcClient rpc(fds[0]);
+        MsgRead msg(0, "/a", 0, 5);
+        // the first call is abandoned, its parts must be dropped
+        auto abandoned = rpc.send(msg);
+        auto call = rpc.send(msg);
+        abandoned.reset();
+        Message part;
+        std::vector<char> data;
+        while (call.next(part))
+        {
+            auto ptr = std::get_if<MsgReadResp>(&part);
+            ASSERT_TRUE(ptr);
+            ASSERT_TRUE(ptr->more);
+            data.push_back(ptr->data[0]);
+        }
+        auto ptr = std::get_if<MsgReadResp>(&call.get());
+        ASSERT_TRUE(ptr);
+        ASSERT_FALSE(ptr->more);
+        data.push_back(ptr->data[0]);
+        ASSERT_EQ(data, std::vector<char>({0, 1, 2, 3, 4}));
+        call.reset();
+        ASSERT_EQ(rpc.countPending(), 0);
+    }
+    server.join();
+}
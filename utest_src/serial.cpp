@@ -25,23 +25,17 @@ static std::string tmpFilename(const std::string& name)
     return (std::string("/tmp/") + getUserName() + "." + name).c_str();
 }
 
-static SReader tmpReader(const std::string& fname)
+static FdReader tmpReader(const std::string& fname)
 {
     int fd = open(tmpFilename(fname).c_str(), O_RDONLY);
-    auto fdrd = FdReader(fd);
-    return [fdrd = std::move(fdrd)](char* buf, size_t size) mutable {
-        fdrd.read(buf, size);
-    };
+    return FdReader(fd);
 }
 
-static SWriter tmpWriter(const std::string& fname)
+static FdWriter tmpWriter(const std::string& fname)
 {
     int fd = open(tmpFilename(fname).c_str(), O_WRONLY | O_CREAT | O_TRUNC,
                   S_IRWXU | S_IRWXG | S_IRWXO);
-    auto wt = FdWriter(fd);
-    return [wt = std::move(wt)](const char* buf, size_t size) mutable {
-        wt.write(buf, size);
-    };
+    return FdWriter(fd);
 }
 
 TEST(serial, basic_types)
@@ -84,11 +78,11 @@ TEST(serial, vector)
     const std::string tmpfile = "ece590-serial-vector";
     {
         auto ws = tmpWriter(tmpfile);
-        serializeVector<std::string>(vec, serializeString, ws);
+        serializeVector(vec, ws);
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeVector<std::string>(unserializeString, rs);
+        auto res = unserializeVector<std::string>(rs);
         ASSERT_EQ(res, vec);
     }
 }
@@ -99,11 +93,11 @@ TEST(serial, vector_char)
     const std::string tmpfile = "ece590-serial-vector";
     {
         auto ws = tmpWriter(tmpfile);
-        serializeVectorChar(vec, ws);
+        serializeVector(vec, ws);
     }
     {
         auto rs = tmpReader(tmpfile);
-        auto res = unserializeVectorChar(rs);
+        auto res = unserializeVector<char>(rs);
         ASSERT_EQ(res, vec);
     }
 }
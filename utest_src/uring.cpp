@@ -0,0 +1,143 @@
+#include "uring.hpp"
+#include <gtest/gtest.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "fileop.hpp"
+#include "msg_response.hpp"
+
+/* null where the kernel has no io_uring, which is then not tested */
+static std::unique_ptr<IoRing> makeRing(unsigned entries)
+{
+    try
+    {
+        return std::unique_ptr<IoRing>(new IoRing(entries));
+    }
+    catch (std::system_error& e)
+    {
+        std::cout << "io_uring unavailable: " << e.what() << std::endl;
+        return nullptr;
+    }
+}
+
+static std::string tmpRoot()
+{
+    char root[] = "/tmp/netfs-uring-XXXXXX";
+    EXPECT_TRUE(mkdtemp(root));
+    return root;
+}
+
+TEST(uring, file_ops)
+{
+    auto ring = makeRing(32);
+    if (!ring)
+    {
+        return;
+    }
+    std::string root = tmpRoot();
+    FileOp op(root, ring.get());
+    uint64_t before, after;
+    ASSERT_EQ(op.write("/a", 0, "hello", 5, before, after), ENOENT);
+    ASSERT_EQ(op.creat("/a"), 0);
+    ASSERT_EQ(op.write("/a", 3, "hello", 5, before, after), 0);
+    struct stat st;
+    ASSERT_EQ(op.stat("/a", st), 0);
+    ASSERT_EQ(st.st_size, 8);
+    ASSERT_TRUE(S_ISREG(st.st_mode));
+    ASSERT_EQ(op.version(st), after);
+
+    char buf[16];
+    size_t done;
+    ASSERT_EQ(op.read("/a", 2, 16, buf, done), 0);
+    ASSERT_EQ(std::string(buf, done), std::string("\0hello", 6));
+    ASSERT_EQ(op.read("/a", 100, 16, buf, done), 0);
+    ASSERT_EQ(done, 0);
+    ASSERT_EQ(op.read("/b", 0, 16, buf, done), ENOENT);
+    ASSERT_EQ(op.stat("/b", st), ENOENT);
+    // the file is closed even though the read failed
+    ASSERT_EQ(op.mkdir("/d", 0755), 0);
+    for (int i = 0; i < 20; i++)
+    {
+        ASSERT_EQ(op.read("/d", 0, 16, buf, done), EISDIR);
+    }
+    ASSERT_EQ(op.rmdir("/d"), 0);
+    ASSERT_EQ(op.unlink("/a"), 0);
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+/* more threads than slots, so that requests wait for slots and are
+ * batched
+ */
+TEST(uring, concurrent)
+{
+    auto ring = makeRing(4);
+    if (!ring)
+    {
+        return;
+    }
+    std::string root = tmpRoot();
+    std::vector<std::thread> threads;
+    std::vector<int> errors(8, 0);
+    for (int t = 0; t < 8; t++)
+    {
+        threads.emplace_back([&, t] {
+            FileOp op(root, ring.get());
+            std::string name = "/f" + std::to_string(t);
+            Message resp;
+            respondMsg(MsgCreate(0, name), resp, op);
+            for (int i = 0; i < 100; i++)
+            {
+                std::string data = std::to_string(t * 1000 + i);
+                std::vector<char> bytes(data.begin(), data.end());
+                respondMsg(MsgWrite(0, name, 0, bytes), resp, op);
+                respondMsg(MsgRead(0, name, 0, data.size()), resp, op);
+                auto ptr = std::get_if<MsgReadResp>(&resp);
+                if (!ptr || ptr->error || ptr->data != bytes)
+                {
+                    errors[t] += 1;
+                }
+            }
+            op.unlink(name);
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    ASSERT_EQ(errors, std::vector<int>(8, 0));
+    ASSERT_EQ(rmdir(root.c_str()), 0);
+}
+
+/* a read that comes back short, as from a pipe written to in pieces, is
+ * continued until the size asked for, as with pread
+ */
+TEST(uring, short_read)
+{
+    auto ring = makeRing(4);
+    if (!ring)
+    {
+        return;
+    }
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    std::thread writer([&] {
+        for (const char* piece : {"hello", " ", "world"})
+        {
+            ASSERT_EQ(::write(fds[1], piece, strlen(piece)),
+                      (ssize_t)strlen(piece));
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        close(fds[1]);
+    });
+    char buf[16];
+    size_t done;
+    ASSERT_EQ(ring->read(fds[0], 0, buf, sizeof(buf), done), 0);
+    writer.join();
+    ASSERT_EQ(std::string(buf, done), "hello world");
+    close(fds[0]);
+}
@@ -0,0 +1,252 @@
+#include "writelog.hpp"
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fileop.hpp"
+
+static std::string tmpRoot()
+{
+    char root[] = "/tmp/netfs-writelog-XXXXXX";
+    EXPECT_TRUE(mkdtemp(root));
+    return root;
+}
+
+static std::string readFile(const std::string& path)
+{
+    std::string data(64, 0);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    EXPECT_GE(fd, 0);
+    ssize_t size = ::read(fd, &data[0], data.size());
+    EXPECT_GE(size, 0);
+    ::close(fd);
+    data.resize(std::max<ssize_t>(size, 0));
+    return data;
+}
+
+static size_t fileSize(const std::string& path)
+{
+    struct stat st;
+    EXPECT_EQ(::stat(path.c_str(), &st), 0);
+    return st.st_size;
+}
+
+/* changes logged but never applied, as at a crash, are applied on replay,
+ * in order
+ */
+TEST(writelog, replay)
+{
+    std::string root = tmpRoot();
+    std::string log = root + ".log";
+    ASSERT_EQ(mkdir((root + "/d").c_str(), 0755), 0);
+    {
+        WriteLog wl(log, root);
+        ASSERT_EQ(wl.logCreate("/d/a"), 0);
+        ASSERT_EQ(wl.logWrite("/d/a", 0, "hello world", 11), 0);
+        ASSERT_EQ(wl.logWrite("/d/a", 6, "there", 5), 0);
+        ASSERT_EQ(wl.logTruncate("/d/a", 9), 0);
+        // the directory is gone, along with the file
+        ASSERT_EQ(wl.logWrite("/x/b", 0, "b", 1), 0);
+        for (int i = 0; i < 5; i++)
+        {
+            wl.applied();
+        }
+        ASSERT_GT(wl.size(), 0);
+    }
+    // a record cut short
+    FILE* fp = fopen(log.c_str(), "a");
+    fwrite("\x12\x34\x56", 1, 3, fp);
+    fclose(fp);
+
+    WriteLog wl(log, root);
+    size_t records;
+    ASSERT_EQ(wl.replay(records), 0);
+    ASSERT_EQ(records, 5);
+    ASSERT_EQ(readFile(root + "/d/a"), "hello the");
+    ASSERT_EQ(wl.size(), 0);
+    ASSERT_EQ(wl.replay(records), 0);
+    ASSERT_EQ(records, 0);
+}
+
+/* records from before a checkpoint are written over, and not replayed */
+TEST(writelog, generation)
+{
+    std::string root = tmpRoot();
+    std::string log = root + ".log";
+    {
+        WriteLog wl(log, root);
+        ASSERT_EQ(wl.logCreate("/a"), 0);
+        for (int i = 0; i < 8; i++)
+        {
+            ASSERT_EQ(wl.logWrite("/a", i, "a", 1), 0);
+        }
+        for (int i = 0; i < 9; i++)
+        {
+            wl.applied();
+        }
+        ASSERT_EQ(wl.checkpoint(), 0);
+        ASSERT_EQ(wl.size(), 0);
+        ASSERT_EQ(wl.logCreate("/b"), 0);
+        wl.applied();
+    }
+    size_t size = fileSize(log);
+    WriteLog wl(log, root);
+    size_t records;
+    ASSERT_EQ(wl.replay(records), 0);
+    ASSERT_EQ(records, 1);
+    ASSERT_EQ(fileSize(root + "/b"), 0);
+    ASSERT_NE(::access((root + "/a").c_str(), F_OK), 0);
+    // not truncated
+    ASSERT_EQ(fileSize(log), size);
+}
+
+/* a damaged record ends the log */
+TEST(writelog, corrupt)
+{
+    std::string root = tmpRoot();
+    std::string log = root + ".log";
+    {
+        WriteLog wl(log, root);
+        ASSERT_EQ(wl.logCreate("/a"), 0);
+        ASSERT_EQ(wl.logWrite("/a", 0, "aaaa", 4), 0);
+        ASSERT_EQ(wl.logWrite("/a", 0, "bb", 2), 0);
+    }
+    int fd = ::open(log.c_str(), O_WRONLY);
+    ASSERT_EQ(::pwrite(fd, "x", 1, fileSize(log) - 1), 1);
+    ::close(fd);
+    WriteLog wl(log, root);
+    size_t records;
+    ASSERT_EQ(wl.replay(records), 0);
+    ASSERT_EQ(records, 2);
+    ASSERT_EQ(readFile(root + "/a"), "aaaa");
+}
+
+/* writers at once share syncs */
+TEST(writelog, group_commit)
+{
+    std::string root = tmpRoot();
+    WriteLog wl(root + ".log", root);
+    FileOp op(root, nullptr, MAX_OPEN_FILES, nullptr, &wl);
+    const int threads = 8, writes = 50;
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; t++)
+    {
+        std::string fpath = "/f" + std::to_string(t);
+        ASSERT_EQ(op.creat(fpath), 0);
+        writers.emplace_back([&op, fpath]() {
+            uint64_t before, after;
+            for (int i = 0; i < writes; i++)
+            {
+                ASSERT_EQ(op.write(fpath, i, "x", 1, before, after), 0);
+            }
+        });
+    }
+    for (auto& w : writers)
+    {
+        w.join();
+    }
+    ASSERT_LT(wl.countSyncs(), threads * (writes + 1));
+    for (int t = 0; t < threads; t++)
+    {
+        ASSERT_EQ(fileSize(root + "/f" + std::to_string(t)), writes);
+    }
+}
+
+/* the log is emptied once full, and before changes it does not hold */
+TEST(writelog, checkpoint)
+{
+    std::string root = tmpRoot();
+    WriteLog wl(root + ".log", root, 4096);
+    FileOp op(root, nullptr, MAX_OPEN_FILES, nullptr, &wl);
+    uint64_t before, after;
+    ASSERT_EQ(op.creat("/a"), 0);
+    ASSERT_EQ(op.write("/a", 0, "aaa", 3, before, after), 0);
+    ASSERT_GT(wl.size(), 0);
+    ASSERT_EQ(op.rename("/a", "/b", 0), 0);
+    ASSERT_EQ(wl.size(), 0);
+    ASSERT_EQ(op.truncate("/b", 1, before, after), 0);
+    ASSERT_GT(wl.size(), 0);
+    ASSERT_EQ(op.unlink("/b"), 0);
+    ASSERT_EQ(wl.size(), 0);
+
+    std::vector<char> data(1024, 'x');
+    ASSERT_EQ(op.creat("/c"), 0);
+    for (size_t off = 0; off < 16 * data.size(); off += data.size())
+    {
+        ASSERT_EQ(
+            op.write("/c", off, data.data(), data.size(), before, after), 0);
+        ASSERT_LT(wl.size(), 4096 + 2 * data.size());
+    }
+    ASSERT_EQ(fileSize(root + "/c"), 16 * data.size());
+}
+
+/* a write that fails once logged is not made by a later replay: the client
+ * was told it failed
+ */
+TEST(writelog, failed_write)
+{
+    std::string root = tmpRoot();
+    std::string log = root + ".log";
+    {
+        WriteLog wl(log, root);
+        FileOp op(root, nullptr, MAX_OPEN_FILES, nullptr, &wl);
+        ASSERT_EQ(op.creat("/a"), 0);
+        // writes past the limit fail with EFBIG, the log stays below it
+        struct rlimit old_limit, limit;
+        ASSERT_EQ(getrlimit(RLIMIT_FSIZE, &old_limit), 0);
+        limit = old_limit;
+        limit.rlim_cur = 1 << 20;
+        auto old_handler = signal(SIGXFSZ, SIG_IGN);
+        ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+        uint64_t before, after;
+        int err = op.write("/a", 2 << 20, "x", 1, before, after);
+        ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &old_limit), 0);
+        signal(SIGXFSZ, old_handler);
+        ASSERT_EQ(err, EFBIG);
+    }
+    // as after a crash
+    WriteLog wl(log, root);
+    size_t records;
+    ASSERT_EQ(wl.replay(records), 0);
+    ASSERT_EQ(records, 0);
+    ASSERT_EQ(fileSize(root + "/a"), 0);
+}
+
+/* changes that are not logged leave the log alone, unless it has records
+ * of the paths they change
+ */
+TEST(writelog, holds)
+{
+    std::string root = tmpRoot();
+    WriteLog wl(root + ".log", root);
+    FileOp op(root, nullptr, MAX_OPEN_FILES, nullptr, &wl);
+    uint64_t before, after;
+    ASSERT_EQ(op.mkdir("/d", 0755), 0);
+    ASSERT_EQ(op.mkdir("/e", 0755), 0);
+    ASSERT_EQ(op.creat("/d/a"), 0);
+    ASSERT_EQ(op.write("/d/a", 0, "a", 1, before, after), 0);
+    ASSERT_TRUE(wl.holds("/d/a"));
+    ASSERT_TRUE(wl.holds("/d"));
+    ASSERT_FALSE(wl.holds("/d/"));
+    ASSERT_FALSE(wl.holds("/e"));
+    ASSERT_FALSE(wl.holds("/d/a/b"));
+
+    // not made through the log
+    int fd = ::open((root + "/x").c_str(), O_WRONLY | O_CREAT, 0644);
+    ASSERT_GE(fd, 0);
+    ::close(fd);
+    size_t copied;
+    ASSERT_EQ(op.copy("/d/a", 0, "/x", 0, 1, copied, before, after), 0);
+    ASSERT_EQ(op.unlink("/x"), 0);
+    ASSERT_EQ(op.rmdir("/e"), 0);
+    ASSERT_GT(wl.size(), 0);
+    ASSERT_EQ(op.rename("/d", "/e", 0), 0);
+    ASSERT_EQ(wl.size(), 0);
+    ASSERT_FALSE(wl.holds("/d"));
+}